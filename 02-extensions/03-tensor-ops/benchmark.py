@@ -40,4 +40,232 @@ for size in [64, 128, 256, 512]:
     
     py_time = benchmark("Python matmul", python_matmul, runs=1)
     
-    print(f"Speedup: {py_time/cpp_time:.1f}x\n")
\ No newline at end of file
+    print(f"Speedup: {py_time/cpp_time:.1f}x\n")
+print("=== Huge Pages Benchmark ===\n")
+# Compare regular 4K pages with 2 MB transparent huge pages. For the
+# TLB numbers themselves, run under perf:
+#   perf stat -e dTLB-load-misses,dTLB-store-misses python3 benchmark.py
+
+def anon_huge_kb():
+    try:
+        with open("/proc/self/smaps_rollup") as f:
+            for line in f:
+                if line.startswith("AnonHugePages:"):
+                    return int(line.split()[1])
+    except OSError:
+        pass
+    return None
+
+def filled(shape):
+    # add() writes every element, so all pages are actually backed
+    z = tensor.zeros(shape)
+    return tensor.add(z, z)
+
+for mode in ["off", "thp"]:
+    tensor.set_huge_pages(mode)
+    print(f"--- huge pages: {mode} ---")
+    v = filled(32 * 1024 * 1024)  # 256 MB
+    m = filled((512, 512))        # 2 MB, column walk through B touches a new 4K page per step
+    huge = anon_huge_kb()
+    if huge is not None:
+        print(f"AnonHugePages: {huge // 1024} MB")
+    benchmark("sum 32M elements", lambda: tensor.sum(v))
+    benchmark("matmul 512x512", lambda: tensor.matmul(m, m), runs=1)
+    del v, m
+    print()
+
+tensor.set_huge_pages("thp")
+
+print("\n=== Batched Matmul Benchmark ===\n")
+# Many small products: one batched call vs a Python loop of 2D calls
+
+for (m, k, n), count in [((8, 16, 8), 20000), ((32, 64, 32), 2000)]:
+    print(f"--- {count} x ({m}x{k} @ {k}x{n}) ---")
+    a_list = [[[float(i + j + p) / k for j in range(k)] for i in range(m)] for p in range(count)]
+    b_list = [[[float(i - j + p) / k for j in range(n)] for i in range(k)] for p in range(count)]
+    a3 = tensor.from_list(a_list)
+    b3 = tensor.from_list(b_list)
+    a2 = [tensor.from_list(x) for x in a_list]
+    b2 = [tensor.from_list(x) for x in b_list]
+
+    loop_time = benchmark("loop of matmul", lambda: [tensor.matmul(x, y) for x, y in zip(a2, b2)])
+    batch_time = benchmark("batched matmul", lambda: tensor.matmul(a3, b3))
+    print(f"Speedup: {loop_time/batch_time:.1f}x\n")
+
+print("\n=== Matrix-Vector Benchmark ===\n")
+# Bandwidth-bound shapes with one dimension of 1, float32
+
+big = tensor.rand((4096, 4096), dtype="float32")
+col = tensor.rand((4096, 1), dtype="float32")
+row = tensor.rand((1, 4096), dtype="float32")
+benchmark("gemv A @ x", lambda: tensor.matmul(big, col))
+view_time = benchmark("gemv A.T @ x", lambda: tensor.matmul(big.T, col))
+benchmark("x @ A", lambda: tensor.matmul(row, big))
+long_row = tensor.rand((1, 1 << 22), dtype="float32")
+benchmark("dot (4M)", lambda: tensor.matmul(long_row, long_row.T))
+benchmark("outer 4096 x 4096", lambda: tensor.matmul(col, row))
+gather_time = benchmark("A.T.contiguous() @ x", lambda: tensor.matmul(big.T.contiguous(), col))
+print(f"Speedup from reading the view in place: {gather_time/view_time:.1f}x")
+
+print("\n=== Graph Replay Benchmark ===\n")
+# A short step of small ops, called many times: eager calls vs one replay
+
+w = tensor.from_list([[float(i * j % 7) / 7 for j in range(16)] for i in range(16)])
+x = tensor.from_list([[float(i + j) / 32 for j in range(16)] for i in range(16)])
+
+def step(x):
+    h = tensor.relu(tensor.matmul(x, w))
+    h = tensor.add(h, x)
+    return tensor.tanh(tensor.mul(h, h))
+
+g = tensor.capture(step, x)
+eager_time = benchmark("eager x 1000", lambda: [step(x) for _ in range(1000)])
+graph_time = benchmark("replay x 1000", lambda: [g(x) for _ in range(1000)])
+print(f"Speedup: {eager_time/graph_time:.1f}x")
+
+print("\n=== Conv2d Benchmark ===\n")
+# 3x3 convolutions, padding 1: the direct kernel vs im2col + GEMM
+
+for n, c, k, hw in [(1, 3, 32, 128), (1, 32, 32, 64), (8, 64, 64, 16)]:
+    print(f"--- x [{n}, {c}, {hw}, {hw}], w [{k}, {c}, 3, 3] ---")
+    x = tensor.from_list([[[[float((i + j + ch) % 5) for j in range(hw)] for i in range(hw)]
+                           for ch in range(c)] for _ in range(n)], dtype="float32")
+    w = tensor.from_list([[[[0.1 * (r - s) for s in range(3)] for r in range(3)]
+                           for _ in range(c)] for _ in range(k)], dtype="float32")
+    im2col_time = benchmark("im2col + GEMM", lambda: tensor.conv2d(x, w, padding=1, method="im2col"))
+    direct_time = benchmark("direct 3x3", lambda: tensor.conv2d(x, w, padding=1, method="direct"))
+    print(f"Speedup: {im2col_time/direct_time:.1f}x\n")
+
+print("\n=== Softmax and LayerNorm Benchmark ===\n")
+# Fused row-wise kernels next to a single elementwise pass over the same data
+
+x = tensor.from_list([[float((i * 7 + j) % 13) / 3 for j in range(1024)] for i in range(1024)],
+                     dtype="float32")
+y = tensor.empty((1024, 1024), dtype="float32")
+benchmark("exp (one pass)", lambda: tensor.exp(x, out=y))
+benchmark("softmax", lambda: tensor.softmax(x, out=y))
+benchmark("log_softmax", lambda: tensor.log_softmax(x, out=y))
+benchmark("layer_norm", lambda: tensor.layer_norm(x, out=y))
+
+print("\n=== Int8 Matmul Benchmark ===\n")
+# int8 GEMM with int32 accumulation vs float32 GEMM of the same shape
+print(f"qgemm kernel: {tensor.qgemm_kernel}\n")
+
+for n in [256, 512]:
+    print(f"--- {n}x{n} ---")
+    a = tensor.from_list([[float((i * 3 + j) % 11 - 5) for j in range(n)] for i in range(n)],
+                         dtype="float32")
+    b = tensor.from_list([[float((i + j * 5) % 13 - 6) for j in range(n)] for i in range(n)],
+                         dtype="float32")
+    qa, qb = tensor.quantize(a, 1.0), tensor.quantize(b, 1.0)
+    f32_time = benchmark("float32 matmul", lambda: tensor.matmul(a, b))
+    int8_time = benchmark("int8 qmatmul", lambda: tensor.qmatmul(qa, qb))
+    print(f"Speedup: {f32_time/int8_time:.1f}x\n")
+
+print("\n=== Prefix Scan Benchmark ===\n")
+# Running total of a 10M-value series: two-pass scan vs a Python loop
+
+import itertools
+
+n = 10_000_000
+series = tensor.rand(n, dtype="float32")
+cpp_time = benchmark("cumsum float32", lambda: tensor.cumsum(series))
+series64 = tensor.rand(n)
+benchmark("cumsum float64", lambda: tensor.cumsum(series64))
+grid = tensor.rand((1000, 10_000), dtype="float32")
+benchmark("cumsum axis=0 (1000 x 10000)", lambda: tensor.cumsum(grid, axis=0))
+values = series.tolist()
+py_time = benchmark("itertools.accumulate", lambda: list(itertools.accumulate(values)), runs=1)
+print(f"Speedup: {py_time/cpp_time:.1f}x")
+
+print("\n=== Sort Benchmark ===\n")
+# 1M float32 values: radix sort vs Python's sorted()
+
+import random
+
+data = [random.random() for _ in range(1 << 20)]
+v = tensor.from_list(data, dtype="float32")
+cpp_time = benchmark("sort", lambda: tensor.sort(v))
+benchmark("argsort", lambda: tensor.argsort(v))
+benchmark("topk(k=10)", lambda: tensor.topk(v, 10))
+benchmark("topk(k=1000)", lambda: tensor.topk(v, 1000))
+py_time = benchmark("Python sorted()", lambda: sorted(data), runs=1)
+print(f"Speedup: {py_time/cpp_time:.1f}x")
+
+print("\n=== Random Numbers Benchmark ===\n")
+# 1M values: Philox kernel vs the random module
+
+n = 1 << 20
+cpp_time = benchmark("rand float64", lambda: tensor.rand(n))
+benchmark("rand float32", lambda: tensor.rand(n, dtype="float32"))
+benchmark("randn float64", lambda: tensor.randn(n))
+benchmark("randint", lambda: tensor.randint(0, 100, n))
+py_time = benchmark("random.random() + from_list",
+                    lambda: tensor.from_list([random.random() for _ in range(n)]), runs=1)
+print(f"Speedup: {py_time/cpp_time:.1f}x")
+
+print("\n=== Indexing Benchmark ===\n")
+# Embedding lookup and its backward pass: 100K x 128 float32 table, 64K tokens
+
+rows, dim, tokens = 100_000, 128, 1 << 16
+table = tensor.randn((rows, dim), dtype="float32")
+ids = tensor.randint(0, rows, tokens)
+grads = tensor.randn((tokens, dim), dtype="float32")
+benchmark("index_select", lambda: tensor.index_select(table, 0, ids))
+cpp_time = benchmark("index_add_", lambda: tensor.index_add_(table, 0, ids, grads))
+flat, updates = tensor.zeros(rows), tensor.rand(tokens)
+benchmark("scatter_add_ 1D", lambda: tensor.scatter_add_(flat, 0, ids, updates))
+py_table = table.tolist()
+py_ids, py_grads = ids.tolist(), grads.tolist()
+def python_loop():
+    for i, g in zip(py_ids, py_grads):
+        row = py_table[i]
+        for k in range(dim):
+            row[k] += g[k]
+py_time = benchmark("Python loop", python_loop, runs=1)
+print(f"Speedup: {py_time/cpp_time:.1f}x")
+
+print("\n=== Concat Benchmark ===\n")
+# 64 x 4 MB pieces joined once, and 100K rows appended to a builder
+
+pieces = [tensor.rand((1000, 1000), dtype="float32") for _ in range(64)]
+benchmark("concat axis=0", lambda: tensor.concat(pieces))
+benchmark("concat axis=1", lambda: tensor.concat(pieces, axis=1))
+benchmark("stack", lambda: tensor.stack(pieces))
+row = tensor.rand(64, dtype="float32")
+def build_rows():
+    b = tensor.builder()
+    for _ in range(100_000):
+        b.append(row)
+    return b.build()
+cpp_time = benchmark("builder.append x 100K", build_rows, runs=3)
+py_time = benchmark("tolist + from_list", lambda: tensor.from_list([row.tolist() for _ in range(100_000)],
+                                                                   dtype="float32"), runs=1)
+print(f"Speedup: {py_time/cpp_time:.1f}x")
+
+print("\n=== Copy-on-Write Benchmark ===\n")
+# copy() shares memory; the bytes move only if the copy is written
+
+x = tensor.from_list([[float(i + j) for j in range(1024)] for i in range(1024)])
+benchmark("copy()", lambda: x.copy())
+benchmark("copy() + read (sum)", lambda: tensor.sum(x.copy()))
+benchmark("copy() + in-place relu_", lambda: tensor.relu_(x.copy()))
+benchmark("relu(x) (one pass into new memory)", lambda: tensor.relu(x))
+
+print("\n=== Pickle Benchmark ===\n")
+# 8 MB tensor: pickled list of floats vs protocol 5 out of band vs shared memory by name
+
+import pickle
+
+x = tensor.from_list([[float(i + j) for j in range(1024)] for i in range(1024)])
+s = tensor.shared(x)
+benchmark("tolist() + pickle", lambda: pickle.loads(pickle.dumps(x.tolist())))
+benchmark("pickle protocol 4", lambda: pickle.loads(pickle.dumps(x, protocol=4)))
+
+def out_of_band():
+    buffers = []
+    data = pickle.dumps(x, protocol=5, buffer_callback=buffers.append)
+    return pickle.loads(data, buffers=buffers)
+
+benchmark("pickle protocol 5, out of band", out_of_band)
+benchmark("shared tensor (by name)", lambda: pickle.loads(pickle.dumps(s)))
@@ -1,380 +1,9112 @@
 #include <Python.h>
 #include <vector>
 #include <sstream>
+#include <string>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <functional>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <unistd.h>
 
 // ============================================================
-// Tensor class
+// Caching allocator
 // ============================================================
-struct Tensor {
-    std::vector<double> data;
-    std::vector<size_t> shape;
+// Tensor storage is recycled through free lists keyed by a rounded
+// size class, so a loop that keeps producing same-shaped tensors stops
+// hitting malloc/free (and mmap/munmap for large buffers) after the
+// first iteration.
+//
+// Each thread keeps a small cache of recently freed small blocks in
+// front of the shared, mutex-protected pool.
+//
+// Every block is 64-byte aligned (one cache line, one AVX-512 vector).
+// Blocks of 1 MB and up are mapped directly; above a configurable
+// threshold those mappings are 2 MB aligned and backed by huge pages,
+// so a multi-GB tensor needs a few hundred TLB entries, not a million.
 
-    size_t size() const {
-        size_t s = 1;
-        for (auto dim : shape) s *= dim;
-        return s;
+enum class HugePages { Off, Transparent, Explicit };
+
+static const size_t kAlignment = 64;
+static const size_t kMmapMinBytes = 1 << 20;
+static const size_t kHugePageBytes = 2 << 20;
+
+static std::atomic<HugePages> g_huge_pages{HugePages::Transparent};
+static std::atomic<size_t> g_huge_threshold{kHugePageBytes};
+
+static const size_t kMinBlockBytes = 64;
+static const size_t kLocalMaxBytes = 256 * 1024;  // larger blocks skip the thread cache
+static const size_t kLocalMaxBlocks = 4;          // per size class, per thread
+
+// Round up to one of four size classes per power of two
+// (5/8, 6/8, 7/8 or 8/8 of it), which bounds the waste at 25%.
+static size_t round_size(size_t nbytes) {
+    if (nbytes <= kMinBlockBytes) return kMinBlockBytes;
+    size_t pow2 = (size_t)1 << (64 - __builtin_clzll(nbytes - 1));
+    size_t step = pow2 / 8;
+    return (nbytes + step - 1) / step * step;
+}
+
+struct AllocatorStats {
+    std::atomic<size_t> allocated_bytes{0};  // live in tensors
+    std::atomic<size_t> cached_bytes{0};     // held in free lists
+    std::atomic<size_t> peak_bytes{0};       // high-water mark of allocated_bytes
+    std::atomic<size_t> requests{0};
+    std::atomic<size_t> cache_hits{0};
+    std::atomic<size_t> system_allocs{0};
+    std::atomic<size_t> system_frees{0};
+};
+
+static AllocatorStats g_stats;
+
+static size_t round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+// Length of every live mapping, needed by munmap (hugetlb mappings are
+// rounded to 2 MB, so it cannot be recomputed from the size class)
+static std::mutex g_mappings_mutex;
+static std::unordered_map<void*, size_t> g_mappings;
+
+static void* map_anonymous(size_t len, int extra_flags) {
+    void* ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+static void* map_block(size_t nbytes) {
+    HugePages mode = g_huge_pages.load();
+    bool huge = mode != HugePages::Off && nbytes >= g_huge_threshold.load();
+    size_t len = round_up(nbytes, huge ? kHugePageBytes : (size_t)sysconf(_SC_PAGESIZE));
+    char* ptr = nullptr;
+
+#ifdef MAP_HUGETLB
+    // Falls through to THP when no pages are reserved in hugetlbfs
+    if (huge && mode == HugePages::Explicit) {
+        ptr = (char*)map_anonymous(len, MAP_HUGETLB);
     }
+#endif
 
-    bool same_shape(const Tensor& other) const {
-        return shape == other.shape;
+    if (!ptr && !huge) {
+        ptr = (char*)map_anonymous(len, 0);
+    } else if (!ptr) {
+        // Over-map, then trim so the block starts on a 2 MB boundary
+        size_t span = len + kHugePageBytes;
+        char* raw = (char*)map_anonymous(span, 0);
+        if (!raw) return nullptr;
+        ptr = (char*)round_up((uintptr_t)raw, kHugePageBytes);
+        if (ptr > raw) munmap(raw, ptr - raw);
+        size_t tail = (raw + span) - (ptr + len);
+        if (tail) munmap(ptr + len, tail);
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    if (ptr) {
+        std::lock_guard<std::mutex> lock(g_mappings_mutex);
+        g_mappings[ptr] = len;
+    }
+    return ptr;
+}
+
+static void unmap_block(void* ptr) {
+    size_t len;
+    {
+        std::lock_guard<std::mutex> lock(g_mappings_mutex);
+        auto it = g_mappings.find(ptr);
+        len = it->second;
+        g_mappings.erase(it);
+    }
+    munmap(ptr, len);
+}
+
+static void* system_alloc(size_t nbytes) {
+    g_stats.system_allocs++;
+    if (nbytes >= kMmapMinBytes) return map_block(nbytes);
+
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, kAlignment, nbytes) != 0) return nullptr;
+    return ptr;
+}
+
+static void system_free(void* ptr, size_t nbytes) {
+    g_stats.system_frees++;
+    if (nbytes >= kMmapMinBytes) {
+        unmap_block(ptr);
+    } else {
+        std::free(ptr);
+    }
+}
+
+typedef std::unordered_map<size_t, std::vector<void*>> FreeLists;
+
+// Shared pool. Intentionally leaked so that thread caches being torn
+// down at interpreter exit can still return their blocks to it.
+struct GlobalPool {
+    std::mutex mutex;
+    FreeLists free;
+};
+
+static GlobalPool& global_pool() {
+    static GlobalPool* pool = new GlobalPool();
+    return *pool;
+}
+
+struct ThreadCache {
+    FreeLists free;
+
+    void flush() {
+        GlobalPool& pool = global_pool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        for (auto& entry : free) {
+            auto& dst = pool.free[entry.first];
+            dst.insert(dst.end(), entry.second.begin(), entry.second.end());
+        }
+        free.clear();
     }
+
+    ~ThreadCache() { flush(); }
 };
 
+static ThreadCache& thread_cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+}
+
+static void note_allocated(size_t nbytes) {
+    size_t now = g_stats.allocated_bytes += nbytes;
+    size_t peak = g_stats.peak_bytes.load(std::memory_order_relaxed);
+    while (now > peak && !g_stats.peak_bytes.compare_exchange_weak(peak, now)) {}
+}
+
+// Pop a block of exactly `rounded` bytes from the thread cache or the
+// shared pool, or return null on a miss
+static void* take_cached(size_t rounded) {
+    void* ptr = nullptr;
+
+    if (rounded <= kLocalMaxBytes) {
+        auto it = thread_cache().free.find(rounded);
+        if (it != thread_cache().free.end() && !it->second.empty()) {
+            ptr = it->second.back();
+            it->second.pop_back();
+        }
+    }
+
+    if (!ptr) {
+        GlobalPool& pool = global_pool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        auto it = pool.free.find(rounded);
+        if (it != pool.free.end() && !it->second.empty()) {
+            ptr = it->second.back();
+            it->second.pop_back();
+        }
+    }
+
+    if (ptr) {
+        g_stats.cache_hits++;
+        g_stats.cached_bytes -= rounded;
+        note_allocated(rounded);
+    }
+    return ptr;
+}
+
+// Zero a recycled block. Mapped blocks are handed back to the kernel
+// instead of being written: the next read sees the shared zero page
+// and the first write to each page faults in a fresh zeroed one.
+static void zero_block(void* ptr, size_t nbytes) {
+#ifdef __linux__
+    if (nbytes >= kMmapMinBytes && madvise(ptr, nbytes, MADV_DONTNEED) == 0) return;
+#endif
+    std::memset(ptr, 0, nbytes);
+}
+
+// Returns a block of at least `nbytes`; the rounded capacity is stored
+// in `*capacity` and must be passed back to storage_free. With `zeroed`
+// the first `nbytes` read as zero, which for large blocks costs no
+// page writes at all.
+static void* storage_alloc(size_t nbytes, size_t* capacity, bool zeroed) {
+    size_t rounded = round_size(nbytes);
+    *capacity = rounded;
+    g_stats.requests++;
+
+    void* ptr = take_cached(rounded);
+    if (ptr) {
+        if (zeroed) zero_block(ptr, nbytes);
+        return ptr;
+    }
+
+    ptr = system_alloc(rounded);
+    if (!ptr) return nullptr;
+    note_allocated(rounded);
+
+    // Fresh mappings are already zero
+    if (zeroed && rounded < kMmapMinBytes) std::memset(ptr, 0, nbytes);
+    return ptr;
+}
+
+static void storage_free(void* ptr, size_t capacity) {
+    if (!ptr) return;
+    g_stats.allocated_bytes -= capacity;
+    g_stats.cached_bytes += capacity;
+
+    if (capacity <= kLocalMaxBytes) {
+        auto& list = thread_cache().free[capacity];
+        if (list.size() < kLocalMaxBlocks) {
+            list.push_back(ptr);
+            return;
+        }
+    }
+
+    GlobalPool& pool = global_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.free[capacity].push_back(ptr);
+}
+
+// Give every cached block back to the system. Blocks parked in other
+// threads' caches are left alone; they are bounded and get returned
+// to the pool when those threads exit.
+static void storage_empty_cache() {
+    thread_cache().flush();
+
+    GlobalPool& pool = global_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    for (auto& entry : pool.free) {
+        for (void* ptr : entry.second) {
+            system_free(ptr, entry.first);
+            g_stats.cached_bytes -= entry.first;
+        }
+    }
+    pool.free.clear();
+}
+
 // ============================================================
-// Python object wrapping Tensor
+// Storage: an owned block of tensor memory
 // ============================================================
-typedef struct {
-    PyObject_HEAD
-    Tensor* tensor;
-} PyTensor;
+// Normally a block from the caching allocator. Tensors loaded with
+// load(..., mmap=True) own a file mapping instead, with `ptr` pointing
+// at the payload inside it; tensor.shared() maps a named POSIX shared
+// memory object the same way. A captured graph turns storages into
+// windows onto other storages (see borrow), and so does copy(): copies
+// borrow one hidden owner's memory until one of them is written.
+struct Storage {
+    void* ptr = nullptr;
+    size_t bytes = 0;           // usable bytes at ptr
+    size_t capacity = 0;        // allocator size class, or mapping length
+    void* map_base = nullptr;   // start of the mapping, for file-backed storage
+    bool writable = true;       // false for read-only file mappings
+    uint64_t pending = 0;       // stream op that last writes this memory, 0 if none
+    std::shared_ptr<Storage> parent;  // owner of the memory, for borrowed storage
+    bool cow = false;           // parent's memory is shared copy-on-write
+    std::string shm_name;       // shared memory object this maps, if any
+    pid_t shm_owner = 0;        // process that unlinks shm_name on release, not a fork
+    std::atomic<bool> failed{false};  // a kernel writing this deferred an error
+    std::string deferred_error;       // its message; both under g_deferred_mutex
+
+    Storage() = default;
+
+    // Leaves ptr null if the allocation failed
+    explicit Storage(size_t nbytes, bool zeroed = false) {
+        if (nbytes == 0) return;
+        ptr = storage_alloc(nbytes, &capacity, zeroed);
+        if (ptr) bytes = nbytes;
+    }
+
+    // Takes ownership of a mapping of `len` bytes at `base`
+    static Storage from_mapping(void* base, size_t len, size_t offset, bool writable) {
+        Storage s;
+        s.map_base = base;
+        s.capacity = len;
+        s.ptr = (char*)base + offset;
+        s.bytes = len - offset;
+        s.writable = writable;
+        return s;
+    }
+
+    bool is_mapped() const { return map_base != nullptr || (cow && parent->is_mapped()); }
+
+    // Gives up this storage's own memory and points it `offset` bytes
+    // into `base` instead, keeping `base` alive
+    void borrow(std::shared_ptr<Storage> base, size_t offset) {
+        release();
+        ptr = base->ptr ? (char*)base->ptr + offset : nullptr;
+        bytes = base->bytes > offset ? base->bytes - offset : 0;
+        capacity = 0;
+        writable = base->writable;
+        parent = std::move(base);
+    }
+
+    Storage(Storage&& other) noexcept { take(other); }
+
+    Storage& operator=(Storage&& other) noexcept {
+        if (this != &other) {
+            release();
+            take(other);
+        }
+        return *this;
+    }
+
+    Storage(const Storage&) = delete;
+    Storage& operator=(const Storage&) = delete;
+
+    ~Storage() { release(); }
+
+private:
+    void take(Storage& other) {
+        ptr = other.ptr;
+        bytes = other.bytes;
+        capacity = other.capacity;
+        map_base = other.map_base;
+        writable = other.writable;
+        pending = other.pending;
+        parent = std::move(other.parent);
+        cow = other.cow;
+        shm_name = std::move(other.shm_name);
+        shm_owner = other.shm_owner;
+        failed.store(other.failed.load());
+        deferred_error = std::move(other.deferred_error);
+        other.ptr = nullptr;
+        other.bytes = 0;
+        other.capacity = 0;
+        other.map_base = nullptr;
+        other.writable = true;
+        other.pending = 0;
+        other.cow = false;
+        other.shm_name.clear();
+        other.shm_owner = 0;
+        other.failed.store(false);
+        other.deferred_error.clear();
+    }
+
+    void release() {
+        if (parent) {
+            parent.reset();
+        } else if (map_base) {
+            munmap(map_base, capacity);
+            if (shm_owner == getpid()) shm_unlink(shm_name.c_str());
+        } else {
+            storage_free(ptr, capacity);
+        }
+        ptr = nullptr;
+        bytes = 0;
+        map_base = nullptr;
+        cow = false;
+        shm_name.clear();
+        shm_owner = 0;
+    }
+};
 
 // ============================================================
-// Forward declarations of type methods
+// Data types
 // ============================================================
-static PyObject* Tensor_new(PyTypeObject* type, PyObject* args, PyObject* kwargs);
-static void Tensor_dealloc(PyTensor* self);
-static PyObject* Tensor_repr(PyTensor* self);
-static PyObject* Tensor_tolist(PyTensor* self, PyObject* args);
-static PyObject* Tensor_shape(PyTensor* self, void* closure);
+// Mixing two dtypes yields the later one in promotion order,
+// bool < int8 < int32 < int64 < float32 < float64. An integer mixed with
+// float32 stays float32 (the float kind wins, its width is kept). The
+// enum values are the on-disk dtype codes, so new types go at the end.
+enum class DType { Bool, Int32, Int64, Float32, Float64, Int8 };
+
+static int promotion_rank(DType dtype) {
+    switch (dtype) {
+        case DType::Bool:    return 0;
+        case DType::Int8:    return 1;
+        case DType::Int32:   return 2;
+        case DType::Int64:   return 3;
+        case DType::Float32: return 4;
+        case DType::Float64: return 5;
+    }
+    return 0;
+}
+
+static DType promote(DType a, DType b) {
+    return promotion_rank(a) > promotion_rank(b) ? a : b;
+}
+
+static bool is_floating(DType dtype) {
+    return dtype == DType::Float32 || dtype == DType::Float64;
+}
+
+static size_t dtype_size(DType dtype) {
+    switch (dtype) {
+        case DType::Bool:    return sizeof(bool);
+        case DType::Int8:    return sizeof(int8_t);
+        case DType::Int32:   return sizeof(int32_t);
+        case DType::Int64:   return sizeof(int64_t);
+        case DType::Float32: return sizeof(float);
+        case DType::Float64: return sizeof(double);
+    }
+    return 0;
+}
+
+static const char* dtype_name(DType dtype) {
+    switch (dtype) {
+        case DType::Bool:    return "bool";
+        case DType::Int8:    return "int8";
+        case DType::Int32:   return "int32";
+        case DType::Int64:   return "int64";
+        case DType::Float32: return "float32";
+        case DType::Float64: return "float64";
+    }
+    return "unknown";
+}
+
+static bool dtype_from_name(const char* name, DType* dtype) {
+    static const DType all[] = {DType::Bool, DType::Int8, DType::Int32, DType::Int64,
+                                DType::Float32, DType::Float64};
+    for (DType d : all) {
+        if (strcmp(name, dtype_name(d)) == 0) {
+            *dtype = d;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Call fn with a value of the C++ type matching `dtype`:
+//   dispatch(t->dtype, [&](auto tag) { using T = decltype(tag); ... });
+template <typename F>
+static void dispatch(DType dtype, F&& fn) {
+    switch (dtype) {
+        case DType::Bool:    fn(bool()); break;
+        case DType::Int8:    fn(int8_t()); break;
+        case DType::Int32:   fn(int32_t()); break;
+        case DType::Int64:   fn(int64_t()); break;
+        case DType::Float32: fn(float()); break;
+        case DType::Float64: fn(double()); break;
+    }
+}
 
 // ============================================================
-// Method and getset tables
+// SIMD helpers
 // ============================================================
-static PyMethodDef Tensor_methods[] = {
-    {"tolist", (PyCFunction)Tensor_tolist, METH_NOARGS, "Convert to Python list"},
-    {NULL}
-};
+// GCC/Clang vector extensions: one native register's worth of T (or
+// `Bytes`). The compiler lowers these to AVX, SSE or NEON depending on
+// the target, so the kernels below stay portable. A wider default would
+// pass vectors between functions differently than the target does, and
+// GCC warns about that ABI on every build without -mavx.
+#if defined(__AVX__)
+static const size_t kVectorBytes = 32;
+#else
+static const size_t kVectorBytes = 16;
+#endif
 
-static PyGetSetDef Tensor_getset[] = {
-    {"shape", (getter)Tensor_shape, NULL, "Shape of tensor", NULL},
-    {NULL}
+template <typename T, size_t Bytes = kVectorBytes>
+struct Simd {
+    typedef T vec __attribute__((vector_size(Bytes)));
+    static const size_t width = Bytes / sizeof(T);
+
+    static vec load(const T* p) {
+        vec v;
+        std::memcpy(&v, p, sizeof(vec));
+        return v;
+    }
+
+    static void store(T* p, vec v) {
+        std::memcpy(p, &v, sizeof(vec));
+    }
+
+    // x - 0 rather than a loop over the lanes, which GCC builds one
+    // lane at a time; the subtraction keeps -0.0 and is a single shuffle
+    static vec broadcast(T x) { return x - vec{}; }
+
+    // Lane-wise comparison result: all-ones where true
+    typedef decltype(vec() > vec()) mask;
+
+    static vec select(mask m, vec a, vec b) {
+        return (vec)(((mask)a & m) | ((mask)b & ~m));
+    }
+
+    static T hsum(vec v) {
+        T s = 0;
+        for (size_t i = 0; i < width; i++) s += v[i];
+        return s;
+    }
 };
 
 // ============================================================
-// PyTensorType definition (before functions that use it)
+// Thread pool
 // ============================================================
-static PyTypeObject PyTensorType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "tensor.Tensor",            // tp_name
-    sizeof(PyTensor),           // tp_basicsize
-    0,                          // tp_itemsize
-    (destructor)Tensor_dealloc, // tp_dealloc
-    0,                          // tp_vectorcall_offset
-    0,                          // tp_getattr
-    0,                          // tp_setattr
-    0,                          // tp_as_async
-    (reprfunc)Tensor_repr,      // tp_repr
-    0,                          // tp_as_number
-    0,                          // tp_as_sequence
-    0,                          // tp_as_mapping
-    0,                          // tp_hash
-    0,                          // tp_call
-    0,                          // tp_str
-    0,                          // tp_getattro
-    0,                          // tp_setattro
-    0,                          // tp_as_buffer
-    Py_TPFLAGS_DEFAULT,         // tp_flags
-    "Tensor object",            // tp_doc
-    0,                          // tp_traverse
-    0,                          // tp_clear
-    0,                          // tp_richcompare
-    0,                          // tp_weaklistoffset
-    0,                          // tp_iter
-    0,                          // tp_iternext
-    Tensor_methods,             // tp_methods
-    0,                          // tp_members
-    Tensor_getset,              // tp_getset
-    0,                          // tp_base
-    0,                          // tp_dict
-    0,                          // tp_descr_get
-    0,                          // tp_descr_set
-    0,                          // tp_dictoffset
-    0,                          // tp_init
-    0,                          // tp_alloc
-    Tensor_new,                 // tp_new
+// A fixed set of workers that execute parallel_for chunks. Chunk
+// boundaries depend only on `n` and `grain`, never on the number of
+// threads, so a kernel that produces one result per chunk and combines
+// them in chunk order is deterministic however many threads run it.
+
+static thread_local bool t_in_parallel = false;
+
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t nthreads) {
+        for (size_t i = 1; i < nthreads; i++) {
+            workers_.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& w : workers_) w.join();
+    }
+
+    size_t size() const { return workers_.size() + 1; }
+
+    // Run fn(0) .. fn(nchunks - 1); the calling thread takes chunks too
+    void run(size_t nchunks, const std::function<void(size_t)>& fn) {
+        std::lock_guard<std::mutex> serial(run_mutex_);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &fn;
+            nchunks_ = nchunks;
+            next_ = 0;
+            finished_ = 0;
+            generation_++;
+        }
+        wake_.notify_all();
+
+        t_in_parallel = true;
+        size_t done = drain(fn, nchunks);
+        t_in_parallel = false;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_ += done;
+        done_.wait(lock, [&] { return finished_ == nchunks_ && active_ == 0; });
+        job_ = nullptr;
+    }
+
+private:
+    size_t drain(const std::function<void(size_t)>& fn, size_t nchunks) {
+        size_t count = 0;
+        for (size_t c; (c = next_.fetch_add(1)) < nchunks; count++) fn(c);
+        return count;
+    }
+
+    void worker_loop() {
+        t_in_parallel = true;
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wake_.wait(lock, [&] { return stop_ || (job_ && generation_ != seen); });
+            if (stop_) return;
+            seen = generation_;
+            const std::function<void(size_t)>* job = job_;
+            size_t nchunks = nchunks_;
+            active_++;
+
+            lock.unlock();
+            size_t done = drain(*job, nchunks);
+            lock.lock();
+
+            finished_ += done;
+            active_--;
+            if (finished_ == nchunks_ && active_ == 0) done_.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex run_mutex_;  // one job at a time
+    std::mutex mutex_;      // guards everything below
+    std::condition_variable wake_, done_;
+    const std::function<void(size_t)>* job_ = nullptr;
+    size_t nchunks_ = 0;
+    std::atomic<size_t> next_{0};
+    size_t finished_ = 0;
+    size_t active_ = 0;
+    uint64_t generation_ = 0;
+    bool stop_ = false;
 };
 
+// Read by kernels on any thread while set_num_threads() may be writing it
+static std::atomic<size_t> g_num_threads{std::max(1u, std::thread::hardware_concurrency())};
+
+// Each run() holds a reference, so set_num_threads() can swap in a new
+// pool while another Python thread (kernels run without the GIL) is
+// still using the old one; the old pool is joined by its last user.
+static std::shared_ptr<ThreadPool> g_pool;
+
+// A forked child inherits the pool object but none of its threads;
+// drop it (leaking is the only safe option) and start fresh on demand.
+static void pool_after_fork_child() {
+    new std::shared_ptr<ThreadPool>(std::move(g_pool));
+}
+
+// Both the Python thread and the stream worker may get here first
+static std::mutex g_pool_mutex;
+
+static std::shared_ptr<ThreadPool> thread_pool() {
+    static bool registered = (pthread_atfork(nullptr, nullptr, pool_after_fork_child), true);
+    (void)registered;
+    std::lock_guard<std::mutex> lock(g_pool_mutex);
+    if (!g_pool) g_pool = std::make_shared<ThreadPool>(g_num_threads.load());
+    return g_pool;
+}
+
+static void set_num_threads(size_t n) {
+    std::shared_ptr<ThreadPool> old;
+    {
+        std::lock_guard<std::mutex> lock(g_pool_mutex);
+        old = std::move(g_pool);
+        g_num_threads = std::max((size_t)1, n);
+    }
+    // `old` is joined here unless a run() still holds it
+}
+
+// Calls fn(begin, end) over [0, n) in chunks of `grain`. Runs inline
+// when there is a single chunk, a single thread, or when already inside
+// a parallel region.
+static void parallel_for(size_t n, size_t grain,
+                         const std::function<void(size_t, size_t)>& fn) {
+    if (n == 0) return;
+    grain = std::max(grain, (size_t)1);
+    size_t nchunks = (n + grain - 1) / grain;
+    auto chunk = [&](size_t c) { fn(c * grain, std::min(n, (c + 1) * grain)); };
+
+    if (nchunks == 1 || g_num_threads == 1 || t_in_parallel) {
+        for (size_t c = 0; c < nchunks; c++) chunk(c);
+        return;
+    }
+    thread_pool()->run(nchunks, chunk);
+}
+
 // ============================================================
-// Helper functions (now PyTensorType is defined)
+// Execution stream
 // ============================================================
-static Tensor* get_tensor(PyObject* obj) {
-    if (!PyObject_TypeCheck(obj, &PyTensorType)) {
-        PyErr_SetString(PyExc_TypeError, "Expected Tensor");
-        return nullptr;
+// Optional asynchronous execution (set_async). Ops still check their
+// arguments and allocate their outputs on the calling thread, then hand
+// the computation to launch(), which either runs it right away or
+// queues it on one native worker thread and returns. The queue runs in
+// order, so an op whose input is still pending needs no synchronization
+// of its own; only host code that reads tensor memory (tolist, repr,
+// save, scalar reductions, ...) waits, and only for the op that last
+// wrote the storage it reads.
+
+// Ops the host may run ahead of the worker. Queued ops keep their
+// operands alive, so without a bound a loop that never reads its
+// results would hold on to memory without limit.
+static const size_t kStreamDepth = 64;
+
+class Stream {
+public:
+    // Sequence numbers continue from `last`, the previous stream's count
+    explicit Stream(uint64_t last = 0)
+        : submitted_(last), completed_(last), worker_([this] { loop(); }) {}
+
+    ~Stream() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_.notify_one();
+        worker_.join();
+    }
+
+    // Queues fn and returns its sequence number (1, 2, ...). Blocks while
+    // kStreamDepth ops are already waiting.
+    uint64_t submit(std::function<void()> fn) {
+        uint64_t seq;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [&] { return submitted_ - completed_ < kStreamDepth; });
+            queue_.push_back(std::move(fn));
+            seq = ++submitted_;
+        }
+        work_.notify_one();
+        return seq;
+    }
+
+    bool done(uint64_t seq) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return completed_ >= seq;
+    }
+
+    void wait(uint64_t seq) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return completed_ >= seq; });
+    }
+
+    // Returns the last sequence number, all of which are now done
+    uint64_t wait_all() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [&] { return completed_ == submitted_; });
+        return submitted_;
+    }
+
+private:
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            work_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+            std::function<void()> fn = std::move(queue_.front());
+            queue_.pop_front();
+
+            // The closure owns references to its tensors' storage;
+            // destroy it before reporting completion
+            lock.unlock();
+            fn();
+            fn = nullptr;
+            lock.lock();
+
+            completed_++;
+            done_.notify_all();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable work_, done_;
+    std::deque<std::function<void()>> queue_;
+    uint64_t submitted_;
+    uint64_t completed_;
+    bool stop_ = false;
+    std::thread worker_;  // last, so it starts after everything above exists
+};
+
+static bool g_async = false;
+static Stream* g_stream = nullptr;
+static uint64_t g_stream_last = 0;
+
+// The child of a fork gets the stream object but not its thread. Drain
+// first so every pending mark in the child refers to finished work, then
+// let the child start a fresh stream that keeps counting from there.
+static void stream_before_fork() {
+    if (g_stream) g_stream_last = g_stream->wait_all();
+}
+
+static void stream_after_fork_child() {
+    g_stream = nullptr;
+}
+
+static Stream& stream() {
+    static bool registered =
+        (pthread_atfork(stream_before_fork, nullptr, stream_after_fork_child), true);
+    (void)registered;
+    if (!g_stream) g_stream = new Stream(g_stream_last);
+    return *g_stream;
+}
+
+// Waits for every queued op; call without the GIL
+static void stream_drain() {
+    if (g_stream) g_stream->wait_all();
+}
+
+// A kernel that finds bad input only once it runs (on the stream, or in
+// a graph replay) can't raise. It records the message on the storage it
+// writes instead, and the next host read of that tensor (wait_ready:
+// tolist, wait, repr, ...) raises it as IndexError. The first message
+// not yet raised is also kept here, with its storage, for the calls that
+// wait on everything: synchronize, capture and replay. Raising it either
+// way clears both copies.
+static std::mutex g_deferred_mutex;
+static std::string g_deferred_error;
+static std::weak_ptr<Storage> g_deferred_storage;
+static std::atomic<bool> g_deferred{false};
+
+// Any thread. `out` is the storage the kernel writes.
+static void defer_index_error(const std::shared_ptr<Storage>& out, const std::string& message) {
+    std::lock_guard<std::mutex> lock(g_deferred_mutex);
+    if (out && !out->failed.load()) {
+        out->deferred_error = message;
+        out->failed.store(true);
+    }
+    if (g_deferred.load()) return;
+    g_deferred_error = message;
+    g_deferred_storage = out;
+    g_deferred.store(true);
+}
+
+// Raises and clears the error deferred on `s`. Returns false with
+// IndexError set if there was one.
+static bool raise_deferred(Storage* s) {
+    if (!s || !s->failed.load()) return true;
+    std::string message;
+    {
+        std::lock_guard<std::mutex> lock(g_deferred_mutex);
+        if (!s->failed.load()) return true;
+        message.swap(s->deferred_error);
+        s->failed.store(false);
+        if (g_deferred.load() && g_deferred_storage.lock().get() == s) {
+            g_deferred_error.clear();
+            g_deferred_storage.reset();
+            g_deferred.store(false);
+        }
+    }
+    PyErr_SetString(PyExc_IndexError, message.c_str());
+    return false;
+}
+
+// The same for the first error deferred on any storage
+static bool raise_deferred() {
+    if (!g_deferred.load()) return true;
+    std::string message;
+    {
+        std::lock_guard<std::mutex> lock(g_deferred_mutex);
+        if (!g_deferred.load()) return true;
+        message.swap(g_deferred_error);
+        if (std::shared_ptr<Storage> s = g_deferred_storage.lock()) {
+            s->deferred_error.clear();
+            s->failed.store(false);
+        }
+        g_deferred_storage.reset();
+        g_deferred.store(false);
+    }
+    PyErr_SetString(PyExc_IndexError, message.c_str());
+    return false;
+}
+
+// ============================================================
+// Profiler
+// ============================================================
+// Opt-in per-op records (tensor.profiler). Each launched op becomes one
+// ProfileEvent in a fixed ring buffer. Writers (the calling thread, the
+// stream worker) claim slots with one fetch_add and publish them with a
+// per-slot sequence number, so recording never takes a lock; once the
+// ring wraps, the oldest events are overwritten. When the profiler is
+// off, the only cost to an op is the branch on g_profiling.
+
+static const size_t kProfileShapeChars = 80;
+
+struct ProfileEvent {
+    const char* name;
+    const char* dtype;
+    char shapes[kProfileShapeChars];  // "(2, 3), (3, 4) -> (2, 4)", truncated
+    bool on_stream;                   // ran on the stream worker
+    uint64_t queued_ns;               // when the op was launched
+    uint64_t start_ns, end_ns;
+    uint64_t bytes;                   // operand + result bytes
+    double flops;
+};
+
+struct ProfileSlot {
+    std::atomic<uint64_t> seq{0};  // index + 1 once written, 0 while being written
+    ProfileEvent event;
+};
+
+static std::atomic<bool> g_profiling{false};
+static ProfileSlot* g_profile_ring = nullptr;
+static size_t g_profile_capacity = 0;
+static std::atomic<uint64_t> g_profile_next{0};
+
+static uint64_t profile_clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void profile_record(const ProfileEvent& event) {
+    uint64_t index = g_profile_next.fetch_add(1, std::memory_order_relaxed);
+    ProfileSlot& slot = g_profile_ring[index % g_profile_capacity];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.event = event;
+    slot.seq.store(index + 1, std::memory_order_release);
+}
+
+// The events still in the ring, oldest first; `*dropped` counts the
+// overwritten ones. Slots a writer is busy with are skipped.
+static std::vector<ProfileEvent> profile_snapshot(uint64_t* dropped) {
+    std::vector<ProfileEvent> events;
+    uint64_t end = g_profile_next.load(std::memory_order_acquire);
+    uint64_t begin = end > g_profile_capacity ? end - g_profile_capacity : 0;
+    *dropped = begin;
+    for (uint64_t i = begin; i < end; i++) {
+        ProfileSlot& slot = g_profile_ring[i % g_profile_capacity];
+        if (slot.seq.load(std::memory_order_acquire) != i + 1) continue;
+        ProfileEvent event = slot.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != i + 1) continue;
+        events.push_back(event);
+    }
+    return events;
+}
+
+// ============================================================
+// Kernels
+// ============================================================
+// Raw-pointer loops over contiguous data, templated on element type.
+// Callers pick T with dispatch().
+
+template <typename Src, typename Dst>
+static void cast_kernel(const Src* __restrict src, Dst* __restrict dst, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = (Dst)src[i];
+}
+
+template <typename T, typename Op>
+static void binary_kernel(const T* __restrict a, const T* __restrict b,
+                          T* __restrict out, size_t n, Op op) {
+    for (size_t i = 0; i < n; i++) out[i] = op(a[i], b[i]);
+}
+
+// Whole-array sum. Floats are summed in SIMD lanes a block at a time and
+// the block totals are accumulated in double, which keeps float32 error
+// bounded by the block size rather than by n.
+template <typename T>
+static double sum_float_kernel(const T* a, size_t n) {
+    typedef Simd<T> S;
+    const size_t kBlock = 4096;
+    double total = 0.0;
+
+    for (size_t start = 0; start < n; start += kBlock) {
+        size_t end = std::min(n, start + kBlock);
+        typename S::vec acc0 = S::broadcast(0), acc1 = S::broadcast(0);
+        size_t i = start;
+        for (; i + 2 * S::width <= end; i += 2 * S::width) {
+            acc0 += S::load(a + i);
+            acc1 += S::load(a + i + S::width);
+        }
+        T block = S::hsum(acc0 + acc1);
+        for (; i < end; i++) block += a[i];
+        total += block;
+    }
+    return total;
+}
+
+template <typename T>
+static int64_t sum_int_kernel(const T* a, size_t n) {
+    int64_t total = 0;
+    for (size_t i = 0; i < n; i++) total += a[i];
+    return total;
+}
+
+// C[m x n] = A[m x k] * B[k x n] (or C += A * B with `accumulate`), all
+// row-major with leading dimensions lda/ldb/ldc, so the operands can be
+// tiles of larger matrices.
+//
+// Blocked so that a KC x NC panel of B stays in L2 while every row of A
+// streams past it. The micro-kernel keeps a 4 x (2 vectors) tile of C in
+// registers and, per step of k, broadcasts one element from each of the
+// 4 rows of A against two vector loads from a row of B.
+template <typename T>
+static void gemm_kernel(const T* A, size_t lda, const T* B, size_t ldb, T* C, size_t ldc,
+                        size_t m, size_t k, size_t n, bool accumulate = false) {
+    typedef Simd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+    const size_t KC = 256;
+    const size_t NC = (256 * 1024) / (KC * sizeof(T));
+
+    if (!accumulate) {
+        for (size_t i = 0; i < m; i++) std::fill(C + i * ldc, C + i * ldc + n, T(0));
+    }
+
+    for (size_t p0 = 0; p0 < k; p0 += KC) {
+        size_t pend = std::min(k, p0 + KC);
+        for (size_t j0 = 0; j0 < n; j0 += NC) {
+            size_t jend = std::min(n, j0 + NC);
+
+            size_t i = 0;
+            for (; i + 4 <= m; i += 4) {
+                const T* a0 = A + (i + 0) * lda;
+                const T* a1 = A + (i + 1) * lda;
+                const T* a2 = A + (i + 2) * lda;
+                const T* a3 = A + (i + 3) * lda;
+                T* c0 = C + (i + 0) * ldc;
+                T* c1 = C + (i + 1) * ldc;
+                T* c2 = C + (i + 2) * ldc;
+                T* c3 = C + (i + 3) * ldc;
+
+                size_t j = j0;
+                for (; j + 2 * W <= jend; j += 2 * W) {
+                    vec c00 = S::load(c0 + j), c01 = S::load(c0 + j + W);
+                    vec c10 = S::load(c1 + j), c11 = S::load(c1 + j + W);
+                    vec c20 = S::load(c2 + j), c21 = S::load(c2 + j + W);
+                    vec c30 = S::load(c3 + j), c31 = S::load(c3 + j + W);
+                    for (size_t p = p0; p < pend; p++) {
+                        vec b0 = S::load(B + p * ldb + j);
+                        vec b1 = S::load(B + p * ldb + j + W);
+                        vec x;
+                        x = S::broadcast(a0[p]); c00 += x * b0; c01 += x * b1;
+                        x = S::broadcast(a1[p]); c10 += x * b0; c11 += x * b1;
+                        x = S::broadcast(a2[p]); c20 += x * b0; c21 += x * b1;
+                        x = S::broadcast(a3[p]); c30 += x * b0; c31 += x * b1;
+                    }
+                    S::store(c0 + j, c00); S::store(c0 + j + W, c01);
+                    S::store(c1 + j, c10); S::store(c1 + j + W, c11);
+                    S::store(c2 + j, c20); S::store(c2 + j + W, c21);
+                    S::store(c3 + j, c30); S::store(c3 + j + W, c31);
+                }
+                for (; j < jend; j++) {
+                    T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+                    for (size_t p = p0; p < pend; p++) {
+                        T bv = B[p * ldb + j];
+                        s0 += a0[p] * bv; s1 += a1[p] * bv;
+                        s2 += a2[p] * bv; s3 += a3[p] * bv;
+                    }
+                    c0[j] += s0; c1[j] += s1; c2[j] += s2; c3[j] += s3;
+                }
+            }
+
+            // Leftover rows, one at a time
+            for (; i < m; i++) {
+                const T* a0 = A + i * lda;
+                T* c0 = C + i * ldc;
+                for (size_t p = p0; p < pend; p++) {
+                    T x = a0[p];
+                    const T* brow = B + p * ldb;
+                    for (size_t j = j0; j < jend; j++) c0[j] += x * brow[j];
+                }
+            }
+        }
+    }
+}
+
+// Whole-matrix kernel for contiguous operands whose B fits the same
+// 256 KB budget as one gemm_kernel panel: the common case in batched
+// matmul. No k/n blocking and no separate zeroing pass: each C tile
+// starts at zero in registers and is stored once, which matters when a
+// product is only a few thousand FMAs.
+static const size_t kSmallGemmBytes = 256 * 1024;
+
+template <typename T>
+static void gemm_small(const T* A, const T* B, T* C, size_t m, size_t k, size_t n) {
+    typedef Simd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+
+    size_t i = 0;
+    for (; i + 4 <= m; i += 4) {
+        const T* a0 = A + (i + 0) * k;
+        const T* a1 = A + (i + 1) * k;
+        const T* a2 = A + (i + 2) * k;
+        const T* a3 = A + (i + 3) * k;
+        size_t j = 0;
+        for (; j + 2 * W <= n; j += 2 * W) {
+            vec c00 = {}, c01 = {}, c10 = {}, c11 = {};
+            vec c20 = {}, c21 = {}, c30 = {}, c31 = {};
+            for (size_t p = 0; p < k; p++) {
+                vec b0 = S::load(B + p * n + j);
+                vec b1 = S::load(B + p * n + j + W);
+                vec x;
+                x = S::broadcast(a0[p]); c00 += x * b0; c01 += x * b1;
+                x = S::broadcast(a1[p]); c10 += x * b0; c11 += x * b1;
+                x = S::broadcast(a2[p]); c20 += x * b0; c21 += x * b1;
+                x = S::broadcast(a3[p]); c30 += x * b0; c31 += x * b1;
+            }
+            S::store(C + (i + 0) * n + j, c00); S::store(C + (i + 0) * n + j + W, c01);
+            S::store(C + (i + 1) * n + j, c10); S::store(C + (i + 1) * n + j + W, c11);
+            S::store(C + (i + 2) * n + j, c20); S::store(C + (i + 2) * n + j + W, c21);
+            S::store(C + (i + 3) * n + j, c30); S::store(C + (i + 3) * n + j + W, c31);
+        }
+        for (; j < n; j++) {
+            T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+            for (size_t p = 0; p < k; p++) {
+                T bv = B[p * n + j];
+                s0 += a0[p] * bv; s1 += a1[p] * bv;
+                s2 += a2[p] * bv; s3 += a3[p] * bv;
+            }
+            C[(i + 0) * n + j] = s0; C[(i + 1) * n + j] = s1;
+            C[(i + 2) * n + j] = s2; C[(i + 3) * n + j] = s3;
+        }
+    }
+
+    // Leftover rows, one at a time
+    for (; i < m; i++) {
+        const T* a0 = A + i * k;
+        T* c0 = C + i * n;
+        size_t j = 0;
+        for (; j + W <= n; j += W) {
+            vec c = {};
+            for (size_t p = 0; p < k; p++) c += S::broadcast(a0[p]) * S::load(B + p * n + j);
+            S::store(c0 + j, c);
+        }
+        for (; j < n; j++) {
+            T s = 0;
+            for (size_t p = 0; p < k; p++) s += a0[p] * B[p * n + j];
+            c0[j] = s;
+        }
+    }
+}
+
+static const size_t kGemmParallelFlops = 1 << 21;  // m * k * n
+static const size_t kGemmTaskFlops = 1 << 20;
+
+// Matrix-vector shapes. With n == 1, m == 1 or k == 1 the GEMM tile
+// above degenerates into its scalar edge loops, and nothing is reused
+// anyway: each element of A (or B, or C) is touched once, so these
+// products are bound by memory bandwidth. They get one-pass SIMD kernels
+// split across threads instead:
+//   gemv_rows   y = A x, one dot product per row of A
+//   gemv_cols   y = x A, rows of A scaled and added into y
+//   dot         m == n == 1
+//   outer       k == 1, a rank-1 product
+// A k range is only ever split by the shapes (never by the thread
+// count), so every kernel sums in the same order on any number of
+// threads.
+static const size_t kGemvColChunk = 16 * 1024;  // bytes of y per task in gemv_cols
+static const size_t kDotBlock = 64 * 1024;      // elements per partial dot product
+
+// y[i] = A[i, :] . x for i in [0, m). Four rows at a time share each
+// load of x; every row keeps one vector of partial sums, then a tail.
+template <typename T>
+static void gemv_rows_block(const T* A, size_t lda, const T* x, T* y, size_t m, size_t k) {
+    typedef Simd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+
+    size_t i = 0;
+    for (; i + 4 <= m; i += 4) {
+        const T* a0 = A + (i + 0) * lda;
+        const T* a1 = A + (i + 1) * lda;
+        const T* a2 = A + (i + 2) * lda;
+        const T* a3 = A + (i + 3) * lda;
+        vec s0 = {}, s1 = {}, s2 = {}, s3 = {};
+        size_t p = 0;
+        for (; p + W <= k; p += W) {
+            vec xv = S::load(x + p);
+            s0 += S::load(a0 + p) * xv;
+            s1 += S::load(a1 + p) * xv;
+            s2 += S::load(a2 + p) * xv;
+            s3 += S::load(a3 + p) * xv;
+        }
+        T r0 = S::hsum(s0), r1 = S::hsum(s1), r2 = S::hsum(s2), r3 = S::hsum(s3);
+        for (; p < k; p++) {
+            r0 += a0[p] * x[p]; r1 += a1[p] * x[p];
+            r2 += a2[p] * x[p]; r3 += a3[p] * x[p];
+        }
+        y[i] = r0; y[i + 1] = r1; y[i + 2] = r2; y[i + 3] = r3;
+    }
+    for (; i < m; i++) {
+        const T* a0 = A + i * lda;
+        vec s0 = {};
+        size_t p = 0;
+        for (; p + W <= k; p += W) s0 += S::load(a0 + p) * S::load(x + p);
+        T r0 = S::hsum(s0);
+        for (; p < k; p++) r0 += a0[p] * x[p];
+        y[i] = r0;
+    }
+}
+
+template <typename T>
+static void gemv_rows(const T* A, size_t lda, const T* x, T* y, size_t m, size_t k) {
+    if (m * k < kGemmParallelFlops) {
+        gemv_rows_block(A, lda, x, y, m, k);
+        return;
+    }
+    size_t rows = round_up(std::max(kGemmTaskFlops / std::max(k, (size_t)1), (size_t)4), 4);
+    parallel_for(m, rows, [&](size_t begin, size_t end) {
+        gemv_rows_block(A + begin * lda, lda, x, y + begin, end - begin, k);
+    });
+}
+
+// y[j] += sum over p of x[p] * A[p, j] for j in [0, n): four rows of A
+// at a time are scaled and added into y, which stays in L1
+template <typename T>
+static void gemv_cols_block(const T* A, size_t lda, const T* x, T* y, size_t k, size_t n) {
+    typedef Simd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+
+    size_t p = 0;
+    for (; p + 4 <= k; p += 4) {
+        const T* a0 = A + (p + 0) * lda;
+        const T* a1 = A + (p + 1) * lda;
+        const T* a2 = A + (p + 2) * lda;
+        const T* a3 = A + (p + 3) * lda;
+        vec x0 = S::broadcast(x[p]), x1 = S::broadcast(x[p + 1]);
+        vec x2 = S::broadcast(x[p + 2]), x3 = S::broadcast(x[p + 3]);
+        size_t j = 0;
+        for (; j + W <= n; j += W) {
+            S::store(y + j, S::load(y + j) + x0 * S::load(a0 + j) + x1 * S::load(a1 + j) +
+                            x2 * S::load(a2 + j) + x3 * S::load(a3 + j));
+        }
+        for (; j < n; j++) {
+            y[j] = y[j] + x[p] * a0[j] + x[p + 1] * a1[j] + x[p + 2] * a2[j] + x[p + 3] * a3[j];
+        }
+    }
+    for (; p < k; p++) {
+        const T* a0 = A + p * lda;
+        vec x0 = S::broadcast(x[p]);
+        size_t j = 0;
+        for (; j + W <= n; j += W) S::store(y + j, S::load(y + j) + x0 * S::load(a0 + j));
+        for (; j < n; j++) y[j] = y[j] + x[p] * a0[j];
+    }
+}
+
+// y = x A for A [k x n]. Wide rows are split into column chunks, one
+// task each; narrow ones (fewer than four chunks) into fixed blocks of
+// k, whose partial results are added up in block order.
+template <typename T>
+static void gemv_cols(const T* A, size_t lda, const T* x, T* y, size_t k, size_t n) {
+    const size_t cols = kGemvColChunk / sizeof(T);
+    size_t chunks = (n + cols - 1) / cols;
+    std::fill(y, y + n, T(0));
+    if (k * n < kGemmParallelFlops) {
+        for (size_t c = 0; c < chunks; c++) {
+            size_t j0 = c * cols;
+            gemv_cols_block(A + j0, lda, x, y + j0, k, std::min(n, j0 + cols) - j0);
+        }
+        return;
+    }
+    if (chunks >= 4) {
+        parallel_for(chunks, 1, [&](size_t c0, size_t c1) {
+            for (size_t c = c0; c < c1; c++) {
+                size_t j0 = c * cols;
+                gemv_cols_block(A + j0, lda, x, y + j0, k, std::min(n, j0 + cols) - j0);
+            }
+        });
+        return;
+    }
+
+    size_t rows = round_up(std::max(kGemmTaskFlops / n, (size_t)4), 4);
+    size_t blocks = (k + rows - 1) / rows;
+    std::vector<T> partial(blocks * n, T(0));
+    parallel_for(blocks, 1, [&](size_t b0, size_t b1) {
+        for (size_t b = b0; b < b1; b++) {
+            size_t p0 = b * rows;
+            gemv_cols_block(A + p0 * lda, lda, x + p0, partial.data() + b * n,
+                            std::min(k, p0 + rows) - p0, n);
+        }
+    });
+    for (size_t b = 0; b < blocks; b++) {
+        for (size_t j = 0; j < n; j++) y[j] += partial[b * n + j];
+    }
+}
+
+template <typename T>
+static T dot_block(const T* a, const T* b, size_t n) {
+    typedef Simd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+    vec s0 = {}, s1 = {}, s2 = {}, s3 = {};
+    size_t i = 0;
+    for (; i + 4 * W <= n; i += 4 * W) {
+        s0 += S::load(a + i) * S::load(b + i);
+        s1 += S::load(a + i + W) * S::load(b + i + W);
+        s2 += S::load(a + i + 2 * W) * S::load(b + i + 2 * W);
+        s3 += S::load(a + i + 3 * W) * S::load(b + i + 3 * W);
+    }
+    for (; i + W <= n; i += W) s0 += S::load(a + i) * S::load(b + i);
+    T r = S::hsum((s0 + s1) + (s2 + s3));
+    for (; i < n; i++) r += a[i] * b[i];
+    return r;
+}
+
+// a . b over fixed blocks of kDotBlock, in parallel for long vectors
+template <typename T>
+static T dot(const T* a, const T* b, size_t n) {
+    size_t blocks = (n + kDotBlock - 1) / kDotBlock;
+    std::vector<T> partial(blocks);
+    size_t grain = n < kGemmParallelFlops ? blocks : 1;
+    parallel_for(blocks, grain, [&](size_t first, size_t last) {
+        for (size_t blk = first; blk < last; blk++) {
+            size_t i0 = blk * kDotBlock;
+            partial[blk] = dot_block(a + i0, b + i0, std::min(n, i0 + kDotBlock) - i0);
+        }
+    });
+    T total = 0;
+    for (T v : partial) total += v;
+    return total;
+}
+
+// C[i, j] = x[i] * y[j]. Write-bound: four rows are written side by
+// side, each load of y feeding four stores, which keeps more stores in
+// flight than one row at a time. Tasks are pieces of four-row groups of
+// about kGemmTaskFlops / 8 elements, so a single long row splits too.
+template <typename T>
+static void outer(const T* x, const T* y, T* C, size_t m, size_t n) {
+    typedef Simd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+    const size_t task = kGemmTaskFlops / 8;
+    size_t groups = (m + 3) / 4;
+    size_t piece = std::min(n, std::max(task / 4, W));
+    size_t pieces = n == 0 ? 0 : (n + piece - 1) / piece;
+    size_t grain = std::max((size_t)1, task / 4 / std::max(n, (size_t)1));
+    if (m * n < kGemmParallelFlops) grain = groups * pieces;
+
+    parallel_for(groups * pieces, grain, [&](size_t t0, size_t t1) {
+        for (size_t t = t0; t < t1; t++) {
+            size_t i = t / pieces * 4, j0 = (t % pieces) * piece, j1 = std::min(n, j0 + piece);
+            if (i + 4 <= m) {
+                T* c0 = C + (i + 0) * n;
+                T* c1 = C + (i + 1) * n;
+                T* c2 = C + (i + 2) * n;
+                T* c3 = C + (i + 3) * n;
+                vec x0 = S::broadcast(x[i]), x1 = S::broadcast(x[i + 1]);
+                vec x2 = S::broadcast(x[i + 2]), x3 = S::broadcast(x[i + 3]);
+                size_t j = j0;
+                for (; j + W <= j1; j += W) {
+                    vec yv = S::load(y + j);
+                    S::store(c0 + j, x0 * yv);
+                    S::store(c1 + j, x1 * yv);
+                    S::store(c2 + j, x2 * yv);
+                    S::store(c3 + j, x3 * yv);
+                }
+                for (; j < j1; j++) {
+                    c0[j] = x[i] * y[j]; c1[j] = x[i + 1] * y[j];
+                    c2[j] = x[i + 2] * y[j]; c3[j] = x[i + 3] * y[j];
+                }
+                continue;
+            }
+            // Leftover rows, one at a time
+            for (; i < m; i++) {
+                T* c = C + i * n;
+                vec xv = S::broadcast(x[i]);
+                size_t j = j0;
+                for (; j + W <= j1; j += W) S::store(c + j, xv * S::load(y + j));
+                for (; j < j1; j++) c[j] = x[i] * y[j];
+            }
+        }
+    });
+}
+
+// C = A B for contiguous operands. Vector shapes go to the kernels
+// above. Small products run whole on the calling thread; larger ones
+// split C into bands of rows, one task per band, each streaming all of
+// B. Every element of C is summed in the same k order either way, so
+// results do not depend on the thread count.
+template <typename T>
+static void gemm(const T* A, const T* B, T* C, size_t m, size_t k, size_t n) {
+    if (k == 1) {
+        outer(A, B, C, m, n);
+        return;
+    }
+    if (k > 1 && m == 1 && n == 1) {
+        C[0] = dot(A, B, k);
+        return;
+    }
+    if (k > 1 && n == 1) {
+        gemv_rows(A, k, B, C, m, k);
+        return;
+    }
+    if (k > 1 && m == 1) {
+        gemv_cols(B, n, A, C, k, n);
+        return;
+    }
+
+    auto block = [&](size_t begin, size_t end) {
+        if (k * n * sizeof(T) <= kSmallGemmBytes) {
+            gemm_small(A + begin * k, B, C + begin * n, end - begin, k, n);
+        } else {
+            gemm_kernel(A + begin * k, k, B, n, C + begin * n, n, end - begin, k, n);
+        }
+    };
+    size_t flops = m * k * n;
+    if (flops < kGemmParallelFlops || m < 8) {
+        block(0, m);
+        return;
+    }
+    size_t rows = std::max(kGemmTaskFlops / std::max(k * n, (size_t)1), (size_t)4);
+    rows = std::min(round_up(rows, 4), round_up((m + g_num_threads - 1) / g_num_threads, 4));
+    parallel_for(m, rows, block);
+}
+
+// C[i] = A[a_index[i]] B[b_index[i]] for i in [0, batch), where the
+// indexes pick matrices out of stacked operands (repeats express
+// broadcasting). Small products are spread across threads one matrix per
+// task; large ones run in turn, each split by gemm().
+template <typename T>
+static void gemm_batched(const T* A, const size_t* a_index, const T* B, const size_t* b_index,
+                         T* C, size_t batch, size_t m, size_t k, size_t n) {
+    auto product = [&](size_t i) {
+        gemm(A + a_index[i] * m * k, B + b_index[i] * k * n, C + i * m * n, m, k, n);
+    };
+    size_t flops = std::max(m * k * n, (size_t)1);
+    if (flops >= kGemmParallelFlops) {
+        for (size_t i = 0; i < batch; i++) product(i);
+        return;
+    }
+    size_t grain = std::max(kGemmTaskFlops / flops, (size_t)1);
+    grain = std::min(grain, std::max(batch / g_num_threads, (size_t)1));
+    parallel_for(batch, grain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) product(i);
+    });
+}
+
+// ============================================================
+// Transpose and strided copy
+// ============================================================
+// Views (transpose, permuted axes) only change strides, so any kernel
+// that needs a contiguous operand first has to gather it. A naive
+// element loop over a transposed matrix misses cache (and TLB) on every
+// store; instead the copy is split recursively until a tile fits in L1,
+// and each tile is moved as W x W register blocks transposed with
+// vector shuffles, W being the vector width: 2, 4 or 8 elements.
+
+static const size_t kTransposeLeaf = 32;               // leaf tile edge, in elements
+static const size_t kParallelCopyElems = 1 << 20;      // go multithreaded above this
+
+// In-register transpose of one W x W block: out[j][i] = in[i][j]
+template <typename T>
+static inline void transpose_micro(const T* in, size_t ld_in, T* out, size_t ld_out) {
+    typedef Simd<T> S;
+    typedef typename S::vec vec;
+    if constexpr (S::width == 2) {
+        vec r0 = S::load(in), r1 = S::load(in + ld_in);
+        S::store(out, __builtin_shufflevector(r0, r1, 0, 2));
+        S::store(out + ld_out, __builtin_shufflevector(r0, r1, 1, 3));
+    } else if constexpr (S::width == 4) {
+        vec r0 = S::load(in), r1 = S::load(in + ld_in);
+        vec r2 = S::load(in + 2 * ld_in), r3 = S::load(in + 3 * ld_in);
+        vec t0 = __builtin_shufflevector(r0, r1, 0, 4, 2, 6);
+        vec t1 = __builtin_shufflevector(r0, r1, 1, 5, 3, 7);
+        vec t2 = __builtin_shufflevector(r2, r3, 0, 4, 2, 6);
+        vec t3 = __builtin_shufflevector(r2, r3, 1, 5, 3, 7);
+        S::store(out, __builtin_shufflevector(t0, t2, 0, 1, 4, 5));
+        S::store(out + ld_out, __builtin_shufflevector(t1, t3, 0, 1, 4, 5));
+        S::store(out + 2 * ld_out, __builtin_shufflevector(t0, t2, 2, 3, 6, 7));
+        S::store(out + 3 * ld_out, __builtin_shufflevector(t1, t3, 2, 3, 6, 7));
+    } else {
+        vec r[8], t[8], u[8];
+        for (int i = 0; i < 8; i++) r[i] = S::load(in + i * ld_in);
+        // Interleave 32-bit lanes of row pairs
+        for (int i = 0; i < 8; i += 2) {
+            t[i] = __builtin_shufflevector(r[i], r[i + 1], 0, 8, 2, 10, 4, 12, 6, 14);
+            t[i + 1] = __builtin_shufflevector(r[i], r[i + 1], 1, 9, 3, 11, 5, 13, 7, 15);
+        }
+        // Interleave 64-bit pairs
+        for (int i = 0; i < 8; i += 4) {
+            u[i] = __builtin_shufflevector(t[i], t[i + 2], 0, 1, 8, 9, 4, 5, 12, 13);
+            u[i + 1] = __builtin_shufflevector(t[i], t[i + 2], 2, 3, 10, 11, 6, 7, 14, 15);
+            u[i + 2] = __builtin_shufflevector(t[i + 1], t[i + 3], 0, 1, 8, 9, 4, 5, 12, 13);
+            u[i + 3] = __builtin_shufflevector(t[i + 1], t[i + 3], 2, 3, 10, 11, 6, 7, 14, 15);
+        }
+        // Swap 128-bit halves; u[0..3] hold columns {0,4}, {2,6}, {1,5}, {3,7}
+        static const int col_lo[4] = {0, 2, 1, 3};
+        for (int i = 0; i < 4; i++) {
+            S::store(out + col_lo[i] * ld_out,
+                     __builtin_shufflevector(u[i], u[i + 4], 0, 1, 2, 3, 8, 9, 10, 11));
+            S::store(out + (col_lo[i] + 4) * ld_out,
+                     __builtin_shufflevector(u[i], u[i + 4], 4, 5, 6, 7, 12, 13, 14, 15));
+        }
+    }
+}
+
+// out[j * ld_out + i] = in[i * ld_in + j] for a rows x cols block,
+// halving the longer side until the block fits in L1
+template <typename T>
+static void transpose_block(const T* in, size_t ld_in, T* out, size_t ld_out,
+                            size_t rows, size_t cols) {
+    if (rows > kTransposeLeaf || cols > kTransposeLeaf) {
+        if (rows >= cols) {
+            size_t half = rows / 2;
+            transpose_block(in, ld_in, out, ld_out, half, cols);
+            transpose_block(in + half * ld_in, ld_in, out + half, ld_out, rows - half, cols);
+        } else {
+            size_t half = cols / 2;
+            transpose_block(in, ld_in, out, ld_out, rows, half);
+            transpose_block(in + half, ld_in, out + half * ld_out, ld_out, rows, cols - half);
+        }
+        return;
+    }
+
+    size_t i = 0;
+    if constexpr (!std::is_same<T, bool>::value && (sizeof(T) == 4 || sizeof(T) == 8)) {
+        const size_t W = Simd<T>::width;
+        for (; i + W <= rows; i += W) {
+            size_t j = 0;
+            for (; j + W <= cols; j += W) {
+                transpose_micro(in + i * ld_in + j, ld_in, out + j * ld_out + i, ld_out);
+            }
+            for (; j < cols; j++) {
+                for (size_t ii = i; ii < i + W; ii++) out[j * ld_out + ii] = in[ii * ld_in + j];
+            }
+        }
+    }
+    for (; i < rows; i++) {
+        for (size_t j = 0; j < cols; j++) out[j * ld_out + i] = in[i * ld_in + j];
+    }
+}
+
+// Row-parallel for large inputs: each task transposes a band of input
+// rows, i.e. writes a disjoint band of output columns
+template <typename T>
+static void transpose_2d(const T* in, size_t ld_in, T* out, size_t ld_out,
+                         size_t rows, size_t cols) {
+    if (rows * cols < kParallelCopyElems) {
+        transpose_block(in, ld_in, out, ld_out, rows, cols);
+        return;
+    }
+    size_t band = std::max((size_t)64, kParallelCopyElems / 8 / std::max(cols, (size_t)1));
+    band = (band + 7) / 8 * 8;
+    parallel_for(rows, band, [&](size_t r0, size_t r1) {
+        transpose_block(in + r0 * ld_in, ld_in, out + r0, ld_out, r1 - r0, cols);
+    });
+}
+
+// Gather an arbitrarily strided N-D view into contiguous row-major
+// `dst`. The last two axes decide the inner loop: memcpy when the last
+// axis is unit-stride, the blocked transpose when the second-to-last
+// is, and a plain strided gather otherwise. Leading axes are walked
+// with an index counter, in parallel for large copies.
+template <typename T>
+static void strided_copy(const T* src, const std::vector<size_t>& shape,
+                         const std::vector<int64_t>& strides, T* dst) {
+    size_t ndim = shape.size();
+    size_t total = 1;
+    for (size_t d : shape) total *= d;
+    if (total == 0) return;
+    if (ndim == 0) {
+        dst[0] = src[0];
+        return;
+    }
+
+    size_t cols = shape[ndim - 1];
+    int64_t cs = strides[ndim - 1];
+    size_t rows = ndim >= 2 ? shape[ndim - 2] : 1;
+    int64_t rs = ndim >= 2 ? strides[ndim - 2] : 0;
+    size_t plane = rows * cols;
+    size_t planes = total / plane;
+
+    // Source offset of the first element of plane `p`
+    auto plane_offset = [&](size_t p) {
+        int64_t off = 0;
+        for (size_t d = ndim >= 2 ? ndim - 2 : ndim - 1; d-- > 0;) {
+            off += (int64_t)(p % shape[d]) * strides[d];
+            p /= shape[d];
+        }
+        return off;
+    };
+
+    auto copy_plane = [&](const T* s, T* d) {
+        if (cs == 1) {
+            for (size_t i = 0; i < rows; i++) std::memcpy(d + i * cols, s + i * rs, cols * sizeof(T));
+        } else if (rs == 1 && rows > 1) {
+            // The view is a transpose of a plane with row stride cs
+            transpose_2d(s, (size_t)cs, d, cols, cols, rows);
+        } else {
+            for (size_t i = 0; i < rows; i++) {
+                for (size_t j = 0; j < cols; j++) d[i * cols + j] = s[i * rs + j * cs];
+            }
+        }
+    };
+
+    if (planes == 1) {
+        copy_plane(src, dst);
+        return;
+    }
+    size_t grain = std::max((size_t)1, kParallelCopyElems / 8 / plane);
+    if (total < kParallelCopyElems) grain = planes;
+    parallel_for(planes, grain, [&](size_t p0, size_t p1) {
+        for (size_t p = p0; p < p1; p++) copy_plane(src + plane_offset(p), dst + p * plane);
+    });
+}
+
+// ============================================================
+// Elementwise math
+// ============================================================
+// Vector exp/log/tanh/sigmoid built from range reduction plus a short
+// polynomial, operating on whole registers. Integer parts of
+// the reduction use the lanes' bit patterns (the mask type is the
+// same-width integer vector), which avoids float <-> int64 conversions
+// that SSE/AVX2 lack.
+//
+// Maximum error, measured against 80-bit long double on random inputs
+// across each function's whole domain and around zero (1 ulp = one unit
+// in the last place of the correctly rounded result):
+//   exp      float64 1.2 ulp   float32 1.2 ulp
+//   log      float64 0.9 ulp   float32 0.9 ulp
+//   tanh     float64 2.8 ulp   float32 2.5 ulp
+//   sigmoid  float64 2.3 ulp   float32 2.4 ulp
+// Subnormal results and inputs are handled; NaN propagates; exp
+// overflows to inf and underflows to 0 as the libm version does.
+
+template <typename T>
+struct MathConst;
+
+template <>
+struct MathConst<double> {
+    typedef uint64_t Bits;
+    static constexpr int mantissa_bits = 52;
+    static constexpr int64_t bias = 1023;
+    static constexpr int64_t exponent_mask = 0x7ff;
+    static constexpr int64_t mantissa_mask = (int64_t(1) << 52) - 1;
+    static constexpr double round_shift = 6755399441055744.0;  // 1.5 * 2^52
+    // ln 2 = ln2_hi + ln2_lo, with ln2_hi * n exact for any exponent n
+    static constexpr double ln2_hi = 6.93147180369123816490e-01;
+    static constexpr double ln2_lo = 1.90821492927058770002e-10;
+    static constexpr double exp_max = 709.782712893384;        // log(DBL_MAX)
+    static constexpr double exp_min = -745.1332191019412;      // log(smallest subnormal)
+    static constexpr double tanh_saturate = 19.1;              // 1 - tanh(x) < ulp/2 beyond
+    static constexpr double min_normal = 2.2250738585072014e-308;
+    static constexpr double subnormal_scale = 18446744073709551616.0;  // 2^64
+    static constexpr int subnormal_shift = 64;
+    // exp(r) = 1 + r * sum(r^i / (i + 1)!) on |r| <= ln2 / 2
+    static constexpr double exp_poly[] = {
+        1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+        1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800,
+        1.0 / 479001600, 1.0 / 6227020800};
+    // log(1 + f) = 2 atanh(s) = 2s + s * z * sum(2 z^i / (2i + 3)),
+    // s = f / (2 + f), z = s^2 <= 0.0295
+    static constexpr double log_poly[] = {
+        2.0 / 3, 2.0 / 5, 2.0 / 7, 2.0 / 9, 2.0 / 11, 2.0 / 13, 2.0 / 15,
+        2.0 / 17, 2.0 / 19, 2.0 / 21};
+    // tanh(x) = x + x * z * sum(c[i] z^i), z = x^2, for |x| <= ln2 / 4
+    static constexpr double tanh_poly[] = {
+        -1.0 / 3, 2.0 / 15, -17.0 / 315, 62.0 / 2835, -1382.0 / 155925,
+        21844.0 / 6081075, -929569.0 / 638512875, 6404582.0 / 10854718875,
+        -443861162.0 / 1856156927625};
+    // sin(x) = x + x * z * sum(s[i] z^i), cos(x) = 1 + z * sum(c[i] z^i),
+    // z = x^2, for |x| <= pi / 4
+    static constexpr double sin_poly[] = {
+        -1.0 / 6, 1.0 / 120, -1.0 / 5040, 1.0 / 362880, -1.0 / 39916800,
+        1.0 / 6227020800, -1.0 / 1307674368000};
+    static constexpr double cos_poly[] = {
+        -1.0 / 2, 1.0 / 24, -1.0 / 720, 1.0 / 40320, -1.0 / 3628800,
+        1.0 / 479001600, -1.0 / 87178291200, 1.0 / 20922789888000};
+};
+
+template <>
+struct MathConst<float> {
+    typedef uint32_t Bits;
+    static constexpr int mantissa_bits = 23;
+    static constexpr int32_t bias = 127;
+    static constexpr int32_t exponent_mask = 0xff;
+    static constexpr int32_t mantissa_mask = (int32_t(1) << 23) - 1;
+    static constexpr float round_shift = 12582912.0f;          // 1.5 * 2^23
+    static constexpr float ln2_hi = 6.9314575195e-01f;
+    static constexpr float ln2_lo = 1.4286067653e-06f;
+    static constexpr float exp_max = 88.72283905f;
+    static constexpr float exp_min = -103.97208f;
+    static constexpr float tanh_saturate = 9.02f;
+    static constexpr float min_normal = 1.17549435e-38f;
+    static constexpr float subnormal_scale = 4294967296.0f;   // 2^32
+    static constexpr int subnormal_shift = 32;
+    static constexpr float exp_poly[] = {
+        1.0f, 1.0f / 2, 1.0f / 6, 1.0f / 24, 1.0f / 120, 1.0f / 720, 1.0f / 5040};
+    static constexpr float log_poly[] = {2.0f / 3, 2.0f / 5, 2.0f / 7, 2.0f / 9};
+    static constexpr float tanh_poly[] = {
+        -1.0f / 3, 2.0f / 15, -17.0f / 315, 62.0f / 2835};
+    static constexpr float sin_poly[] = {-1.0f / 6, 1.0f / 120, -1.0f / 5040, 1.0f / 362880};
+    static constexpr float cos_poly[] = {-1.0f / 2, 1.0f / 24, -1.0f / 720, 1.0f / 40320,
+                                         -1.0f / 3628800};
+};
+
+// These kernels use the target's native vector width. Generic vectors
+// wider than the hardware are split up, but GCC lowers their
+// comparisons and selects lane by lane with branches, which every
+// function here depends on.
+#if defined(__AVX2__)
+static const size_t kMathVectorBytes = 32;
+#else
+static const size_t kMathVectorBytes = 16;
+#endif
+
+template <typename T>
+using MathSimd = Simd<T, kMathVectorBytes>;
+
+// GCC's inliner otherwise gives up on the larger functions at -O2, and
+// each call then spills its vectors through the stack
+#define VEC_INLINE static inline __attribute__((always_inline))
+
+static const double kHalfLn2 = 0.34657359027997265471;
+static const double kLog2e = 1.44269504088896340736;
+static const double kSqrt2 = 1.41421356237309504880;
+static const double kGeluScale = 1.59576912160573071176;  // 2 sqrt(2 / pi)
+
+// Horner evaluation of sum(c[i] * x^i), unrolled at compile time
+template <typename T, size_t N, size_t I = 0>
+VEC_INLINE typename MathSimd<T>::vec polynomial(typename MathSimd<T>::vec x, const T (&c)[N]) {
+    typedef MathSimd<T> S;
+    if constexpr (I + 1 == N) {
+        return S::broadcast(c[I]);
+    } else {
+        return polynomial<T, N, I + 1>(x, c) * x + S::broadcast(c[I]);
+    }
+}
+
+// round(x) as floats and as integers, for |x| < 2^(mantissa_bits - 1):
+// adding 1.5 * 2^mantissa_bits leaves the integer in the low bits
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec round_to_int(typename MathSimd<T>::vec x,
+                                                 typename MathSimd<T>::mask* as_int) {
+    typedef MathSimd<T> S;
+    typedef typename S::mask ivec;
+    typename S::vec shift = S::broadcast(MathConst<T>::round_shift);
+    typename S::vec t = x + shift;
+    *as_int = (ivec)t - (ivec)shift;
+    return t - shift;
+}
+
+// Integer lanes to floats, same trick in reverse
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec int_to_float(typename MathSimd<T>::mask n) {
+    typedef MathSimd<T> S;
+    typedef typename S::mask ivec;
+    typename S::vec shift = S::broadcast(MathConst<T>::round_shift);
+    return (typename S::vec)(n + (ivec)shift) - shift;
+}
+
+// e^r - 1 for |r| <= ln2 / 2, without cancellation
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec expm1_reduced(typename MathSimd<T>::vec r) {
+    return r * polynomial<T>(r, MathConst<T>::exp_poly);
+}
+
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec vexp(typename MathSimd<T>::vec x) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    typedef typename S::mask ivec;
+    typedef MathConst<T> C;
+
+    vec hi = S::broadcast(C::exp_max), lo = S::broadcast(C::exp_min);
+    vec xc = S::select(x > hi, hi, S::select(x < lo, lo, x));
+
+    // x = n ln2 + r
+    ivec ni;
+    vec n = round_to_int<T>(xc * S::broadcast((T)kLog2e), &ni);
+    vec r = (xc - n * S::broadcast(C::ln2_hi)) - n * S::broadcast(C::ln2_lo);
+    vec p = S::broadcast(1) + expm1_reduced<T>(r);
+
+    // Scale by 2^n in two halves so subnormal results round only once.
+    // n1 comes from float math: SSE/AVX2 have no 64-bit arithmetic shift.
+    ivec n1;
+    round_to_int<T>(n * S::broadcast((T)0.5), &n1);
+    ivec n2 = ni - n1;
+    vec s1 = (vec)((n1 + C::bias) << C::mantissa_bits);
+    vec s2 = (vec)((n2 + C::bias) << C::mantissa_bits);
+    vec y = p * s1 * s2;
+
+    y = S::select(x > hi, S::broadcast(std::numeric_limits<T>::infinity()), y);
+    return S::select(x < lo, S::broadcast(0), y);
+}
+
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec vlog(typename MathSimd<T>::vec x) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    typedef typename S::mask ivec;
+    typedef MathConst<T> C;
+
+    typedef typename C::Bits bits_t;
+    typedef bits_t uvec __attribute__((vector_size(sizeof(vec))));
+
+    // Lift subnormals into the normal range first
+    ivec sub = x < S::broadcast(C::min_normal);
+    vec xs = S::select(sub, x * S::broadcast(C::subnormal_scale), x);
+
+    // x = m * 2^e with m in [sqrt(1/2), sqrt(2))
+    ivec bits = (ivec)xs;
+    ivec one = (ivec)S::broadcast(1);
+    ivec e = (ivec)(((uvec)bits >> C::mantissa_bits) & C::exponent_mask) - C::bias;
+    e -= sub & C::subnormal_shift;
+    vec m = (vec)((bits & C::mantissa_mask) | one);
+    ivec big = m > S::broadcast((T)kSqrt2);
+    m = S::select(big, m * S::broadcast((T)0.5), m);
+    e -= big;  // mask lanes are -1 where true
+
+    // As in fdlibm: log(m) = f - (f^2 / 2 - s (f^2 / 2 + R)) keeps the
+    // leading term f exact
+    vec f = m - S::broadcast(1);
+    vec s = f / (f + S::broadcast(2));
+    vec z = s * s;
+    vec R = z * polynomial<T>(z, C::log_poly);
+    vec hfsq = S::broadcast((T)0.5) * f * f;
+    vec ef = int_to_float<T>(e);
+    vec y = ef * S::broadcast(C::ln2_hi) -
+            ((hfsq - (s * (hfsq + R) + ef * S::broadcast(C::ln2_lo))) - f);
+
+    const T inf = std::numeric_limits<T>::infinity();
+    y = S::select(x == S::broadcast(0), S::broadcast(-inf), y);
+    y = S::select(x == S::broadcast(inf), S::broadcast(inf), y);
+    return S::select((x < S::broadcast(0)) | (x != x),
+                     S::broadcast(std::numeric_limits<T>::quiet_NaN()), y);
+}
+
+// e^y - 1 for 0 <= y < 64 without cancellation: with y = n ln2 + r,
+// e^y - 1 = 2^n (e^r - 1) + (2^n - 1)
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec vexpm1_positive(typename MathSimd<T>::vec y) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    typedef typename S::mask ivec;
+    typedef MathConst<T> C;
+
+    ivec ni;
+    vec n = round_to_int<T>(y * S::broadcast((T)kLog2e), &ni);
+    vec r = (y - n * S::broadcast(C::ln2_hi)) - n * S::broadcast(C::ln2_lo);
+    vec scale = (vec)((ni + C::bias) << C::mantissa_bits);
+    return scale * expm1_reduced<T>(r) + (scale - S::broadcast(1));
+}
+
+// Odd polynomial near zero; (e^2x - 1) / (e^2x + 1) elsewhere
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec vtanh(typename MathSimd<T>::vec x) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    typedef typename S::mask ivec;
+    typedef MathConst<T> C;
+
+    ivec sign = (ivec)x & (ivec)S::broadcast(-0.0);
+    vec ax = (vec)((ivec)x ^ sign);
+
+    vec z = ax * ax;
+    vec small = ax + ax * z * polynomial<T>(z, C::tanh_poly);
+
+    vec capped = S::select(ax > S::broadcast(C::tanh_saturate), S::broadcast(C::tanh_saturate), ax);
+    vec em1 = vexpm1_positive<T>(S::broadcast(2) * capped);
+    vec large = em1 / (em1 + S::broadcast(2));
+    large = S::select(ax > S::broadcast(C::tanh_saturate), S::broadcast(1), large);
+
+    vec t = S::select(ax <= S::broadcast((T)(kHalfLn2 / 2)), small, large);
+    return (vec)((ivec)t | sign);
+}
+
+// 1 / (1 + e^-x), written as e^x / (1 + e^x) for x < 0 so tiny results
+// keep their relative accuracy
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec vsigmoid(typename MathSimd<T>::vec x) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    typedef typename S::mask ivec;
+
+    ivec negative = x < S::broadcast(0);
+    vec e = vexp<T>(S::select(negative, x, -x));
+    vec d = S::broadcast(1) + e;
+    return S::select(negative, e / d, S::broadcast(1) / d);
+}
+
+// max(x, 0), keeping NaN
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec vrelu(typename MathSimd<T>::vec x) {
+    typedef MathSimd<T> S;
+    return S::select(x < S::broadcast(0), S::broadcast(0), x);
+}
+
+// GELU, tanh form: x/2 (1 + tanh(sqrt(2/pi) (x + 0.044715 x^3))), which
+// is x sigmoid(2 sqrt(2/pi) (...)); sigmoid keeps the far negative tail
+// accurate where 1 + tanh would cancel
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec vgelu(typename MathSimd<T>::vec x) {
+    typedef MathSimd<T> S;
+    typename MathSimd<T>::vec inner = x + S::broadcast((T)0.044715) * x * x * x;
+    return x * vsigmoid<T>(S::broadcast((T)kGeluScale) * inner);
+}
+
+static const size_t kParallelMathElems = 1 << 16;
+static const size_t kMathChunk = 1 << 14;  // a multiple of every Simd width
+
+// y[i] = f(x[i]) with f mapping a whole register. The ragged tail goes
+// through a padded buffer so every element takes the same code path.
+// x and y may be the same array.
+template <typename T, typename F>
+static void unary_kernel(const T* x, T* y, size_t n, F f) {
+    typedef MathSimd<T> S;
+    const size_t W = S::width;
+    auto run = [x, y, f, W](size_t begin, size_t end) {
+        size_t i = begin;
+        for (; i + W <= end; i += W) S::store(y + i, f(S::load(x + i)));
+        if (i < end) {
+            T buf[S::width] = {};
+            std::copy(x + i, x + end, buf);
+            S::store(buf, f(S::load(buf)));
+            std::copy(buf, buf + (end - i), y + i);
+        }
+    };
+    if (n >= kParallelMathElems) {
+        parallel_for(n, kMathChunk, run);
+    } else {
+        run(0, n);
+    }
+}
+
+enum class UnaryOp { Exp, Log, Tanh, Sigmoid, Relu, Gelu };
+
+template <typename T>
+static void apply_unary(UnaryOp op, const T* x, T* y, size_t n) {
+    typedef typename MathSimd<T>::vec vec;
+    if (op == UnaryOp::Relu) {
+        unary_kernel(x, y, n, [](vec v) { return vrelu<T>(v); });
+        return;
+    }
+    if constexpr (std::is_floating_point<T>::value) {
+        switch (op) {
+            case UnaryOp::Exp: unary_kernel(x, y, n, [](vec v) { return vexp<T>(v); }); break;
+            case UnaryOp::Log: unary_kernel(x, y, n, [](vec v) { return vlog<T>(v); }); break;
+            case UnaryOp::Tanh: unary_kernel(x, y, n, [](vec v) { return vtanh<T>(v); }); break;
+            case UnaryOp::Sigmoid:
+                unary_kernel(x, y, n, [](vec v) { return vsigmoid<T>(v); });
+                break;
+            case UnaryOp::Gelu: unary_kernel(x, y, n, [](vec v) { return vgelu<T>(v); }); break;
+            case UnaryOp::Relu: break;
+        }
+    }
+}
+
+// ============================================================
+// Row-wise softmax and layer norm
+// ============================================================
+// Fused kernels over the last axis, parallel over rows. Each row is
+// streamed from memory once, then revisited in cache, with no
+// temporaries; exps dominate, so each kernel computes one per element:
+// - log_softmax keeps an online maximum and sum of exponentials: each
+//   chunk of kRowChunk vectors rescales the running sum to the new
+//   maximum once, so nothing overflows. It then writes
+//   x - (max + log(sum)) with no further exps.
+// - softmax needs exp(x - max) for its output as well, so it takes the
+//   (cheap) maximum first, writes the exponentials while summing them,
+//   and scales them in place.
+// - layer_norm keeps a Welford mean and sum of squared deviations per
+//   vector lane, on the row shifted by its first element, and merges the
+//   lanes at the end (Chan et al.). That stays accurate when the mean is
+//   large next to the spread, where sum(x^2) - sum(x)^2 / n cancels.
+
+static const size_t kRowChunk = 16;
+
+template <typename T>
+VEC_INLINE T hmax(typename MathSimd<T>::vec v) {
+    T m = v[0];
+    for (size_t i = 1; i < MathSimd<T>::width; i++) m = v[i] > m ? v[i] : m;
+    return m;
+}
+
+// Maximum of a row and the sum of exp(x - maximum). NaNs are skipped by
+// the maximum but poison the sum, so they spread to the whole row.
+template <typename T>
+static void softmax_stats(const T* x, size_t n, T* max_out, T* sum_out) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+    const T ninf = -std::numeric_limits<T>::infinity();
+
+    T m = ninf;
+    vec sum = S::broadcast(0);
+    for (size_t i = 0; i < n;) {
+        size_t end = std::min(n, i + kRowChunk * W);
+        vec cm = S::broadcast(ninf);
+        size_t j = i;
+        for (; j + W <= end; j += W) {
+            vec v = S::load(x + j);
+            cm = S::select(v > cm, v, cm);
+        }
+        T chunk_max = hmax<T>(cm);
+        for (; j < end; j++) chunk_max = x[j] > chunk_max ? x[j] : chunk_max;
+
+        if (chunk_max > m) {
+            if (m != ninf) sum *= S::broadcast(std::exp(m - chunk_max));
+            m = chunk_max;
+        }
+        // Nothing to add while every element so far is -inf
+        if (m != ninf) {
+            vec mv = S::broadcast(m);
+            for (j = i; j + W <= end; j += W) sum += vexp<T>(S::load(x + j) - mv);
+            if (j < end) {
+                T buf[S::width];
+                std::fill(buf, buf + W, ninf);
+                std::copy(x + j, x + end, buf);
+                sum += vexp<T>(S::load(buf) - mv);
+            }
+        }
+        i = end;
+    }
+    *max_out = m;
+    *sum_out = S::hsum(sum);
+}
+
+static void row_parallel(size_t rows, size_t cols, const std::function<void(size_t, size_t)>& run) {
+    if (rows * cols >= kParallelMathElems) {
+        parallel_for(rows, std::max((size_t)1, kParallelMathElems / std::max(cols, (size_t)1)), run);
+    } else {
+        run(0, rows);
+    }
+}
+
+// softmax (or log_softmax) of each row of x [rows, cols] into y, which
+// may be x
+template <typename T>
+static void softmax_rows(const T* x, T* y, size_t rows, size_t cols, bool log) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+    row_parallel(rows, cols, [=](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            const T* xr = x + r * cols;
+            T* yr = y + r * cols;
+            size_t i = 0;
+            if (log) {
+                T m, sum;
+                softmax_stats(xr, cols, &m, &sum);
+                // (x - m) - log(sum), not x - (m + log(sum)): a large m
+                // would round away most of log(sum)'s bits
+                T ls = std::log(sum);
+                vec mv = S::broadcast(m), lv = S::broadcast(ls);
+                for (; i + W <= cols; i += W) S::store(yr + i, (S::load(xr + i) - mv) - lv);
+                for (; i < cols; i++) yr[i] = (xr[i] - m) - ls;
+                continue;
+            }
+
+            vec mv = S::broadcast(-std::numeric_limits<T>::infinity());
+            for (; i + W <= cols; i += W) {
+                vec v = S::load(xr + i);
+                mv = S::select(v > mv, v, mv);
+            }
+            T m = hmax<T>(mv);
+            for (; i < cols; i++) m = xr[i] > m ? xr[i] : m;
+
+            // A row of -inf has no finite maximum to subtract; it comes
+            // out NaN either way (0 / 0)
+            mv = S::broadcast(m);
+            vec sum = S::broadcast(0);
+            for (i = 0; i + W <= cols; i += W) {
+                vec e = vexp<T>(S::load(xr + i) - mv);
+                sum += e;
+                S::store(yr + i, e);
+            }
+            if (i < cols) {
+                T buf[S::width];
+                std::fill(buf, buf + W, -std::numeric_limits<T>::infinity());
+                std::copy(xr + i, xr + cols, buf);
+                vec e = vexp<T>(S::load(buf) - mv);
+                sum += e;
+                S::store(buf, e);
+                std::copy(buf, buf + (cols - i), yr + i);
+            }
+
+            T scale = (T)1 / S::hsum(sum);
+            vec sv = S::broadcast(scale);
+            for (i = 0; i + W <= cols; i += W) S::store(yr + i, S::load(yr + i) * sv);
+            for (; i < cols; i++) yr[i] *= scale;
+        }
+    });
+}
+
+// Combines (count, mean, m2) of two disjoint parts of a row
+template <typename T>
+static inline void welford_merge(T& count, T& mean, T& m2, T count_b, T mean_b, T m2_b) {
+    T total = count + count_b;
+    if (total == 0) return;
+    T delta = mean_b - mean;
+    mean += delta * (count_b / total);
+    m2 += m2_b + delta * delta * (count * count_b / total);
+    count = total;
+}
+
+// (x - mean) / sqrt(var + eps) * weight + bias over each row of
+// x [rows, cols] into y, which may be x. weight and bias may be null.
+template <typename T>
+static void layer_norm_rows(const T* x, const T* weight, const T* bias, T* y,
+                            size_t rows, size_t cols, T eps) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    const size_t W = S::width;
+    row_parallel(rows, cols, [=](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            const T* xr = x + r * cols;
+            T* yr = y + r * cols;
+
+            // Statistics of x - x[0]: the running means then stay near
+            // zero, where their rounding is small next to the spread
+            T shift = cols ? xr[0] : 0;
+            vec sv = S::broadcast(shift);
+            vec mean_v = S::broadcast(0), m2_v = S::broadcast(0);
+            size_t i = 0, steps = 0;
+            for (; i + W <= cols; i += W) {
+                vec v = S::load(xr + i) - sv;
+                vec delta = v - mean_v;
+                mean_v += delta * S::broadcast((T)1 / (T)++steps);
+                m2_v += delta * (v - mean_v);
+            }
+            T count = 0, mean = 0, m2 = 0;
+            for (size_t lane = 0; lane < W && steps; lane++) {
+                welford_merge(count, mean, m2, (T)steps, mean_v[lane], m2_v[lane]);
+            }
+            for (; i < cols; i++) welford_merge(count, mean, m2, (T)1, xr[i] - shift, (T)0);
+            mean += shift;
+
+            T rstd = (T)1 / std::sqrt(m2 / (T)cols + eps);
+            vec mv = S::broadcast(mean), rv = S::broadcast(rstd);
+            for (i = 0; i + W <= cols; i += W) {
+                vec v = (S::load(xr + i) - mv) * rv;
+                if (weight) v *= S::load(weight + i);
+                if (bias) v += S::load(bias + i);
+                S::store(yr + i, v);
+            }
+            for (; i < cols; i++) {
+                T v = (xr[i] - mean) * rstd;
+                if (weight) v *= weight[i];
+                if (bias) v += bias[i];
+                yr[i] = v;
+            }
+        }
+    });
+}
+
+// ============================================================
+// Convolution
+// ============================================================
+// conv2d over NCHW input x [N, C, H, W] with filters w [K, C, R, S]:
+//
+//   out[n, k, oh, ow] = bias[k] + sum over c, r, s of
+//       w[k, c, r, s] * x[n, c, oh*sh + r*dh - ph, ow*sw + s*dw - pw]
+//
+// Two implementations:
+// - im2col + GEMM: each image is unrolled into a [C*R*S, OH*OW] matrix
+//   whose columns are receptive fields, then out[n] = w [K, C*R*S] @ col
+//   runs on the blocked GEMM. Handles any filter and stride, at the cost
+//   of an unrolled copy R*S times the size of the input.
+// - direct: 3x3 and 1x1 filters, with the tap loop fixed at compile
+//   time. Reads a zero-padded copy of the input, so the inner loop has
+//   no bounds checks, and vectorizes along output rows, so it needs unit
+//   horizontal stride and rows at least a vector wide.
+//
+// Both split work into whole output planes (or bands of filters), so
+// results do not depend on the thread count.
+
+struct ConvShape {
+    size_t N, C, H, W;   // input
+    size_t K, R, S;      // filters
+    size_t OH, OW;       // output plane
+    size_t sh, sw, ph, pw, dh, dw;
+    size_t HP, WP;       // padded input plane, for the direct kernel
+};
+
+// Copies image planes into the middle of zeroed HP x WP planes
+template <typename T>
+static void conv_pad(const T* x, T* xp, const ConvShape& g) {
+    parallel_for(g.N * g.C, std::max((size_t)1, kParallelCopyElems / (g.HP * g.WP)),
+                 [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++) {
+            const T* src = x + p * g.H * g.W;
+            T* dst = xp + p * g.HP * g.WP;
+            std::fill(dst, dst + g.ph * g.WP, (T)0);
+            for (size_t i = 0; i < g.H; i++) {
+                T* row = dst + (g.ph + i) * g.WP;
+                std::fill(row, row + g.pw, (T)0);
+                std::memcpy(row + g.pw, src + i * g.W, g.W * sizeof(T));
+                std::fill(row + g.pw + g.W, row + g.WP, (T)0);
+            }
+            std::fill(dst + (g.ph + g.H) * g.WP, dst + g.HP * g.WP, (T)0);
+        }
+    });
+}
+
+// One output value of filter k at (oh, ow), from the padded input
+template <typename T, size_t R, size_t S>
+static inline T conv_point(const T* image, const T* filter, const size_t* tap,
+                           const ConvShape& g, size_t oh, size_t ow) {
+    const T* corner = image + oh * g.sh * g.WP + ow * g.sw;
+    T sum = 0;
+    for (size_t c = 0; c < g.C; c++, corner += g.HP * g.WP, filter += R * S) {
+        for (size_t t = 0; t < R * S; t++) sum += filter[t] * corner[tap[t]];
+    }
+    return sum;
+}
+
+// Filters [k0, k1) of image n, from the padded input `xp`. Same tile as
+// the GEMM micro-kernel: 4 filters x (2 vectors) of one output row, one
+// broadcast weight per filter against two input vector loads per tap;
+// then one vector for narrow rows, then scalars.
+template <typename T, size_t R, size_t S>
+static void conv_direct(const T* xp, const T* w, const T* bias, T* out,
+                        const ConvShape& g, size_t n, size_t k0, size_t k1) {
+    typedef Simd<T> Sd;
+    typedef typename Sd::vec vec;
+    const size_t V = Sd::width;
+    const size_t taps = g.C * R * S;
+    const size_t plane = g.HP * g.WP;
+    const T* image = xp + n * g.C * plane;
+
+    // Offset of each filter tap from the top-left corner of its window
+    size_t tap[R * S];
+    for (size_t r = 0; r < R; r++) {
+        for (size_t s = 0; s < S; s++) tap[r * S + s] = r * g.dh * g.WP + s * g.dw;
+    }
+
+    size_t k = k0;
+    for (; k + 4 <= k1; k += 4) {
+        const T* f0 = w + (k + 0) * taps;
+        const T* f1 = w + (k + 1) * taps;
+        const T* f2 = w + (k + 2) * taps;
+        const T* f3 = w + (k + 3) * taps;
+        T* o0 = out + ((n * g.K) + k + 0) * g.OH * g.OW;
+        T* o1 = o0 + g.OH * g.OW;
+        T* o2 = o1 + g.OH * g.OW;
+        T* o3 = o2 + g.OH * g.OW;
+        T b0 = bias ? bias[k + 0] : 0, b1 = bias ? bias[k + 1] : 0;
+        T b2 = bias ? bias[k + 2] : 0, b3 = bias ? bias[k + 3] : 0;
+
+        for (size_t oh = 0; oh < g.OH; oh++) {
+            const T* top = image + oh * g.sh * g.WP;
+            size_t row = oh * g.OW;
+            size_t ow = 0;
+            for (; g.sw == 1 && ow + 2 * V <= g.OW; ow += 2 * V) {
+                vec c00 = Sd::broadcast(b0), c01 = c00, c10 = Sd::broadcast(b1), c11 = c10;
+                vec c20 = Sd::broadcast(b2), c21 = c20, c30 = Sd::broadcast(b3), c31 = c30;
+                const T* corner = top + ow;
+                for (size_t c = 0; c < g.C; c++, corner += plane) {
+                    const size_t p0 = c * R * S;
+                    for (size_t t = 0; t < R * S; t++) {
+                        vec x0 = Sd::load(corner + tap[t]);
+                        vec x1 = Sd::load(corner + tap[t] + V);
+                        vec x;
+                        x = Sd::broadcast(f0[p0 + t]); c00 += x * x0; c01 += x * x1;
+                        x = Sd::broadcast(f1[p0 + t]); c10 += x * x0; c11 += x * x1;
+                        x = Sd::broadcast(f2[p0 + t]); c20 += x * x0; c21 += x * x1;
+                        x = Sd::broadcast(f3[p0 + t]); c30 += x * x0; c31 += x * x1;
+                    }
+                }
+                Sd::store(o0 + row + ow, c00); Sd::store(o0 + row + ow + V, c01);
+                Sd::store(o1 + row + ow, c10); Sd::store(o1 + row + ow + V, c11);
+                Sd::store(o2 + row + ow, c20); Sd::store(o2 + row + ow + V, c21);
+                Sd::store(o3 + row + ow, c30); Sd::store(o3 + row + ow + V, c31);
+            }
+            for (; g.sw == 1 && ow + V <= g.OW; ow += V) {
+                vec c0 = Sd::broadcast(b0), c1 = Sd::broadcast(b1);
+                vec c2 = Sd::broadcast(b2), c3 = Sd::broadcast(b3);
+                const T* corner = top + ow;
+                for (size_t c = 0; c < g.C; c++, corner += plane) {
+                    const size_t p0 = c * R * S;
+                    for (size_t t = 0; t < R * S; t++) {
+                        vec x0 = Sd::load(corner + tap[t]);
+                        c0 += Sd::broadcast(f0[p0 + t]) * x0;
+                        c1 += Sd::broadcast(f1[p0 + t]) * x0;
+                        c2 += Sd::broadcast(f2[p0 + t]) * x0;
+                        c3 += Sd::broadcast(f3[p0 + t]) * x0;
+                    }
+                }
+                Sd::store(o0 + row + ow, c0); Sd::store(o1 + row + ow, c1);
+                Sd::store(o2 + row + ow, c2); Sd::store(o3 + row + ow, c3);
+            }
+            for (; ow < g.OW; ow++) {
+                o0[row + ow] = b0 + conv_point<T, R, S>(image, f0, tap, g, oh, ow);
+                o1[row + ow] = b1 + conv_point<T, R, S>(image, f1, tap, g, oh, ow);
+                o2[row + ow] = b2 + conv_point<T, R, S>(image, f2, tap, g, oh, ow);
+                o3[row + ow] = b3 + conv_point<T, R, S>(image, f3, tap, g, oh, ow);
+            }
+        }
+    }
+
+    // Leftover filters, one at a time
+    for (; k < k1; k++) {
+        const T* f0 = w + k * taps;
+        T* o0 = out + ((n * g.K) + k) * g.OH * g.OW;
+        T b0 = bias ? bias[k] : 0;
+        for (size_t oh = 0; oh < g.OH; oh++) {
+            const T* top = image + oh * g.sh * g.WP;
+            size_t row = oh * g.OW;
+            size_t ow = 0;
+            for (; g.sw == 1 && ow + 2 * V <= g.OW; ow += 2 * V) {
+                vec c00 = Sd::broadcast(b0), c01 = c00;
+                const T* corner = top + ow;
+                for (size_t c = 0; c < g.C; c++, corner += plane) {
+                    const size_t p0 = c * R * S;
+                    for (size_t t = 0; t < R * S; t++) {
+                        vec x = Sd::broadcast(f0[p0 + t]);
+                        c00 += x * Sd::load(corner + tap[t]);
+                        c01 += x * Sd::load(corner + tap[t] + V);
+                    }
+                }
+                Sd::store(o0 + row + ow, c00); Sd::store(o0 + row + ow + V, c01);
+            }
+            for (; ow < g.OW; ow++) {
+                o0[row + ow] = b0 + conv_point<T, R, S>(image, f0, tap, g, oh, ow);
+            }
+        }
+    }
+}
+
+// Tasks are bands of up to 4 filters of one image
+template <typename T, size_t R, size_t S>
+static void conv_direct_all(const T* xp, const T* w, const T* bias, T* out, const ConvShape& g) {
+    size_t bands = (g.K + 3) / 4;
+    size_t band_flops = 2 * 4 * g.C * R * S * g.OH * g.OW;
+    size_t grain = std::max((size_t)1, kGemmTaskFlops / std::max(band_flops, (size_t)1));
+    parallel_for(g.N * bands, grain, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; t++) {
+            size_t n = t / bands, k0 = (t % bands) * 4;
+            conv_direct<T, R, S>(xp, w, bias, out, g, n, k0, std::min(k0 + 4, g.K));
+        }
+    });
+}
+
+// One image x [C, H, W] into col [C*R*S, OH*OW]; taps that fall in the
+// padding read as zero
+template <typename T>
+static void im2col(const T* x, T* col, const ConvShape& g) {
+    size_t rows = g.C * g.R * g.S, cols = g.OH * g.OW;
+    parallel_for(rows, std::max((size_t)1, kParallelCopyElems / 8 / std::max(cols, (size_t)1)),
+                 [&](size_t begin, size_t end) {
+        for (size_t row = begin; row < end; row++) {
+            size_t c = row / (g.R * g.S), r = row / g.S % g.R, s = row % g.S;
+            const T* plane = x + c * g.H * g.W;
+            T* dst = col + row * cols;
+            // Output columns whose tap lands inside the image: iw in [0, W)
+            int64_t shift = (int64_t)(s * g.dw) - (int64_t)g.pw;
+            int64_t lo = shift >= 0 ? 0 : (-shift + (int64_t)g.sw - 1) / (int64_t)g.sw;
+            int64_t hi = (int64_t)g.W - 1 - shift < 0 ? 0
+                       : ((int64_t)g.W - 1 - shift) / (int64_t)g.sw + 1;
+            size_t ow_lo = (size_t)std::min<int64_t>(lo, g.OW);
+            size_t ow_hi = std::max(ow_lo, (size_t)std::min<int64_t>(hi, g.OW));
+            for (size_t oh = 0; oh < g.OH; oh++, dst += g.OW) {
+                int64_t ih = (int64_t)(oh * g.sh + r * g.dh) - (int64_t)g.ph;
+                if (ih < 0 || ih >= (int64_t)g.H) {
+                    std::fill(dst, dst + g.OW, (T)0);
+                    continue;
+                }
+                const T* src = plane + ih * g.W + shift;
+                std::fill(dst, dst + ow_lo, (T)0);
+                if (g.sw == 1) {
+                    std::memcpy(dst + ow_lo, src + ow_lo, (ow_hi - ow_lo) * sizeof(T));
+                } else {
+                    for (size_t ow = ow_lo; ow < ow_hi; ow++) dst[ow] = src[ow * g.sw];
+                }
+                std::fill(dst + ow_hi, dst + g.OW, (T)0);
+            }
+        }
+    });
+}
+
+// A 1x1 filter with unit stride and no padding sees the image as is
+static bool conv_identity(const ConvShape& g) {
+    return g.R == 1 && g.S == 1 && g.sh == 1 && g.sw == 1 && g.ph == 0 && g.pw == 0;
+}
+
+// Enough images to go around: one task per thread, each taking whole
+// images with the GEMM inline. Otherwise one image at a time, with the
+// unrolling and the GEMM (over filters) each split across threads.
+// Decided once on the host: the workspace holds one image per task, so
+// the kernel (or a graph replay) must not recount with a newer
+// set_num_threads().
+static size_t conv_im2col_tasks(const ConvShape& g) {
+    size_t threads = g_num_threads;
+    return g.N >= threads && g.N > 1 ? threads : 1;
+}
+
+template <typename T>
+static void conv_im2col(const T* x, const T* w, const T* bias, T* out, const ConvShape& g,
+                        size_t tasks, T* work) {
+    size_t rows = g.C * g.R * g.S, cols = g.OH * g.OW;
+    bool identity = conv_identity(g);
+    auto image = [&](size_t n, T* col) {
+        const T* b = x + n * g.C * g.H * g.W;
+        if (!identity) {
+            im2col(b, col, g);
+            b = col;
+        }
+        T* o = out + n * g.K * cols;
+        gemm(w, b, o, g.K, rows, cols);
+        if (bias) {
+            for (size_t k = 0; k < g.K; k++) {
+                for (size_t j = 0; j < cols; j++) o[k * cols + j] += bias[k];
+            }
+        }
+    };
+    if (tasks > 1) {
+        parallel_for(tasks, 1, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; t++) {
+                for (size_t n = t; n < g.N; n += tasks) image(n, work + t * rows * cols);
+            }
+        });
+    } else {
+        for (size_t n = 0; n < g.N; n++) image(n, work);
+    }
+}
+
+static bool conv_has_direct(const ConvShape& g) {
+    return (g.R == 1 && g.S == 1) || (g.R == 3 && g.S == 3);
+}
+
+// The direct kernel when its rows are mostly whole vectors (at most a
+// quarter scalar tail). A 1x1 filter that needs no unrolling is a plain
+// GEMM, which the im2col path runs without a copy.
+static bool conv_use_direct(const ConvShape& g, size_t width) {
+    return conv_has_direct(g) && !conv_identity(g) && g.sw == 1 &&
+           g.OW >= width && (g.OW % width) * 4 <= g.OW;
+}
+
+// Scratch elements conv2d needs: the padded input for the direct
+// kernel, one unrolled image per im2col task
+static size_t conv_workspace(const ConvShape& g, bool direct, size_t tasks) {
+    if (direct) return g.ph || g.pw ? g.N * g.C * g.HP * g.WP : 0;
+    if (conv_identity(g)) return 0;
+    return tasks * g.C * g.R * g.S * g.OH * g.OW;
+}
+
+template <typename T>
+static void conv2d(const T* x, const T* w, const T* bias, T* out, const ConvShape& g,
+                   bool direct, size_t tasks, T* work) {
+    if (!direct) {
+        conv_im2col(x, w, bias, out, g, tasks, work);
+        return;
+    }
+    const T* xp = x;
+    if (g.ph || g.pw) {
+        conv_pad(x, work, g);
+        xp = work;
+    }
+    if (g.R == 1) {
+        conv_direct_all<T, 1, 1>(xp, w, bias, out, g);
+    } else {
+        conv_direct_all<T, 3, 3>(xp, w, bias, out, g);
+    }
+}
+
+// ============================================================
+// Quantization
+// ============================================================
+// Affine int8: real = scale * (q - zero_point), and quantizing rounds
+// q = clamp(round(real / scale) + zero_point, -128, 127), ties to even.
+// Per tensor, or per channel: a scale and zero point for each index
+// along one axis (for a [k, n] weight, typically the n output columns).
+
+struct QuantParams {
+    std::vector<double> scale;       // one entry, or one per channel
+    std::vector<int32_t> zero_point;
+    size_t channels = 1;             // extent of the channel axis
+    size_t inner = 1;                // elements per step along it
+};
+
+static inline int8_t quantize_value(double x, double scale, int32_t zero_point) {
+    double q = std::nearbyint(x / scale) + zero_point;
+    return (int8_t)std::min(127.0, std::max(-128.0, q));
+}
+
+// Runs fn(begin, end, channel) over runs of elements that share a channel
+template <typename F>
+static void for_each_channel_run(size_t n, const QuantParams& qp, F fn) {
+    size_t run = qp.channels > 1 ? qp.inner : n;
+    size_t runs = run ? n / run : 0;
+    size_t grain = std::max((size_t)1, kParallelMathElems / std::max(run, (size_t)1));
+    auto body = [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) fn(r * run, (r + 1) * run, r % qp.channels);
+    };
+    if (n >= kParallelMathElems) {
+        parallel_for(runs, grain, body);
+    } else {
+        body(0, runs);
+    }
+}
+
+template <typename T>
+static void quantize_kernel(const T* x, int8_t* q, size_t n, const QuantParams& qp) {
+    for_each_channel_run(n, qp, [&](size_t begin, size_t end, size_t c) {
+        double scale = qp.scale[qp.scale.size() > 1 ? c : 0];
+        int32_t zero_point = qp.zero_point[qp.zero_point.size() > 1 ? c : 0];
+        for (size_t i = begin; i < end; i++) q[i] = quantize_value((double)x[i], scale, zero_point);
+    });
+}
+
+template <typename T>
+static void dequantize_kernel(const int8_t* q, T* x, size_t n, const QuantParams& qp) {
+    for_each_channel_run(n, qp, [&](size_t begin, size_t end, size_t c) {
+        T scale = (T)qp.scale[qp.scale.size() > 1 ? c : 0];
+        int32_t zero_point = qp.zero_point[qp.zero_point.size() > 1 ? c : 0];
+        for (size_t i = begin; i < end; i++) x[i] = scale * (T)((int32_t)q[i] - zero_point);
+    });
+}
+
+// int8 GEMM: C[i, j] = sum_p (A[i, p] - za) (B[p, j] - zb[j]), expanded so the
+// inner loop is a plain int8 product accumulated in int32:
+//
+//   A B  -  za colsum(B)[j]  -  zb[j] rowsum(A)[i]  +  k za zb[j]
+//
+// For k <= kQGemmMaxK the true result fits int32 (|a - za|, |b - zb| <=
+// 255), so the terms are combined in wrapping 32-bit arithmetic and the
+// result is still exact. The corrections and the epilogue (int32 out,
+// scale * C + bias as float32, or that requantized to int8) are applied
+// to each register tile before it is stored.
+//
+// Inner kernels, one per instruction set. Each is compiled for its own
+// target and the module picks the widest one the CPU supports when it is
+// imported (qgemm_select), so a default build still reaches VNNI:
+// - AVX-512 VNNI: vpdpbusd multiplies unsigned by signed bytes, four
+//   along k at a time, straight into int32. A is biased to unsigned
+//   (a + 128); the extra 128 colsum(B) folds into the za correction.
+// - AVX2 / SSE2: vpmaddubsw would saturate its int16 pair sums when both
+//   bytes are large (2 * 255 * 127 > 32767), so operands are widened to
+//   int16 and (v)pmaddwd sums pairs along k into int32 exactly.
+// - Off x86, portable vectors: int8 x int8 fits int16, widened to int32
+//   and accumulated, reading B unpacked.
+// The x86 paths read B packed into groups of QKernel::group values along
+// k per column, so one 4-byte broadcast from a row of A meets a whole
+// register of columns. A and B are zero-padded to whole groups and
+// register widths; padded columns are computed and dropped.
+
+static const size_t kQGemmMaxK = 1 << 15;
+
+#if defined(__SSE2__)
+#define QGEMM_PACKED 1
+#endif
+
+// Widest tile any kernel produces: two AVX-512 registers of int32
+static const size_t kQMaxTileCols = 32;
+
+enum class QOutput { Int32, Float32, Int8 };
+
+struct QEpilogue {
+    QOutput output = QOutput::Int32;
+    int32_t a_zero = 0;
+    std::vector<int32_t> b_zero;     // per column
+    std::vector<float> scale;        // a_scale * b_scale, per column
+    const float* bias = nullptr;     // per column, or null
+    float out_scale = 1;
+    int32_t out_zero = 0;
+};
+
+// Applies corrections and the epilogue to raw sums for rows [i0, i0 + rows)
+// and columns [j0, j0 + cols); `raw` is row-major with stride `ld`.
+// col_term[j] holds the row-independent part, k za zb - (za + bias) colsum.
+static void qgemm_store(const int32_t* raw, size_t ld, size_t i0, size_t rows, size_t j0,
+                        size_t cols, const int32_t* row_sum, const uint32_t* col_term,
+                        const QEpilogue& e, void* C, size_t n) {
+    const uint32_t* ct = col_term + j0;
+    const int32_t* zb = e.b_zero.data() + j0;
+    int32_t acc[kQMaxTileCols];
+    for (size_t r = 0; r < rows; r++) {
+        size_t i = i0 + r;
+        uint32_t rs = (uint32_t)row_sum[i];
+        const int32_t* x = raw + r * ld;
+        for (size_t c = 0; c < cols; c++) {
+            acc[c] = (int32_t)((uint32_t)x[c] + ct[c] - (uint32_t)zb[c] * rs);
+        }
+        if (e.output == QOutput::Int32) {
+            std::memcpy((int32_t*)C + i * n + j0, acc, cols * sizeof(int32_t));
+            continue;
+        }
+        const float* scale = e.scale.data() + j0;
+        float y[kQMaxTileCols];
+        for (size_t c = 0; c < cols; c++) y[c] = scale[c] * (float)acc[c];
+        if (e.bias) {
+            for (size_t c = 0; c < cols; c++) y[c] += e.bias[j0 + c];
+        }
+        if (e.output == QOutput::Float32) {
+            std::memcpy((float*)C + i * n + j0, y, cols * sizeof(float));
+        } else {
+            int8_t* dst = (int8_t*)C + i * n + j0;
+            for (size_t c = 0; c < cols; c++) dst[c] = quantize_value(y[c], e.out_scale, e.out_zero);
+        }
+    }
+}
+
+#if defined(QGEMM_PACKED)
+
+// B [k, n] into [k_groups][n_pad][Group], zero-padded
+template <typename PackB, size_t Group>
+static void qgemm_pack_b(const int8_t* B, void* out, size_t k, size_t n, size_t n_pad) {
+    PackB* Bp = (PackB*)out;
+    size_t k_pad = round_up(k, Group);
+    std::memset(Bp, 0, k_pad * n_pad * sizeof(PackB));
+    for (size_t p = 0; p < k; p++) {
+        PackB* dst = Bp + (p / Group) * n_pad * Group + p % Group;
+        const int8_t* src = B + p * n;
+        for (size_t j = 0; j < n; j++) dst[j * Group] = (PackB)src[j];
+    }
+}
+
+// One row of A into k_pad entries (biased for VNNI)
+template <typename PackA, int32_t Bias>
+static void qgemm_pack_a_row(const int8_t* a, void* out, size_t k, size_t k_pad) {
+    PackA* dst = (PackA*)out;
+    for (size_t p = 0; p < k; p++) dst[p] = (PackA)((int32_t)a[p] + Bias);
+    for (size_t p = k; p < k_pad; p++) dst[p] = 0;
+}
+
+// 4 rows x 2 registers of raw sums. Rows past the end of A reuse its
+// last row; their results are not stored. Written once and expanded
+// below for each instruction set, with QVEC_* defined for that set.
+#define QGEMM_TILE(name, isa, qvec, qpack_a, qpack_b, kGroup)                                 \
+    __attribute__((target(isa))) static void name(const void* const* rows, const void* packed, \
+                                                  size_t groups, size_t n_pad, size_t j,      \
+                                                  int32_t* out) {                             \
+        const size_t kCols = sizeof(qvec) / sizeof(int32_t), kTileCols = 2 * kCols;          \
+        const qpack_a* const* a = (const qpack_a* const*)rows;                               \
+        const qpack_b* Bp = (const qpack_b*)packed;                                           \
+        qvec c00 = QVEC_ZERO(), c01 = c00, c10 = c00, c11 = c00;                              \
+        qvec c20 = c00, c21 = c00, c30 = c00, c31 = c00;                                      \
+        for (size_t g = 0; g < groups; g++) {                                                 \
+            const qpack_b* brow = Bp + (g * n_pad + j) * kGroup;                              \
+            qvec b0 = QVEC_LOAD(brow);                                                        \
+            qvec b1 = QVEC_LOAD(brow + kCols * kGroup);                                       \
+            qvec x;                                                                           \
+            int32_t group; /* kGroup values of A in one 32-bit lane */                        \
+            std::memcpy(&group, a[0] + g * kGroup, 4); x = QVEC_SPLAT(group);                 \
+            c00 = QVEC_DOT(c00, x, b0); c01 = QVEC_DOT(c01, x, b1);                           \
+            std::memcpy(&group, a[1] + g * kGroup, 4); x = QVEC_SPLAT(group);                 \
+            c10 = QVEC_DOT(c10, x, b0); c11 = QVEC_DOT(c11, x, b1);                           \
+            std::memcpy(&group, a[2] + g * kGroup, 4); x = QVEC_SPLAT(group);                 \
+            c20 = QVEC_DOT(c20, x, b0); c21 = QVEC_DOT(c21, x, b1);                           \
+            std::memcpy(&group, a[3] + g * kGroup, 4); x = QVEC_SPLAT(group);                 \
+            c30 = QVEC_DOT(c30, x, b0); c31 = QVEC_DOT(c31, x, b1);                           \
+        }                                                                                     \
+        QVEC_STORE(out + 0 * kTileCols, c00); QVEC_STORE(out + 0 * kTileCols + kCols, c01);   \
+        QVEC_STORE(out + 1 * kTileCols, c10); QVEC_STORE(out + 1 * kTileCols + kCols, c11);   \
+        QVEC_STORE(out + 2 * kTileCols, c20); QVEC_STORE(out + 2 * kTileCols + kCols, c21);   \
+        QVEC_STORE(out + 3 * kTileCols, c30); QVEC_STORE(out + 3 * kTileCols + kCols, c31);   \
+    }
+
+#define QVEC_ZERO() _mm512_setzero_si512()
+#define QVEC_LOAD(p) _mm512_loadu_si512(p)
+#define QVEC_STORE(p, v) _mm512_storeu_si512(p, v)
+#define QVEC_SPLAT(x) _mm512_set1_epi32(x)
+#define QVEC_DOT(c, a, b) _mm512_dpbusd_epi32(c, a, b)
+QGEMM_TILE(qgemm_tile_vnni, "avx512f,avx512vnni", __m512i, uint8_t, int8_t, 4)
+#undef QVEC_ZERO
+#undef QVEC_LOAD
+#undef QVEC_STORE
+#undef QVEC_SPLAT
+#undef QVEC_DOT
+
+#define QVEC_ZERO() _mm256_setzero_si256()
+#define QVEC_LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+#define QVEC_STORE(p, v) _mm256_storeu_si256((__m256i*)(p), v)
+#define QVEC_SPLAT(x) _mm256_set1_epi32(x)
+#define QVEC_DOT(c, a, b) _mm256_add_epi32(c, _mm256_madd_epi16(a, b))
+QGEMM_TILE(qgemm_tile_avx2, "avx2", __m256i, int16_t, int16_t, 2)
+#undef QVEC_ZERO
+#undef QVEC_LOAD
+#undef QVEC_STORE
+#undef QVEC_SPLAT
+#undef QVEC_DOT
+
+#define QVEC_ZERO() _mm_setzero_si128()
+#define QVEC_LOAD(p) _mm_loadu_si128((const __m128i*)(p))
+#define QVEC_STORE(p, v) _mm_storeu_si128((__m128i*)(p), v)
+#define QVEC_SPLAT(x) _mm_set1_epi32(x)
+#define QVEC_DOT(c, a, b) _mm_add_epi32(c, _mm_madd_epi16(a, b))
+QGEMM_TILE(qgemm_tile_sse2, "sse2", __m128i, int16_t, int16_t, 2)
+#undef QVEC_ZERO
+#undef QVEC_LOAD
+#undef QVEC_STORE
+#undef QVEC_SPLAT
+#undef QVEC_DOT
+#undef QGEMM_TILE
+
+// A packed kernel: its operand layout, packing routines and tile
+struct QKernel {
+    const char* name;
+    size_t group;       // values along k in one 32-bit lane
+    size_t tile_cols;   // columns per tile, two registers of int32
+    size_t elem;        // bytes per packed value of A and of B
+    int32_t a_bias;     // added to A when it is packed
+    void (*pack_b)(const int8_t* B, void* out, size_t k, size_t n, size_t n_pad);
+    void (*pack_a_row)(const int8_t* a, void* out, size_t k, size_t k_pad);
+    void (*tile)(const void* const* a, const void* Bp, size_t groups, size_t n_pad, size_t j,
+                 int32_t* out);
+};
+
+static const QKernel kQKernelVnni = {"avx512vnni", 4, 32, 1, 128, qgemm_pack_b<int8_t, 4>,
+                                     qgemm_pack_a_row<uint8_t, 128>, qgemm_tile_vnni};
+static const QKernel kQKernelAvx2 = {"avx2", 2, 16, 2, 0, qgemm_pack_b<int16_t, 2>,
+                                     qgemm_pack_a_row<int16_t, 0>, qgemm_tile_avx2};
+static const QKernel kQKernelSse2 = {"sse2", 2, 8, 2, 0, qgemm_pack_b<int16_t, 2>,
+                                     qgemm_pack_a_row<int16_t, 0>, qgemm_tile_sse2};
+
+// Chosen once at import; workspace sizing and the kernel itself both
+// read it, so they always agree on the layout.
+static const QKernel* g_qkernel = &kQKernelSse2;
+
+static void qgemm_select() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vnni")) {
+        g_qkernel = &kQKernelVnni;
+    } else if (__builtin_cpu_supports("avx2")) {
+        g_qkernel = &kQKernelAvx2;
+    }
+}
+
+static const char* qgemm_kernel_name() { return g_qkernel->name; }
+
+#else
+
+static const size_t kQTileCols = 8;
+
+// 4 rows x 8 columns of raw sums from unpacked B; columns past n read
+// as zero. Rows past the end of A reuse its last row.
+static void qgemm_tile(const int8_t* const* a, const int8_t* B, size_t k, size_t n, size_t j,
+                       int32_t* out) {
+    typedef int16_t v8s __attribute__((vector_size(16)));
+    typedef int32_t v8i __attribute__((vector_size(32)));
+    typedef int8_t v8b __attribute__((vector_size(8)));
+    v8i c0 = {}, c1 = {}, c2 = {}, c3 = {};
+    size_t cols = std::min((size_t)8, n - j);
+    for (size_t p = 0; p < k; p++) {
+        v8b braw = {};
+        std::memcpy(&braw, B + p * n + j, cols);
+        v8s b = __builtin_convertvector(braw, v8s);
+        c0 += __builtin_convertvector(b * (int16_t)a[0][p], v8i);
+        c1 += __builtin_convertvector(b * (int16_t)a[1][p], v8i);
+        c2 += __builtin_convertvector(b * (int16_t)a[2][p], v8i);
+        c3 += __builtin_convertvector(b * (int16_t)a[3][p], v8i);
+    }
+    std::memcpy(out + 0, &c0, sizeof(c0));
+    std::memcpy(out + 8, &c1, sizeof(c1));
+    std::memcpy(out + 16, &c2, sizeof(c2));
+    std::memcpy(out + 24, &c3, sizeof(c3));
+}
+
+static void qgemm_select() {}
+static const char* qgemm_kernel_name() { return "portable"; }
+
+#endif
+
+// Scratch bytes qgemm needs: row sums, column terms, the packed operands
+static size_t qgemm_workspace(size_t m, size_t k, size_t n) {
+    size_t bytes = (m + n) * sizeof(int32_t);
+#if defined(QGEMM_PACKED)
+    const QKernel& q = *g_qkernel;
+    size_t k_pad = round_up(k, q.group), n_pad = round_up(n, q.tile_cols);
+    bytes += (m * k_pad + k_pad * n_pad) * q.elem;
+#endif
+    return bytes;
+}
+
+// C [m, n] from int8 A [m, k] and B [k, n], as described above. `C` has
+// the element type of e.output; `work` holds qgemm_workspace bytes.
+static void qgemm(const int8_t* A, const int8_t* B, void* C, size_t m, size_t k, size_t n,
+                  const QEpilogue& e, void* work) {
+    int32_t* row_sum = (int32_t*)work;
+    uint32_t* col_term = (uint32_t*)(row_sum + m);
+    size_t bands = (m + 3) / 4;
+#if defined(QGEMM_PACKED)
+    const QKernel& q = *g_qkernel;
+    size_t k_pad = round_up(k, q.group), n_pad = round_up(n, q.tile_cols);
+    size_t groups = k_pad / q.group, a_stride = k_pad * q.elem;
+    char* Ap = (char*)(col_term + n);
+    char* Bp = Ap + m * a_stride;
+    q.pack_b(B, Bp, k, n, n_pad);
+    uint32_t a_bias = (uint32_t)q.a_bias;
+#else
+    uint32_t a_bias = 0;
+#endif
+
+    // Column sums first, then the whole row-independent correction
+    std::fill(col_term, col_term + n, 0u);
+    for (size_t p = 0; p < k; p++) {
+        const int8_t* b = B + p * n;
+        for (size_t j = 0; j < n; j++) col_term[j] += (uint32_t)(int32_t)b[j];
+    }
+    uint32_t za = (uint32_t)e.a_zero, kk = (uint32_t)k;
+    for (size_t j = 0; j < n; j++) {
+        col_term[j] = kk * za * (uint32_t)e.b_zero[j] - (za + a_bias) * col_term[j];
+    }
+
+    size_t band_flops = 2 * 4 * k * n;
+    size_t grain = std::max((size_t)1, kGemmTaskFlops / std::max(band_flops, (size_t)1));
+    parallel_for(bands, grain, [&](size_t begin, size_t end) {
+        int32_t raw[4 * kQMaxTileCols];
+        for (size_t band = begin; band < end; band++) {
+            size_t i0 = band * 4, rows = std::min((size_t)4, m - i0);
+            for (size_t i = i0; i < i0 + rows; i++) {
+                int32_t sum = 0;
+                for (size_t p = 0; p < k; p++) sum += A[i * k + p];
+                row_sum[i] = sum;
+            }
+#if defined(QGEMM_PACKED)
+            const void* a[4];
+            for (size_t r = 0; r < 4; r++) {
+                if (r < rows) q.pack_a_row(A + (i0 + r) * k, Ap + (i0 + r) * a_stride, k, k_pad);
+                a[r] = Ap + (i0 + std::min(r, rows - 1)) * a_stride;
+            }
+            for (size_t j = 0; j < n_pad; j += q.tile_cols) {
+                q.tile(a, Bp, groups, n_pad, j, raw);
+                qgemm_store(raw, q.tile_cols, i0, rows, j, std::min(q.tile_cols, n - j),
+                            row_sum, col_term, e, C, n);
+            }
+#else
+            const int8_t* a[4];
+            for (size_t r = 0; r < 4; r++) a[r] = A + (i0 + std::min(r, rows - 1)) * k;
+            for (size_t j = 0; j < n; j += kQTileCols) {
+                qgemm_tile(a, B, k, n, j, raw);
+                qgemm_store(raw, kQTileCols, i0, rows, j, std::min(kQTileCols, n - j),
+                            row_sum, col_term, e, C, n);
+            }
+#endif
+        }
+    });
+}
+
+// ============================================================
+// Out-of-core matmul
+// ============================================================
+// For operands that live in file mappings larger than memory. C is
+// produced one TM x TN tile at a time, summing over TK-deep panels:
+//
+//   C[i0:i1, j0:j1] += A[i0:i1, p0:p1] * B[p0:p1, j0:j1]
+//
+// Before each panel is multiplied, the A and B tiles of the *next* step
+// are handed to the kernel with MADV_WILLNEED, so readahead from disk
+// overlaps with compute. Rows of a read-only A that are finished are
+// marked MADV_COLD (Linux 5.4+): they stay cached but are reclaimed
+// first under memory pressure, ahead of B. MADV_DONTNEED would not do
+// this; on a file mapping it only drops this process's page-table
+// entries and leaves the page cache as it was.
+
+static const size_t kOocTileM = 1024;
+static const size_t kOocTileN = 1024;
+static const size_t kOocTileK = 512;
+
+static size_t default_ooc_threshold() {
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page <= 0) return (size_t)8 << 30;
+    return (size_t)pages * (size_t)page / 2;
+}
+
+// Operands whose combined size reaches this (and at least one of which
+// is file-backed) take the out-of-core path
+static std::atomic<size_t> g_ooc_threshold{default_ooc_threshold()};
+
+// madvise() the [col, col + bytes) span of `rows` rows spaced `ld`
+// bytes apart. Short spans are advised row by row; long ones as a block.
+static void advise_tile(const void* base, size_t ld, size_t rows,
+                        size_t col, size_t bytes, int advice) {
+    static const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    auto advise = [&](uintptr_t start, uintptr_t end) {
+        uintptr_t aligned = start & ~(page - 1);
+        madvise((void*)aligned, end - aligned, advice);
+    };
+
+    uintptr_t origin = (uintptr_t)base + col;
+    if (rows == 0 || bytes == 0) return;
+    if (bytes * 2 >= ld) {
+        advise(origin, origin + (rows - 1) * ld + bytes);
+    } else {
+        for (size_t r = 0; r < rows; r++) advise(origin + r * ld, origin + r * ld + bytes);
+    }
+}
+
+template <typename T>
+static void gemm_out_of_core(const T* A, const T* B, T* C, size_t m, size_t k, size_t n,
+                             bool a_mapped, bool b_mapped, bool a_droppable) {
+    struct Step { size_t i0, j0, p0; };
+    std::vector<Step> steps;
+    for (size_t i0 = 0; i0 < m; i0 += kOocTileM) {
+        for (size_t j0 = 0; j0 < n; j0 += kOocTileN) {
+            for (size_t p0 = 0; p0 < k; p0 += kOocTileK) {
+                steps.push_back({i0, j0, p0});
+            }
+        }
+    }
+
+    auto prefetch = [&](const Step& s) {
+        size_t rows = std::min(kOocTileM, m - s.i0);
+        size_t depth = std::min(kOocTileK, k - s.p0);
+        size_t cols = std::min(kOocTileN, n - s.j0);
+        if (a_mapped) {
+            advise_tile(A + s.i0 * k, k * sizeof(T), rows, s.p0 * sizeof(T),
+                        depth * sizeof(T), MADV_WILLNEED);
+        }
+        if (b_mapped) {
+            advise_tile(B + s.p0 * n, n * sizeof(T), depth, s.j0 * sizeof(T),
+                        cols * sizeof(T), MADV_WILLNEED);
+        }
+    };
+
+    if (m == 0 || n == 0) return;
+    if (k == 0) {
+        std::fill(C, C + m * n, T(0));
+        return;
+    }
+
+    prefetch(steps[0]);
+    for (size_t s = 0; s < steps.size(); s++) {
+        if (s + 1 < steps.size()) prefetch(steps[s + 1]);
+
+        const Step& st = steps[s];
+        size_t rows = std::min(kOocTileM, m - st.i0);
+        size_t depth = std::min(kOocTileK, k - st.p0);
+        size_t cols = std::min(kOocTileN, n - st.j0);
+        gemm_kernel(A + st.i0 * k + st.p0, k,
+                    B + st.p0 * n + st.j0, n,
+                    C + st.i0 * n + st.j0, n,
+                    rows, depth, cols, st.p0 > 0);
+
+        bool row_block_done = s + 1 == steps.size() || steps[s + 1].i0 != st.i0;
+#ifdef MADV_COLD
+        if (row_block_done && a_mapped && a_droppable) {
+            advise_tile(A + st.i0 * k, k * sizeof(T), rows, 0, k * sizeof(T), MADV_COLD);
+        }
+#endif
+    }
+}
+
+// ============================================================
+// Reductions
+// ============================================================
+// A reduction along one axis views the tensor as [outer, len, inner]
+// and produces an [outer, inner] result.
+//
+// Work is cut into tasks of roughly kReduceBlock elements: a block of
+// rows of the reduced axis times a chunk of the inner axis. With
+// inner == 1 a task reduces one contiguous span with SIMD; otherwise it
+// streams whole rows and accumulates them column-wise into a small
+// buffer. Each task writes its own partial result, and partials are
+// folded in block order, so results do not depend on the thread count.
+
+static const size_t kReduceBlock = 64 * 1024;
+static const size_t kReduceChunk = 1024;  // inner-axis columns per task
+
+struct ReducePlan {
+    size_t outer, len, inner;
+    size_t chunk;       // inner columns per task
+    size_t rows;        // reduced-axis rows per task
+    size_t n_blocks;    // tasks along the reduced axis
+    size_t n_chunks;    // tasks along the inner axis
+
+    ReducePlan(size_t outer_, size_t len_, size_t inner_)
+        : outer(outer_), len(len_), inner(inner_) {
+        chunk = std::max((size_t)1, std::min(inner, kReduceChunk));
+        rows = std::max((size_t)1, kReduceBlock / chunk);
+        n_blocks = (len + rows - 1) / rows;
+        n_chunks = (inner + chunk - 1) / chunk;
+    }
+
+    size_t tasks() const { return outer * n_blocks * n_chunks; }
+
+    // Tasks per parallel_for chunk, so tiny tasks are batched
+    size_t grain() const {
+        size_t task_elems = std::max((size_t)1, std::min(len, rows) * chunk);
+        return std::max((size_t)1, kReduceBlock / task_elems);
+    }
+
+    void split(size_t task, size_t* o, size_t* b, size_t* c) const {
+        *c = task % n_chunks;
+        *b = (task / n_chunks) % n_blocks;
+        *o = task / (n_chunks * n_blocks);
+    }
+};
+
+// Sums accumulate in double for floats and int64 for everything else
+template <typename T>
+using SumAcc = typename std::conditional<std::is_floating_point<T>::value, double, int64_t>::type;
+
+template <typename T>
+static void reduce_sum(const T* x, const ReducePlan& p, SumAcc<T>* out) {
+    typedef SumAcc<T> Acc;
+    std::vector<Acc> partial(p.outer * p.n_blocks * p.inner);
+
+    parallel_for(p.tasks(), p.grain(), [&](size_t t0, size_t t1) {
+        // Column sums run in T so the float path stays in SIMD lanes;
+        // each task covers few enough rows to keep float32 error small
+        typedef typename std::conditional<std::is_floating_point<T>::value, T, int64_t>::type ColAcc;
+        std::vector<ColAcc> acc(p.chunk);
+
+        for (size_t t = t0; t < t1; t++) {
+            size_t o, b, c;
+            p.split(t, &o, &b, &c);
+            size_t l0 = b * p.rows, l1 = std::min(p.len, l0 + p.rows);
+            size_t j0 = c * p.chunk, j1 = std::min(p.inner, j0 + p.chunk);
+            Acc* dst = partial.data() + (o * p.n_blocks + b) * p.inner;
+
+            if (p.inner == 1) {
+                const T* span = x + o * p.len + l0;
+                if constexpr (std::is_floating_point<T>::value) {
+                    dst[0] = sum_float_kernel(span, l1 - l0);
+                } else {
+                    dst[0] = sum_int_kernel(span, l1 - l0);
+                }
+                continue;
+            }
+
+            size_t w = j1 - j0;
+            std::fill(acc.begin(), acc.begin() + w, ColAcc(0));
+            for (size_t l = l0; l < l1; l++) {
+                const T* row = x + (o * p.len + l) * p.inner + j0;
+                size_t j = 0;
+                if constexpr (std::is_floating_point<T>::value) {
+                    typedef Simd<T> S;
+                    for (; j + S::width <= w; j += S::width) {
+                        S::store(&acc[j], S::load(&acc[j]) + S::load(row + j));
+                    }
+                }
+                for (; j < w; j++) acc[j] += row[j];
+            }
+            for (size_t j = 0; j < w; j++) dst[j0 + j] = (Acc)acc[j];
+        }
+    });
+
+    for (size_t o = 0; o < p.outer; o++) {
+        for (size_t j = 0; j < p.inner; j++) {
+            Acc total = 0;
+            for (size_t b = 0; b < p.n_blocks; b++) {
+                total += partial[(o * p.n_blocks + b) * p.inner + j];
+            }
+            out[o * p.inner + j] = total;
+        }
+    }
+}
+
+// `v` should replace the running max (min) `cur`. NaN beats everything
+// and, once held, is never replaced, so NaNs propagate like in NumPy.
+template <typename T, bool IsMax>
+static inline bool better(T v, T cur) {
+    bool nan_v = v != v, nan_cur = cur != cur;
+    if (nan_cur) return false;
+    if (nan_v) return true;
+    return IsMax ? v > cur : v < cur;
+}
+
+// Max (min) of a contiguous span, n >= 1
+template <typename T, bool IsMax>
+static T extreme_row(const T* x, size_t n) {
+    T best = x[0];
+    size_t i = 0;
+    if constexpr (!std::is_same<T, bool>::value) {
+        typedef Simd<T> S;
+        typedef typename S::vec vec;
+        typedef typename S::mask mask;
+        if (n >= S::width) {
+            vec acc = S::load(x);
+            mask nan = acc != acc;
+            for (i = S::width; i + S::width <= n; i += S::width) {
+                vec v = S::load(x + i);
+                acc = S::select(IsMax ? v > acc : v < acc, v, acc);
+                nan |= v != v;
+            }
+            best = acc[0];
+            for (size_t l = 1; l < S::width; l++) {
+                if (better<T, IsMax>(acc[l], best)) best = acc[l];
+            }
+            for (size_t l = 0; l < S::width; l++) {
+                if (nan[l]) return std::numeric_limits<T>::quiet_NaN();
+            }
+        }
+    }
+    for (; i < n; i++) {
+        if (better<T, IsMax>(x[i], best)) best = x[i];
+    }
+    return best;
+}
+
+// Max/min over the reduced axis, plus the index of the first occurrence
+// when `index` is non-null (argmax/argmin)
+template <typename T, bool IsMax>
+static void reduce_extreme(const T* x, const ReducePlan& p, T* out, int64_t* index) {
+    size_t nparts = p.outer * p.n_blocks * p.inner;
+    // unique_ptr rather than vector: std::vector<bool> has no data()
+    std::unique_ptr<T[]> part_val(new T[nparts]);
+    std::unique_ptr<int64_t[]> part_idx(new int64_t[index ? nparts : 0]);
+
+    parallel_for(p.tasks(), p.grain(), [&](size_t t0, size_t t1) {
+        for (size_t t = t0; t < t1; t++) {
+            size_t o, b, c;
+            p.split(t, &o, &b, &c);
+            size_t l0 = b * p.rows, l1 = std::min(p.len, l0 + p.rows);
+            size_t j0 = c * p.chunk, j1 = std::min(p.inner, j0 + p.chunk);
+            size_t base = (o * p.n_blocks + b) * p.inner;
+
+            if (p.inner == 1) {
+                const T* span = x + o * p.len + l0;
+                T best = extreme_row<T, IsMax>(span, l1 - l0);
+                part_val[base] = best;
+                if (index) {
+                    // Second pass: first position holding the extreme
+                    bool want_nan = best != best;
+                    size_t i = 0;
+                    while (!(want_nan ? span[i] != span[i] : span[i] == best)) i++;
+                    part_idx[base] = (int64_t)(l0 + i);
+                }
+                continue;
+            }
+
+            T* val = part_val.get() + base;
+            int64_t* idx = index ? part_idx.get() + base : nullptr;
+            const T* first = x + (o * p.len + l0) * p.inner;
+            for (size_t j = j0; j < j1; j++) {
+                val[j] = first[j];
+                if (idx) idx[j] = (int64_t)l0;
+            }
+            for (size_t l = l0 + 1; l < l1; l++) {
+                const T* row = x + (o * p.len + l) * p.inner;
+                for (size_t j = j0; j < j1; j++) {
+                    if (better<T, IsMax>(row[j], val[j])) {
+                        val[j] = row[j];
+                        if (idx) idx[j] = (int64_t)l;
+                    }
+                }
+            }
+        }
+    });
+
+    for (size_t o = 0; o < p.outer; o++) {
+        for (size_t j = 0; j < p.inner; j++) {
+            size_t first = o * p.n_blocks * p.inner + j;
+            T best = part_val[first];
+            int64_t best_idx = index ? part_idx[first] : 0;
+            for (size_t b = 1; b < p.n_blocks; b++) {
+                size_t k = (o * p.n_blocks + b) * p.inner + j;
+                if (better<T, IsMax>(part_val[k], best)) {
+                    best = part_val[k];
+                    if (index) best_idx = part_idx[k];
+                }
+            }
+            out[o * p.inner + j] = best;
+            if (index) index[o * p.inner + j] = best_idx;
+        }
+    }
+}
+
+// ============================================================
+// Prefix scans
+// ============================================================
+// cumsum/cumprod use the reductions' [outer, len, inner] view and task
+// grid. Each run of `rows` along the scanned axis is a block, and a scan
+// is reduce-then-scan: every block's total is computed in parallel, a
+// short serial scan over the totals gives each block its starting
+// value, and then every block is scanned in parallel from that value.
+// That reads the input twice but writes it once, and the second pass
+// needs nothing from its neighbours.
+//
+// When there are at least as many (outer, inner chunk) lanes as threads,
+// or one thread, each task instead walks its lane's blocks in order and
+// scans and totals in the same pass. Both paths compute block totals and
+// starting values the same way, so results do not depend on the thread
+// count.
+//
+// Contiguous blocks run in registers: a vector is scanned in log2(W)
+// shift-and-combine steps, then combined with the running value
+// broadcast from the previous vector's last lane.
+
+enum class ScanKind { Sum, Prod };
+
+template <ScanKind K>
+struct ScanOp {
+    template <typename T>
+    static T identity() { return K == ScanKind::Sum ? T(0) : T(1); }
+
+    template <typename V>
+    VEC_INLINE V apply(V a, V b) { return K == ScanKind::Sum ? a + b : a * b; }
+};
+
+// Lanes moved up by Shift, with `fill` shifted in at the bottom
+template <size_t Shift, typename V, size_t... I>
+VEC_INLINE V shift_lanes(V v, V fill, std::index_sequence<I...>) {
+    return __builtin_shufflevector(fill, v, (I >= Shift ? sizeof...(I) + I - Shift : I)...);
+}
+
+template <typename V, size_t... I>
+VEC_INLINE V splat_last(V v, std::index_sequence<I...>) {
+    return __builtin_shufflevector(v, v, (I * 0 + sizeof...(I) - 1)...);
+}
+
+// Inclusive scan of one register
+template <ScanKind K, size_t W, size_t Shift = 1, typename V>
+VEC_INLINE V scan_register(V v, V ident) {
+    if constexpr (Shift < W) {
+        v = ScanOp<K>::apply(v, shift_lanes<Shift>(v, ident, std::make_index_sequence<W>()));
+        return scan_register<K, W, Shift * 2>(v, ident);
+    }
+    return v;
+}
+
+// One task of either pass: block b of lane (o, c). With Write, the block
+// is scanned into `out` starting from start[j] for each inner column j;
+// with Totals, its own combined value (from the identity) goes to
+// total[j]. `start` and `total` are indexed by inner column.
+template <typename T, typename O, ScanKind K, bool Write, bool Totals>
+static void scan_block(const T* x, const ReducePlan& p, size_t o, size_t b, size_t c,
+                       const O* start, O* total, O* out) {
+    typedef ScanOp<K> Op;
+    const O ident = Op::template identity<O>();
+    size_t l0 = b * p.rows, l1 = std::min(p.len, l0 + p.rows);
+    size_t j0 = c * p.chunk, j1 = std::min(p.inner, j0 + p.chunk);
+
+    if (p.inner == 1) {
+        const T* src = x + o * p.len + l0;
+        O* dst = out + o * p.len + l0;
+        size_t n = l1 - l0, i = 0;
+        O carry = Write ? start[0] : ident;
+        O sum = ident;
+        if constexpr (std::is_same<T, O>::value && !std::is_same<T, bool>::value) {
+            typedef MathSimd<O> S;
+            typedef typename S::vec vec;
+            const size_t W = S::width;
+            vec id = S::broadcast(ident), acc = id, run = S::broadcast(carry);
+            for (; i + W <= n; i += W) {
+                vec v = S::load(src + i);
+                if (Totals) acc = Op::apply(acc, v);
+                if (Write) {
+                    vec s = Op::apply(run, scan_register<K, W>(v, id));
+                    S::store(dst + i, s);
+                    run = splat_last(s, std::make_index_sequence<W>());
+                }
+            }
+            carry = run[0];
+            for (size_t l = 0; l < W; l++) sum = Op::apply(sum, acc[l]);
+        }
+        for (; i < n; i++) {
+            O v = (O)src[i];
+            if (Totals) sum = Op::apply(sum, v);
+            if (Write) dst[i] = carry = Op::apply(carry, v);
+        }
+        if (Totals) total[0] = sum;
+        return;
+    }
+
+    // Rows at a time: the running values and totals are one per column,
+    // and the column loops vectorize
+    size_t w = j1 - j0;
+    std::vector<O> run(w), sum(w, ident);
+    if (Write) std::copy(start + j0, start + j1, run.begin());
+    for (size_t l = l0; l < l1; l++) {
+        const T* row = x + (o * p.len + l) * p.inner + j0;
+        for (size_t j = 0; j < w; j++) {
+            O v = (O)row[j];
+            if (Totals) sum[j] = Op::apply(sum[j], v);
+            if (Write) run[j] = Op::apply(run[j], v);
+        }
+        if (Write) std::copy(run.begin(), run.end(), out + (o * p.len + l) * p.inner + j0);
+    }
+    if (Totals) std::copy(sum.begin(), sum.end(), total + j0);
+}
+
+template <typename T, typename O, ScanKind K>
+static void scan_axis(const T* x, const ReducePlan& p, O* out) {
+    typedef ScanOp<K> Op;
+    const O ident = Op::template identity<O>();
+    size_t lanes = p.outer * p.n_chunks;
+
+    if (p.n_blocks == 1 || lanes >= g_num_threads) {
+        size_t lane_elems = std::max((size_t)1, p.len * std::min(p.inner, p.chunk));
+        size_t grain = std::max((size_t)1, kReduceBlock / lane_elems);
+        parallel_for(lanes, grain, [&](size_t t0, size_t t1) {
+            std::vector<O> start(p.inner), total(p.inner);
+            for (size_t t = t0; t < t1; t++) {
+                size_t o = t / p.n_chunks, c = t % p.n_chunks;
+                size_t j0 = c * p.chunk, j1 = std::min(p.inner, j0 + p.chunk);
+                std::fill(start.begin() + j0, start.begin() + j1, ident);
+                for (size_t b = 0; b < p.n_blocks; b++) {
+                    scan_block<T, O, K, true, true>(x, p, o, b, c, start.data(), total.data(), out);
+                    for (size_t j = j0; j < j1; j++) start[j] = Op::apply(start[j], total[j]);
+                }
+            }
+        });
+        return;
+    }
+
+    // Block totals, then each block's starting value in place of its total
+    std::vector<O> start(p.outer * p.n_blocks * p.inner);
+    auto block_start = [&](size_t o, size_t b) { return start.data() + (o * p.n_blocks + b) * p.inner; };
+    parallel_for(p.tasks(), p.grain(), [&](size_t t0, size_t t1) {
+        for (size_t t = t0; t < t1; t++) {
+            size_t o, b, c;
+            p.split(t, &o, &b, &c);
+            scan_block<T, O, K, false, true>(x, p, o, b, c, nullptr, block_start(o, b), out);
+        }
+    });
+    for (size_t o = 0; o < p.outer; o++) {
+        for (size_t j = 0; j < p.inner; j++) {
+            O acc = ident;
+            for (size_t b = 0; b < p.n_blocks; b++) {
+                O block_total = block_start(o, b)[j];
+                block_start(o, b)[j] = acc;
+                acc = Op::apply(acc, block_total);
+            }
+        }
+    }
+    parallel_for(p.tasks(), p.grain(), [&](size_t t0, size_t t1) {
+        for (size_t t = t0; t < t1; t++) {
+            size_t o, b, c;
+            p.split(t, &o, &b, &c);
+            scan_block<T, O, K, true, false>(x, p, o, b, c, block_start(o, b), nullptr, out);
+        }
+    });
+}
+
+// ============================================================
+// Sorting
+// ============================================================
+// sort/argsort/topk view the tensor as [outer, len, inner] like the
+// reductions and order each of the outer * inner rows of `len` values.
+//
+// Values are turned into unsigned integer keys that compare the same
+// way: floats flip the sign bit (every bit when negative), signed
+// integers flip the sign bit, and NaN becomes the largest key, so it
+// sorts last (first when descending, where every key bit is flipped).
+// Keys are sorted by a stable LSD radix sort, one byte per pass, which
+// does no comparisons and skips bytes where all keys agree (a pass for
+// int8 and bool, two for small int32 ranges). Rows of up to
+// kSortInsertionMax use insertion sort. sort without indices moves only
+// the keys and maps them back to values.
+//
+// Few long rows are split further: each thread radix sorts a run, then
+// runs are merged pairwise; each merge is cut into equal pieces of
+// output by binary search (merge path), so every round keeps all
+// threads busy. Merges take from the left run on ties, which keeps the
+// sort stable. topk with k much smaller than the row keeps a bounded
+// heap of the best k (key, index) pairs instead of sorting.
+
+static const size_t kSortInsertionMax = 16;
+static const size_t kParallelSortElems = 1 << 16;  // rows this long use every thread
+static const size_t kSortMinRun = 1 << 14;         // smallest run per thread
+static const size_t kSortTaskElems = 1 << 14;      // elements per row-parallel task
+
+template <typename T>
+struct SortKey {
+    typedef typename std::conditional<sizeof(T) <= 4, uint32_t, uint64_t>::type type;
+};
+
+// With MergeZeros, -0.0 gets the key of 0.0 so the two stay in input
+// order; without it the key keeps the sign and maps back exactly.
+template <typename K, bool MergeZeros, typename T>
+static inline K to_sort_key(T v) {
+    if constexpr (std::is_same<T, bool>::value) {
+        return (K)v;
+    } else if constexpr (std::is_floating_point<T>::value) {
+        const K sign = (K)1 << (sizeof(K) * 8 - 1);
+        if (v != v) v = std::numeric_limits<T>::quiet_NaN();  // one NaN, above +inf
+        if (MergeZeros && v == 0) v = 0;
+        K bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        // Branch free: the sign of random data is not predictable
+        K negative = (K)0 - (bits >> (sizeof(K) * 8 - 1));
+        return bits ^ (negative | sign);
+    } else {
+        // Flip the sign bit at the type's own width, so narrow types
+        // leave the upper key bytes zero
+        typedef typename std::make_unsigned<T>::type U;
+        return (K)(U)((U)v ^ ((U)1 << (sizeof(T) * 8 - 1)));
+    }
+}
+
+template <typename T, typename K>
+static inline T from_sort_key(K k) {
+    if constexpr (std::is_same<T, bool>::value) {
+        return k != 0;
+    } else if constexpr (std::is_floating_point<T>::value) {
+        const K sign = (K)1 << (sizeof(K) * 8 - 1);
+        K bits = k ^ (((k >> (sizeof(K) * 8 - 1)) - 1) | sign);
+        T v;
+        std::memcpy(&v, &bits, sizeof(v));
+        return v;
+    } else {
+        typedef typename std::make_unsigned<T>::type U;
+        return (T)(U)((U)k ^ ((U)1 << (sizeof(T) * 8 - 1)));
+    }
+}
+
+// Stable sort of keys[0, n), moving idx along when Indexed. tmp_keys
+// and tmp_idx are scratch of n entries; the result ends up in keys/idx.
+template <typename K, bool Indexed>
+static void radix_sort(K* keys, uint32_t* idx, size_t n, K* tmp_keys, uint32_t* tmp_idx) {
+    if (n <= kSortInsertionMax) {
+        for (size_t i = 1; i < n; i++) {
+            K k = keys[i];
+            uint32_t id = Indexed ? idx[i] : 0;
+            size_t j = i;
+            for (; j > 0 && keys[j - 1] > k; j--) {
+                keys[j] = keys[j - 1];
+                if (Indexed) idx[j] = idx[j - 1];
+            }
+            keys[j] = k;
+            if (Indexed) idx[j] = id;
+        }
+        return;
+    }
+
+    size_t counts[sizeof(K)][256] = {};
+    for (size_t i = 0; i < n; i++) {
+        K k = keys[i];
+        for (size_t b = 0; b < sizeof(K); b++) counts[b][(k >> (8 * b)) & 0xff]++;
+    }
+
+    K* src_k = keys;
+    K* dst_k = tmp_keys;
+    uint32_t* src_i = idx;
+    uint32_t* dst_i = tmp_idx;
+    for (size_t b = 0; b < sizeof(K); b++) {
+        size_t* count = counts[b];
+        if (count[(keys[0] >> (8 * b)) & 0xff] == n) continue;  // every key has this byte
+        size_t offset = 0;
+        for (size_t d = 0; d < 256; d++) {
+            size_t c = count[d];
+            count[d] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t pos = count[(src_k[i] >> (8 * b)) & 0xff]++;
+            dst_k[pos] = src_k[i];
+            if (Indexed) dst_i[pos] = src_i[i];
+        }
+        std::swap(src_k, dst_k);
+        std::swap(src_i, dst_i);
+    }
+    if (src_k != keys) {
+        std::memcpy(keys, src_k, n * sizeof(K));
+        if (Indexed) std::memcpy(idx, src_i, n * sizeof(uint32_t));
+    }
+}
+
+// How many of the first `i` outputs of a stable merge of a and b come
+// from a
+template <typename K>
+static size_t merge_split(const K* a, size_t na, const K* b, size_t nb, size_t i) {
+    size_t lo = i > nb ? i - nb : 0, hi = std::min(i, na);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (a[mid] <= b[i - mid - 1]) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Outputs [begin, end) of the stable merge of runs a and b into out
+template <typename K, bool Indexed>
+static void merge_range(const K* ak, const uint32_t* ai, size_t na, const K* bk,
+                        const uint32_t* bi, size_t nb, K* ok, uint32_t* oi, size_t begin,
+                        size_t end) {
+    size_t x = merge_split(ak, na, bk, nb, begin), y = begin - x;
+    for (size_t o = begin; o < end; o++) {
+        bool take_a = y == nb || (x < na && ak[x] <= bk[y]);
+        if (take_a) {
+            ok[o] = ak[x];
+            if (Indexed) oi[o] = ai[x];
+            x++;
+        } else {
+            ok[o] = bk[y];
+            if (Indexed) oi[o] = bi[y];
+            y++;
+        }
+    }
+}
+
+// radix_sort of one long row on every thread: sorted runs, then rounds
+// of pairwise merges
+template <typename K, bool Indexed>
+static void sort_parallel(K* keys, uint32_t* idx, size_t n, K* tmp_keys, uint32_t* tmp_idx) {
+    size_t runs = 1;
+    while (runs < g_num_threads && n / (runs * 2) >= kSortMinRun) runs *= 2;
+    size_t run_len = (n + runs - 1) / runs;
+    parallel_for(runs, 1, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            size_t lo = std::min(n, r * run_len), len = std::min(n, lo + run_len) - lo;
+            radix_sort<K, Indexed>(keys + lo, idx + lo, len, tmp_keys + lo, tmp_idx + lo);
+        }
+    });
+
+    K* src_k = keys;
+    K* dst_k = tmp_keys;
+    uint32_t* src_i = idx;
+    uint32_t* dst_i = tmp_idx;
+    for (size_t width = run_len; width < n; width *= 2) {
+        size_t pairs = (n + 2 * width - 1) / (2 * width);
+        size_t pieces = std::max((size_t)1, runs / pairs);
+        parallel_for(pairs * pieces, 1, [&](size_t begin, size_t end) {
+            for (size_t task = begin; task < end; task++) {
+                size_t pair = task / pieces, piece = task % pieces;
+                size_t lo = pair * 2 * width;
+                size_t mid = std::min(n, lo + width), hi = std::min(n, lo + 2 * width);
+                size_t total = hi - lo;
+                size_t from = total * piece / pieces, to = total * (piece + 1) / pieces;
+                merge_range<K, Indexed>(src_k + lo, src_i + lo, mid - lo, src_k + mid,
+                                        src_i + mid, hi - mid, dst_k + lo, dst_i + lo, from, to);
+            }
+        });
+        std::swap(src_k, dst_k);
+        std::swap(src_i, dst_i);
+    }
+    if (src_k != keys) {
+        parallel_for(n, kParallelCopyElems, [&](size_t begin, size_t end) {
+            std::memcpy(keys + begin, src_k + begin, (end - begin) * sizeof(K));
+            if (Indexed) std::memcpy(idx + begin, src_i + begin, (end - begin) * sizeof(uint32_t));
+        });
+    }
+}
+
+// The k smallest (key, index) pairs of keys[0, n), in order, through a
+// max-heap of the best k so far. `heap` has room for k pairs.
+template <typename K>
+static void heap_select(const K* keys, size_t n, size_t k, std::pair<K, uint32_t>* heap) {
+    for (size_t i = 0; i < k; i++) heap[i] = {keys[i], (uint32_t)i};
+    std::make_heap(heap, heap + k);
+    for (size_t i = k; i < n; i++) {
+        // Later indices lose ties, so only a strictly smaller key enters
+        if (keys[i] < heap[0].first) {
+            std::pop_heap(heap, heap + k);
+            heap[k - 1] = {keys[i], (uint32_t)i};
+            std::push_heap(heap, heap + k);
+        }
+    }
+    std::sort_heap(heap, heap + k);
+}
+
+struct SortPlan {
+    size_t outer = 1, len = 0, inner = 1;
+    size_t keep = 0;           // outputs per row: len, or k for topk
+    bool descending = false;
+    bool split_rows = false;   // few long rows: each sorted by every thread
+    size_t grain = 1;          // rows per task otherwise
+
+    size_t rows() const { return outer * inner; }
+    size_t slots() const { return split_rows ? 1 : (rows() + grain - 1) / grain; }
+    bool use_heap() const { return keep > 0 && keep * 8 <= len; }
+
+    SortPlan(size_t outer_, size_t len_, size_t inner_, size_t keep_, bool descending_)
+        : outer(outer_), len(len_), inner(inner_), keep(keep_), descending(descending_) {
+        split_rows = len >= kParallelSortElems && rows() < g_num_threads && !use_heap();
+        grain = std::max((size_t)1, kSortTaskElems / std::max(len, (size_t)1));
+    }
+};
+
+// Scratch bytes for sort_rows: two key and two index arrays of one row
+// per slot (a heap for topk fits in the same space)
+static size_t sort_workspace(const SortPlan& p, size_t key_size) {
+    return p.slots() * p.len * 2 * (key_size + sizeof(uint32_t));
+}
+
+// Sorts each row of x and writes the first p.keep sorted values and, when
+// Indexed, their positions along the row (values may then be null), in
+// x's layout with `keep` in place of `len`. With indices the values are
+// read back from x, so they keep their exact bits.
+template <typename T, bool Indexed>
+static void sort_rows(const T* x, const SortPlan& p, T* values, int64_t* indices, void* work) {
+    typedef typename SortKey<T>::type K;
+    const K flip = p.descending ? ~(K)0 : 0;
+    size_t len = p.len, inner = p.inner, keep = p.keep;
+    size_t slot_bytes = len * 2 * (sizeof(K) + sizeof(uint32_t));
+
+    auto sort_row = [&](size_t row, char* slot, bool split) {
+        size_t o = row / inner, in = row % inner;
+        const T* src = x + o * len * inner + in;
+        size_t out_base = o * keep * inner + in;
+        K* keys = (K*)slot;
+        K* tmp_keys = keys + len;
+        uint32_t* idx = (uint32_t*)(tmp_keys + len);
+        uint32_t* tmp_idx = idx + len;
+
+        auto load = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                keys[i] = to_sort_key<K, Indexed>(src[i * inner]) ^ flip;
+                if (Indexed) idx[i] = (uint32_t)i;
+            }
+        };
+        auto store = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                if (Indexed) {
+                    if (values) values[out_base + i * inner] = src[idx[i] * inner];
+                    indices[out_base + i * inner] = idx[i];
+                } else {
+                    values[out_base + i * inner] = from_sort_key<T>((K)(keys[i] ^ flip));
+                }
+            }
+        };
+
+        if (Indexed && p.use_heap()) {
+            for (size_t i = 0; i < len; i++) keys[i] = to_sort_key<K, true>(src[i * inner]) ^ flip;
+            auto* heap = (std::pair<K, uint32_t>*)idx;  // k <= len / 8 pairs fit
+            heap_select(keys, len, keep, heap);
+            for (size_t i = 0; i < keep; i++) {
+                if (values) values[out_base + i * inner] = src[heap[i].second * inner];
+                indices[out_base + i * inner] = heap[i].second;
+            }
+            return;
+        }
+        if (split) {
+            parallel_for(len, kParallelCopyElems, load);
+            sort_parallel<K, Indexed>(keys, idx, len, tmp_keys, tmp_idx);
+            parallel_for(keep, kParallelCopyElems, store);
+        } else {
+            load(0, len);
+            radix_sort<K, Indexed>(keys, idx, len, tmp_keys, tmp_idx);
+            store(0, keep);
+        }
+    };
+
+    if (p.split_rows) {
+        for (size_t row = 0; row < p.rows(); row++) sort_row(row, (char*)work, true);
+        return;
+    }
+    parallel_for(p.rows(), p.grain, [&](size_t begin, size_t end) {
+        char* slot = (char*)work + (begin / p.grain) * slot_bytes;
+        for (size_t row = begin; row < end; row++) sort_row(row, slot, false);
+    });
+}
+
+// ============================================================
+// Random numbers
+// ============================================================
+// rand/randn/randint use Philox4x32-10 (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3"), a counter-based generator: block b of
+// the stream for a 64-bit seed is a keyed bijection of the counter b, so
+// any part of the stream can be computed directly, in any order, by any
+// thread. Each block is four 32-bit words.
+//
+// Blocks are generated kPhiloxLanes at a time, one per vector lane, and
+// a group of them fills a fixed run of output elements: a value of
+// 32 bits or less takes one word (32 per group), anything wider two (16
+// per group). Element e of a stream comes from group e / group_size:
+// with r = e % group_size, block r % 8 of the group and word r / 8 (or
+// word pair). Values for position e are therefore the same for any
+// thread count and any vector width, and a tensor generated at offset k
+// equals elements [k, k + n) of a longer one.
+//
+// randn is Box-Muller: each pair of uniforms gives two normals, one for
+// the cosine and one for the sine, so it needs no rejection loop (which
+// would make the stream position of an element depend on earlier
+// values). randint maps 64 random bits to [low, high) by multiplying
+// with the range and keeping the high 64 bits; the bias is at most
+// range / 2^64.
+
+static const uint32_t kPhiloxM0 = 0xD2511F53;
+static const uint32_t kPhiloxM1 = 0xCD9E8D57;
+static const uint32_t kPhiloxW0 = 0x9E3779B9;  // key schedule: golden ratio
+static const uint32_t kPhiloxW1 = 0xBB67AE85;  // sqrt(3) - 1
+static const size_t kPhiloxRounds = 10;
+static const size_t kPhiloxLanes = 8;
+static const size_t kRandomTaskGroups = 512;  // 8-16K elements per task
+static const double kTwoPi = 6.28318530717958647693;
+
+// Philox runs at the native vector width (the math kernels' width),
+// so a group of kPhiloxLanes blocks takes one or two passes
+typedef uint32_t philox_vec __attribute__((vector_size(kMathVectorBytes)));
+typedef uint64_t philox_wide __attribute__((vector_size(kMathVectorBytes)));
+static const size_t kPhiloxVecLanes = kMathVectorBytes / 4;
+
+// Low 32 bits of each 64-bit lane of a, times those of b, as 64-bit
+// products. The vector extensions only know full 64-bit multiplies,
+// which take three multiplies each on SSE2/AVX2.
+static inline philox_wide mul_even(philox_wide a, philox_wide b) {
+#if defined(__AVX2__)
+    return (philox_wide)_mm256_mul_epu32((__m256i)a, (__m256i)b);
+#elif defined(__SSE2__)
+    return (philox_wide)_mm_mul_epu32((__m128i)a, (__m128i)b);
+#else
+    return (a & 0xffffffff) * (b & 0xffffffff);
+#endif
+}
+
+// Full 64-bit products of a and m in every lane, split in halves
+static inline void mulhilo(philox_vec a, uint32_t m, philox_vec* hi, philox_vec* lo) {
+    philox_wide mv = philox_wide{} + m;
+    philox_wide even = mul_even((philox_wide)a, mv);
+    philox_wide odd = mul_even((philox_wide)a >> 32, mv);
+    *lo = (philox_vec)((even & 0xffffffff) | (odd << 32));
+    *hi = (philox_vec)((even >> 32) | (odd & ~(uint64_t)0xffffffff));
+}
+
+// Philox4x32-10 on kPhiloxVecLanes counters at once; c[j] holds word j
+// of every counter and is replaced by word j of the output
+static inline void philox_rounds(philox_vec c[4], uint64_t key) {
+    uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+    for (size_t round = 0; round < kPhiloxRounds; round++) {
+        philox_vec hi0, lo0, hi1, lo1;
+        mulhilo(c[0], kPhiloxM0, &hi0, &lo0);
+        mulhilo(c[2], kPhiloxM1, &hi1, &lo1);
+        c[0] = hi1 ^ c[1] ^ k0;
+        c[1] = lo1;
+        c[2] = hi0 ^ c[3] ^ k1;
+        c[3] = lo0;
+        k0 += kPhiloxW0;
+        k1 += kPhiloxW1;
+    }
+}
+
+enum class RandomKind { Uniform, Normal, Integer };
+
+struct RandomParams {
+    RandomKind kind = RandomKind::Uniform;
+    uint64_t seed = 0;
+    uint64_t counter = 0;  // first Philox block of the stream
+    uint64_t offset = 0;   // first element of the stream to produce
+    int64_t low = 0;       // randint: [low, low + range)
+    uint64_t range = 0;
+};
+
+static size_t random_group_size(RandomKind kind, DType dtype) {
+    return kind != RandomKind::Integer && dtype == DType::Float32 ? 32 : 16;
+}
+
+// sin(2 pi u) and cos(2 pi u) for u in [0, 1]: u = q / 4 + f with
+// |f| <= 1/8 is exact, and the quadrant q swaps and negates the results
+// of the polynomials on [-pi/4, pi/4]
+template <typename T>
+VEC_INLINE void vsincos_2pi(typename MathSimd<T>::vec u, typename MathSimd<T>::vec* sin_out,
+                            typename MathSimd<T>::vec* cos_out) {
+    typedef MathSimd<T> S;
+    typedef typename S::vec vec;
+    typedef typename S::mask ivec;
+
+    ivec q;
+    vec n = round_to_int<T>(u * S::broadcast(4), &q);
+    vec x = (u - n * S::broadcast((T)0.25)) * S::broadcast((T)kTwoPi);
+    vec z = x * x;
+    vec s = x + x * z * polynomial<T>(z, MathConst<T>::sin_poly);
+    vec c = S::broadcast(1) + z * polynomial<T>(z, MathConst<T>::cos_poly);
+
+    ivec odd = -(q & 1);
+    const int sign_shift = sizeof(T) * 8 - 2;
+    *sin_out = (vec)((ivec)S::select(odd, c, s) ^ ((q & 2) << sign_shift));
+    *cos_out = (vec)((ivec)S::select(odd, s, c) ^ (((q + 1) & 2) << sign_shift));
+}
+
+template <typename T>
+VEC_INLINE typename MathSimd<T>::vec vsqrt(typename MathSimd<T>::vec x) {
+    for (size_t i = 0; i < MathSimd<T>::width; i++) x[i] = std::sqrt(x[i]);
+    return x;
+}
+
+// Two normals per pair of uniforms: sqrt(-2 log u1) times the cosine and
+// sine of 2 pi u2. u1 is in (0, 1], so the log is finite.
+template <typename T>
+static void box_muller(const T* u1, const T* u2, T* cos_out, T* sin_out) {
+    typedef MathSimd<T> S;
+    for (size_t i = 0; i < kPhiloxLanes; i += S::width) {
+        typename S::vec r = vsqrt<T>(S::broadcast(-2) * vlog<T>(S::load(u1 + i)));
+        typename S::vec s, c;
+        vsincos_2pi<T>(S::load(u2 + i), &s, &c);
+        S::store(cos_out + i, r * c);
+        S::store(sin_out + i, r * s);
+    }
+}
+
+// Uniform floats in [0, 1) from 24 or 53 random bits, or in (0, 1] with
+// `open_zero`. One run of kPhiloxLanes values: from word w for float,
+// from words w and w + 1 for double (numpy's 53-bit construction).
+static inline void uniform_floats(const uint32_t (*words)[kPhiloxLanes], size_t w, bool open_zero,
+                                  float* out) {
+    typedef MathSimd<float> S;
+    for (size_t i = 0; i < kPhiloxLanes; i += S::width) {
+        philox_vec bits;
+        std::memcpy(&bits, words[w] + i, sizeof(bits));
+        bits = (bits >> 8) + (open_zero ? 1 : 0);
+        S::store(out + i, __builtin_convertvector((S::mask)bits, S::vec) * 0x1p-24f);
+    }
+}
+
+static inline void uniform_floats(const uint32_t (*words)[kPhiloxLanes], size_t w, bool open_zero,
+                                  double* out) {
+    typedef MathSimd<double> S;
+    typedef uint32_t half_vec __attribute__((vector_size(kMathVectorBytes / 2)));
+    typedef int32_t half_ivec __attribute__((vector_size(kMathVectorBytes / 2)));
+    for (size_t i = 0; i < kPhiloxLanes; i += S::width) {
+        half_vec a, b;
+        std::memcpy(&a, words[w] + i, sizeof(a));
+        std::memcpy(&b, words[w + 1] + i, sizeof(b));
+        S::vec hi = __builtin_convertvector((half_ivec)(a >> 5), S::vec);
+        S::vec lo = __builtin_convertvector((half_ivec)(b >> 6), S::vec);
+        S::store(out + i, (hi * 67108864.0 + lo + (open_zero ? 1.0 : 0.0)) * 0x1p-53);
+    }
+}
+
+// One group of values, from the kPhiloxLanes blocks starting at `block`
+template <typename T>
+static void random_group(const RandomParams& p, uint64_t block, T* out) {
+    uint32_t words[4][kPhiloxLanes];
+    for (size_t i = 0; i < kPhiloxLanes; i += kPhiloxVecLanes) {
+        // Built as plain arrays: storing single lanes of a vector makes
+        // GCC warn that the vector is used uninitialized
+        uint32_t lo[kPhiloxVecLanes], hi[kPhiloxVecLanes];
+        for (size_t l = 0; l < kPhiloxVecLanes; l++) {
+            lo[l] = (uint32_t)(block + i + l);
+            hi[l] = (uint32_t)((block + i + l) >> 32);
+        }
+        philox_vec c[4] = {};
+        std::memcpy(&c[0], lo, sizeof(lo));
+        std::memcpy(&c[1], hi, sizeof(hi));
+        philox_rounds(c, p.seed);
+        for (size_t j = 0; j < 4; j++) std::memcpy(words[j] + i, &c[j], sizeof(c[j]));
+    }
+
+    if constexpr (std::is_floating_point<T>::value) {
+        // Runs of kPhiloxLanes values: one per word for float, one per
+        // word pair for double
+        const size_t L = kPhiloxLanes, runs = 16 / sizeof(T), step = sizeof(T) / 4;
+        if (p.kind == RandomKind::Uniform) {
+            for (size_t r = 0; r < runs; r++) uniform_floats(words, r * step, false, out + r * L);
+            return;
+        }
+        T u1[L], u2[L];
+        for (size_t r = 0; r < runs; r += 2) {
+            uniform_floats(words, r * step, true, u1);
+            uniform_floats(words, (r + 1) * step, false, u2);
+            box_muller(u1, u2, out + r * L, out + (r + 1) * L);
+        }
+    } else {
+        for (size_t r = 0; r < 2; r++) {
+            for (size_t i = 0; i < kPhiloxLanes; i++) {
+                uint64_t bits = (uint64_t)words[2 * r + 1][i] << 32 | words[2 * r][i];
+                uint64_t value = (uint64_t)(((unsigned __int128)bits * p.range) >> 64);
+                out[r * kPhiloxLanes + i] = (T)(p.low + (int64_t)value);
+            }
+        }
+    }
+}
+
+// Elements [p.offset, p.offset + n) of the stream into out
+template <typename T>
+static void random_fill(T* out, size_t n, DType dtype, const RandomParams& p) {
+    const size_t group = random_group_size(p.kind, dtype);
+    if (n == 0) return;
+    uint64_t first = p.offset / group, last = (p.offset + n - 1) / group;
+    parallel_for(last - first + 1, kRandomTaskGroups, [&](size_t begin, size_t end) {
+        T buf[32];
+        for (size_t g = first + begin; g < first + end; g++) {
+            uint64_t lo = std::max<uint64_t>(g * group, p.offset);
+            uint64_t hi = std::min<uint64_t>((g + 1) * group, p.offset + n);
+            T* dst = out + (lo - p.offset);
+            if (hi - lo == group) {
+                random_group(p, p.counter + g * kPhiloxLanes, dst);
+            } else {
+                random_group(p, p.counter + g * kPhiloxLanes, buf);
+                std::memcpy(dst, buf + (lo - g * group), (hi - lo) * sizeof(T));
+            }
+        }
+    });
+}
+
+// Philox blocks that random_fill consumes for n elements from offset 0
+static uint64_t random_blocks(size_t n, RandomKind kind, DType dtype) {
+    size_t group = random_group_size(kind, dtype);
+    return (uint64_t)((n + group - 1) / group) * kPhiloxLanes;
+}
+
+// ============================================================
+// Indexing
+// ============================================================
+// The tensor indexed into (or scattered into) is viewed as
+// [outer, dim, inner] around the axis, and an index array of `count`
+// entries per outer slice selects positions along it:
+// - index_select/index_add move rows: entry (o, j) is the `inner`
+//   contiguous values at [o, index[j], :], e.g. one embedding row of a
+//   [vocab, width] table along axis 0.
+// - gather/scatter/scatter_add move single values: the index has the
+//   tensor's shape except along the axis, and entry (o, j, i) pairs with
+//   [o, index[o, j, i], i].
+// Negative indices count from the end.
+//
+// Lookups hit rows in random order, which the hardware prefetcher does
+// not follow, so the kernels prefetch the source of the entry
+// kIndexPrefetch ahead.
+//
+// Scatters are deterministic without atomics. Entries are bucketed by
+// destination row range with a stable parallel counting sort, then
+// each task applies one bucket in entry order. Every destination sees
+// its updates in the same order as a sequential loop for any thread
+// count: scatter_add sums are reproducible and scatter keeps the last
+// write. All updates to one row land in one bucket, so heavily repeated
+// indices serialize.
+//
+// Indices are checked on the host when their values are available.
+// When they are not (in async mode while the index is still being
+// computed, or during capture), the kernel checks them and defers an
+// IndexError to the next sync point; out-of-range entries gather zeros
+// and scatter nothing meanwhile.
+
+static const size_t kIndexPrefetch = 16;
+static const size_t kIndexTaskElems = 1 << 14;  // values moved per task
+
+struct IndexPlan {
+    size_t outer = 1, dim = 0, inner = 1;  // the indexed tensor
+    size_t count = 0;                      // index entries per outer slice
+    bool rows = true;                      // entries move rows (index_select/index_add)
+
+    size_t entries() const { return outer * count * (rows ? 1 : inner); }
+    size_t entry_len() const { return rows ? inner : 1; }
+};
+
+template <typename I>
+static inline bool resolve_index(I v, size_t dim, size_t* pos) {
+    int64_t i = (int64_t)v;
+    if (i < 0) i += (int64_t)dim;
+    *pos = (size_t)i;
+    return i >= 0 && (size_t)i < dim;
+}
+
+// Offset in the indexed tensor of entry e's first value, or false when
+// its index is out of range. The common shapes (axis 0, or the last
+// axis) skip the divisions, which would cost more than the copy.
+template <typename I>
+static inline bool index_target(const IndexPlan& p, const I* idx, size_t e, size_t* offset) {
+    size_t pos;
+    if (p.rows) {
+        size_t o = p.outer == 1 ? 0 : e / p.count, j = p.outer == 1 ? e : e % p.count;
+        if (!resolve_index(idx[j], p.dim, &pos)) return false;
+        *offset = (o * p.dim + pos) * p.inner;
+    } else {
+        size_t o = p.outer == 1 ? 0 : e / (p.count * p.inner), i = p.inner == 1 ? 0 : e % p.inner;
+        if (!resolve_index(idx[e], p.dim, &pos)) return false;
+        *offset = (o * p.dim + pos) * p.inner + i;
+    }
+    return true;
+}
+
+// index_select and gather: entry e of out comes from a
+template <typename T, typename I>
+static void index_gather(const T* a, const I* idx, const IndexPlan& p, T* out) {
+    size_t len = p.entry_len();
+    size_t grain = std::max((size_t)1, kIndexTaskElems / std::max(len, (size_t)1));
+    parallel_for(p.entries(), grain, [&](size_t begin, size_t end) {
+        size_t ahead;
+        for (size_t e = begin; e < end; e++) {
+            if (e + kIndexPrefetch < end && index_target(p, idx, e + kIndexPrefetch, &ahead)) {
+                __builtin_prefetch(a + ahead);
+            }
+            size_t src;
+            bool valid = index_target(p, idx, e, &src);
+            if (len == 1) {
+                out[e] = valid ? a[src] : T(0);
+            } else if (valid) {
+                std::memcpy(out + e * len, a + src, len * sizeof(T));
+            } else {
+                std::fill(out + e * len, out + (e + 1) * len, T(0));
+            }
+        }
+    });
+}
+
+// Scratch entries for index_scatter: the bucketed entry order plus one
+// count per (task, bucket)
+static size_t scatter_workspace(const IndexPlan& p, size_t buckets) {
+    size_t tasks = (p.entries() + kIndexTaskElems - 1) / kIndexTaskElems;
+    return p.entries() + tasks * (buckets + 1);
+}
+
+// index_add, scatter and scatter_add: entry e of src goes into out, in
+// entry order per destination. `buckets` (at least 1) is how many row
+// ranges are applied in parallel; work holds scatter_workspace entries.
+template <typename T, typename I, bool Add>
+static void index_scatter(T* out, const I* idx, const T* src, const IndexPlan& p, size_t buckets,
+                          size_t* work) {
+    size_t n = p.entries(), len = p.entry_len();
+    auto apply = [&](size_t e) {
+        size_t dst;
+        if (!index_target(p, idx, e, &dst)) return;
+        const T* s = src + e * len;
+        T* d = out + dst;
+        for (size_t k = 0; k < len; k++) {
+            if (Add) {
+                d[k] += s[k];
+            } else {
+                d[k] = s[k];
+            }
+        }
+    };
+    auto prefetch = [&](size_t e) {
+        size_t dst;
+        if (index_target(p, idx, e, &dst)) __builtin_prefetch(out + dst, 1);
+    };
+    if (buckets <= 1 || n * len <= kIndexTaskElems) {
+        for (size_t e = 0; e < n; e++) {
+            if (e + kIndexPrefetch < n) prefetch(e + kIndexPrefetch);
+            apply(e);
+        }
+        return;
+    }
+
+    // Bucket b holds destination rows [b * rows_per, (b + 1) * rows_per);
+    // bucket `buckets` collects out-of-range entries, which are dropped
+    size_t rows = p.outer * p.dim;
+    size_t rows_per = (rows + buckets - 1) / buckets;
+    size_t row_len = p.inner;
+    auto bucket_of = [&](size_t e) {
+        size_t dst;
+        return index_target(p, idx, e, &dst) ? dst / row_len / rows_per : buckets;
+    };
+
+    size_t tasks = (n + kIndexTaskElems - 1) / kIndexTaskElems;
+    size_t* order = work;
+    size_t* counts = work + n;  // [task][bucket], then exclusive offsets
+    parallel_for(n, kIndexTaskElems, [&](size_t begin, size_t end) {
+        size_t* c = counts + (begin / kIndexTaskElems) * (buckets + 1);
+        std::fill(c, c + buckets + 1, 0);
+        for (size_t e = begin; e < end; e++) c[bucket_of(e)]++;
+    });
+    std::vector<size_t> bucket_start(buckets + 2, 0);
+    size_t offset = 0;
+    for (size_t b = 0; b <= buckets; b++) {
+        bucket_start[b] = offset;
+        for (size_t t = 0; t < tasks; t++) {
+            size_t c = counts[t * (buckets + 1) + b];
+            counts[t * (buckets + 1) + b] = offset;
+            offset += c;
+        }
+    }
+    bucket_start[buckets + 1] = offset;
+    parallel_for(n, kIndexTaskElems, [&](size_t begin, size_t end) {
+        size_t* c = counts + (begin / kIndexTaskElems) * (buckets + 1);
+        for (size_t e = begin; e < end; e++) order[c[bucket_of(e)]++] = e;
+    });
+
+    parallel_for(buckets, 1, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; b++) {
+            for (size_t k = bucket_start[b]; k < bucket_start[b + 1]; k++) {
+                if (k + kIndexPrefetch < bucket_start[b + 1]) prefetch(order[k + kIndexPrefetch]);
+                apply(order[k]);
+            }
+        }
+    });
+}
+
+// ============================================================
+// Concatenation
+// ============================================================
+// concat/stack view the output as `outer` rows of row_bytes, where every
+// input contributes one contiguous run per row at a fixed byte offset.
+// The output is cut into equal chunks of kConcatChunkBytes and each task
+// fills one chunk, run piece by run piece, with memcpy. Big inputs are
+// spread over all threads, and many small runs (concatenating along a
+// late axis) are batched, whatever the mix of input sizes.
+
+static const size_t kConcatChunkBytes = 256 * 1024;
+
+// One input: `run` bytes per output row, starting at byte `at` of the row
+struct ConcatPiece {
+    const char* src;
+    size_t run;
+    size_t at;
+};
+
+// Pieces are in output order, so their `at` offsets ascend
+static void concat_copy(const std::vector<ConcatPiece>& pieces, size_t outer, size_t row_bytes,
+                        char* dst) {
+    size_t total = outer * row_bytes;
+    if (total == 0) return;
+    size_t chunks = (total + kConcatChunkBytes - 1) / kConcatChunkBytes;
+
+    parallel_for(chunks, 1, [&](size_t c0, size_t c1) {
+        size_t pos = c0 * kConcatChunkBytes, end = std::min(total, c1 * kConcatChunkBytes);
+        size_t o = pos / row_bytes, in_row = pos % row_bytes;
+        // Last piece starting at or before in_row (skips empty pieces)
+        size_t p = std::upper_bound(pieces.begin(), pieces.end(), in_row,
+                                    [](size_t at, const ConcatPiece& q) { return at < q.at; }) -
+                   pieces.begin() - 1;
+        while (pos < end) {
+            const ConcatPiece& q = pieces[p];
+            size_t skip = in_row - q.at;
+            size_t n = std::min(q.run - skip, end - pos);
+            std::memcpy(dst + pos, q.src + o * q.run + skip, n);
+            pos += n;
+            in_row += n;
+            if (in_row == q.at + q.run) {
+                // Next non-empty piece, wrapping to the next row
+                do {
+                    if (++p == pieces.size()) {
+                        p = 0;
+                        o++;
+                        in_row = 0;
+                    }
+                } while (pieces[p].run == 0);
+            }
+        }
+    });
+}
+
+// ============================================================
+// Sparse kernels
+// ============================================================
+// CSR: row r owns nonzeros [indptr[r], indptr[r+1]) of `indices`
+// (column numbers) and `values`. Work and memory follow nnz, so threads
+// get row ranges of equal rows + nonzeros rather than equal row counts;
+// a few dense rows in a power-law graph would otherwise serialize.
+
+static const size_t kSparseParallelWork = 32 * 1024;  // rows + nnz
+static const size_t kSparseTasksPerThread = 4;
+
+// parts + 1 row boundaries splitting rows + nnz evenly. The cost of the
+// first r rows, r + indptr[r], is strictly increasing, so each
+// boundary is a binary search.
+static std::vector<size_t> balanced_row_splits(const int64_t* indptr, size_t rows,
+                                               size_t parts) {
+    size_t total = rows + (size_t)indptr[rows];
+    std::vector<size_t> splits(parts + 1, rows);
+    splits[0] = 0;
+    for (size_t p = 1; p < parts; p++) {
+        size_t target = total * p / parts;
+        size_t lo = splits[p - 1], hi = rows;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (mid + (size_t)indptr[mid] < target) lo = mid + 1;
+            else hi = mid;
+        }
+        splits[p] = lo;
+    }
+    return splits;
+}
+
+// Calls fn(row_begin, row_end) over nnz-balanced row ranges
+static void parallel_rows(const int64_t* indptr, size_t rows,
+                          const std::function<void(size_t, size_t)>& fn) {
+    size_t work = rows + (size_t)indptr[rows];
+    size_t parts = 1;
+    if (work >= kSparseParallelWork) {
+        parts = std::min(rows, g_num_threads * kSparseTasksPerThread);
+    }
+    if (parts <= 1) {
+        fn(0, rows);
+        return;
+    }
+    std::vector<size_t> splits = balanced_row_splits(indptr, rows, parts);
+    parallel_for(parts, 1, [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++) {
+            if (splits[p] < splits[p + 1]) fn(splits[p], splits[p + 1]);
+        }
+    });
+}
+
+// y = A x
+template <typename T>
+static void spmv_kernel(const int64_t* indptr, const int32_t* indices, const T* values,
+                        size_t rows, const T* x, T* y) {
+    parallel_rows(indptr, rows, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            T acc = 0;
+            for (int64_t j = indptr[r]; j < indptr[r + 1]; j++) {
+                acc += values[j] * x[indices[j]];
+            }
+            y[r] = acc;
+        }
+    });
+}
+
+// C = A B for dense row-major B [cols, n]: each nonzero scales one row
+// of B into one row of C, so the inner loop is a contiguous axpy
+template <typename T>
+static void spmm_kernel(const int64_t* indptr, const int32_t* indices, const T* values,
+                        size_t rows, const T* B, size_t n, T* C) {
+    parallel_rows(indptr, rows, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            T* c = C + r * n;
+            std::fill(c, c + n, (T)0);
+            for (int64_t j = indptr[r]; j < indptr[r + 1]; j++) {
+                const T v = values[j];
+                const T* b = B + (size_t)indices[j] * n;
+                for (size_t i = 0; i < n; i++) c[i] += v * b[i];
+            }
+        }
+    });
+}
+
+// ============================================================
+// Tensor class
+// ============================================================
+// Storage is shared, so views (transpose, permuted axes) are just a
+// different shape/strides/offset over the same memory.
+struct Tensor {
+    std::shared_ptr<Storage> storage;
+    size_t offset = 0;              // in elements
+    std::vector<size_t> shape;
+    std::vector<int64_t> strides;   // in elements
+    DType dtype = DType::Float64;
+
+    void* raw() const {
+        return storage && storage->ptr ? (char*)storage->ptr + offset * itemsize() : nullptr;
+    }
+
+    template <typename T>
+    T* data() const { return (T*)raw(); }
+
+    size_t itemsize() const { return dtype_size(dtype); }
+    size_t nbytes() const { return size() * itemsize(); }
+
+    // Attach fresh contiguous storage for size() elements, uninitialized
+    // unless `zeroed`
+    bool allocate(bool zeroed = false) {
+        storage = std::make_shared<Storage>(nbytes(), zeroed);
+        offset = 0;
+        strides = contiguous_strides(shape);
+        return storage->ptr != nullptr || size() == 0;
+    }
+
+    size_t size() const {
+        size_t s = 1;
+        for (auto dim : shape) s *= dim;
+        return s;
+    }
+
+    bool same_shape(const Tensor& other) const {
+        return shape == other.shape;
+    }
+
+    static std::vector<int64_t> contiguous_strides(const std::vector<size_t>& shape) {
+        std::vector<int64_t> strides(shape.size());
+        int64_t stride = 1;
+        for (size_t d = shape.size(); d-- > 0;) {
+            strides[d] = stride;
+            stride *= (int64_t)shape[d];
+        }
+        return strides;
+    }
+
+    // Size-1 axes can carry any stride without affecting the layout
+    bool is_contiguous() const {
+        int64_t expected = 1;
+        for (size_t d = shape.size(); d-- > 0;) {
+            if (shape[d] != 1 && strides[d] != expected) return false;
+            expected *= (int64_t)shape[d];
+        }
+        return true;
+    }
+};
+
+// Non-owning list of tensors, from a braced list or a vector. Like the
+// braced list itself, only good for the call it is passed to.
+class TensorList {
+public:
+    TensorList() = default;
+    TensorList(std::initializer_list<const Tensor*> list) : list_(list) {}
+    TensorList(const std::vector<const Tensor*>& list) : vector_(&list) {}
+
+    const Tensor* const* begin() const { return vector_ ? vector_->data() : list_.begin(); }
+    const Tensor* const* end() const { return begin() + size(); }
+    size_t size() const { return vector_ ? vector_->size() : list_.size(); }
+
+private:
+    std::initializer_list<const Tensor*> list_;
+    const std::vector<const Tensor*>* vector_ = nullptr;
+};
+
+// ============================================================
+// Sparse tensor class
+// ============================================================
+// 2D CSR matrix. The three arrays are ordinary 1D tensors, so they come
+// from the caching allocator and can be handed to Python as views.
+// Column indices are int32: half the index traffic of int64, and wide
+// enough for any matrix whose dense rows fit in memory.
+struct SparseTensor {
+    size_t rows = 0;
+    size_t cols = 0;
+    Tensor indptr;   // int64, rows + 1
+    Tensor indices;  // int32, nnz
+    Tensor values;   // nnz
+
+    size_t nnz() const { return values.size(); }
+    DType dtype() const { return values.dtype; }
+
+    bool allocate(size_t r, size_t c, size_t nnz, DType dtype) {
+        rows = r;
+        cols = c;
+        indptr.shape = {r + 1};
+        indptr.dtype = DType::Int64;
+        indices.shape = {nnz};
+        indices.dtype = DType::Int32;
+        values.shape = {nnz};
+        values.dtype = dtype;
+        return indptr.allocate() && indices.allocate() && values.allocate();
+    }
+};
+
+// ============================================================
+// Graph capture
+// ============================================================
+// capture(fn, *inputs) runs fn once on placeholder inputs and keeps the
+// kernel closure of every op it launches. The buffers those ops create
+// are then packed into one arena: two buffers whose lifetimes (first
+// write to last use, in op order) don't overlap share bytes. Replay
+// points the placeholders at new inputs and runs the closures back to
+// back, with no argument parsing, shape checks or allocation.
+
+static const size_t kArenaAlignment = 64;
+
+struct GraphBuffer {
+    Storage* storage;
+    size_t bytes;  // highest byte any op touches
+};
+
+struct GraphNode {
+    std::function<void()> run;
+    std::vector<GraphBuffer> reads, writes;  // only needed until planned
+};
+
+struct Graph {
+    std::vector<GraphNode> nodes;
+    std::vector<Tensor> inputs;          // placeholders, each a borrowed storage
+    std::vector<bool> input_written;     // some op writes the input in place
+    std::vector<const Tensor*> outputs;  // the tensors fn returned
+    std::shared_ptr<Storage> arena;
+    std::unordered_map<Storage*, bool> created;  // allocated while capturing
+    size_t intermediate_bytes = 0;       // the created buffers without reuse
+    double flops = 0;
+    bool host_read = false;              // fn read tensor data on the host
+    std::mutex run_mutex;                // one replay at a time
+
+    // Runs the captured ops on `values`, which match the placeholders
+    void replay(const std::vector<Tensor>& values) {
+        std::lock_guard<std::mutex> lock(run_mutex);
+        for (size_t i = 0; i < inputs.size(); i++) {
+            const Tensor& v = values[i];
+            if (v.storage) inputs[i].storage->borrow(v.storage, v.offset * v.itemsize());
+        }
+        for (GraphNode& node : nodes) node.run();
+    }
+
+    bool plan();
+
+    // True if replay overwrites or repoints `s`: the arena, a window onto
+    // it, a placeholder or the storage of a returned tensor
+    bool aliases(const Storage* s) const {
+        if (arena && (s == arena.get() || s->parent == arena)) return true;
+        for (const Tensor& t : inputs) {
+            if (s == t.storage.get()) return true;
+        }
+        for (const Tensor* t : outputs) {
+            if (s == t->storage.get()) return true;
+        }
+        return false;
+    }
+};
+
+// Bytes from the start of t's storage to the end of its last element
+static size_t storage_extent(const Tensor& t) {
+    if (t.size() == 0) return 0;
+    size_t last = t.offset;
+    for (size_t d = 0; d < t.shape.size(); d++) {
+        last += (t.shape[d] - 1) * (size_t)t.strides[d];
+    }
+    return (last + 1) * t.itemsize();
+}
+
+// Assigns arena offsets, moves the buffers fn created into the arena and
+// keeps the returned tensors' values. Returns false if the arena can't
+// be allocated.
+bool Graph::plan() {
+    struct Lifetime {
+        size_t first, last;
+        size_t bytes;        // as used by the ops
+        size_t size = 0;     // rounded to the arena alignment
+        size_t offset = 0;
+        bool planned;
+    };
+    std::unordered_map<Storage*, Lifetime> lifetimes;
+    std::vector<Storage*> order;
+    auto touch = [&](const GraphBuffer& buf, size_t step, bool write) {
+        auto it = lifetimes.find(buf.storage);
+        if (it == lifetimes.end()) {
+            // Planned only if fn allocated it and an op writes it before
+            // anything reads it; inputs and constants keep their memory
+            bool planned = write && created.count(buf.storage);
+            Lifetime life;
+            life.first = life.last = step;
+            life.bytes = buf.bytes;
+            life.planned = planned;
+            lifetimes[buf.storage] = life;
+            order.push_back(buf.storage);
+        } else {
+            it->second.last = step;
+            it->second.bytes = std::max(it->second.bytes, buf.bytes);
+        }
+    };
+    for (size_t step = 0; step < nodes.size(); step++) {
+        for (const GraphBuffer& buf : nodes[step].reads) touch(buf, step, false);
+        for (const GraphBuffer& buf : nodes[step].writes) touch(buf, step, true);
+    }
+    for (const Tensor* t : outputs) {
+        auto it = lifetimes.find(t->storage.get());
+        if (it != lifetimes.end()) it->second.last = nodes.size();
+    }
+    for (size_t i = 0; i < inputs.size(); i++) {
+        auto it = lifetimes.find(inputs[i].storage.get());
+        input_written[i] = false;
+        if (it == lifetimes.end()) continue;
+        it->second.planned = false;
+        for (const GraphNode& node : nodes) {
+            for (const GraphBuffer& buf : node.writes) {
+                if (buf.storage == inputs[i].storage.get()) input_written[i] = true;
+            }
+        }
+    }
+
+    // Largest first, each at the lowest offset clear of every placed
+    // buffer that is live at the same time
+    std::vector<Storage*> planned;
+    for (Storage* s : order) {
+        if (lifetimes[s].planned) planned.push_back(s);
+    }
+    std::stable_sort(planned.begin(), planned.end(), [&](Storage* a, Storage* b) {
+        return lifetimes[a].bytes > lifetimes[b].bytes;
+    });
+    size_t arena_bytes = 0;
+    intermediate_bytes = 0;
+    std::vector<const Lifetime*> placed;
+    for (Storage* s : planned) {
+        Lifetime& life = lifetimes[s];
+        life.size = (life.bytes + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment;
+        intermediate_bytes += life.size;
+
+        std::vector<const Lifetime*> live;
+        for (const Lifetime* other : placed) {
+            if (other->first <= life.last && life.first <= other->last) live.push_back(other);
+        }
+        std::sort(live.begin(), live.end(), [](const Lifetime* a, const Lifetime* b) {
+            return a->offset < b->offset;
+        });
+        size_t offset = 0;
+        for (const Lifetime* other : live) {
+            if (offset + life.size <= other->offset) break;
+            offset = std::max(offset, other->offset + other->size);
+        }
+        life.offset = offset;
+        placed.push_back(&life);
+        arena_bytes = std::max(arena_bytes, offset + life.size);
+    }
+
+    arena = std::make_shared<Storage>(arena_bytes);
+    if (!arena->ptr && arena_bytes > 0) return false;
+
+    // Returned tensors are live until the end, so their regions are
+    // theirs alone: carry the values computed while capturing over
+    for (const Tensor* t : outputs) {
+        auto it = lifetimes.find(t->storage.get());
+        if (it != lifetimes.end() && it->second.planned && t->storage->ptr) {
+            std::memcpy((char*)arena->ptr + it->second.offset, t->storage->ptr, it->second.bytes);
+        }
+    }
+    for (Storage* s : planned) s->borrow(arena, lifetimes[s].offset);
+
+    for (GraphNode& node : nodes) {
+        node.reads = {};
+        node.writes = {};
+    }
+    created.clear();
+    return true;
+}
+
+// The graph the calling thread is capturing into. Per thread: kernels
+// release the GIL, so other Python threads keep issuing ops meanwhile,
+// and those must run normally rather than land in this graph.
+static thread_local Graph* g_capture = nullptr;
+
+// ============================================================
+// Python object wrapping Tensor
+// ============================================================
+typedef struct {
+    PyObject_HEAD
+    Tensor* tensor;
+} PyTensor;
+
+// ============================================================
+// Forward declarations of type methods
+// ============================================================
+static PyObject* Tensor_new(PyTypeObject* type, PyObject* args, PyObject* kwargs);
+static void Tensor_dealloc(PyTensor* self);
+static PyObject* Tensor_repr(PyTensor* self);
+static PyObject* Tensor_tolist(PyTensor* self, PyObject* args);
+static PyObject* Tensor_shape(PyTensor* self, void* closure);
+static PyObject* Tensor_dtype(PyTensor* self, void* closure);
+static PyObject* Tensor_astype(PyTensor* self, PyObject* args);
+static PyObject* Tensor_strides(PyTensor* self, void* closure);
+static PyObject* Tensor_is_contiguous(PyTensor* self, void* closure);
+static PyObject* Tensor_T(PyTensor* self, void* closure);
+static PyObject* Tensor_contiguous(PyTensor* self, PyObject* args);
+static PyObject* Tensor_copy(PyTensor* self, PyObject* args);
+static PyObject* Tensor_reduce_ex(PyTensor* self, PyObject* args);
+static PyObject* Tensor_shm_name(PyTensor* self, void* closure);
+static int Tensor_getbuffer(PyTensor* self, Py_buffer* view, int flags);
+static void Tensor_releasebuffer(PyTensor* self, Py_buffer* view);
+static PyObject* Tensor_ready(PyTensor* self, void* closure);
+static PyObject* Tensor_wait(PyTensor* self, PyObject* args);
+
+// ============================================================
+// Method and getset tables
+// ============================================================
+static PyMethodDef Tensor_methods[] = {
+    {"tolist", (PyCFunction)Tensor_tolist, METH_NOARGS, "Convert to Python list"},
+    {"astype", (PyCFunction)Tensor_astype, METH_VARARGS, "Copy converted to another dtype"},
+    {"copy", (PyCFunction)Tensor_copy, METH_NOARGS,
+     "Copy that shares memory until either tensor is written in place"},
+    {"contiguous", (PyCFunction)Tensor_contiguous, METH_NOARGS,
+     "Row-major copy of a view (or the tensor itself if already contiguous)"},
+    {"wait", (PyCFunction)Tensor_wait, METH_NOARGS,
+     "Block until queued ops writing this tensor finish; returns the tensor"},
+    {"__reduce_ex__", (PyCFunction)Tensor_reduce_ex, METH_VARARGS,
+     "Pickle support; protocol 5 passes the data as a PickleBuffer"},
+    {NULL}
+};
+
+static PyGetSetDef Tensor_getset[] = {
+    {"shape", (getter)Tensor_shape, NULL, "Shape of tensor", NULL},
+    {"dtype", (getter)Tensor_dtype, NULL, "Element type name", NULL},
+    {"strides", (getter)Tensor_strides, NULL, "Strides in elements", NULL},
+    {"is_contiguous", (getter)Tensor_is_contiguous, NULL, "Row-major and dense", NULL},
+    {"T", (getter)Tensor_T, NULL, "Transposed view", NULL},
+    {"ready", (getter)Tensor_ready, NULL, "No queued op is still writing this tensor", NULL},
+    {"shm_name", (getter)Tensor_shm_name, NULL,
+     "Name of the shared memory holding this tensor, or None", NULL},
+    {NULL}
+};
+
+static PyBufferProcs Tensor_as_buffer = {
+    (getbufferproc)Tensor_getbuffer,
+    (releasebufferproc)Tensor_releasebuffer,
+};
+
+// ============================================================
+// PyTensorType definition (before functions that use it)
+// ============================================================
+static PyTypeObject PyTensorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "tensor.Tensor",            // tp_name
+    sizeof(PyTensor),           // tp_basicsize
+    0,                          // tp_itemsize
+    (destructor)Tensor_dealloc, // tp_dealloc
+    0,                          // tp_vectorcall_offset
+    0,                          // tp_getattr
+    0,                          // tp_setattr
+    0,                          // tp_as_async
+    (reprfunc)Tensor_repr,      // tp_repr
+    0,                          // tp_as_number
+    0,                          // tp_as_sequence
+    0,                          // tp_as_mapping
+    0,                          // tp_hash
+    0,                          // tp_call
+    0,                          // tp_str
+    0,                          // tp_getattro
+    0,                          // tp_setattro
+    &Tensor_as_buffer,          // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,         // tp_flags
+    "Tensor object",            // tp_doc
+    0,                          // tp_traverse
+    0,                          // tp_clear
+    0,                          // tp_richcompare
+    0,                          // tp_weaklistoffset
+    0,                          // tp_iter
+    0,                          // tp_iternext
+    Tensor_methods,             // tp_methods
+    0,                          // tp_members
+    Tensor_getset,              // tp_getset
+    0,                          // tp_base
+    0,                          // tp_dict
+    0,                          // tp_descr_get
+    0,                          // tp_descr_set
+    0,                          // tp_dictoffset
+    0,                          // tp_init
+    0,                          // tp_alloc
+    Tensor_new,                 // tp_new
+};
+
+// ============================================================
+// Helper functions (now PyTensorType is defined)
+// ============================================================
+static Tensor* get_tensor(PyObject* obj) {
+    if (!PyObject_TypeCheck(obj, &PyTensorType)) {
+        PyErr_SetString(PyExc_TypeError, "Expected Tensor");
+        return nullptr;
+    }
+    return ((PyTensor*)obj)->tensor;
+}
+
+static PyObject* make_pytensor(Tensor* t) {
+    PyTensor* self = PyObject_New(PyTensor, &PyTensorType);
+    if (!self) {
+        delete t;
+        return NULL;
+    }
+    self->tensor = t;
+    return (PyObject*)self;
+}
+
+// Tensor with uninitialized (or zeroed) storage, or NULL with
+// MemoryError set
+static Tensor* new_tensor(const std::vector<size_t>& shape, DType dtype = DType::Float64,
+                          bool zeroed = false) {
+    Tensor* t = new Tensor();
+    t->shape = shape;
+    t->dtype = dtype;
+    if (!t->allocate(zeroed)) {
+        delete t;
+        PyErr_NoMemory();
+        return nullptr;
+    }
+    if (g_capture) g_capture->created[t->storage.get()] = true;
+    return t;
+}
+
+// What an op tells the profiler and graph capture besides what it
+// writes: its name, every tensor its kernel reads and the arithmetic it
+// does (0 for data movement)
+struct OpInfo {
+    const char* name;
+    TensorList inputs;
+    double flops = 0;
+};
+
+// Appends "(2, 3), (4,)" for `tensors` to `buf`, truncating with "..."
+static void format_shapes(char* buf, size_t size, TensorList tensors) {
+    size_t used = std::strlen(buf);
+    bool first = true;
+    for (const Tensor* t : tensors) {
+        std::string shape = first ? "(" : ", (";
+        first = false;
+        for (size_t d = 0; d < t->shape.size(); d++) {
+            if (d > 0) shape += ", ";
+            shape += std::to_string(t->shape[d]);
+        }
+        shape += t->shape.size() == 1 ? ",)" : ")";
+        if (used + shape.size() + 4 > size) {
+            std::snprintf(buf + used, size - used, "...");
+            return;
+        }
+        std::memcpy(buf + used, shape.c_str(), shape.size() + 1);
+        used += shape.size();
+    }
+}
+
+static uint64_t total_bytes(TensorList tensors) {
+    uint64_t bytes = 0;
+    for (const Tensor* t : tensors) bytes += t->nbytes();
+    return bytes;
+}
+
+static ProfileEvent profile_event(const OpInfo& op, TensorList outputs) {
+    ProfileEvent event{};
+    event.name = op.name;
+    const Tensor* typed = outputs.size() > 0 ? *outputs.begin()
+                        : op.inputs.size() > 0 ? *op.inputs.begin() : nullptr;
+    event.dtype = typed ? dtype_name(typed->dtype) : "";
+    format_shapes(event.shapes, sizeof(event.shapes), op.inputs);
+    if (outputs.size() > 0) {
+        std::strncat(event.shapes, " -> ", sizeof(event.shapes) - std::strlen(event.shapes) - 1);
+        format_shapes(event.shapes, sizeof(event.shapes), outputs);
+    }
+    event.queued_ns = profile_clock();
+    event.bytes = total_bytes(op.inputs) + total_bytes(outputs);
+    event.flops = op.flops;
+    return event;
+}
+
+// Runs `fn` now, or queues it on the stream when async execution is on.
+// `outputs` are the tensors it writes. `fn` must hold its own copies of
+// every Tensor it touches (copies share storage), since it may outlive
+// the caller's temporaries. Runs without the GIL either way.
+template <typename F>
+static void launch_task(F&& fn, TensorList outputs) {
+    if (g_async) {
+        Stream& s = stream();
+        std::function<void()> task(std::forward<F>(fn));
+        uint64_t seq;
+        Py_BEGIN_ALLOW_THREADS
+        seq = s.submit(std::move(task));
+        Py_END_ALLOW_THREADS
+        for (const Tensor* t : outputs) {
+            if (t->storage) t->storage->pending = seq;
+        }
+        return;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    stream_drain();  // ops queued before set_async(False) may touch the same memory
+    fn();
+    Py_END_ALLOW_THREADS
+}
+
+// Adds an op to the graph being captured
+static void capture_op(const OpInfo& op, std::function<void()> fn, TensorList outputs) {
+    GraphNode node;
+    node.run = std::move(fn);
+    for (const Tensor* t : op.inputs) {
+        if (t->storage) node.reads.push_back({t->storage.get(), storage_extent(*t)});
+    }
+    for (const Tensor* t : outputs) {
+        if (t->storage) node.writes.push_back({t->storage.get(), storage_extent(*t)});
+    }
+    g_capture->nodes.push_back(std::move(node));
+    g_capture->flops += op.flops;
+}
+
+// launch_task, timed by the profiler when it is on. While capturing, a
+// copy of `fn` is also kept for replay.
+template <typename F>
+static void launch(const OpInfo& op, F&& fn, TensorList outputs) {
+    if (g_capture) capture_op(op, fn, outputs);
+    if (!g_profiling.load(std::memory_order_relaxed)) {
+        launch_task(std::forward<F>(fn), outputs);
+        return;
+    }
+    ProfileEvent event = profile_event(op, outputs);
+    if (g_async) {
+        event.on_stream = true;
+        launch_task([event, fn = std::forward<F>(fn)]() mutable {
+            event.start_ns = profile_clock();
+            fn();
+            event.end_ns = profile_clock();
+            profile_record(event);
+        }, outputs);
+    } else {
+        launch_task([&] {
+            event.start_ns = profile_clock();
+            fn();
+            event.end_ns = profile_clock();
+        }, outputs);
+        // With the GIL held, so profiler.start() can't swap the ring meanwhile
+        profile_record(event);
+    }
+}
+
+// Times a host-side op (one that reads or builds tensor data on the
+// calling thread) from construction to destruction
+class ProfileScope {
+public:
+    explicit ProfileScope(const OpInfo& op) : on_(g_profiling.load(std::memory_order_relaxed)) {
+        if (!on_) return;
+        event_ = profile_event(op, {});
+        event_.start_ns = event_.queued_ns;
+    }
+
+    ~ProfileScope() {
+        if (!on_) return;
+        event_.end_ns = profile_clock();
+        profile_record(event_);
+    }
+
+    void output(const Tensor* t) {
+        if (!on_) return;
+        if (!event_.dtype[0]) event_.dtype = dtype_name(t->dtype);
+        std::strncat(event_.shapes, " -> ", sizeof(event_.shapes) - std::strlen(event_.shapes) - 1);
+        format_shapes(event_.shapes, sizeof(event_.shapes), {t});
+        event_.bytes += t->nbytes();
+    }
+
+private:
+    bool on_;
+    ProfileEvent event_;
+};
+
+// Blocks until no queued op is still writing t's memory. Every host-side
+// read of tensor data goes through here first. Returns false with
+// IndexError set if a kernel deferred one on t's storage.
+static bool wait_ready(const Tensor* t) {
+    if (g_capture) g_capture->host_read = true;
+    if (g_stream && t->storage && t->storage->pending != 0) {
+        uint64_t seq = t->storage->pending;
+        if (!g_stream->done(seq)) {
+            ProfileScope scope({"wait", {t}});
+            Py_BEGIN_ALLOW_THREADS
+            g_stream->wait(seq);
+            Py_END_ALLOW_THREADS
+        }
+        t->storage->pending = 0;
+    }
+    return raise_deferred(t->storage.get());
+}
+
+static bool parse_dtype(const char* name, DType* dtype) {
+    if (!dtype_from_name(name, dtype)) {
+        PyErr_Format(PyExc_ValueError,
+                     "unknown dtype '%s' (expected bool, int8, int32, int64, float32 or float64)", name);
+        return false;
+    }
+    return true;
+}
+
+// `t` as a contiguous tensor of `dtype`, the form every kernel expects.
+// Returns `t` itself when it already is one; otherwise a converted or
+// gathered copy, owned by `holder`.
+static Tensor* operand(Tensor* t, DType dtype, std::unique_ptr<Tensor>& holder) {
+    bool contiguous = t->is_contiguous();
+    if (t->dtype == dtype && contiguous) return t;
+
+    Tensor* out = new_tensor(t->shape, dtype);
+    if (!out) return nullptr;
+    holder.reset(out);
+
+    // Gather first (in the source type), then convert. A gather that
+    // also converts goes through a temporary.
+    Tensor gathered;
+    if (!contiguous && t->dtype != dtype) {
+        gathered.shape = t->shape;
+        gathered.dtype = t->dtype;
+        if (!gathered.allocate()) {
+            PyErr_NoMemory();
+            return nullptr;
+        }
+    }
+
+    launch({contiguous ? "cast" : "gather", {t}}, [src = *t, dst = *out, gathered, contiguous]() {
+        const Tensor* from = &src;
+        if (!contiguous) {
+            const Tensor* into = src.dtype == dst.dtype ? &dst : &gathered;
+            dispatch(src.dtype, [&](auto tag) {
+                using T = decltype(tag);
+                strided_copy(src.data<T>(), src.shape, src.strides, into->data<T>());
+            });
+            if (into == &dst) return;
+            from = &gathered;
+        }
+
+        dispatch(from->dtype, [&](auto src_tag) {
+            using Src = decltype(src_tag);
+            dispatch(dst.dtype, [&](auto dst_tag) {
+                using Dst = decltype(dst_tag);
+                cast_kernel(from->data<Src>(), dst.data<Dst>(), from->size());
+            });
+        });
+    }, {out});
+    return out;
+}
+
+// Whether copies of `s` may share its memory (see share_tensor). Not
+// for memory that can change without an op writing this tensor: a
+// graph's buffers and inputs, writable file mappings, shared memory.
+static bool can_share(const Storage* s) {
+    return s && !(s->parent && !s->cow) && !(s->map_base && s->writable) && s->shm_name.empty();
+}
+
+// Copy of `t` that shares its memory until either side is written in
+// place (see make_private). No data moves. Requires can_share.
+static Tensor* share_tensor(Tensor* t) {
+    const std::shared_ptr<Storage>& s = t->storage;
+    if (!s->cow) {
+        // Hand the memory to a hidden owner and borrow it back
+        auto owner = std::make_shared<Storage>(std::move(*s));
+        uint64_t pending = owner->pending;
+        bool writable = owner->writable;
+        s->borrow(owner, 0);
+        s->cow = true;
+        s->pending = pending;
+        s->writable = writable;
+    }
+    Tensor* copy = new Tensor(*t);
+    copy->storage = std::make_shared<Storage>();
+    copy->storage->borrow(s->parent, 0);
+    copy->storage->cow = true;
+    copy->storage->pending = s->pending;
+    copy->storage->writable = true;  // read-only shared memory is copied on the first write
+    return copy;
+}
+
+// t.copy(): shared copy-on-write when possible, otherwise (and always
+// while capturing) an ordinary copy
+static Tensor* copy_tensor(Tensor* t) {
+    if (!g_capture && can_share(t->storage.get())) return share_tensor(t);
+
+    std::unique_ptr<Tensor> gathered;
+    Tensor* result = operand(t, t->dtype, gathered);
+    if (!result) return nullptr;
+    if (result != t) return gathered.release();
+    result = new_tensor(t->shape, t->dtype);
+    if (!result) return nullptr;
+    launch({"copy", {t}}, [src = *t, dst = *result]() {
+        if (src.raw()) std::memcpy(dst.raw(), src.raw(), src.nbytes());
+    }, {result});
+    return result;
+}
+
+// Gives `t` memory of its own before an op writes it in place, if it
+// shares it copy-on-write. The storage itself changes memory, so views
+// of `t` follow. Returns false with MemoryError set.
+static bool make_private(Tensor* t) {
+    Storage* s = t->storage.get();
+    if (!s) return true;
+    // A graph placeholder borrowing a copy detaches the copy, then
+    // borrows its new memory at the same offset
+    Storage* window = nullptr;
+    size_t window_offset = 0;
+    if (!s->cow && s->parent && s->parent->cow) {
+        window = s;
+        window_offset = (char*)s->ptr - (char*)s->parent->ptr;
+        s = s->parent.get();
+    }
+    if (!s->cow || (s->parent.use_count() == 1 && s->parent->writable)) return true;
+
+    ProfileScope scope({"copy_on_write", {t}});
+    Storage fresh(s->bytes);
+    if (!fresh.ptr && s->bytes > 0) {
+        PyErr_NoMemory();
+        return false;
+    }
+    // Queued ops may still use the shared memory through this storage
+    Py_BEGIN_ALLOW_THREADS
+    stream_drain();
+    Py_END_ALLOW_THREADS
+    if (s->bytes > 0) std::memcpy(fresh.ptr, s->ptr, s->bytes);
+    bool writable = s->writable;
+    *s = std::move(fresh);
+    s->writable = writable;
+    if (window) window->borrow(window->parent, window_offset);
+    return true;
+}
+
+// View of `t` with axes reordered: axis d of the view is axis perm[d]
+// of `t`. No data moves; the storage is shared.
+static Tensor* permuted_view(const Tensor* t, const std::vector<size_t>& perm) {
+    Tensor* v = new Tensor();
+    v->storage = t->storage;
+    v->offset = t->offset;
+    v->dtype = t->dtype;
+    for (size_t axis : perm) {
+        v->shape.push_back(t->shape[axis]);
+        v->strides.push_back(t->strides[axis]);
+    }
+    return v;
+}
+
+static PyObject* item_to_py(const Tensor* t, size_t i) {
+    PyObject* result = nullptr;
+    dispatch(t->dtype, [&](auto tag) {
+        using T = decltype(tag);
+        T value = t->data<T>()[i];
+        if (std::is_same<T, bool>::value) {
+            result = PyBool_FromLong((long)value);
+        } else if (std::is_floating_point<T>::value) {
+            result = PyFloat_FromDouble((double)value);
+        } else {
+            result = PyLong_FromLongLong((long long)value);
+        }
+    });
+    return result;
+}
+
+// Errors are left set for the caller to check once via PyErr_Occurred
+static void item_from_py(Tensor* t, size_t i, PyObject* obj) {
+    dispatch(t->dtype, [&](auto tag) {
+        using T = decltype(tag);
+        T value;
+        if (std::is_same<T, bool>::value) {
+            value = (T)PyObject_IsTrue(obj);
+        } else if (std::is_floating_point<T>::value) {
+            value = (T)PyFloat_AsDouble(obj);
+        } else {
+            value = (T)PyLong_AsLongLong(obj);
+        }
+        t->data<T>()[i] = value;
+    });
+}
+
+// ============================================================
+// Type method implementations
+// ============================================================
+static PyObject* Tensor_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    PyTensor* self = (PyTensor*)type->tp_alloc(type, 0);
+    if (self) {
+        self->tensor = new Tensor();
+    }
+    return (PyObject*)self;
+}
+
+static void Tensor_dealloc(PyTensor* self) {
+    delete self->tensor;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* Tensor_shape(PyTensor* self, void* closure) {
+    PyObject* shape_tuple = PyTuple_New(self->tensor->shape.size());
+    for (size_t i = 0; i < self->tensor->shape.size(); i++) {
+        PyTuple_SetItem(shape_tuple, i, PyLong_FromSize_t(self->tensor->shape[i]));
+    }
+    return shape_tuple;
+}
+
+static PyObject* Tensor_dtype(PyTensor* self, void* closure) {
+    return PyUnicode_FromString(dtype_name(self->tensor->dtype));
+}
+
+// Nested lists for dimensions [dim, ndim), consuming elements from *next
+static PyObject* nested_list(const Tensor* t, size_t dim, size_t* next) {
+    PyObject* list = PyList_New(t->shape[dim]);
+    if (!list) return NULL;
+    for (size_t i = 0; i < t->shape[dim]; i++) {
+        PyObject* item = dim + 1 == t->shape.size() ? item_to_py(t, (*next)++)
+                                                    : nested_list(t, dim + 1, next);
+        if (!item) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+static PyObject* Tensor_tolist(PyTensor* self, PyObject* args) {
+    ProfileScope scope({"tolist", {self->tensor}});
+    std::unique_ptr<Tensor> gathered;
+    Tensor* t = operand(self->tensor, self->tensor->dtype, gathered);
+    if (!t || !wait_ready(t)) return NULL;
+
+    if (t->shape.empty()) {
+        PyErr_SetString(PyExc_ValueError, "tolist requires at least one dimension");
+        return NULL;
+    }
+    size_t next = 0;
+    return nested_list(t, 0, &next);
+}
+
+static PyObject* Tensor_strides(PyTensor* self, void* closure) {
+    const std::vector<int64_t>& strides = self->tensor->strides;
+    PyObject* tuple = PyTuple_New(strides.size());
+    for (size_t i = 0; i < strides.size(); i++) {
+        PyTuple_SetItem(tuple, i, PyLong_FromLongLong(strides[i]));
+    }
+    return tuple;
+}
+
+static PyObject* Tensor_is_contiguous(PyTensor* self, void* closure) {
+    return PyBool_FromLong(self->tensor->is_contiguous());
+}
+
+// Reversed axes, as a view
+static PyObject* Tensor_T(PyTensor* self, void* closure) {
+    size_t ndim = self->tensor->shape.size();
+    std::vector<size_t> perm(ndim);
+    for (size_t d = 0; d < ndim; d++) perm[d] = ndim - 1 - d;
+    return make_pytensor(permuted_view(self->tensor, perm));
+}
+
+// Self when already contiguous, otherwise a gathered copy
+static PyObject* Tensor_contiguous(PyTensor* self, PyObject* args) {
+    std::unique_ptr<Tensor> gathered;
+    Tensor* t = operand(self->tensor, self->tensor->dtype, gathered);
+    if (!t) return NULL;
+    if (t == self->tensor) {
+        Py_INCREF(self);
+        return (PyObject*)self;
+    }
+    return make_pytensor(gathered.release());
+}
+
+// Non-blocking check of the stream
+static PyObject* Tensor_ready(PyTensor* self, void* closure) {
+    const Tensor* t = self->tensor;
+    bool ready = !g_stream || !t->storage || g_stream->done(t->storage->pending);
+    return PyBool_FromLong(ready);
+}
+
+static PyObject* Tensor_wait(PyTensor* self, PyObject* args) {
+    if (!wait_ready(self->tensor)) return NULL;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* Tensor_astype(PyTensor* self, PyObject* args) {
+    const char* name;
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+
+    DType dtype;
+    if (!parse_dtype(name, &dtype)) return NULL;
+
+    Tensor* t = self->tensor;
+    if (dtype == t->dtype) {
+        Tensor* copy = copy_tensor(t);
+        return copy ? make_pytensor(copy) : NULL;
+    }
+    std::unique_ptr<Tensor> converted;
+    if (!operand(t, dtype, converted)) return NULL;
+    return make_pytensor(converted.release());
+}
+
+// Copy-on-write copy: O(1) until this tensor or the copy is written
+static PyObject* Tensor_copy(PyTensor* self, PyObject* args) {
+    Tensor* copy = copy_tensor(self->tensor);
+    return copy ? make_pytensor(copy) : NULL;
+}
+
+static PyObject* Tensor_repr(PyTensor* self) {
+    std::unique_ptr<Tensor> gathered;
+    Tensor* t = operand(self->tensor, self->tensor->dtype, gathered);
+    if (!t || !wait_ready(t)) return NULL;
+    std::ostringstream oss;
+    oss << "Tensor(shape=(";
+    for (size_t i = 0; i < t->shape.size(); i++) {
+        if (i > 0) oss << ", ";
+        oss << t->shape[i];
+    }
+    oss << "), data=[";
+    size_t count = t->raw() ? t->size() : 0;
+    size_t n = std::min(count, (size_t)6);
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0) oss << ", ";
+        dispatch(t->dtype, [&](auto tag) {
+            using T = decltype(tag);
+            T value = t->data<T>()[i];
+            if (std::is_same<T, bool>::value) {
+                oss << (value ? "True" : "False");
+            } else {
+                oss << +value;
+            }
+        });
+    }
+    if (count > 6) oss << ", ...";
+    oss << "]";
+    if (t->dtype != DType::Float64) oss << ", dtype=" << dtype_name(t->dtype);
+    oss << ")";
+    return PyUnicode_FromString(oss.str().c_str());
+}
+
+// ============================================================
+// Sparse tensor type
+// ============================================================
+typedef struct {
+    PyObject_HEAD
+    SparseTensor* sparse;
+} PySparseTensor;
+
+static void SparseTensor_dealloc(PySparseTensor* self) {
+    delete self->sparse;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* SparseTensor_repr(PySparseTensor* self) {
+    const SparseTensor* s = self->sparse;
+    return PyUnicode_FromFormat("SparseTensor(shape=(%zu, %zu), nnz=%zu, dtype=%s)",
+                                s->rows, s->cols, s->nnz(), dtype_name(s->dtype()));
+}
+
+static PyObject* SparseTensor_shape(PySparseTensor* self, void* closure) {
+    return Py_BuildValue("(nn)", (Py_ssize_t)self->sparse->rows, (Py_ssize_t)self->sparse->cols);
+}
+
+static PyObject* SparseTensor_nnz(PySparseTensor* self, void* closure) {
+    return PyLong_FromSize_t(self->sparse->nnz());
+}
+
+static PyObject* SparseTensor_dtype(PySparseTensor* self, void* closure) {
+    return PyUnicode_FromString(dtype_name(self->sparse->dtype()));
+}
+
+// indptr/indices/values: tensors sharing the sparse tensor's storage
+static PyObject* SparseTensor_indptr(PySparseTensor* self, void* closure) {
+    return make_pytensor(new Tensor(self->sparse->indptr));
+}
+
+static PyObject* SparseTensor_indices(PySparseTensor* self, void* closure) {
+    return make_pytensor(new Tensor(self->sparse->indices));
+}
+
+static PyObject* SparseTensor_values(PySparseTensor* self, void* closure) {
+    return make_pytensor(new Tensor(self->sparse->values));
+}
+
+static PyObject* SparseTensor_to_dense(PySparseTensor* self, PyObject* args) {
+    const SparseTensor* s = self->sparse;
+    Tensor* result = new_tensor({s->rows, s->cols}, s->dtype());
+    if (!result) return NULL;
+
+    launch({"to_dense", {&s->indptr, &s->indices, &s->values}, (double)s->nnz()},
+           [s = *s, dense = *result]() {
+        dispatch(s.dtype(), [&](auto tag) {
+            using T = decltype(tag);
+            const int64_t* indptr = s.indptr.data<int64_t>();
+            const int32_t* indices = s.indices.data<int32_t>();
+            const T* values = s.values.data<T>();
+            T* out = dense.data<T>();
+            parallel_rows(indptr, s.rows, [&](size_t begin, size_t end) {
+                // Zeroed here rather than at allocation, so a graph replay
+                // into reused memory starts clean too
+                std::fill(out + begin * s.cols, out + end * s.cols, (T)0);
+                for (size_t r = begin; r < end; r++) {
+                    for (int64_t j = indptr[r]; j < indptr[r + 1]; j++) {
+                        out[r * s.cols + indices[j]] += values[j];
+                    }
+                }
+            });
+        });
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+static PyMethodDef SparseTensor_methods[] = {
+    {"to_dense", (PyCFunction)SparseTensor_to_dense, METH_NOARGS, "Convert to a dense Tensor"},
+    {NULL}
+};
+
+static PyGetSetDef SparseTensor_getset[] = {
+    {"shape", (getter)SparseTensor_shape, NULL, "Shape of matrix", NULL},
+    {"nnz", (getter)SparseTensor_nnz, NULL, "Number of stored entries", NULL},
+    {"dtype", (getter)SparseTensor_dtype, NULL, "Element type name", NULL},
+    {"indptr", (getter)SparseTensor_indptr, NULL, "Row pointers (int64, rows + 1)", NULL},
+    {"indices", (getter)SparseTensor_indices, NULL, "Column indices (int32, nnz)", NULL},
+    {"values", (getter)SparseTensor_values, NULL, "Stored values (nnz)", NULL},
+    {NULL}
+};
+
+static PyTypeObject PySparseTensorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "tensor.SparseTensor",              // tp_name
+    sizeof(PySparseTensor),             // tp_basicsize
+    0,                                  // tp_itemsize
+    (destructor)SparseTensor_dealloc,   // tp_dealloc
+    0,                                  // tp_vectorcall_offset
+    0,                                  // tp_getattr
+    0,                                  // tp_setattr
+    0,                                  // tp_as_async
+    (reprfunc)SparseTensor_repr,        // tp_repr
+    0,                                  // tp_as_number
+    0,                                  // tp_as_sequence
+    0,                                  // tp_as_mapping
+    0,                                  // tp_hash
+    0,                                  // tp_call
+    0,                                  // tp_str
+    0,                                  // tp_getattro
+    0,                                  // tp_setattro
+    0,                                  // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,                 // tp_flags
+    "Sparse matrix in CSR format",      // tp_doc
+    0,                                  // tp_traverse
+    0,                                  // tp_clear
+    0,                                  // tp_richcompare
+    0,                                  // tp_weaklistoffset
+    0,                                  // tp_iter
+    0,                                  // tp_iternext
+    SparseTensor_methods,               // tp_methods
+    0,                                  // tp_members
+    SparseTensor_getset,                // tp_getset
+};
+
+static SparseTensor* get_sparse(PyObject* obj) {
+    if (!PyObject_TypeCheck(obj, &PySparseTensorType)) {
+        PyErr_SetString(PyExc_TypeError, "Expected SparseTensor");
+        return nullptr;
+    }
+    return ((PySparseTensor*)obj)->sparse;
+}
+
+static PyObject* make_pysparse(SparseTensor* s) {
+    PySparseTensor* self = PyObject_New(PySparseTensor, &PySparseTensorType);
+    if (!self) {
+        delete s;
+        return NULL;
+    }
+    self->sparse = s;
+    return (PyObject*)self;
+}
+
+// ============================================================
+// Graph type
+// ============================================================
+typedef struct {
+    PyObject_HEAD
+    std::shared_ptr<Graph>* graph;
+    PyObject* result;  // what the captured function returned
+} PyGraph;
+
+static void Graph_dealloc(PyGraph* self) {
+    delete self->graph;
+    Py_XDECREF(self->result);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* Graph_repr(PyGraph* self) {
+    const Graph& g = **self->graph;
+    return PyUnicode_FromFormat("Graph(ops=%zu, inputs=%zu, arena_bytes=%zu)",
+                                g.nodes.size(), g.inputs.size(),
+                                g.arena ? g.arena->capacity : (size_t)0);
+}
+
+// g(*inputs): runs the captured ops on new inputs laid out like the
+// captured ones. Returns what the function returned at capture time;
+// those tensors are overwritten by the next replay.
+static PyObject* Graph_call(PyGraph* self, PyObject* args, PyObject* kwargs) {
+    if (kwargs && PyDict_Size(kwargs) > 0) {
+        PyErr_SetString(PyExc_TypeError, "graph replay takes positional tensors only");
+        return NULL;
+    }
+    if (g_capture) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot replay a graph while capturing");
+        return NULL;
+    }
+    std::shared_ptr<Graph> graph = *self->graph;
+    size_t n = graph->inputs.size();
+    if ((size_t)PyTuple_Size(args) != n) {
+        PyErr_Format(PyExc_TypeError, "graph takes %zu inputs, got %zd", n, PyTuple_Size(args));
+        return NULL;
+    }
+
+    std::vector<Tensor> values(n);
+    std::vector<const Tensor*> given(n);
+    std::vector<std::unique_ptr<Tensor>> copies;
+    for (size_t i = 0; i < n; i++) {
+        Tensor* t = get_tensor(PyTuple_GET_ITEM(args, i));
+        if (!t) return NULL;
+        const Tensor& captured = graph->inputs[i];
+        if (t->dtype != captured.dtype || t->shape != captured.shape ||
+            t->strides != captured.strides) {
+            PyErr_Format(PyExc_ValueError,
+                         "input %zu must have the dtype, shape and strides it was captured with", i);
+            return NULL;
+        }
+        // An earlier result fed back in, as in x = g(x), lives in memory
+        // the replay overwrites before reading it; replay a copy instead
+        if (t->storage && graph->aliases(t->storage.get())) {
+            size_t bytes = t->size() ? storage_extent(*t) - t->offset * t->itemsize() : 0;
+            std::unique_ptr<Tensor> copy(new Tensor(*t));
+            copy->storage = std::make_shared<Storage>(bytes);
+            copy->offset = 0;
+            if (!copy->storage->ptr && bytes > 0) {
+                PyErr_NoMemory();
+                return NULL;
+            }
+            launch({"copy", {t}}, [src = *t, dst = *copy, bytes]() {
+                if (bytes > 0) std::memcpy(dst.raw(), src.raw(), bytes);
+            }, {copy.get()});
+            t = copy.get();
+            copies.push_back(std::move(copy));
+        }
+        if (graph->input_written[i] && t->storage && !t->storage->writable) {
+            PyErr_Format(PyExc_ValueError, "input %zu is written in place but is read-only", i);
+            return NULL;
+        }
+        if (graph->input_written[i] && !make_private(t)) return NULL;
+        values[i] = *t;
+        given[i] = t;
+    }
+
+    launch({"graph", given, graph->flops}, [graph, values = std::move(values)]() {
+        graph->replay(values);
+    }, graph->outputs);
+    if (!g_async && !raise_deferred()) return NULL;
+
+    Py_INCREF(self->result);
+    return self->result;
+}
+
+static PyObject* Graph_num_ops(PyGraph* self, void* closure) {
+    return PyLong_FromSize_t((*self->graph)->nodes.size());
+}
+
+static PyObject* Graph_arena_bytes(PyGraph* self, void* closure) {
+    const Graph& g = **self->graph;
+    return PyLong_FromSize_t(g.arena ? g.arena->capacity : 0);
+}
+
+static PyObject* Graph_intermediate_bytes(PyGraph* self, void* closure) {
+    return PyLong_FromSize_t((*self->graph)->intermediate_bytes);
+}
+
+static PyGetSetDef Graph_getset[] = {
+    {"num_ops", (getter)Graph_num_ops, NULL, "Number of captured ops", NULL},
+    {"arena_bytes", (getter)Graph_arena_bytes, NULL, "Memory holding every planned buffer", NULL},
+    {"intermediate_bytes", (getter)Graph_intermediate_bytes, NULL,
+     "What the planned buffers would take without reuse", NULL},
+    {NULL}
+};
+
+static PyTypeObject PyGraphType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "tensor.Graph",                     // tp_name
+    sizeof(PyGraph),                    // tp_basicsize
+    0,                                  // tp_itemsize
+    (destructor)Graph_dealloc,          // tp_dealloc
+    0,                                  // tp_vectorcall_offset
+    0,                                  // tp_getattr
+    0,                                  // tp_setattr
+    0,                                  // tp_as_async
+    (reprfunc)Graph_repr,               // tp_repr
+    0,                                  // tp_as_number
+    0,                                  // tp_as_sequence
+    0,                                  // tp_as_mapping
+    0,                                  // tp_hash
+    (ternaryfunc)Graph_call,            // tp_call
+    0,                                  // tp_str
+    0,                                  // tp_getattro
+    0,                                  // tp_setattro
+    0,                                  // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,                 // tp_flags
+    "Captured op sequence; call it with new inputs to replay",  // tp_doc
+    0,                                  // tp_traverse
+    0,                                  // tp_clear
+    0,                                  // tp_richcompare
+    0,                                  // tp_weaklistoffset
+    0,                                  // tp_iter
+    0,                                  // tp_iternext
+    0,                                  // tp_methods
+    0,                                  // tp_members
+    Graph_getset,                       // tp_getset
+};
+
+// ============================================================
+// Builder type
+// ============================================================
+// tensor.builder() collects rows into one growing buffer. Appends copy
+// straight into the spare capacity, and a full buffer is replaced by
+// one twice as large, so appending costs amortized O(1) per row however
+// many chunks arrive. build() hands the filled rows over as a tensor
+// that views the buffer, without a copy.
+struct TensorBuilder {
+    Tensor buffer;                  // [capacity, *row_shape]; dtype is the builder's
+    size_t rows = 0;                // rows filled
+    size_t requested = 0;           // capacity asked for before row_shape was known
+    std::vector<size_t> row_shape;
+    bool shaped = false;            // row_shape given or set by the first append
+    bool typed = false;             // dtype given or set by the first append
+
+    size_t capacity() const { return buffer.shape.empty() ? 0 : buffer.shape[0]; }
+
+    size_t row_bytes() const {
+        size_t n = dtype_size(buffer.dtype);
+        for (size_t d : row_shape) n *= d;
+        return n;
+    }
+};
+
+typedef struct {
+    PyObject_HEAD
+    TensorBuilder* builder;
+} PyBuilder;
+
+// Grows the buffer to hold at least `rows` rows, moving the filled ones
+static bool builder_reserve(TensorBuilder* b, size_t rows) {
+    if (rows <= b->capacity()) return true;
+    Tensor grown;
+    grown.dtype = b->buffer.dtype;
+    grown.shape = b->row_shape;
+    grown.shape.insert(grown.shape.begin(), std::max(rows, 2 * b->capacity()));
+    if (!grown.allocate()) {
+        PyErr_NoMemory();
+        return false;
+    }
+    if (b->rows > 0) {
+        size_t bytes = b->rows * b->row_bytes();
+        launch({"builder_grow", {&b->buffer}}, [src = b->buffer, dst = grown, bytes]() {
+            concat_copy({{src.data<char>(), bytes, 0}}, 1, bytes, dst.data<char>());
+        }, {&grown});
+    }
+    b->buffer = std::move(grown);
+    return true;
+}
+
+static void Builder_dealloc(PyBuilder* self) {
+    delete self->builder;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* Builder_repr(PyBuilder* self) {
+    const TensorBuilder* b = self->builder;
+    return PyUnicode_FromFormat("Builder(rows=%zu, capacity=%zu, dtype=%s)", b->rows,
+                                b->capacity(), b->typed ? dtype_name(b->buffer.dtype) : "None");
+}
+
+// b.append(t): adds the rows of `t`, shape (k, *row_shape), or `t` as a
+// single row when its shape is row_shape. Other dtypes are cast.
+static PyObject* Builder_append(PyBuilder* self, PyObject* arg) {
+    TensorBuilder* b = self->builder;
+    Tensor* t = get_tensor(arg);
+    if (!t) return NULL;
+    if (g_capture) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot append to a builder while capturing");
+        return NULL;
+    }
+    if (!b->shaped && t->shape.empty()) {
+        PyErr_SetString(PyExc_ValueError, "the first append needs at least one axis");
+        return NULL;
+    }
+
+    std::vector<size_t> row_shape = b->shaped ? b->row_shape
+                                              : std::vector<size_t>(t->shape.begin() + 1, t->shape.end());
+    size_t count;
+    if (t->shape == row_shape) {
+        count = 1;
+    } else if (t->shape.size() == row_shape.size() + 1 &&
+               std::equal(row_shape.begin(), row_shape.end(), t->shape.begin() + 1)) {
+        count = t->shape[0];
+    } else {
+        PyErr_SetString(PyExc_ValueError, "append: tensor is neither a row nor a stack of rows");
+        return NULL;
+    }
+
+    if (!b->shaped) {
+        b->row_shape = std::move(row_shape);
+        b->shaped = true;
+    }
+    if (!b->typed) {
+        b->buffer.dtype = t->dtype;
+        b->typed = true;
+    }
+    std::unique_ptr<Tensor> holder;
+    Tensor* src = operand(t, b->buffer.dtype, holder);
+    if (!src || !builder_reserve(b, std::max(b->rows + count, b->requested))) return NULL;
+
+    size_t bytes = count * b->row_bytes();
+    if (bytes > 0) {
+        launch({"append", {src}}, [src = *src, dst = b->buffer, at = b->rows * b->row_bytes(), bytes]() {
+            concat_copy({{src.data<char>(), bytes, 0}}, 1, bytes, dst.data<char>() + at);
+        }, {&b->buffer});
+    }
+    b->rows += count;
+    Py_RETURN_NONE;
+}
+
+// b.build(): the rows appended so far as a (rows, *row_shape) tensor.
+// The builder starts over empty, with the same row shape and dtype.
+static PyObject* Builder_build(PyBuilder* self, PyObject* Py_UNUSED(ignored)) {
+    TensorBuilder* b = self->builder;
+    Tensor* t = new Tensor(b->buffer);
+    t->shape = b->row_shape;
+    t->shape.insert(t->shape.begin(), b->rows);
+    t->strides = Tensor::contiguous_strides(t->shape);
+    if (!t->storage) t->storage = std::make_shared<Storage>();
+    b->buffer = Tensor();
+    b->buffer.dtype = t->dtype;
+    b->rows = 0;
+    b->requested = 0;
+    return make_pytensor(t);
+}
+
+static Py_ssize_t Builder_len(PyBuilder* self) {
+    return (Py_ssize_t)self->builder->rows;
+}
+
+static PyObject* Builder_capacity(PyBuilder* self, void* closure) {
+    return PyLong_FromSize_t(self->builder->capacity());
+}
+
+static PyMethodDef Builder_methods[] = {
+    {"append", (PyCFunction)Builder_append, METH_O,
+     "Append a row, or a tensor of rows along its first axis"},
+    {"build", (PyCFunction)Builder_build, METH_NOARGS,
+     "Return the rows appended so far as one tensor, and start over"},
+    {NULL}
+};
+
+static PyGetSetDef Builder_getset[] = {
+    {"capacity", (getter)Builder_capacity, NULL, "Rows the current buffer can hold", NULL},
+    {NULL}
+};
+
+static PySequenceMethods Builder_as_sequence = {
+    (lenfunc)Builder_len,               // sq_length
+};
+
+static PyTypeObject PyBuilderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "tensor.Builder",                   // tp_name
+    sizeof(PyBuilder),                  // tp_basicsize
+    0,                                  // tp_itemsize
+    (destructor)Builder_dealloc,        // tp_dealloc
+    0,                                  // tp_vectorcall_offset
+    0,                                  // tp_getattr
+    0,                                  // tp_setattr
+    0,                                  // tp_as_async
+    (reprfunc)Builder_repr,             // tp_repr
+    0,                                  // tp_as_number
+    &Builder_as_sequence,               // tp_as_sequence
+    0,                                  // tp_as_mapping
+    0,                                  // tp_hash
+    0,                                  // tp_call
+    0,                                  // tp_str
+    0,                                  // tp_getattro
+    0,                                  // tp_setattro
+    0,                                  // tp_as_buffer
+    Py_TPFLAGS_DEFAULT,                 // tp_flags
+    "Growable buffer of rows; build() returns them as one tensor",  // tp_doc
+    0,                                  // tp_traverse
+    0,                                  // tp_clear
+    0,                                  // tp_richcompare
+    0,                                  // tp_weaklistoffset
+    0,                                  // tp_iter
+    0,                                  // tp_iternext
+    Builder_methods,                    // tp_methods
+    0,                                  // tp_members
+    Builder_getset,                     // tp_getset
+};
+
+// ============================================================
+// Module-level functions
+// ============================================================
+static bool parse_shape(PyObject* shape_obj, std::vector<size_t>& shape) {
+    if (PyLong_Check(shape_obj)) {
+        shape.push_back(PyLong_AsSize_t(shape_obj));
+    } else if (PyTuple_Check(shape_obj)) {
+        for (Py_ssize_t i = 0; i < PyTuple_Size(shape_obj); i++) {
+            shape.push_back(PyLong_AsSize_t(PyTuple_GetItem(shape_obj, i)));
+        }
+    } else {
+        PyErr_SetString(PyExc_TypeError, "shape must be int or tuple");
+        return false;
+    }
+    return !PyErr_Occurred();
+}
+
+static PyObject* tensor_zeros(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"shape", "dtype", NULL};
+    PyObject* shape_obj;
+    const char* dtype_str = "float64";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|s", (char**)kwlist,
+                                     &shape_obj, &dtype_str)) {
+        return NULL;
+    }
+
+    std::vector<size_t> shape;
+    DType dtype;
+    if (!parse_shape(shape_obj, shape) || !parse_dtype(dtype_str, &dtype)) return NULL;
+
+    Tensor* t = new_tensor(shape, dtype, true);
+    if (!t) return NULL;
+    return make_pytensor(t);
+}
+
+// Uninitialized: for outputs that are about to be overwritten anyway
+static PyObject* tensor_empty(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"shape", "dtype", NULL};
+    PyObject* shape_obj;
+    const char* dtype_str = "float64";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|s", (char**)kwlist,
+                                     &shape_obj, &dtype_str)) {
+        return NULL;
+    }
+
+    std::vector<size_t> shape;
+    DType dtype;
+    if (!parse_shape(shape_obj, shape) || !parse_dtype(dtype_str, &dtype)) return NULL;
+
+    Tensor* t = new_tensor(shape, dtype);
+    if (!t) return NULL;
+    return make_pytensor(t);
+}
+
+// Fill `t` from nested lists for dimensions [dim, ndim), checking that
+// every list at a given depth has the same length
+static bool fill_from_list(Tensor* t, PyObject* list, size_t dim, size_t* next) {
+    if (!PyList_Check(list) || (size_t)PyList_Size(list) != t->shape[dim]) {
+        PyErr_SetString(PyExc_ValueError, "nested lists must be rectangular");
+        return false;
+    }
+    for (size_t i = 0; i < t->shape[dim]; i++) {
+        PyObject* item = PyList_GET_ITEM(list, i);
+        if (dim + 1 == t->shape.size()) {
+            item_from_py(t, (*next)++, item);
+            if (PyErr_Occurred()) return false;
+        } else if (!fill_from_list(t, item, dim + 1, next)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static PyObject* tensor_from_list(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"data", "dtype", NULL};
+    PyObject* list_obj;
+    const char* dtype_str = "float64";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|s", (char**)kwlist,
+                                     &list_obj, &dtype_str)) {
+        return NULL;
+    }
+
+    if (!PyList_Check(list_obj)) {
+        PyErr_SetString(PyExc_TypeError, "Expected list");
+        return NULL;
+    }
+
+    DType dtype;
+    if (!parse_dtype(dtype_str, &dtype)) return NULL;
+
+    // Shape from the first element at each depth
+    std::vector<size_t> shape;
+    for (PyObject* level = list_obj; PyList_Check(level);) {
+        shape.push_back(PyList_Size(level));
+        if (PyList_Size(level) == 0) break;
+        level = PyList_GET_ITEM(level, 0);
+    }
+
+    ProfileScope scope({"from_list", {}});
+    Tensor* t = new_tensor(shape, dtype);
+    if (!t) return NULL;
+    scope.output(t);
+
+    size_t next = 0;
+    if (!fill_from_list(t, list_obj, 0, &next)) {
+        delete t;
+        return NULL;
+    }
+
+    return make_pytensor(t);
+}
+
+// Shared body of add/mul: promote both operands to a common dtype, then
+// run `op` elementwise in that type
+template <typename Op>
+static PyObject* elementwise_binary(PyObject* args, const char* name, Op op) {
+    PyObject *a_obj, *b_obj;
+    if (!PyArg_ParseTuple(args, "OO", &a_obj, &b_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    Tensor* b = get_tensor(b_obj);
+    if (!a || !b) return NULL;
+
+    if (!a->same_shape(*b)) {
+        PyErr_SetString(PyExc_ValueError, "Shape mismatch");
+        return NULL;
+    }
+
+    DType dtype = promote(a->dtype, b->dtype);
+    std::unique_ptr<Tensor> a_conv, b_conv;
+    a = operand(a, dtype, a_conv);
+    b = operand(b, dtype, b_conv);
+    if (!a || !b) return NULL;
+
+    Tensor* result = new_tensor(a->shape, dtype);
+    if (!result) return NULL;
+
+    launch({name, {a, b}, (double)a->size()}, [a = *a, b = *b, out = *result, op]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            binary_kernel(a.data<T>(), b.data<T>(), out.data<T>(), a.size(),
+                          [&](T x, T y) { return (T)op(x, y); });
+        });
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+static PyObject* tensor_add(PyObject* self, PyObject* args) {
+    return elementwise_binary(args, "add", [](auto x, auto y) { return x + y; });
+}
+
+static PyObject* tensor_mul(PyObject* self, PyObject* args) {
+    return elementwise_binary(args, "mul", [](auto x, auto y) { return x * y; });
+}
+
+// A 2D view over the memory of a contiguous matrix of the opposite
+// shape, as transpose() makes
+static bool is_transposed_matrix(const Tensor* t) {
+    return t->shape.size() == 2 && t->shape[0] > 1 && t->shape[1] > 1 &&
+           t->strides[0] == 1 && t->strides[1] == (int64_t)t->shape[0];
+}
+
+// matmul(a, b): a [..., m, k] times b [..., k, n]. Leading batch
+// dimensions broadcast as in NumPy; plain 2D operands are a batch of one.
+static PyObject* tensor_matmul(PyObject* self, PyObject* args) {
+    PyObject *a_obj, *b_obj;
+    if (!PyArg_ParseTuple(args, "OO", &a_obj, &b_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    Tensor* b = get_tensor(b_obj);
+    if (!a || !b) return NULL;
+
+    size_t a_ndim = a->shape.size(), b_ndim = b->shape.size();
+    if (a_ndim < 2 || b_ndim < 2) {
+        PyErr_SetString(PyExc_ValueError, "matmul requires tensors with at least 2 dimensions");
+        return NULL;
+    }
+
+    size_t m = a->shape[a_ndim - 2];
+    size_t k = a->shape[a_ndim - 1];
+    size_t n = b->shape[b_ndim - 1];
+
+    if (k != b->shape[b_ndim - 2]) {
+        PyErr_SetString(PyExc_ValueError, "Inner dimensions must match");
+        return NULL;
+    }
+
+    // Broadcast batch dimensions, aligned from the right
+    std::vector<size_t> a_batch(a->shape.begin(), a->shape.end() - 2);
+    std::vector<size_t> b_batch(b->shape.begin(), b->shape.end() - 2);
+    size_t batch_ndim = std::max(a_batch.size(), b_batch.size());
+    a_batch.insert(a_batch.begin(), batch_ndim - a_batch.size(), 1);
+    b_batch.insert(b_batch.begin(), batch_ndim - b_batch.size(), 1);
+    std::vector<size_t> out_shape(batch_ndim);
+    for (size_t d = 0; d < batch_ndim; d++) {
+        if (a_batch[d] != b_batch[d] && a_batch[d] != 1 && b_batch[d] != 1) {
+            PyErr_SetString(PyExc_ValueError, "Batch dimensions cannot be broadcast");
+            return NULL;
+        }
+        out_shape[d] = std::max(a_batch[d], b_batch[d]);
+    }
+
+    DType dtype = promote(a->dtype, b->dtype);
+    if (dtype == DType::Bool) {
+        PyErr_SetString(PyExc_TypeError, "matmul does not support bool tensors");
+        return NULL;
+    }
+
+    // Out of core only for plain 2D products, and only without a
+    // conversion or gather, which would pull the whole operand into
+    // memory anyway
+    bool out_of_core = batch_ndim == 0 && a->storage && b->storage &&
+                       (a->storage->is_mapped() || b->storage->is_mapped()) &&
+                       a->dtype == dtype && b->dtype == dtype &&
+                       a->is_contiguous() && b->is_contiguous() &&
+                       a->nbytes() + b->nbytes() >= g_ooc_threshold.load();
+
+    // A matrix-vector product reads a transposed matrix where it lies:
+    // A^T x is the vector-matrix product x^T A over A's memory, and
+    // x^T B^T is B x, so gathering the transpose would only add a copy
+    bool a_transposed = batch_ndim == 0 && !out_of_core && n == 1 && a->dtype == dtype &&
+                        is_transposed_matrix(a);
+    bool b_transposed = batch_ndim == 0 && !out_of_core && m == 1 && b->dtype == dtype &&
+                        is_transposed_matrix(b);
+
+    std::unique_ptr<Tensor> a_conv, b_conv;
+    if (!a_transposed) a = operand(a, dtype, a_conv);
+    if (!b_transposed) b = operand(b, dtype, b_conv);
+    if (!a || !b) return NULL;
+
+    // Matrix index into each operand for every output matrix
+    size_t batch = 1;
+    for (size_t dim : out_shape) batch *= dim;
+    std::vector<size_t> a_index(batch), b_index(batch);
+    for (size_t i = 0; i < batch; i++) {
+        size_t rest = i, ai = 0, bi = 0, a_stride = 1, b_stride = 1;
+        for (size_t d = batch_ndim; d-- > 0;) {
+            size_t pos = rest % out_shape[d];
+            rest /= out_shape[d];
+            if (a_batch[d] != 1) ai += pos * a_stride;
+            if (b_batch[d] != 1) bi += pos * b_stride;
+            a_stride *= a_batch[d];
+            b_stride *= b_batch[d];
+        }
+        a_index[i] = ai;
+        b_index[i] = bi;
+    }
+
+    out_shape.push_back(m);
+    out_shape.push_back(n);
+    Tensor* result = new_tensor(out_shape, dtype);
+    if (!result) return NULL;
+
+    launch({"matmul", {a, b}, 2.0 * batch * m * k * n},
+           [a = *a, b = *b, out = *result, a_index = std::move(a_index),
+            b_index = std::move(b_index), out_of_core, a_transposed, b_transposed,
+            batch, m, k, n]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if constexpr (!std::is_same<T, bool>::value) {
+                if (a_transposed) {
+                    gemv_cols(a.data<T>(), m, b.data<T>(), out.data<T>(), k, m);
+                } else if (b_transposed) {
+                    gemv_rows(b.data<T>(), k, a.data<T>(), out.data<T>(), n, k);
+                } else if (out_of_core) {
+                    gemm_out_of_core(a.data<T>(), b.data<T>(), out.data<T>(), m, k, n,
+                                     a.storage->is_mapped(), b.storage->is_mapped(),
+                                     !a.storage->writable);
+                } else {
+                    gemm_batched(a.data<T>(), a_index.data(), b.data<T>(), b_index.data(),
+                                 out.data<T>(), batch, m, k, n);
+                }
+            }
+        });
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+// transpose(t, axes=None): view with reversed (or the given) axis order
+static PyObject* tensor_transpose(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"t", "axes", NULL};
+    PyObject* t_obj;
+    PyObject* axes_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", (char**)kwlist, &t_obj, &axes_obj)) {
+        return NULL;
+    }
+
+    Tensor* t = get_tensor(t_obj);
+    if (!t) return NULL;
+
+    size_t ndim = t->shape.size();
+    std::vector<size_t> perm(ndim);
+    if (axes_obj == Py_None) {
+        for (size_t d = 0; d < ndim; d++) perm[d] = ndim - 1 - d;
+    } else {
+        if (!PyTuple_Check(axes_obj) || (size_t)PyTuple_Size(axes_obj) != ndim) {
+            PyErr_SetString(PyExc_ValueError, "axes must be a tuple with one entry per dimension");
+            return NULL;
+        }
+        std::vector<bool> seen(ndim, false);
+        for (size_t d = 0; d < ndim; d++) {
+            long axis = PyLong_AsLong(PyTuple_GetItem(axes_obj, d));
+            if (axis == -1 && PyErr_Occurred()) return NULL;
+            if (axis < 0) axis += (long)ndim;
+            if (axis < 0 || axis >= (long)ndim || seen[axis]) {
+                PyErr_SetString(PyExc_ValueError, "axes must be a permutation of the dimensions");
+                return NULL;
+            }
+            seen[axis] = true;
+            perm[d] = (size_t)axis;
+        }
+    }
+
+    return make_pytensor(permuted_view(t, perm));
+}
+
+// An int, or a tuple of two, for a (height, width) parameter
+static bool parse_pair(PyObject* obj, const char* name, bool allow_zero, size_t* h, size_t* w) {
+    long values[2];
+    if (PyLong_Check(obj)) {
+        values[0] = values[1] = PyLong_AsLong(obj);
+    } else if (PyTuple_Check(obj) && PyTuple_Size(obj) == 2) {
+        values[0] = PyLong_AsLong(PyTuple_GetItem(obj, 0));
+        values[1] = PyLong_AsLong(PyTuple_GetItem(obj, 1));
+    } else {
+        PyErr_Format(PyExc_TypeError, "%s must be an int or a tuple of two ints", name);
+        return false;
+    }
+    if (PyErr_Occurred()) return false;
+    if (values[0] < (allow_zero ? 0 : 1) || values[1] < (allow_zero ? 0 : 1)) {
+        PyErr_Format(PyExc_ValueError, "%s must be %s", name,
+                     allow_zero ? "non-negative" : "positive");
+        return false;
+    }
+    *h = (size_t)values[0];
+    *w = (size_t)values[1];
+    return true;
+}
+
+// conv2d(x, w, bias=None, stride=1, padding=0, dilation=1, method="auto"):
+// x [N, C, H, W] with filters w [K, C, R, S] gives [N, K, OH, OW].
+// method picks "direct" (3x3 and 1x1 filters only) or "im2col".
+static PyObject* tensor_conv2d(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"x", "w", "bias", "stride", "padding", "dilation", "method",
+                                   NULL};
+    PyObject *x_obj, *w_obj;
+    PyObject* bias_obj = Py_None;
+    PyObject* stride_obj = NULL;
+    PyObject* padding_obj = NULL;
+    PyObject* dilation_obj = NULL;
+    const char* method = "auto";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OOOOs", (char**)kwlist, &x_obj, &w_obj,
+                                     &bias_obj, &stride_obj, &padding_obj, &dilation_obj,
+                                     &method)) {
+        return NULL;
+    }
+
+    Tensor* x = get_tensor(x_obj);
+    Tensor* w = get_tensor(w_obj);
+    if (!x || !w) return NULL;
+    Tensor* bias = NULL;
+    if (bias_obj != Py_None) {
+        bias = get_tensor(bias_obj);
+        if (!bias) return NULL;
+    }
+
+    ConvShape g = {};
+    g.sh = g.sw = g.dh = g.dw = 1;
+    if ((stride_obj && !parse_pair(stride_obj, "stride", false, &g.sh, &g.sw)) ||
+        (padding_obj && !parse_pair(padding_obj, "padding", true, &g.ph, &g.pw)) ||
+        (dilation_obj && !parse_pair(dilation_obj, "dilation", false, &g.dh, &g.dw))) {
+        return NULL;
+    }
+
+    if (x->shape.size() != 4 || w->shape.size() != 4) {
+        PyErr_SetString(PyExc_ValueError, "conv2d requires x [N, C, H, W] and w [K, C, R, S]");
+        return NULL;
+    }
+    g.N = x->shape[0]; g.C = x->shape[1]; g.H = x->shape[2]; g.W = x->shape[3];
+    g.K = w->shape[0]; g.R = w->shape[2]; g.S = w->shape[3];
+    if (w->shape[1] != g.C) {
+        PyErr_SetString(PyExc_ValueError, "Filter channels must match input channels");
+        return NULL;
+    }
+    if (bias && (bias->shape.size() != 1 || bias->shape[0] != g.K)) {
+        PyErr_SetString(PyExc_ValueError, "bias must be 1D with one entry per filter");
+        return NULL;
+    }
+    g.HP = g.H + 2 * g.ph;
+    g.WP = g.W + 2 * g.pw;
+    size_t span_h = g.dh * (g.R - 1) + 1, span_w = g.dw * (g.S - 1) + 1;
+    if (g.R == 0 || g.S == 0 || span_h > g.HP || span_w > g.WP) {
+        PyErr_SetString(PyExc_ValueError, "Filter is larger than the padded input");
+        return NULL;
+    }
+    g.OH = (g.HP - span_h) / g.sh + 1;
+    g.OW = (g.WP - span_w) / g.sw + 1;
+
+    bool automatic = strcmp(method, "auto") == 0;
+    bool direct = strcmp(method, "direct") == 0;
+    if (!automatic && !direct && strcmp(method, "im2col") != 0) {
+        PyErr_Format(PyExc_ValueError, "Unknown conv2d method '%s'", method);
+        return NULL;
+    }
+    if (direct && !conv_has_direct(g)) {
+        PyErr_SetString(PyExc_ValueError, "The direct method supports 3x3 and 1x1 filters only");
+        return NULL;
+    }
+
+    DType dtype = promote(x->dtype, w->dtype);
+    if (bias) dtype = promote(dtype, bias->dtype);
+    if (dtype == DType::Bool) {
+        PyErr_SetString(PyExc_TypeError, "conv2d does not support bool tensors");
+        return NULL;
+    }
+    if (automatic) {
+        dispatch(dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if constexpr (!std::is_same<T, bool>::value) {
+                direct = conv_use_direct(g, Simd<T>::width);
+            }
+        });
+    }
+
+    std::unique_ptr<Tensor> x_conv, w_conv, bias_conv;
+    x = operand(x, dtype, x_conv);
+    w = operand(w, dtype, w_conv);
+    if (!x || !w) return NULL;
+    if (bias) {
+        bias = operand(bias, dtype, bias_conv);
+        if (!bias) return NULL;
+    }
+
+    size_t tasks = direct ? 1 : conv_im2col_tasks(g);
+    size_t work_bytes = conv_workspace(g, direct, tasks) * dtype_size(dtype);
+    auto work = std::make_shared<Storage>(work_bytes);
+    if (work_bytes && !work->ptr) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    Tensor* result = new_tensor({g.N, g.K, g.OH, g.OW}, dtype);
+    if (!result) return NULL;
+
+    std::vector<const Tensor*> inputs = {x, w};
+    if (bias) inputs.push_back(bias);
+    double flops = 2.0 * g.N * g.K * g.OH * g.OW * g.C * g.R * g.S;
+    launch({"conv2d", inputs, flops},
+           [x = *x, w = *w, bias = bias ? *bias : Tensor(), has_bias = bias != NULL,
+            out = *result, work, g, direct, tasks]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if constexpr (!std::is_same<T, bool>::value) {
+                conv2d(x.data<T>(), w.data<T>(), has_bias ? bias.data<T>() : (const T*)NULL,
+                       out.data<T>(), g, direct, tasks, (T*)work->ptr);
+            }
+        });
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+// ---- Sparse ----
+
+// A 1D operand given as a Tensor or a Python list, as contiguous `dtype`
+static Tensor* vector_operand(PyObject* obj, DType dtype, std::unique_ptr<Tensor>& holder) {
+    if (PyList_Check(obj)) {
+        Py_ssize_t n = PyList_Size(obj);
+        holder.reset(new_tensor({(size_t)n}, dtype));
+        if (!holder) return nullptr;
+        for (Py_ssize_t i = 0; i < n; i++) {
+            item_from_py(holder.get(), i, PyList_GetItem(obj, i));
+        }
+        return PyErr_Occurred() ? nullptr : holder.get();
+    }
+    Tensor* t = get_tensor(obj);
+    if (!t) return nullptr;
+    if (t->shape.size() != 1) {
+        PyErr_SetString(PyExc_ValueError, "expected a 1D tensor");
+        return nullptr;
+    }
+    return operand(t, dtype, holder);
+}
+
+static bool check_sparse_dtype(DType dtype) {
+    if (dtype == DType::Bool) {
+        PyErr_SetString(PyExc_TypeError, "sparse tensors do not support bool values");
+        return false;
+    }
+    return true;
+}
+
+// CSR from COO triplets in any order. Entries are bucketed by row
+// (stably), ordered by column within each row, and duplicates are summed
+// in input order, so the result is deterministic.
+template <typename T>
+static bool coo_to_csr(const int64_t* row, const int64_t* col, const T* val, size_t count,
+                       SparseTensor* s, DType dtype) {
+    size_t rows = s->rows;
+    std::vector<int64_t> start(rows + 1, 0);
+    for (size_t i = 0; i < count; i++) start[row[i] + 1]++;
+    for (size_t r = 0; r < rows; r++) start[r + 1] += start[r];
+
+    std::vector<size_t> order(count);
+    std::vector<int64_t> next(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < count; i++) order[next[row[i]]++] = i;
+
+    // Sort each row by column and count distinct columns
+    std::vector<int64_t> unique(rows + 1, 0);
+    parallel_for(rows, 4096, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            size_t* first = order.data() + start[r];
+            size_t* last = order.data() + start[r + 1];
+            std::stable_sort(first, last, [&](size_t a, size_t b) { return col[a] < col[b]; });
+            int64_t distinct = 0;
+            for (size_t* p = first; p < last; p++) {
+                if (p == first || col[*p] != col[*(p - 1)]) distinct++;
+            }
+            unique[r + 1] = distinct;
+        }
+    });
+    for (size_t r = 0; r < rows; r++) unique[r + 1] += unique[r];
+
+    if (!s->allocate(rows, s->cols, (size_t)unique[rows], dtype)) return false;
+    int64_t* indptr = s->indptr.data<int64_t>();
+    int32_t* indices = s->indices.data<int32_t>();
+    T* values = s->values.data<T>();
+    std::copy(unique.begin(), unique.end(), indptr);
+
+    parallel_for(rows, 4096, [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            int64_t out = indptr[r] - 1;
+            for (int64_t p = start[r]; p < start[r + 1]; p++) {
+                size_t i = order[p];
+                if (p == start[r] || col[i] != col[order[p - 1]]) {
+                    out++;
+                    indices[out] = (int32_t)col[i];
+                    values[out] = val[i];
+                } else {
+                    values[out] += val[i];
+                }
+            }
+        }
+    });
+    return true;
+}
+
+// sparse_coo(row, col, values, shape, dtype='float64')
+static PyObject* tensor_sparse_coo(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"row", "col", "values", "shape", "dtype", NULL};
+    PyObject *row_obj, *col_obj, *val_obj;
+    Py_ssize_t rows, cols;
+    const char* dtype_str = "float64";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO(nn)|s", (char**)kwlist, &row_obj,
+                                     &col_obj, &val_obj, &rows, &cols, &dtype_str)) {
+        return NULL;
+    }
+
+    DType dtype;
+    if (!parse_dtype(dtype_str, &dtype) || !check_sparse_dtype(dtype)) return NULL;
+    if (rows < 0 || cols < 0 || cols > std::numeric_limits<int32_t>::max()) {
+        PyErr_SetString(PyExc_ValueError, "invalid sparse shape (columns are limited to 2^31 - 1)");
+        return NULL;
+    }
+
+    std::unique_ptr<Tensor> row_holder, col_holder, val_holder;
+    Tensor* row = vector_operand(row_obj, DType::Int64, row_holder);
+    if (!row) return NULL;
+    Tensor* col = vector_operand(col_obj, DType::Int64, col_holder);
+    if (!col) return NULL;
+    Tensor* val = vector_operand(val_obj, dtype, val_holder);
+    if (!val) return NULL;
+    if (!wait_ready(row) || !wait_ready(col) || !wait_ready(val)) return NULL;
+
+    size_t count = val->size();
+    if (row->size() != count || col->size() != count) {
+        PyErr_SetString(PyExc_ValueError, "row, col and values must have the same length");
+        return NULL;
+    }
+    const int64_t* r = row->data<int64_t>();
+    const int64_t* c = col->data<int64_t>();
+    for (size_t i = 0; i < count; i++) {
+        if (r[i] < 0 || r[i] >= rows || c[i] < 0 || c[i] >= cols) {
+            PyErr_Format(PyExc_IndexError, "entry %zu at (%lld, %lld) is out of bounds",
+                         i, (long long)r[i], (long long)c[i]);
+            return NULL;
+        }
+    }
+
+    SparseTensor* s = new SparseTensor();
+    s->rows = rows;
+    s->cols = cols;
+    bool ok = true;
+    dispatch(dtype, [&](auto tag) {
+        using T = decltype(tag);
+        ok = coo_to_csr(r, c, val->data<T>(), count, s, dtype);
+    });
+    if (!ok) {
+        delete s;
+        return PyErr_NoMemory();
+    }
+    return make_pysparse(s);
+}
+
+// to_sparse(t): CSR holding the nonzeros of a 2D tensor
+static PyObject* tensor_to_sparse(PyObject* self, PyObject* args) {
+    PyObject* t_obj;
+    if (!PyArg_ParseTuple(args, "O", &t_obj)) {
+        return NULL;
+    }
+
+    Tensor* t = get_tensor(t_obj);
+    if (!t) return NULL;
+    if (t->shape.size() != 2) {
+        PyErr_SetString(PyExc_ValueError, "to_sparse requires a 2D tensor");
+        return NULL;
+    }
+    if (!check_sparse_dtype(t->dtype)) return NULL;
+    if (t->shape[1] > (size_t)std::numeric_limits<int32_t>::max()) {
+        PyErr_SetString(PyExc_ValueError, "sparse columns are limited to 2^31 - 1");
+        return NULL;
+    }
+
+    ProfileScope scope({"to_sparse", {t}});
+    std::unique_ptr<Tensor> gathered;
+    t = operand(t, t->dtype, gathered);
+    if (!t || !wait_ready(t)) return NULL;
+
+    size_t rows = t->shape[0], cols = t->shape[1];
+    SparseTensor* s = new SparseTensor();
+    bool ok = true;
+    dispatch(t->dtype, [&](auto tag) {
+        using T = decltype(tag);
+        const T* a = t->data<T>();
+
+        // Count, prefix-sum, then fill; both passes split over rows
+        std::vector<int64_t> counts(rows + 1, 0);
+        parallel_for(rows, 256, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++) {
+                int64_t n = 0;
+                for (size_t j = 0; j < cols; j++) n += a[r * cols + j] != (T)0;
+                counts[r + 1] = n;
+            }
+        });
+        for (size_t r = 0; r < rows; r++) counts[r + 1] += counts[r];
+
+        if (!s->allocate(rows, cols, (size_t)counts[rows], t->dtype)) {
+            ok = false;
+            return;
+        }
+        int64_t* indptr = s->indptr.data<int64_t>();
+        int32_t* indices = s->indices.data<int32_t>();
+        T* values = s->values.data<T>();
+        std::copy(counts.begin(), counts.end(), indptr);
+        parallel_for(rows, 256, [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++) {
+                int64_t out = indptr[r];
+                for (size_t j = 0; j < cols; j++) {
+                    T v = a[r * cols + j];
+                    if (v != (T)0) {
+                        indices[out] = (int32_t)j;
+                        values[out++] = v;
+                    }
+                }
+            }
+        });
+    });
+    if (!ok) {
+        delete s;
+        return PyErr_NoMemory();
+    }
+    return make_pysparse(s);
+}
+
+// Shared body of spmv/spmm: y = A x for 1D x, C = A B for 2D B
+static PyObject* sparse_times_dense(PyObject* args, size_t ndim) {
+    PyObject *a_obj, *x_obj;
+    if (!PyArg_ParseTuple(args, "OO", &a_obj, &x_obj)) {
+        return NULL;
+    }
+
+    SparseTensor* a = get_sparse(a_obj);
+    if (!a) return NULL;
+    Tensor* x = get_tensor(x_obj);
+    if (!x) return NULL;
+
+    if (x->shape.size() != ndim || x->shape[0] != a->cols) {
+        PyErr_SetString(PyExc_ValueError, ndim == 1
+            ? "spmv requires a 1D tensor with one entry per column"
+            : "spmm requires a 2D tensor with one row per column");
+        return NULL;
+    }
+
+    DType dtype = promote(a->dtype(), x->dtype);
+    std::unique_ptr<Tensor> values_conv, x_conv;
+    Tensor* values = operand(&a->values, dtype, values_conv);
+    x = operand(x, dtype, x_conv);
+    if (!values || !x) return NULL;
+
+    size_t n = ndim == 1 ? 1 : x->shape[1];
+    Tensor* result = ndim == 1 ? new_tensor({a->rows}, dtype) : new_tensor({a->rows, n}, dtype);
+    if (!result) return NULL;
+
+    launch({ndim == 1 ? "spmv" : "spmm", {&a->indptr, &a->indices, values, x}, 2.0 * a->nnz() * n},
+           [indptr = a->indptr, indices = a->indices, values = *values, rows = a->rows,
+            x = *x, out = *result, ndim, n]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if (ndim == 1) {
+                spmv_kernel(indptr.data<int64_t>(), indices.data<int32_t>(),
+                            values.data<T>(), rows, x.data<T>(), out.data<T>());
+            } else {
+                spmm_kernel(indptr.data<int64_t>(), indices.data<int32_t>(),
+                            values.data<T>(), rows, x.data<T>(), n, out.data<T>());
+            }
+        });
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+static PyObject* tensor_spmv(PyObject* self, PyObject* args) {
+    return sparse_times_dense(args, 1);
+}
+
+static PyObject* tensor_spmm(PyObject* self, PyObject* args) {
+    return sparse_times_dense(args, 2);
+}
+
+// ---- Graph capture ----
+
+// capture(fn, *inputs): calls fn once on stand-ins for `inputs` and
+// returns the Graph of the ops it ran
+static PyObject* tensor_capture(PyObject* self, PyObject* args) {
+    Py_ssize_t nargs = PyTuple_Size(args);
+    if (nargs < 1 || !PyCallable_Check(PyTuple_GET_ITEM(args, 0))) {
+        PyErr_SetString(PyExc_TypeError, "capture(fn, *inputs) requires a callable");
+        return NULL;
+    }
+    if (g_capture) {
+        PyErr_SetString(PyExc_RuntimeError, "capture() cannot be nested");
+        return NULL;
+    }
+
+    // Each input becomes a placeholder: a tensor with its own storage,
+    // borrowing the example's memory for now, that replay can repoint
+    auto graph = std::make_shared<Graph>();
+    PyObject* placeholders = PyTuple_New(nargs - 1);
+    if (!placeholders) return NULL;
+    for (Py_ssize_t i = 1; i < nargs; i++) {
+        Tensor* t = get_tensor(PyTuple_GET_ITEM(args, i));
+        if (!t) {
+            Py_DECREF(placeholders);
+            return NULL;
+        }
+        Tensor* p = new Tensor(*t);
+        p->offset = 0;
+        p->storage = std::make_shared<Storage>();
+        if (t->storage) p->storage->borrow(t->storage, t->offset * t->itemsize());
+        graph->inputs.push_back(*p);
+        PyObject* obj = make_pytensor(p);
+        if (!obj) {
+            Py_DECREF(placeholders);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(placeholders, i - 1, obj);
+    }
+    graph->input_written.assign(graph->inputs.size(), false);
+
+    g_capture = graph.get();
+    PyObject* result = PyObject_CallObject(PyTuple_GET_ITEM(args, 0), placeholders);
+    g_capture = nullptr;
+    Py_DECREF(placeholders);
+
+    // Buffers are about to move; nothing may still be running on them
+    Py_BEGIN_ALLOW_THREADS
+    stream_drain();
+    Py_END_ALLOW_THREADS
+    if (!raise_deferred()) Py_CLEAR(result);
+    if (!result) return NULL;
+
+    if (graph->host_read) {
+        Py_DECREF(result);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "captured function read tensor data on the host (tolist, repr, save, "
+                        "a scalar reduction, ...), which replay cannot repeat");
+        return NULL;
+    }
+    if (PyObject_TypeCheck(result, &PyTensorType)) {
+        graph->outputs.push_back(((PyTensor*)result)->tensor);
+    } else if (PyTuple_Check(result)) {
+        for (Py_ssize_t i = 0; i < PyTuple_Size(result); i++) {
+            PyObject* item = PyTuple_GET_ITEM(result, i);
+            if (!PyObject_TypeCheck(item, &PyTensorType)) {
+                graph->outputs.clear();
+                break;
+            }
+            graph->outputs.push_back(((PyTensor*)item)->tensor);
+        }
+    }
+    if (graph->outputs.empty()) {
+        Py_DECREF(result);
+        PyErr_SetString(PyExc_TypeError,
+                        "captured function must return a Tensor or a tuple of Tensors");
+        return NULL;
+    }
+
+    if (!graph->plan()) {
+        Py_DECREF(result);
+        return PyErr_NoMemory();
+    }
+
+    PyGraph* obj = PyObject_New(PyGraph, &PyGraphType);
+    if (!obj) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    obj->graph = new std::shared_ptr<Graph>(std::move(graph));
+    obj->result = result;
+    return (PyObject*)obj;
+}
+
+// ---- Elementwise math ----
+
+static const char* unary_name(UnaryOp op) {
+    switch (op) {
+        case UnaryOp::Exp: return "exp";
+        case UnaryOp::Log: return "log";
+        case UnaryOp::Tanh: return "tanh";
+        case UnaryOp::Sigmoid: return "sigmoid";
+        case UnaryOp::Relu: return "relu";
+        case UnaryOp::Gelu: return "gelu";
+    }
+    return "";
+}
+
+// Checks that `out` can receive a result of `shape` and `dtype`, and
+// gives it memory of its own if it is a copy-on-write copy
+static bool check_out(Tensor* out, const std::vector<size_t>& shape, DType dtype) {
+    if (out->shape != shape) {
+        PyErr_SetString(PyExc_ValueError, "out has the wrong shape");
+        return false;
+    }
+    if (out->dtype != dtype) {
+        PyErr_Format(PyExc_TypeError, "out must have dtype %s", dtype_name(dtype));
+        return false;
+    }
+    if (!out->is_contiguous()) {
+        PyErr_SetString(PyExc_ValueError, "out must be contiguous");
+        return false;
+    }
+    if (out->storage && !out->storage->writable) {
+        PyErr_SetString(PyExc_ValueError, "out is read-only");
+        return false;
+    }
+    return make_private(out);
+}
+
+// Applies `op` to `a` into `out` (allocated when null). Integer inputs
+// produce float64, except for relu, which keeps the input dtype.
+static Tensor* unary_into(Tensor* a, Tensor* out, UnaryOp op) {
+    if (a->dtype == DType::Bool) {
+        PyErr_Format(PyExc_TypeError, "%s does not support bool tensors", unary_name(op));
+        return nullptr;
+    }
+    DType dtype = op == UnaryOp::Relu || is_floating(a->dtype) ? a->dtype : DType::Float64;
+    if (out && !check_out(out, a->shape, dtype)) return nullptr;
+
+    std::unique_ptr<Tensor> a_conv;
+    a = operand(a, dtype, a_conv);
+    if (!a) return nullptr;
+
+    std::unique_ptr<Tensor> result;
+    if (!out) {
+        result.reset(new_tensor(a->shape, dtype));
+        if (!result) return nullptr;
+        out = result.get();
+    }
+
+    launch({unary_name(op), {a}, (double)a->size()}, [a = *a, out = *out, op]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if constexpr (!std::is_same<T, bool>::value) {
+                apply_unary(op, a.data<T>(), out.data<T>(), a.size());
+            }
+        });
+    }, {out});
+
+    return result ? result.release() : out;
+}
+
+// exp(a, out=None) and friends. `out` may be `a` itself.
+static PyObject* unary_impl(PyObject* args, PyObject* kwargs, UnaryOp op) {
+    static const char* kwlist[] = {"a", "out", NULL};
+    PyObject* a_obj;
+    PyObject* out_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", (char**)kwlist, &a_obj, &out_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    if (!a) return NULL;
+    Tensor* out = nullptr;
+    if (out_obj != Py_None) {
+        out = get_tensor(out_obj);
+        if (!out) return NULL;
+    }
+
+    Tensor* result = unary_into(a, out, op);
+    if (!result) return NULL;
+    if (out) {
+        Py_INCREF(out_obj);
+        return out_obj;
+    }
+    return make_pytensor(result);
+}
+
+// exp_(a) and friends: in place, returning `a`
+static PyObject* unary_inplace_impl(PyObject* args, UnaryOp op) {
+    PyObject* a_obj;
+    if (!PyArg_ParseTuple(args, "O", &a_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    if (!a) return NULL;
+    if (op != UnaryOp::Relu && !is_floating(a->dtype)) {
+        PyErr_Format(PyExc_TypeError, "in-place %s requires a floating tensor", unary_name(op));
+        return NULL;
+    }
+    if (!unary_into(a, a, op)) return NULL;
+
+    Py_INCREF(a_obj);
+    return a_obj;
+}
+
+static PyObject* tensor_exp(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return unary_impl(args, kwargs, UnaryOp::Exp);
+}
+
+static PyObject* tensor_log(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return unary_impl(args, kwargs, UnaryOp::Log);
+}
+
+static PyObject* tensor_tanh(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return unary_impl(args, kwargs, UnaryOp::Tanh);
+}
+
+static PyObject* tensor_sigmoid(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return unary_impl(args, kwargs, UnaryOp::Sigmoid);
+}
+
+static PyObject* tensor_relu(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return unary_impl(args, kwargs, UnaryOp::Relu);
+}
+
+static PyObject* tensor_exp_(PyObject* self, PyObject* args) {
+    return unary_inplace_impl(args, UnaryOp::Exp);
+}
+
+static PyObject* tensor_log_(PyObject* self, PyObject* args) {
+    return unary_inplace_impl(args, UnaryOp::Log);
+}
+
+static PyObject* tensor_tanh_(PyObject* self, PyObject* args) {
+    return unary_inplace_impl(args, UnaryOp::Tanh);
+}
+
+static PyObject* tensor_sigmoid_(PyObject* self, PyObject* args) {
+    return unary_inplace_impl(args, UnaryOp::Sigmoid);
+}
+
+static PyObject* tensor_relu_(PyObject* self, PyObject* args) {
+    return unary_inplace_impl(args, UnaryOp::Relu);
+}
+
+static PyObject* tensor_gelu(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return unary_impl(args, kwargs, UnaryOp::Gelu);
+}
+
+static PyObject* tensor_gelu_(PyObject* self, PyObject* args) {
+    return unary_inplace_impl(args, UnaryOp::Gelu);
+}
+
+// ---- Row-wise softmax and layer norm ----
+
+// Result dtype for the row-wise ops: floating inputs keep theirs,
+// integers produce float64
+static bool row_op_dtype(const Tensor* a, const char* name, DType* dtype) {
+    if (a->dtype == DType::Bool) {
+        PyErr_Format(PyExc_TypeError, "%s does not support bool tensors", name);
+        return false;
+    }
+    *dtype = is_floating(a->dtype) ? a->dtype : DType::Float64;
+    return true;
+}
+
+static size_t last_dim(const Tensor* a) {
+    return a->shape.empty() ? 1 : a->shape.back();
+}
+
+// softmax(a, out=None) / log_softmax(a, out=None) over the last axis.
+// `out` may be `a` itself.
+static PyObject* softmax_impl(PyObject* args, PyObject* kwargs, bool log) {
+    static const char* kwlist[] = {"a", "out", NULL};
+    const char* name = log ? "log_softmax" : "softmax";
+    PyObject* a_obj;
+    PyObject* out_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", (char**)kwlist, &a_obj, &out_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    if (!a) return NULL;
+    Tensor* out = nullptr;
+    if (out_obj != Py_None) {
+        out = get_tensor(out_obj);
+        if (!out) return NULL;
+    }
+    DType dtype;
+    if (!row_op_dtype(a, name, &dtype)) return NULL;
+    if (out && !check_out(out, a->shape, dtype)) return NULL;
+
+    std::unique_ptr<Tensor> a_conv;
+    a = operand(a, dtype, a_conv);
+    if (!a) return NULL;
+
+    Tensor* result = out;
+    if (!out) {
+        result = new_tensor(a->shape, dtype);
+        if (!result) return NULL;
+    }
+
+    size_t cols = last_dim(a), rows = cols ? a->size() / cols : 0;
+    launch({name, {a}, (double)a->size()}, [a = *a, out = *result, rows, cols, log]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if constexpr (std::is_floating_point<T>::value) {
+                softmax_rows(a.data<T>(), out.data<T>(), rows, cols, log);
+            }
+        });
+    }, {result});
+
+    if (out) {
+        Py_INCREF(out_obj);
+        return out_obj;
+    }
+    return make_pytensor(result);
+}
+
+static PyObject* tensor_softmax(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return softmax_impl(args, kwargs, false);
+}
+
+static PyObject* tensor_log_softmax(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return softmax_impl(args, kwargs, true);
+}
+
+// layer_norm(a, weight=None, bias=None, eps=1e-5, out=None): normalizes
+// each row over the last axis, then scales by weight and shifts by bias
+// (1D, one entry per column). `out` may be `a` itself.
+static PyObject* tensor_layer_norm(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"a", "weight", "bias", "eps", "out", NULL};
+    PyObject* a_obj;
+    PyObject* weight_obj = Py_None;
+    PyObject* bias_obj = Py_None;
+    PyObject* out_obj = Py_None;
+    double eps = 1e-5;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOdO", (char**)kwlist, &a_obj,
+                                     &weight_obj, &bias_obj, &eps, &out_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    if (!a) return NULL;
+    Tensor* out = nullptr;
+    if (out_obj != Py_None) {
+        out = get_tensor(out_obj);
+        if (!out) return NULL;
+    }
+    DType dtype;
+    if (!row_op_dtype(a, "layer_norm", &dtype)) return NULL;
+    if (out && !check_out(out, a->shape, dtype)) return NULL;
+    if (eps < 0) {
+        PyErr_SetString(PyExc_ValueError, "eps must be non-negative");
+        return NULL;
+    }
+
+    size_t cols = last_dim(a), rows = cols ? a->size() / cols : 0;
+    Tensor* params[2] = {nullptr, nullptr};
+    std::unique_ptr<Tensor> params_conv[2];
+    PyObject* param_objs[2] = {weight_obj, bias_obj};
+    for (int p = 0; p < 2; p++) {
+        if (param_objs[p] == Py_None) continue;
+        params[p] = get_tensor(param_objs[p]);
+        if (!params[p]) return NULL;
+        if (params[p]->shape != std::vector<size_t>{cols}) {
+            PyErr_Format(PyExc_ValueError, "%s must be 1D with one entry per column",
+                         p == 0 ? "weight" : "bias");
+            return NULL;
+        }
+        params[p] = operand(params[p], dtype, params_conv[p]);
+        if (!params[p]) return NULL;
+    }
+
+    std::unique_ptr<Tensor> a_conv;
+    a = operand(a, dtype, a_conv);
+    if (!a) return NULL;
+
+    Tensor* result = out;
+    if (!out) {
+        result = new_tensor(a->shape, dtype);
+        if (!result) return NULL;
+    }
+
+    std::vector<const Tensor*> inputs = {a};
+    for (Tensor* param : params) {
+        if (param) inputs.push_back(param);
+    }
+    launch({"layer_norm", inputs, (double)a->size()},
+           [a = *a, weight = params[0] ? *params[0] : Tensor(), has_weight = params[0] != nullptr,
+            bias = params[1] ? *params[1] : Tensor(), has_bias = params[1] != nullptr,
+            out = *result, rows, cols, eps]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if constexpr (std::is_floating_point<T>::value) {
+                layer_norm_rows(a.data<T>(), has_weight ? weight.data<T>() : (const T*)NULL,
+                                has_bias ? bias.data<T>() : (const T*)NULL, out.data<T>(),
+                                rows, cols, (T)eps);
+            }
+        });
+    }, {result});
+
+    if (out) {
+        Py_INCREF(out_obj);
+        return out_obj;
+    }
+    return make_pytensor(result);
+}
+
+// ---- Quantization ----
+
+// A quantization parameter given as a Python number (per tensor) or as
+// a list or 1D tensor (per channel)
+static bool read_qparam(PyObject* obj, const char* name, std::vector<double>& values) {
+    values.clear();
+    if (PyFloat_Check(obj) || PyLong_Check(obj)) {
+        double v = PyFloat_AsDouble(obj);
+        if (v == -1.0 && PyErr_Occurred()) return false;
+        values.push_back(v);
+        return true;
+    }
+    if (!PyList_Check(obj) && !PyObject_TypeCheck(obj, &PyTensorType)) {
+        PyErr_Format(PyExc_TypeError, "%s must be a number, a list or a 1D tensor", name);
+        return false;
+    }
+    std::unique_ptr<Tensor> holder;
+    Tensor* t = vector_operand(obj, DType::Float64, holder);
+    if (!t || !wait_ready(t)) return false;
+    values.assign(t->data<double>(), t->data<double>() + t->size());
+    if (values.empty()) {
+        PyErr_Format(PyExc_ValueError, "%s must not be empty", name);
+        return false;
+    }
+    return true;
+}
+
+static bool check_scales(const std::vector<double>& scale, const char* name) {
+    for (double v : scale) {
+        if (!(v > 0) || !std::isfinite(v)) {
+            PyErr_Format(PyExc_ValueError, "%s must be positive and finite", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool to_zero_points(const std::vector<double>& values, const char* name,
+                           std::vector<int32_t>& zero_point) {
+    zero_point.clear();
+    for (double v : values) {
+        if (v != std::floor(v) || v < -128 || v > 127) {
+            PyErr_Format(PyExc_ValueError, "%s must be integers in [-128, 127]", name);
+            return false;
+        }
+        zero_point.push_back((int32_t)v);
+    }
+    return true;
+}
+
+// scale / zero_point / axis arguments of quantize and dequantize, for a
+// tensor of `shape`. More than one value needs an axis, with one value
+// per index along it.
+static bool parse_quant_params(const std::vector<size_t>& shape, PyObject* scale_obj,
+                               PyObject* zero_obj, PyObject* axis_obj, QuantParams* qp) {
+    std::vector<double> zero = {0};
+    if (!read_qparam(scale_obj, "scale", qp->scale) || !check_scales(qp->scale, "scale")) {
+        return false;
+    }
+    if (zero_obj && !read_qparam(zero_obj, "zero_point", zero)) return false;
+    if (!to_zero_points(zero, "zero_point", qp->zero_point)) return false;
+
+    if (axis_obj == Py_None) {
+        if (qp->scale.size() > 1 || qp->zero_point.size() > 1) {
+            PyErr_SetString(PyExc_ValueError, "per-channel scale or zero_point needs an axis");
+            return false;
+        }
+        return true;
+    }
+    long axis = PyLong_AsLong(axis_obj);
+    if (axis == -1 && PyErr_Occurred()) return false;
+    if (axis < 0) axis += (long)shape.size();
+    if (axis < 0 || axis >= (long)shape.size()) {
+        PyErr_SetString(PyExc_ValueError, "axis out of range");
+        return false;
+    }
+    qp->channels = shape[axis];
+    qp->inner = 1;
+    for (size_t d = axis + 1; d < shape.size(); d++) qp->inner *= shape[d];
+    if ((qp->scale.size() != 1 && qp->scale.size() != qp->channels) ||
+        (qp->zero_point.size() != 1 && qp->zero_point.size() != qp->channels)) {
+        PyErr_SetString(PyExc_ValueError, "need one scale and zero_point per channel along axis");
+        return false;
+    }
+    return true;
+}
+
+// quantize(x, scale, zero_point=0, axis=None): int8 tensor of
+// clamp(round(x / scale) + zero_point), per channel along `axis` when
+// scale or zero_point has one entry per index
+static PyObject* tensor_quantize(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"x", "scale", "zero_point", "axis", NULL};
+    PyObject *x_obj, *scale_obj;
+    PyObject* zero_obj = NULL;
+    PyObject* axis_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OO", (char**)kwlist, &x_obj, &scale_obj,
+                                     &zero_obj, &axis_obj)) {
+        return NULL;
+    }
+
+    Tensor* x = get_tensor(x_obj);
+    if (!x) return NULL;
+    if (x->dtype == DType::Bool) {
+        PyErr_SetString(PyExc_TypeError, "quantize does not support bool tensors");
+        return NULL;
+    }
+    QuantParams qp;
+    if (!parse_quant_params(x->shape, scale_obj, zero_obj, axis_obj, &qp)) return NULL;
+
+    std::unique_ptr<Tensor> x_conv;
+    x = operand(x, is_floating(x->dtype) ? x->dtype : DType::Float64, x_conv);
+    if (!x) return NULL;
+    Tensor* result = new_tensor(x->shape, DType::Int8);
+    if (!result) return NULL;
+
+    launch({"quantize", {x}, (double)x->size()}, [x = *x, out = *result, qp]() {
+        dispatch(x.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if constexpr (std::is_floating_point<T>::value) {
+                quantize_kernel(x.data<T>(), out.data<int8_t>(), x.size(), qp);
+            }
+        });
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+// dequantize(q, scale, zero_point=0, axis=None, dtype='float32'):
+// scale * (q - zero_point) for an int8 tensor
+static PyObject* tensor_dequantize(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"q", "scale", "zero_point", "axis", "dtype", NULL};
+    PyObject *q_obj, *scale_obj;
+    PyObject* zero_obj = NULL;
+    PyObject* axis_obj = Py_None;
+    const char* dtype_str = "float32";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OOs", (char**)kwlist, &q_obj, &scale_obj,
+                                     &zero_obj, &axis_obj, &dtype_str)) {
+        return NULL;
+    }
+    DType dtype;
+    if (!parse_dtype(dtype_str, &dtype)) return NULL;
+
+    Tensor* q = get_tensor(q_obj);
+    if (!q) return NULL;
+    if (q->dtype != DType::Int8) {
+        PyErr_SetString(PyExc_TypeError, "dequantize requires an int8 tensor");
+        return NULL;
+    }
+    if (!is_floating(dtype)) {
+        PyErr_SetString(PyExc_TypeError, "dequantize produces float32 or float64");
+        return NULL;
+    }
+    QuantParams qp;
+    if (!parse_quant_params(q->shape, scale_obj, zero_obj, axis_obj, &qp)) return NULL;
+
+    std::unique_ptr<Tensor> q_conv;
+    q = operand(q, DType::Int8, q_conv);
+    if (!q) return NULL;
+    Tensor* result = new_tensor(q->shape, dtype);
+    if (!result) return NULL;
+
+    launch({"dequantize", {q}, (double)q->size()}, [q = *q, out = *result, qp]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            if constexpr (std::is_floating_point<T>::value) {
+                dequantize_kernel(q.data<int8_t>(), out.data<T>(), q.size(), qp);
+            }
+        });
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+// qparams(x, axis=None, symmetric=True) -> (scale, zero_point) covering
+// the range of x (and 0), per channel along `axis` as lists. Symmetric
+// maps +-max|x| to +-127 with zero point 0, which is what qmatmul's
+// weights usually want; otherwise [min, max] maps to [-128, 127].
+static PyObject* tensor_qparams(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"x", "axis", "symmetric", NULL};
+    PyObject* x_obj;
+    PyObject* axis_obj = Py_None;
+    int symmetric = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Op", (char**)kwlist, &x_obj, &axis_obj,
+                                     &symmetric)) {
+        return NULL;
+    }
+
+    Tensor* x = get_tensor(x_obj);
+    if (!x) return NULL;
+    if (x->dtype == DType::Bool) {
+        PyErr_SetString(PyExc_TypeError, "qparams does not support bool tensors");
+        return NULL;
+    }
+    QuantParams qp;
+    PyObject* one = PyFloat_FromDouble(1.0);
+    if (!one) return NULL;
+    bool ok = parse_quant_params(x->shape, one, NULL, axis_obj, &qp);
+    Py_DECREF(one);
+    if (!ok) return NULL;
+
+    ProfileScope scope({"qparams", {x}});
+    std::unique_ptr<Tensor> x_conv;
+    x = operand(x, DType::Float64, x_conv);
+    if (!x || !wait_ready(x)) return NULL;
+
+    std::vector<double> lo(qp.channels, 0.0), hi(qp.channels, 0.0);
+    const double* data = x->data<double>();
+    bool finite = true;
+    for_each_channel_run(x->size(), qp, [&](size_t begin, size_t end, size_t c) {
+        for (size_t i = begin; i < end; i++) {
+            finite &= std::isfinite(data[i]);
+            lo[c] = std::min(lo[c], data[i]);
+            hi[c] = std::max(hi[c], data[i]);
+        }
+    });
+    if (!finite) {
+        PyErr_SetString(PyExc_ValueError, "qparams requires finite values");
+        return NULL;
+    }
+
+    PyObject* scales = PyList_New(qp.channels);
+    PyObject* zeros = PyList_New(qp.channels);
+    if (!scales || !zeros) {
+        Py_XDECREF(scales);
+        Py_XDECREF(zeros);
+        return NULL;
+    }
+    for (size_t c = 0; c < qp.channels; c++) {
+        double scale;
+        long zero = 0;
+        if (symmetric) {
+            scale = std::max(-lo[c], hi[c]) / 127;
+        } else {
+            scale = (hi[c] - lo[c]) / 255;
+            if (scale > 0) zero = (long)std::min(127.0, std::max(-128.0, std::nearbyint(-128 - lo[c] / scale)));
+        }
+        if (scale == 0) scale = 1;
+        PyList_SET_ITEM(scales, c, PyFloat_FromDouble(scale));
+        PyList_SET_ITEM(zeros, c, PyLong_FromLong(zero));
+    }
+    if (axis_obj != Py_None) return Py_BuildValue("(NN)", scales, zeros);
+
+    PyObject* result = Py_BuildValue("(OO)", PyList_GET_ITEM(scales, 0), PyList_GET_ITEM(zeros, 0));
+    Py_DECREF(scales);
+    Py_DECREF(zeros);
+    return result;
+}
+
+// qmatmul(a, b, a_scale=None, b_scale=None, a_zero_point=0,
+//         b_zero_point=0, bias=None, out_scale=None, out_zero_point=0):
+// int8 a [..., k] times int8 b [k, n]. b's scale and zero point may be
+// per column. Without scales the result is the int32 accumulator; with
+// them float32 a_scale * b_scale * acc + bias; with out_scale as well,
+// that requantized to int8.
+static PyObject* tensor_qmatmul(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"a", "b", "a_scale", "b_scale", "a_zero_point",
+                                   "b_zero_point", "bias", "out_scale", "out_zero_point", NULL};
+    PyObject *a_obj, *b_obj;
+    PyObject* a_scale_obj = Py_None;
+    PyObject* b_scale_obj = Py_None;
+    PyObject* a_zero_obj = NULL;
+    PyObject* b_zero_obj = NULL;
+    PyObject* bias_obj = Py_None;
+    PyObject* out_scale_obj = Py_None;
+    PyObject* out_zero_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OOOOOOO", (char**)kwlist, &a_obj, &b_obj,
+                                     &a_scale_obj, &b_scale_obj, &a_zero_obj, &b_zero_obj,
+                                     &bias_obj, &out_scale_obj, &out_zero_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    Tensor* b = get_tensor(b_obj);
+    if (!a || !b) return NULL;
+    if (a->dtype != DType::Int8 || b->dtype != DType::Int8) {
+        PyErr_SetString(PyExc_TypeError, "qmatmul requires int8 tensors (see quantize)");
+        return NULL;
+    }
+    if (a->shape.empty() || b->shape.size() != 2 || a->shape.back() != b->shape[0]) {
+        PyErr_SetString(PyExc_ValueError, "qmatmul requires a [..., k] and b [k, n]");
+        return NULL;
+    }
+    size_t k = b->shape[0], n = b->shape[1];
+    size_t m = 1;
+    for (size_t d = 0; d + 1 < a->shape.size(); d++) m *= a->shape[d];
+    if (k > kQGemmMaxK) {
+        PyErr_Format(PyExc_ValueError, "qmatmul supports k up to %zu", kQGemmMaxK);
+        return NULL;
+    }
+
+    QEpilogue e;
+    std::vector<double> values;
+    if (a_zero_obj) {
+        std::vector<int32_t> zero;
+        if (!read_qparam(a_zero_obj, "a_zero_point", values) ||
+            !to_zero_points(values, "a_zero_point", zero)) {
+            return NULL;
+        }
+        if (zero.size() != 1) {
+            PyErr_SetString(PyExc_ValueError, "a_zero_point must be a single value");
+            return NULL;
+        }
+        e.a_zero = zero[0];
+    }
+    e.b_zero.assign(n, 0);
+    if (b_zero_obj) {
+        std::vector<int32_t> zero;
+        if (!read_qparam(b_zero_obj, "b_zero_point", values) ||
+            !to_zero_points(values, "b_zero_point", zero)) {
+            return NULL;
+        }
+        if (zero.size() != 1 && zero.size() != n) {
+            PyErr_SetString(PyExc_ValueError, "b_zero_point needs one value or one per column");
+            return NULL;
+        }
+        for (size_t j = 0; j < n; j++) e.b_zero[j] = zero[zero.size() > 1 ? j : 0];
+    }
+
+    if ((a_scale_obj == Py_None) != (b_scale_obj == Py_None)) {
+        PyErr_SetString(PyExc_ValueError, "a_scale and b_scale go together");
+        return NULL;
+    }
+    bool scaled = a_scale_obj != Py_None;
+    if (!scaled && (bias_obj != Py_None || out_scale_obj != Py_None)) {
+        PyErr_SetString(PyExc_ValueError, "bias and out_scale need a_scale and b_scale");
+        return NULL;
+    }
+    DType out_dtype = DType::Int32;
+    if (scaled) {
+        std::vector<double> a_scale, b_scale;
+        if (!read_qparam(a_scale_obj, "a_scale", a_scale) || !check_scales(a_scale, "a_scale") ||
+            !read_qparam(b_scale_obj, "b_scale", b_scale) || !check_scales(b_scale, "b_scale")) {
+            return NULL;
+        }
+        if (a_scale.size() != 1 || (b_scale.size() != 1 && b_scale.size() != n)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "a_scale must be a single value, b_scale one value or one per column");
+            return NULL;
+        }
+        e.scale.resize(n);
+        for (size_t j = 0; j < n; j++) e.scale[j] = (float)(a_scale[0] * b_scale[b_scale.size() > 1 ? j : 0]);
+        e.output = QOutput::Float32;
+        out_dtype = DType::Float32;
+
+        if (out_scale_obj != Py_None) {
+            std::vector<double> out_scale, out_zero = {0};
+            std::vector<int32_t> zero;
+            if (!read_qparam(out_scale_obj, "out_scale", out_scale) ||
+                !check_scales(out_scale, "out_scale") ||
+                (out_zero_obj && !read_qparam(out_zero_obj, "out_zero_point", out_zero)) ||
+                !to_zero_points(out_zero, "out_zero_point", zero)) {
+                return NULL;
+            }
+            if (out_scale.size() != 1 || zero.size() != 1) {
+                PyErr_SetString(PyExc_ValueError, "out_scale and out_zero_point must be single values");
+                return NULL;
+            }
+            e.out_scale = (float)out_scale[0];
+            e.out_zero = zero[0];
+            e.output = QOutput::Int8;
+            out_dtype = DType::Int8;
+        }
+    }
+
+    std::unique_ptr<Tensor> bias_conv;
+    Tensor* bias = nullptr;
+    if (bias_obj != Py_None) {
+        bias = vector_operand(bias_obj, DType::Float32, bias_conv);
+        if (!bias) return NULL;
+        if (bias->size() != n) {
+            PyErr_SetString(PyExc_ValueError, "bias must have one entry per column");
+            return NULL;
+        }
+    }
+
+    std::unique_ptr<Tensor> a_conv, b_conv;
+    a = operand(a, DType::Int8, a_conv);
+    b = operand(b, DType::Int8, b_conv);
+    if (!a || !b) return NULL;
+
+    size_t work_bytes = qgemm_workspace(m, k, n);
+    auto work = std::make_shared<Storage>(work_bytes);
+    if (work_bytes && !work->ptr) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    std::vector<size_t> out_shape(a->shape.begin(), a->shape.end() - 1);
+    out_shape.push_back(n);
+    Tensor* result = new_tensor(out_shape, out_dtype);
+    if (!result) return NULL;
+
+    std::vector<const Tensor*> inputs = {a, b};
+    if (bias) inputs.push_back(bias);
+    launch({"qmatmul", inputs, 2.0 * m * k * n},
+           [a = *a, b = *b, bias = bias ? *bias : Tensor(), has_bias = bias != nullptr,
+            out = *result, e = std::move(e), work, m, k, n]() {
+        QEpilogue epilogue = e;
+        if (has_bias) epilogue.bias = bias.data<float>();
+        qgemm(a.data<int8_t>(), b.data<int8_t>(), out.storage ? out.data<char>() : nullptr, m, k, n,
+              epilogue, work->ptr);
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+enum class ReduceKind { Sum, Mean, Max, Min, ArgMax };
+
+static const char* reduce_name(ReduceKind kind) {
+    switch (kind) {
+        case ReduceKind::Sum: return "sum";
+        case ReduceKind::Mean: return "mean";
+        case ReduceKind::Max: return "max";
+        case ReduceKind::Min: return "min";
+        case ReduceKind::ArgMax: return "argmax";
+    }
+    return "";
+}
+
+// sum/mean/max/min/argmax(a, axis=None, keepdims=False). Without an
+// axis (and without keepdims) the result is a Python scalar: a float
+// for float tensors, an int for integer and bool sums and for argmax.
+static PyObject* reduce_impl(PyObject* args, PyObject* kwargs, ReduceKind kind) {
+    static const char* kwlist[] = {"a", "axis", "keepdims", NULL};
+    PyObject* a_obj;
+    PyObject* axis_obj = Py_None;
+    int keepdims = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Op", (char**)kwlist,
+                                     &a_obj, &axis_obj, &keepdims)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    if (!a) return NULL;
+    std::unique_ptr<Tensor> gathered;
+    a = operand(a, a->dtype, gathered);
+    if (!a) return NULL;
+
+    size_t ndim = a->shape.size();
+    size_t outer = 1, len = a->size(), inner = 1;
+    std::vector<size_t> out_shape;
+
+    if (axis_obj == Py_None) {
+        if (keepdims) out_shape.assign(ndim, 1);
+    } else {
+        long axis = PyLong_AsLong(axis_obj);
+        if (axis == -1 && PyErr_Occurred()) return NULL;
+        if (axis < 0) axis += (long)ndim;
+        if (axis < 0 || axis >= (long)ndim) {
+            PyErr_SetString(PyExc_ValueError, "axis out of range");
+            return NULL;
+        }
+        len = a->shape[axis];
+        for (long d = 0; d < axis; d++) outer *= a->shape[d];
+        for (size_t d = axis + 1; d < ndim; d++) inner *= a->shape[d];
+        out_shape = a->shape;
+        if (keepdims) {
+            out_shape[axis] = 1;
+        } else {
+            out_shape.erase(out_shape.begin() + axis);
+        }
+        // Reducing the only axis of a 1D tensor still yields a scalar
+        if (out_shape.empty()) axis_obj = Py_None;
+    }
+
+    if (len == 0 && kind != ReduceKind::Sum && kind != ReduceKind::Mean) {
+        PyErr_SetString(PyExc_ValueError, "zero-size reduction has no identity");
+        return NULL;
+    }
+
+    DType out_dtype = a->dtype;
+    if (kind == ReduceKind::Sum && !is_floating(a->dtype)) out_dtype = DType::Int64;
+    if (kind == ReduceKind::Mean && !is_floating(a->dtype)) out_dtype = DType::Float64;
+    if (kind == ReduceKind::ArgMax) out_dtype = DType::Int64;
+
+    Tensor* result = new_tensor(out_shape, out_dtype);
+    if (!result) return NULL;
+
+    launch({reduce_name(kind), {a}, (double)a->size()},
+           [a = *a, result = *result, kind, outer, len, inner]() {
+        ReducePlan plan(outer, len, inner);
+        dispatch(a.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            const T* x = a.data<T>();
+            switch (kind) {
+                case ReduceKind::Sum:
+                case ReduceKind::Mean: {
+                    std::vector<SumAcc<T>> acc(outer * inner);
+                    reduce_sum(x, plan, acc.data());
+                    dispatch(result.dtype, [&](auto out_tag) {
+                        using Out = decltype(out_tag);
+                        Out* out = result.data<Out>();
+                        for (size_t i = 0; i < acc.size(); i++) {
+                            out[i] = kind == ReduceKind::Mean ? (Out)(acc[i] / (double)len)
+                                                              : (Out)acc[i];
+                        }
+                    });
+                    break;
+                }
+                case ReduceKind::Max:
+                    reduce_extreme<T, true>(x, plan, result.data<T>(), nullptr);
+                    break;
+                case ReduceKind::Min:
+                    reduce_extreme<T, false>(x, plan, result.data<T>(), nullptr);
+                    break;
+                case ReduceKind::ArgMax: {
+                    std::unique_ptr<T[]> values(new T[outer * inner]);
+                    reduce_extreme<T, true>(x, plan, values.get(), result.data<int64_t>());
+                    break;
+                }
+            }
+        });
+    }, {result});
+
+    // A Python scalar has to be computed now, so this is a sync point
+    if (axis_obj == Py_None && !keepdims) {
+        PyObject* scalar = wait_ready(result) ? item_to_py(result, 0) : NULL;
+        delete result;
+        return scalar;
+    }
+    return make_pytensor(result);
+}
+
+static PyObject* tensor_sum(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return reduce_impl(args, kwargs, ReduceKind::Sum);
+}
+
+static PyObject* tensor_mean(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return reduce_impl(args, kwargs, ReduceKind::Mean);
+}
+
+static PyObject* tensor_max(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return reduce_impl(args, kwargs, ReduceKind::Max);
+}
+
+static PyObject* tensor_min(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return reduce_impl(args, kwargs, ReduceKind::Min);
+}
+
+static PyObject* tensor_argmax(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return reduce_impl(args, kwargs, ReduceKind::ArgMax);
+}
+
+// ---- Prefix scans ----
+
+// cumsum/cumprod(a, axis=None): running sums (products) along `axis`,
+// with the shape of `a`. Without an axis `a` is flattened first, like
+// NumPy. Integer and bool inputs accumulate into int64.
+static PyObject* scan_impl(PyObject* args, PyObject* kwargs, ScanKind kind) {
+    static const char* kwlist[] = {"a", "axis", NULL};
+    PyObject* a_obj;
+    PyObject* axis_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", (char**)kwlist, &a_obj, &axis_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    if (!a) return NULL;
+    std::unique_ptr<Tensor> gathered;
+    a = operand(a, a->dtype, gathered);
+    if (!a) return NULL;
+
+    size_t ndim = a->shape.size();
+    size_t outer = 1, len = a->size(), inner = 1;
+    std::vector<size_t> out_shape = {a->size()};
+    if (axis_obj != Py_None) {
+        long axis = PyLong_AsLong(axis_obj);
+        if (axis == -1 && PyErr_Occurred()) return NULL;
+        if (axis < 0) axis += (long)ndim;
+        if (axis < 0 || axis >= (long)ndim) {
+            PyErr_SetString(PyExc_ValueError, "axis out of range");
+            return NULL;
+        }
+        len = a->shape[axis];
+        for (long d = 0; d < axis; d++) outer *= a->shape[d];
+        for (size_t d = axis + 1; d < ndim; d++) inner *= a->shape[d];
+        out_shape = a->shape;
+    }
+
+    DType out_dtype = is_floating(a->dtype) ? a->dtype : DType::Int64;
+    Tensor* result = new_tensor(out_shape, out_dtype);
+    if (!result) return NULL;
+
+    launch({kind == ScanKind::Sum ? "cumsum" : "cumprod", {a}, (double)a->size()},
+           [a = *a, result = *result, kind, outer, len, inner]() {
+        if (a.size() == 0) return;
+        ReducePlan plan(outer, len, inner);
+        dispatch(a.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            using O = typename std::conditional<std::is_floating_point<T>::value, T, int64_t>::type;
+            if (kind == ScanKind::Sum) {
+                scan_axis<T, O, ScanKind::Sum>(a.data<T>(), plan, result.data<O>());
+            } else {
+                scan_axis<T, O, ScanKind::Prod>(a.data<T>(), plan, result.data<O>());
+            }
+        });
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+static PyObject* tensor_cumsum(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return scan_impl(args, kwargs, ScanKind::Sum);
+}
+
+static PyObject* tensor_cumprod(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return scan_impl(args, kwargs, ScanKind::Prod);
+}
+
+// ---- Sorting ----
+
+enum class SortKind { Sort, ArgSort, TopK };
+
+// sort(a, axis=-1, descending=False), argsort(a, axis=-1,
+// descending=False) and topk(a, k, axis=-1, largest=True). All three are
+// stable: equal values keep their order, and topk prefers the lower
+// index on ties. NaN counts as larger than every other value.
+static PyObject* sort_impl(PyObject* args, PyObject* kwargs, SortKind kind) {
+    static const char* sort_kwlist[] = {"a", "axis", "descending", NULL};
+    static const char* topk_kwlist[] = {"a", "k", "axis", "largest", NULL};
+    PyObject* a_obj;
+    Py_ssize_t k = 0;
+    long axis = -1;
+    int descending = 0;
+    if (kind == SortKind::TopK) {
+        int largest = 1;
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "On|lp", (char**)topk_kwlist,
+                                         &a_obj, &k, &axis, &largest)) {
+            return NULL;
+        }
+        descending = largest;
+    } else if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|lp", (char**)sort_kwlist,
+                                            &a_obj, &axis, &descending)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    if (!a) return NULL;
+    std::unique_ptr<Tensor> gathered;
+    a = operand(a, a->dtype, gathered);
+    if (!a) return NULL;
+
+    long ndim = (long)a->shape.size();
+    if (axis < 0) axis += ndim;
+    if (axis < 0 || axis >= ndim) {
+        PyErr_SetString(PyExc_ValueError, "axis out of range");
+        return NULL;
+    }
+    size_t outer = 1, len = a->shape[axis], inner = 1;
+    for (long d = 0; d < axis; d++) outer *= a->shape[d];
+    for (long d = axis + 1; d < ndim; d++) inner *= a->shape[d];
+    if (len > UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "cannot sort more than 2**32 - 1 values along an axis");
+        return NULL;
+    }
+
+    size_t keep = len;
+    if (kind == SortKind::TopK) {
+        if (k < 0 || (size_t)k > len) {
+            PyErr_SetString(PyExc_ValueError, "k must be between 0 and the length of the axis");
+            return NULL;
+        }
+        keep = (size_t)k;
+    }
+
+    SortPlan plan(outer, len, inner, keep, descending != 0);
+    size_t key_size = a->itemsize() <= 4 ? 4 : 8;
+    size_t work_bytes = sort_workspace(plan, key_size);
+    auto work = std::make_shared<Storage>(work_bytes);
+    if (work_bytes && !work->ptr) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    std::vector<size_t> out_shape = a->shape;
+    out_shape[axis] = keep;
+    Tensor* values = nullptr;
+    Tensor* indices = nullptr;
+    if (kind != SortKind::ArgSort) {
+        values = new_tensor(out_shape, a->dtype);
+        if (!values) return NULL;
+    }
+    if (kind != SortKind::Sort) {
+        indices = new_tensor(out_shape, DType::Int64);
+        if (!indices) {
+            delete values;
+            return NULL;
+        }
+    }
+
+    static const char* names[] = {"sort", "argsort", "topk"};
+    std::vector<const Tensor*> outputs;
+    if (values) outputs.push_back(values);
+    if (indices) outputs.push_back(indices);
+    launch({names[(int)kind], {a}, (double)a->size()},
+           [a = *a, values = values ? *values : Tensor(), indices = indices ? *indices : Tensor(),
+            has_values = values != nullptr, has_indices = indices != nullptr, plan, work]() {
+        dispatch(a.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            T* out = has_values ? values.data<T>() : nullptr;
+            if (has_indices) {
+                sort_rows<T, true>(a.data<T>(), plan, out, indices.data<int64_t>(), work->ptr);
+            } else {
+                sort_rows<T, false>(a.data<T>(), plan, out, nullptr, work->ptr);
+            }
+        });
+    }, outputs);
+
+    if (kind == SortKind::Sort) return make_pytensor(values);
+    if (kind == SortKind::ArgSort) return make_pytensor(indices);
+    PyObject* v = make_pytensor(values);
+    if (!v) {
+        delete indices;
+        return NULL;
+    }
+    PyObject* i = make_pytensor(indices);
+    if (!i) {
+        Py_DECREF(v);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", v, i);
+}
+
+static PyObject* tensor_sort(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return sort_impl(args, kwargs, SortKind::Sort);
+}
+
+static PyObject* tensor_argsort(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return sort_impl(args, kwargs, SortKind::ArgSort);
+}
+
+static PyObject* tensor_topk(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return sort_impl(args, kwargs, SortKind::TopK);
+}
+
+// ---- Random numbers ----
+
+// Default generator: a seed and the next unused Philox block. Ops
+// without an explicit seed take fresh blocks from it; a new process
+// starts from a seed drawn from the OS.
+static uint64_t g_rng_seed = ((uint64_t)std::random_device()() << 32) | std::random_device()();
+static uint64_t g_rng_counter = 0;
+
+// Stream position for n values: with an explicit seed, elements
+// [offset, offset + n) of that seed's stream; otherwise the next unused
+// blocks of the default generator
+static bool random_params(PyObject* seed_obj, PyObject* offset_obj, size_t n, DType dtype,
+                          RandomParams* p) {
+    if (seed_obj == Py_None) {
+        if (offset_obj != Py_None) {
+            PyErr_SetString(PyExc_ValueError, "offset needs an explicit seed");
+            return false;
+        }
+        p->seed = g_rng_seed;
+        p->counter = g_rng_counter;
+        g_rng_counter += random_blocks(n, p->kind, dtype);
+        return true;
+    }
+    p->seed = PyLong_AsUnsignedLongLong(seed_obj);
+    if (PyErr_Occurred()) return false;
+    if (offset_obj != Py_None) {
+        p->offset = PyLong_AsUnsignedLongLong(offset_obj);
+        if (PyErr_Occurred()) return false;
+    }
+    return true;
+}
+
+static PyObject* random_tensor(const std::vector<size_t>& shape, DType dtype, PyObject* seed_obj,
+                               PyObject* offset_obj, RandomParams p) {
+    Tensor* result = new_tensor(shape, dtype);
+    if (!result) return NULL;
+    if (!random_params(seed_obj, offset_obj, result->size(), dtype, &p)) {
+        delete result;
+        return NULL;
+    }
+
+    static const char* names[] = {"rand", "randn", "randint"};
+    launch({names[(int)p.kind], {}, (double)result->size()}, [out = *result, p]() {
+        dispatch(out.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            random_fill(out.data<T>(), out.size(), out.dtype, p);
+        });
+    }, {result});
+    return make_pytensor(result);
+}
+
+// rand/randn(shape, dtype='float64', seed=None, offset=None)
+static PyObject* random_floats(PyObject* args, PyObject* kwargs, RandomKind kind) {
+    static const char* kwlist[] = {"shape", "dtype", "seed", "offset", NULL};
+    PyObject* shape_obj;
+    const char* dtype_str = "float64";
+    PyObject* seed_obj = Py_None;
+    PyObject* offset_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|sOO", (char**)kwlist,
+                                     &shape_obj, &dtype_str, &seed_obj, &offset_obj)) {
+        return NULL;
+    }
+
+    std::vector<size_t> shape;
+    DType dtype;
+    if (!parse_shape(shape_obj, shape) || !parse_dtype(dtype_str, &dtype)) return NULL;
+    if (!is_floating(dtype)) {
+        PyErr_SetString(PyExc_TypeError, "rand and randn need a float dtype");
+        return NULL;
+    }
+    RandomParams p;
+    p.kind = kind;
+    return random_tensor(shape, dtype, seed_obj, offset_obj, p);
+}
+
+static PyObject* tensor_rand(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return random_floats(args, kwargs, RandomKind::Uniform);
+}
+
+static PyObject* tensor_randn(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return random_floats(args, kwargs, RandomKind::Normal);
+}
+
+// randint(low, high, shape, dtype='int64', seed=None, offset=None):
+// integers in [low, high)
+static PyObject* tensor_randint(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"low", "high", "shape", "dtype", "seed", "offset", NULL};
+    long long low, high;
+    PyObject* shape_obj;
+    const char* dtype_str = "int64";
+    PyObject* seed_obj = Py_None;
+    PyObject* offset_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "LLO|sOO", (char**)kwlist, &low, &high,
+                                     &shape_obj, &dtype_str, &seed_obj, &offset_obj)) {
+        return NULL;
+    }
+
+    std::vector<size_t> shape;
+    DType dtype;
+    if (!parse_shape(shape_obj, shape) || !parse_dtype(dtype_str, &dtype)) return NULL;
+    if (dtype != DType::Int8 && dtype != DType::Int32 && dtype != DType::Int64) {
+        PyErr_SetString(PyExc_TypeError, "randint needs an integer dtype");
+        return NULL;
+    }
+    if (low >= high) {
+        PyErr_SetString(PyExc_ValueError, "randint needs low < high");
+        return NULL;
+    }
+    long long lo_limit = dtype == DType::Int8 ? INT8_MIN : dtype == DType::Int32 ? INT32_MIN : INT64_MIN;
+    long long hi_limit = dtype == DType::Int8 ? INT8_MAX : dtype == DType::Int32 ? INT32_MAX : INT64_MAX;
+    if (low < lo_limit || high - 1 > hi_limit) {
+        PyErr_Format(PyExc_ValueError, "randint range does not fit in %s", dtype_str);
+        return NULL;
+    }
+    RandomParams p;
+    p.kind = RandomKind::Integer;
+    p.low = low;
+    p.range = (uint64_t)high - (uint64_t)low;
+    return random_tensor(shape, dtype, seed_obj, offset_obj, p);
+}
+
+static PyObject* tensor_manual_seed(PyObject* self, PyObject* args) {
+    unsigned long long seed;
+    if (!PyArg_ParseTuple(args, "K", &seed)) {
+        return NULL;
+    }
+    g_rng_seed = seed;
+    g_rng_counter = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject* tensor_get_rng_state(PyObject* self, PyObject* args) {
+    return Py_BuildValue("(KK)", (unsigned long long)g_rng_seed,
+                         (unsigned long long)g_rng_counter);
+}
+
+static PyObject* tensor_set_rng_state(PyObject* self, PyObject* args) {
+    unsigned long long seed, counter;
+    if (!PyArg_ParseTuple(args, "(KK)", &seed, &counter)) {
+        return NULL;
+    }
+    g_rng_seed = seed;
+    g_rng_counter = counter;
+    Py_RETURN_NONE;
+}
+
+// ---- Indexing ----
+
+enum class IndexOp { Select, Add, Gather, Scatter, ScatterAdd };
+
+static const char* index_op_name(IndexOp op) {
+    switch (op) {
+        case IndexOp::Select: return "index_select";
+        case IndexOp::Add: return "index_add";
+        case IndexOp::Gather: return "gather";
+        case IndexOp::Scatter: return "scatter";
+        case IndexOp::ScatterAdd: return "scatter_add";
+    }
+    return "";
+}
+
+// An index given as an integer Tensor or a Python list, as contiguous
+// int32 or int64
+static Tensor* index_operand(PyObject* obj, std::unique_ptr<Tensor>& holder) {
+    if (PyList_Check(obj)) return vector_operand(obj, DType::Int64, holder);
+    Tensor* t = get_tensor(obj);
+    if (!t) return nullptr;
+    if (is_floating(t->dtype) || t->dtype == DType::Bool) {
+        PyErr_SetString(PyExc_TypeError, "index must be an integer tensor");
+        return nullptr;
+    }
+    return operand(t, t->dtype == DType::Int32 ? DType::Int32 : DType::Int64, holder);
+}
+
+// Message for the first out-of-range entry of `index`, or "" if there
+// is none
+static std::string find_bad_index(const Tensor& index, size_t dim, long axis) {
+    bool ok = true;
+    int64_t bad = 0;
+    auto scan = [&](auto* idx) {
+        size_t pos;
+        for (size_t i = 0; i < index.size() && ok; i++) {
+            if (!resolve_index(idx[i], dim, &pos)) {
+                ok = false;
+                bad = (int64_t)idx[i];
+            }
+        }
+    };
+    if (index.dtype == DType::Int32) {
+        scan(index.data<int32_t>());
+    } else {
+        scan(index.data<int64_t>());
+    }
+    if (ok) return "";
+    char message[128];
+    std::snprintf(message, sizeof(message), "index %lld is out of bounds for axis %ld with size %zu",
+                  (long long)bad, axis, dim);
+    return message;
+}
+
+// Raises IndexError for an out-of-range index if the values can be read
+// now, and sets *checked. Otherwise the kernel checks them when it runs,
+// skips such entries and defers the error (see defer_index_error).
+static bool check_indices(const Tensor* index, size_t dim, long axis, bool* checked) {
+    const Tensor* t = index;
+    *checked = !g_capture && (!g_stream || !t->storage || g_stream->done(t->storage->pending));
+    if (!*checked) return true;
+    std::string bad = find_bad_index(*index, dim, axis);
+    if (!bad.empty()) PyErr_SetString(PyExc_IndexError, bad.c_str());
+    return bad.empty();
+}
+
+// index_select(a, axis, index), gather(a, axis, index), and
+// index_add/scatter/scatter_add(a, axis, index, src), which return an
+// updated copy of `a` or, `inplace`, update `a` itself
+static PyObject* index_impl(PyObject* args, PyObject* kwargs, IndexOp op, bool inplace) {
+    static const char* read_kwlist[] = {"a", "axis", "index", NULL};
+    static const char* write_kwlist[] = {"a", "axis", "index", "src", NULL};
+    PyObject *a_obj, *index_obj;
+    PyObject* src_obj = nullptr;
+    long axis;
+    bool reads = op == IndexOp::Select || op == IndexOp::Gather;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, reads ? "OlO" : "OlOO",
+                                     (char**)(reads ? read_kwlist : write_kwlist),
+                                     &a_obj, &axis, &index_obj, &src_obj)) {
+        return NULL;
+    }
+
+    Tensor* a = get_tensor(a_obj);
+    if (!a) return NULL;
+    std::unique_ptr<Tensor> index_holder;
+    Tensor* index = index_operand(index_obj, index_holder);
+    if (!index) return NULL;
+
+    long ndim = (long)a->shape.size();
+    if (axis < 0) axis += ndim;
+    if (axis < 0 || axis >= ndim) {
+        PyErr_SetString(PyExc_ValueError, "axis out of range");
+        return NULL;
+    }
+    IndexPlan plan;
+    plan.dim = a->shape[axis];
+    for (long d = 0; d < axis; d++) plan.outer *= a->shape[d];
+    for (long d = axis + 1; d < ndim; d++) plan.inner *= a->shape[d];
+
+    // Shape of the values read (the result) or written (src)
+    std::vector<size_t> values_shape;
+    if (op == IndexOp::Select || op == IndexOp::Add) {
+        plan.rows = true;
+        plan.count = index->size();
+        values_shape.assign(a->shape.begin(), a->shape.begin() + axis);
+        values_shape.insert(values_shape.end(), index->shape.begin(), index->shape.end());
+        values_shape.insert(values_shape.end(), a->shape.begin() + axis + 1, a->shape.end());
+    } else {
+        plan.rows = false;
+        bool same = (long)index->shape.size() == ndim;
+        for (long d = 0; same && d < ndim; d++) same = d == axis || index->shape[d] == a->shape[d];
+        if (!same) {
+            PyErr_Format(PyExc_ValueError, "%s: index must have the shape of a except along axis",
+                         index_op_name(op));
+            return NULL;
+        }
+        plan.count = index->shape[axis];
+        values_shape = index->shape;
+    }
+    bool checked;
+    if (!check_indices(index, plan.dim, axis, &checked)) return NULL;
+
+    std::unique_ptr<Tensor> a_holder, src_holder;
+    Tensor* src = nullptr;
+    if (!reads) {
+        src = get_tensor(src_obj);
+        if (!src) return NULL;
+        if (src->shape != values_shape) {
+            PyErr_Format(PyExc_ValueError,
+                         op == IndexOp::Add
+                             ? "%s: src must have the shape of the rows it adds to, "
+                               "a.shape[:axis] + index.shape + a.shape[axis + 1:]"
+                             : "%s: src must have the shape of index",
+                         index_op_name(op));
+            return NULL;
+        }
+        src = operand(src, a->dtype, src_holder);
+        if (!src) return NULL;
+        if (inplace && !check_out(a, a->shape, a->dtype)) return NULL;
+    }
+    if (!inplace) {
+        a = operand(a, a->dtype, a_holder);
+        if (!a) return NULL;
+    }
+
+    size_t buckets = 0, work_bytes = 0;
+    if (!reads) {
+        size_t threads = g_num_threads;
+        buckets = threads == 1 ? 1 : std::min(plan.outer * plan.dim, 4 * threads);
+        if (buckets > 1) work_bytes = scatter_workspace(plan, buckets) * sizeof(size_t);
+    }
+    auto work = std::make_shared<Storage>(work_bytes);
+    if (work_bytes && !work->ptr) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    Tensor* result = inplace ? a : new_tensor(reads ? values_shape : a->shape, a->dtype);
+    if (!result) return NULL;
+    std::vector<const Tensor*> inputs = {a, index};
+    if (src) inputs.push_back(src);
+    double moved = (double)(reads ? result->size() : src->size());
+    launch({index_op_name(op), inputs, moved},
+           [a = *a, index = *index, src = src ? *src : Tensor(), out = *result, op, inplace,
+            plan, buckets, work, checked, axis]() {
+        if (!checked) {
+            std::string bad = find_bad_index(index, plan.dim, axis);
+            if (!bad.empty()) defer_index_error(out.storage, bad);
+        }
+        dispatch(a.dtype, [&](auto tag) {
+            using T = decltype(tag);
+            auto run = [&](auto index_tag) {
+                using I = decltype(index_tag);
+                const I* idx = index.data<I>();
+                if (op == IndexOp::Select || op == IndexOp::Gather) {
+                    index_gather(a.data<T>(), idx, plan, out.data<T>());
+                    return;
+                }
+                if (!inplace && a.raw()) std::memcpy(out.raw(), a.raw(), a.nbytes());
+                size_t* w = (size_t*)work->ptr;
+                if (op == IndexOp::Scatter) {
+                    index_scatter<T, I, false>(out.data<T>(), idx, src.data<T>(), plan, buckets, w);
+                } else {
+                    index_scatter<T, I, true>(out.data<T>(), idx, src.data<T>(), plan, buckets, w);
+                }
+            };
+            if (index.dtype == DType::Int32) {
+                run(int32_t());
+            } else {
+                run(int64_t());
+            }
+        });
+    }, {result});
+
+    if (inplace) {
+        Py_INCREF(a_obj);
+        return a_obj;
+    }
+    return make_pytensor(result);
+}
+
+static PyObject* tensor_index_select(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return index_impl(args, kwargs, IndexOp::Select, false);
+}
+
+static PyObject* tensor_index_add(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return index_impl(args, kwargs, IndexOp::Add, false);
+}
+
+static PyObject* tensor_index_add_(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return index_impl(args, kwargs, IndexOp::Add, true);
+}
+
+static PyObject* tensor_gather(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return index_impl(args, kwargs, IndexOp::Gather, false);
+}
+
+static PyObject* tensor_scatter(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return index_impl(args, kwargs, IndexOp::Scatter, false);
+}
+
+static PyObject* tensor_scatter_(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return index_impl(args, kwargs, IndexOp::Scatter, true);
+}
+
+static PyObject* tensor_scatter_add(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return index_impl(args, kwargs, IndexOp::ScatterAdd, false);
+}
+
+static PyObject* tensor_scatter_add_(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return index_impl(args, kwargs, IndexOp::ScatterAdd, true);
+}
+
+// ---- Concatenation ----
+
+// concat(tensors, axis=0) joins tensors along an existing axis;
+// stack(tensors, axis=0) along a new one. Inputs are promoted to a
+// common dtype. The output is allocated once and each input is copied
+// straight into its slice; only inputs that are views or of another
+// dtype are gathered (or cast) first.
+static PyObject* join_tensors(const std::vector<Tensor*>& pieces, long axis, bool stack) {
+    const char* name = stack ? "stack" : "concat";
+    size_t n = pieces.size();
+    if (n == 0) {
+        PyErr_Format(PyExc_ValueError, "%s needs at least one tensor", name);
+        return NULL;
+    }
+
+    const std::vector<size_t>& first = pieces[0]->shape;
+    size_t ndim = first.size();
+    long out_ndim = (long)ndim + (stack ? 1 : 0);
+    if (ndim == 0 && !stack) {
+        PyErr_SetString(PyExc_ValueError, "zero-dimensional tensors cannot be concatenated");
+        return NULL;
+    }
+    if (axis < 0) axis += out_ndim;
+    if (axis < 0 || axis >= out_ndim) {
+        PyErr_SetString(PyExc_ValueError, "axis out of range");
+        return NULL;
+    }
+
+    DType dtype = pieces[0]->dtype;
+    size_t joined = 0;
+    for (size_t i = 0; i < n; i++) {
+        const std::vector<size_t>& shape = pieces[i]->shape;
+        bool ok = shape.size() == ndim;
+        for (size_t d = 0; ok && d < ndim; d++) {
+            ok = shape[d] == first[d] || (!stack && (long)d == axis);
+        }
+        if (!ok) {
+            PyErr_Format(PyExc_ValueError,
+                         stack ? "stack: tensor %zu has a different shape than tensor 0"
+                               : "concat: tensor %zu differs from tensor 0 outside the axis", i);
+            return NULL;
+        }
+        joined += stack ? 1 : shape[axis];
+        dtype = promote(dtype, pieces[i]->dtype);
+    }
+
+    std::vector<size_t> out_shape = first;
+    if (stack) {
+        out_shape.insert(out_shape.begin() + axis, n);
+    } else {
+        out_shape[axis] = joined;
+    }
+    size_t outer = 1, inner = 1;
+    for (long d = 0; d < axis; d++) outer *= out_shape[d];
+    for (size_t d = axis + 1; d < out_shape.size(); d++) inner *= out_shape[d];
+
+    std::vector<std::unique_ptr<Tensor>> holders(n);
+    std::vector<Tensor> sources(n);
+    std::vector<const Tensor*> inputs(n);
+    std::vector<size_t> runs(n);
+    size_t itemsize = dtype_size(dtype);
+    for (size_t i = 0; i < n; i++) {
+        Tensor* t = operand(pieces[i], dtype, holders[i]);
+        if (!t) return NULL;
+        sources[i] = *t;
+        inputs[i] = t;
+        runs[i] = (stack ? 1 : t->shape[axis]) * inner * itemsize;
+    }
+
+    Tensor* result = new_tensor(out_shape, dtype);
+    if (!result) return NULL;
+
+    launch({name, inputs}, [sources = std::move(sources), runs = std::move(runs), out = *result,
+                            outer, row_bytes = joined * inner * itemsize]() {
+        std::vector<ConcatPiece> copy(sources.size());
+        size_t at = 0;
+        for (size_t i = 0; i < sources.size(); i++) {
+            copy[i] = {sources[i].data<char>(), runs[i], at};
+            at += runs[i];
+        }
+        concat_copy(copy, outer, row_bytes, out.data<char>());
+    }, {result});
+
+    return make_pytensor(result);
+}
+
+static PyObject* join_impl(PyObject* args, PyObject* kwargs, bool stack) {
+    static const char* kwlist[] = {"tensors", "axis", NULL};
+    PyObject* seq_obj;
+    long axis = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|l", (char**)kwlist, &seq_obj, &axis)) {
+        return NULL;
+    }
+    PyObject* seq = PySequence_Fast(seq_obj, "expected a sequence of tensors");
+    if (!seq) return NULL;
+    std::vector<Tensor*> pieces(PySequence_Fast_GET_SIZE(seq));
+    PyObject* result = NULL;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        pieces[i] = get_tensor(PySequence_Fast_GET_ITEM(seq, i));
+        if (!pieces[i]) break;
+    }
+    if (!PyErr_Occurred()) result = join_tensors(pieces, axis, stack);
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject* tensor_concat(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return join_impl(args, kwargs, false);
+}
+
+static PyObject* tensor_stack(PyObject* self, PyObject* args, PyObject* kwargs) {
+    return join_impl(args, kwargs, true);
+}
+
+// builder(row_shape=None, dtype=None, capacity=0): an empty Builder.
+// Without row_shape (dtype), the first append decides it.
+static PyObject* tensor_builder(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"row_shape", "dtype", "capacity", NULL};
+    PyObject* shape_obj = Py_None;
+    const char* dtype_str = NULL;
+    Py_ssize_t capacity = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|Ozn", (char**)kwlist,
+                                     &shape_obj, &dtype_str, &capacity)) {
+        return NULL;
+    }
+    if (capacity < 0) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be non-negative");
+        return NULL;
+    }
+
+    std::unique_ptr<TensorBuilder> b(new TensorBuilder());
+    if (shape_obj != Py_None) {
+        if (!parse_shape(shape_obj, b->row_shape)) return NULL;
+        b->shaped = true;
+    }
+    if (dtype_str) {
+        if (!parse_dtype(dtype_str, &b->buffer.dtype)) return NULL;
+        b->typed = true;
+    }
+    if (capacity > 0 && b->shaped && b->typed && !builder_reserve(b.get(), (size_t)capacity)) {
+        return NULL;
+    }
+    b->requested = (size_t)capacity;
+
+    PyBuilder* obj = PyObject_New(PyBuilder, &PyBuilderType);
+    if (!obj) return NULL;
+    obj->builder = b.release();
+    return (PyObject*)obj;
+}
+
+static PyObject* tensor_set_out_of_core_threshold(PyObject* self, PyObject* args) {
+    Py_ssize_t threshold;
+    if (!PyArg_ParseTuple(args, "n", &threshold)) {
+        return NULL;
+    }
+    if (threshold < 0) {
+        PyErr_SetString(PyExc_ValueError, "threshold must be >= 0");
+        return NULL;
+    }
+    g_ooc_threshold = (size_t)threshold;
+    Py_RETURN_NONE;
+}
+
+static PyObject* tensor_set_num_threads(PyObject* self, PyObject* args) {
+    Py_ssize_t n;
+    if (!PyArg_ParseTuple(args, "n", &n)) {
+        return NULL;
+    }
+    if (n < 1) {
+        PyErr_SetString(PyExc_ValueError, "need at least one thread");
+        return NULL;
+    }
+    // Queued ops may still be using the pool
+    Py_BEGIN_ALLOW_THREADS
+    stream_drain();
+    Py_END_ALLOW_THREADS
+    set_num_threads((size_t)n);
+    Py_RETURN_NONE;
+}
+
+static PyObject* tensor_get_num_threads(PyObject* self, PyObject* args) {
+    return PyLong_FromSize_t(g_num_threads);
+}
+
+// set_async(flag): returns the previous setting. Turning it off waits
+// for everything already queued.
+static PyObject* tensor_set_async(PyObject* self, PyObject* args) {
+    int flag;
+    if (!PyArg_ParseTuple(args, "p", &flag)) {
+        return NULL;
+    }
+    bool previous = g_async;
+    g_async = flag;
+    if (!flag) {
+        Py_BEGIN_ALLOW_THREADS
+        stream_drain();
+        Py_END_ALLOW_THREADS
+    }
+    return PyBool_FromLong(previous);
+}
+
+static PyObject* tensor_synchronize(PyObject* self, PyObject* args) {
+    Py_BEGIN_ALLOW_THREADS
+    stream_drain();
+    Py_END_ALLOW_THREADS
+    if (!raise_deferred()) return NULL;
+    Py_RETURN_NONE;
+}
+
+// ------------------------------------------------------------
+// On-disk format
+// ------------------------------------------------------------
+// Native byte order, laid out as
+//
+//   TensorFileHeader | shape[ndim] (uint64) | strides[ndim] (int64,
+//   in elements) | zero padding | payload
+//
+// The payload starts at `data_offset`, a multiple of 64, so a mapped
+// tensor is as aligned as an allocated one.
+static const char kTensorMagic[8] = {'M', 'I', 'N', 'I', 'T', 'N', 'S', 'R'};
+static const uint32_t kTensorFileVersion = 1;
+static const uint32_t kByteOrderMark = 0x01020304;
+static const uint32_t kMaxFileDims = 64;
+
+struct TensorFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t dtype;
+    uint32_t ndim;
+    uint64_t data_offset;
+    uint64_t data_bytes;
+};
+
+static bool write_all(int fd, const void* buf, size_t n) {
+    const char* p = (const char*)buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* buf, size_t n, off_t offset) {
+    char* p = (char*)buf;
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r == 0) errno = EIO;  // truncated
+            return false;
+        }
+        p += r;
+        n -= (size_t)r;
+        offset += r;
     }
-    return ((PyTensor*)obj)->tensor;
+    return true;
 }
 
-static PyObject* make_pytensor(Tensor* t) {
-    PyTensor* self = PyObject_New(PyTensor, &PyTensorType);
-    if (!self) {
-        delete t;
+// Everything before the payload of a contiguous tensor of `shape` and
+// `dtype`: header, shape, strides and padding up to header->data_offset
+static std::vector<char> tensor_file_prefix(const std::vector<size_t>& shape, DType dtype,
+                                            TensorFileHeader* header) {
+    size_t ndim = shape.size();
+    std::vector<uint64_t> dims(shape.begin(), shape.end());
+    std::vector<int64_t> strides = Tensor::contiguous_strides(shape);
+    size_t count = 1;
+    for (size_t dim : shape) count *= dim;
+
+    std::memcpy(header->magic, kTensorMagic, sizeof(kTensorMagic));
+    header->version = kTensorFileVersion;
+    header->byte_order = kByteOrderMark;
+    header->dtype = (uint32_t)dtype;
+    header->ndim = (uint32_t)ndim;
+    size_t meta = sizeof(*header) + ndim * (sizeof(uint64_t) + sizeof(int64_t));
+    header->data_offset = round_up(meta, kAlignment);
+    header->data_bytes = count * dtype_size(dtype);
+
+    std::vector<char> prefix(header->data_offset, 0);
+    std::memcpy(prefix.data(), header, sizeof(*header));
+    std::memcpy(prefix.data() + sizeof(*header), dims.data(), ndim * sizeof(uint64_t));
+    std::memcpy(prefix.data() + sizeof(*header) + ndim * sizeof(uint64_t), strides.data(),
+                ndim * sizeof(int64_t));
+    return prefix;
+}
+
+static PyObject* tensor_save(PyObject* self, PyObject* args) {
+    PyObject* path_obj;
+    PyObject* t_obj;
+    if (!PyArg_ParseTuple(args, "O&O", PyUnicode_FSConverter, &path_obj, &t_obj)) {
         return NULL;
     }
-    self->tensor = t;
-    return (PyObject*)self;
-}
+    const char* path = PyBytes_AS_STRING(path_obj);
 
-// ============================================================
-// Type method implementations
-// ============================================================
-static PyObject* Tensor_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
-    PyTensor* self = (PyTensor*)type->tp_alloc(type, 0);
-    if (self) {
-        self->tensor = new Tensor();
+    Tensor* t = get_tensor(t_obj);
+    if (!t || (!t->raw() && t->nbytes() > 0)) {
+        if (t) PyErr_SetString(PyExc_ValueError, "tensor has no data");
+        Py_DECREF(path_obj);
+        return NULL;
     }
-    return (PyObject*)self;
-}
 
-static void Tensor_dealloc(PyTensor* self) {
-    delete self->tensor;
-    Py_TYPE(self)->tp_free((PyObject*)self);
-}
+    ProfileScope scope({"save", {t}});
 
-static PyObject* Tensor_shape(PyTensor* self, void* closure) {
-    PyObject* shape_tuple = PyTuple_New(self->tensor->shape.size());
-    for (size_t i = 0; i < self->tensor->shape.size(); i++) {
-        PyTuple_SetItem(shape_tuple, i, PyLong_FromSize_t(self->tensor->shape[i]));
+    // Views are written out contiguously
+    std::unique_ptr<Tensor> gathered;
+    t = operand(t, t->dtype, gathered);
+    if (!t) {
+        Py_DECREF(path_obj);
+        return NULL;
     }
-    return shape_tuple;
+    if (!wait_ready(t)) {
+        Py_DECREF(path_obj);
+        return NULL;
+    }
+
+    TensorFileHeader header;
+    std::vector<char> prefix = tensor_file_prefix(t->shape, t->dtype, &header);
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 &&
+         write_all(fd, prefix.data(), prefix.size()) &&
+         write_all(fd, t->raw(), header.data_bytes);
+    if (fd >= 0 && close(fd) != 0) ok = false;
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        Py_DECREF(path_obj);
+        return NULL;
+    }
+    Py_DECREF(path_obj);
+    Py_RETURN_NONE;
 }
 
-static PyObject* Tensor_tolist(PyTensor* self, PyObject* args) {
-    Tensor* t = self->tensor;
-    
-    if (t->shape.size() == 1) {
-        PyObject* list = PyList_New(t->shape[0]);
-        for (size_t i = 0; i < t->shape[0]; i++) {
-            PyList_SetItem(list, i, PyFloat_FromDouble(t->data[i]));
+// Validate the header and fill shape/dtype; sets ValueError on a file
+// that is not a tensor or does not fit its own header
+static bool read_tensor_header(int fd, size_t file_size, Tensor* t, TensorFileHeader* header) {
+    if (file_size < sizeof(*header) || !read_all(fd, header, sizeof(*header), 0)) {
+        PyErr_SetString(PyExc_ValueError, "not a tensor file (too short)");
+        return false;
+    }
+    if (std::memcmp(header->magic, kTensorMagic, sizeof(kTensorMagic)) != 0) {
+        PyErr_SetString(PyExc_ValueError, "not a tensor file (bad magic)");
+        return false;
+    }
+    if (header->version != kTensorFileVersion) {
+        PyErr_Format(PyExc_ValueError, "unsupported tensor file version %u", header->version);
+        return false;
+    }
+    if (header->byte_order != kByteOrderMark) {
+        PyErr_SetString(PyExc_ValueError, "tensor file was written with a different byte order");
+        return false;
+    }
+    if (header->dtype > (uint32_t)DType::Int8 || header->ndim > kMaxFileDims) {
+        PyErr_SetString(PyExc_ValueError, "corrupt tensor header");
+        return false;
+    }
+
+    size_t ndim = header->ndim;
+    std::vector<uint64_t> shape(ndim);
+    std::vector<int64_t> strides(ndim);
+    if (!read_all(fd, shape.data(), ndim * sizeof(uint64_t), sizeof(*header)) ||
+        !read_all(fd, strides.data(), ndim * sizeof(int64_t),
+                  sizeof(*header) + ndim * sizeof(uint64_t))) {
+        PyErr_SetString(PyExc_ValueError, "corrupt tensor header");
+        return false;
+    }
+
+    t->dtype = (DType)header->dtype;
+    t->shape.assign(shape.begin(), shape.end());
+    t->strides.assign(strides.begin(), strides.end());
+
+    // Strided files are loaded as views; every element they address has
+    // to lie inside the payload. The header is untrusted, so every size
+    // derived from it is computed with overflow checks: a wrapped value
+    // could otherwise pass and map less than the tensor reaches.
+    bool overflow = false, empty = false;
+    size_t count = 1, bytes, extent_bytes;
+    for (size_t d = 0; d < ndim; d++) {
+        if (strides[d] < 0) {
+            PyErr_SetString(PyExc_ValueError, "negative strides are not supported");
+            return false;
         }
-        return list;
-    } else if (t->shape.size() == 2) {
-        PyObject* outer = PyList_New(t->shape[0]);
-        for (size_t i = 0; i < t->shape[0]; i++) {
-            PyObject* inner = PyList_New(t->shape[1]);
-            for (size_t j = 0; j < t->shape[1]; j++) {
-                PyList_SetItem(inner, j, PyFloat_FromDouble(t->data[i * t->shape[1] + j]));
-            }
-            PyList_SetItem(outer, i, inner);
+        empty = empty || t->shape[d] == 0;
+        overflow = overflow || __builtin_mul_overflow(count, t->shape[d], &count);
+    }
+    if (empty) {
+        count = 0;
+        overflow = false;
+    }
+    overflow = overflow || __builtin_mul_overflow(count, t->itemsize(), &bytes);
+    size_t extent = count ? 1 : 0;
+    for (size_t d = 0; d < ndim && extent && !overflow; d++) {
+        size_t step;
+        overflow = __builtin_mul_overflow(t->shape[d] - 1, (size_t)strides[d], &step) ||
+                   __builtin_add_overflow(extent, step, &extent);
+    }
+    overflow = overflow || __builtin_mul_overflow(extent, t->itemsize(), &extent_bytes);
+    if (overflow) {
+        PyErr_SetString(PyExc_ValueError, "corrupt tensor header");
+        return false;
+    }
+
+    if (header->data_offset % kAlignment != 0 || header->data_offset > file_size ||
+        header->data_bytes > file_size - header->data_offset ||
+        header->data_bytes < extent_bytes) {
+        PyErr_SetString(PyExc_ValueError, "corrupt tensor header (payload size/offset)");
+        return false;
+    }
+    return true;
+}
+
+// load(path, mmap=True, mode='r')
+//   mode 'r':  read-only mapping
+//   mode 'c':  copy-on-write; writes stay private to this process
+//   mode 'r+': writable, changes are written back to the file
+// With mmap=False the payload is read into ordinary storage.
+static PyObject* tensor_load(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"path", "mmap", "mode", NULL};
+    PyObject* path_obj;
+    int use_mmap = 1;
+    const char* mode = "r";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|ps", (char**)kwlist,
+                                     PyUnicode_FSConverter, &path_obj, &use_mmap, &mode)) {
+        return NULL;
+    }
+    const char* path = PyBytes_AS_STRING(path_obj);
+
+    int prot, flags, open_flags = O_RDONLY;
+    bool writable = true;
+    if (strcmp(mode, "r") == 0) {
+        prot = PROT_READ;
+        flags = MAP_SHARED;
+        writable = false;
+    } else if (strcmp(mode, "c") == 0) {
+        prot = PROT_READ | PROT_WRITE;
+        flags = MAP_PRIVATE;
+    } else if (strcmp(mode, "r+") == 0) {
+        prot = PROT_READ | PROT_WRITE;
+        flags = MAP_SHARED;
+        open_flags = O_RDWR;
+    } else {
+        Py_DECREF(path_obj);
+        PyErr_SetString(PyExc_ValueError, "mode must be 'r', 'c' or 'r+'");
+        return NULL;
+    }
+
+    int fd = open(path, open_flags);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        if (fd >= 0) close(fd);
+        Py_DECREF(path_obj);
+        return NULL;
+    }
+    Py_DECREF(path_obj);
+
+    ProfileScope scope({"load", {}});
+    std::unique_ptr<Tensor> t(new Tensor());
+    TensorFileHeader header;
+    if (!read_tensor_header(fd, (size_t)st.st_size, t.get(), &header)) {
+        close(fd);
+        return NULL;
+    }
+
+    if (use_mmap) {
+        // Nothing is read here; pages come in from the page cache on
+        // first touch
+        size_t len = header.data_offset + header.data_bytes;
+        void* base = mmap(nullptr, len, prot, flags, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return PyErr_SetFromErrno(PyExc_OSError);
+        t->storage = std::make_shared<Storage>(
+            Storage::from_mapping(base, len, header.data_offset, writable));
+    } else {
+        t->storage = std::make_shared<Storage>(header.data_bytes);
+        if (!t->storage->ptr && header.data_bytes > 0) {
+            close(fd);
+            return PyErr_NoMemory();
         }
-        return outer;
+        bool ok;
+        Py_BEGIN_ALLOW_THREADS
+        ok = read_all(fd, t->raw(), header.data_bytes, (off_t)header.data_offset);
+        Py_END_ALLOW_THREADS
+        close(fd);
+        if (!ok) return PyErr_SetFromErrno(PyExc_OSError);
     }
-    
-    PyErr_SetString(PyExc_NotImplementedError, "Only 1D and 2D tensors supported");
-    return NULL;
+
+    scope.output(t.get());
+    return make_pytensor(t.release());
 }
 
-static PyObject* Tensor_repr(PyTensor* self) {
-    std::ostringstream oss;
-    oss << "Tensor(shape=(";
-    for (size_t i = 0; i < self->tensor->shape.size(); i++) {
-        if (i > 0) oss << ", ";
-        oss << self->tensor->shape[i];
+// ------------------------------------------------------------
+// Shared memory
+// ------------------------------------------------------------
+// shared() creates a POSIX shared memory object laid out like a tensor
+// file and maps it, so attach(name) in another process maps the same
+// pages and reads shape and dtype from the header: no data is copied
+// either way. The creating storage unlinks the name when it is freed in
+// the creating process; processes that attached before then, and forked
+// children holding a copy of the storage, keep their mapping.
+
+static std::atomic<uint64_t> g_shm_counter{0};
+
+// "/name" as POSIX wants it, from "name" or "/name"
+static std::string shm_path(const char* name) {
+    return name[0] == '/' ? std::string(name) : "/" + std::string(name);
+}
+
+// Maps an existing shared memory object; `t` gets shape and dtype from
+// its header. Sets an exception and returns false on failure.
+static bool attach_shared(const std::string& name, bool writable, Tensor* t) {
+    int fd = shm_open(name.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, name.c_str());
+        if (fd >= 0) close(fd);
+        return false;
     }
-    oss << "), data=[";
-    size_t n = std::min(self->tensor->data.size(), (size_t)6);
-    for (size_t i = 0; i < n; i++) {
-        if (i > 0) oss << ", ";
-        oss << self->tensor->data[i];
+    TensorFileHeader header;
+    if (!read_tensor_header(fd, (size_t)st.st_size, t, &header)) {
+        close(fd);
+        return false;
     }
-    if (self->tensor->data.size() > 6) oss << ", ...";
-    oss << "])";
-    return PyUnicode_FromString(oss.str().c_str());
+    size_t len = header.data_offset + header.data_bytes;
+    void* base = mmap(nullptr, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                      fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return false;
+    }
+    t->offset = 0;
+    t->storage = std::make_shared<Storage>(
+        Storage::from_mapping(base, len, header.data_offset, writable));
+    t->storage->shm_name = name;
+    return true;
 }
 
-// ============================================================
-// Module-level functions
-// ============================================================
-static PyObject* tensor_zeros(PyObject* self, PyObject* args) {
+// shared(shape, dtype='float64', name=None): zero-filled tensor in new
+// shared memory, or shared(t, name=None): a copy of t there. The name
+// defaults to a unique one; see t.shm_name.
+static PyObject* tensor_shared(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"shape", "dtype", "name", NULL};
     PyObject* shape_obj;
-    if (!PyArg_ParseTuple(args, "O", &shape_obj)) {
+    const char* dtype_str = NULL;
+    const char* name_str = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|zz", (char**)kwlist, &shape_obj,
+                                     &dtype_str, &name_str)) {
         return NULL;
     }
 
+    Tensor* src = nullptr;
     std::vector<size_t> shape;
-    if (PyLong_Check(shape_obj)) {
-        shape.push_back(PyLong_AsSize_t(shape_obj));
-    } else if (PyTuple_Check(shape_obj)) {
-        for (Py_ssize_t i = 0; i < PyTuple_Size(shape_obj); i++) {
-            shape.push_back(PyLong_AsSize_t(PyTuple_GetItem(shape_obj, i)));
-        }
-    } else {
-        PyErr_SetString(PyExc_TypeError, "shape must be int or tuple");
+    DType dtype = DType::Float64;
+    if (PyObject_TypeCheck(shape_obj, &PyTensorType)) {
+        src = get_tensor(shape_obj);
+        shape = src->shape;
+        dtype = src->dtype;
+    } else if (!parse_shape(shape_obj, shape)) {
         return NULL;
     }
+    if (dtype_str && !parse_dtype(dtype_str, &dtype)) return NULL;
+
+    std::unique_ptr<Tensor> src_conv;
+    if (src) {
+        src = operand(src, dtype, src_conv);
+        if (!src) return NULL;
+    }
+
+    TensorFileHeader header;
+    std::vector<char> prefix = tensor_file_prefix(shape, dtype, &header);
+    size_t len = header.data_offset + header.data_bytes;
+
+    // O_EXCL: never map someone else's object by accident
+    std::string name;
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < 100; attempt++) {
+        if (name_str) {
+            name = shm_path(name_str);
+        } else {
+            char buf[64];
+            std::snprintf(buf, sizeof(buf), "/tensor-%d-%llu", (int)getpid(),
+                          (unsigned long long)g_shm_counter.fetch_add(1));
+            name = buf;
+        }
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && (errno != EEXIST || name_str)) break;
+    }
+    if (fd < 0) return PyErr_SetFromErrnoWithFilename(PyExc_OSError, name.c_str());
+
+    void* base = MAP_FAILED;
+    if (ftruncate(fd, (off_t)len) == 0) {
+        base = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int err = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    std::memcpy(base, prefix.data(), prefix.size());
 
     Tensor* t = new Tensor();
     t->shape = shape;
-    t->data.resize(t->size(), 0.0);
+    t->dtype = dtype;
+    t->strides = Tensor::contiguous_strides(shape);
+    t->storage = std::make_shared<Storage>(
+        Storage::from_mapping(base, len, header.data_offset, true));
+    t->storage->shm_name = name;
+    t->storage->shm_owner = getpid();
+
+    if (src) {
+        launch({"copy", {src}}, [src = *src, dst = *t]() {
+            if (src.raw()) std::memcpy(dst.raw(), src.raw(), src.nbytes());
+        }, {t});
+    }
     return make_pytensor(t);
 }
 
-static PyObject* tensor_from_list(PyObject* self, PyObject* args) {
-    PyObject* list_obj;
-    if (!PyArg_ParseTuple(args, "O", &list_obj)) {
+// attach(name, mode='r+'): the tensor another process created with
+// shared(), mapped rather than copied. mode 'r' maps it read-only.
+static PyObject* tensor_attach(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"name", "mode", NULL};
+    const char* name;
+    const char* mode = "r+";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|s", (char**)kwlist, &name, &mode)) {
         return NULL;
     }
-
-    if (!PyList_Check(list_obj)) {
-        PyErr_SetString(PyExc_TypeError, "Expected list");
+    if (strcmp(mode, "r") != 0 && strcmp(mode, "r+") != 0) {
+        PyErr_SetString(PyExc_ValueError, "mode must be 'r' or 'r+'");
         return NULL;
     }
 
-    Tensor* t = new Tensor();
-    Py_ssize_t size0 = PyList_Size(list_obj);
-    
-    PyObject* first = PyList_GetItem(list_obj, 0);
-    if (PyList_Check(first)) {
-        Py_ssize_t size1 = PyList_Size(first);
-        t->shape = {(size_t)size0, (size_t)size1};
-        t->data.resize(size0 * size1);
-        
-        for (Py_ssize_t i = 0; i < size0; i++) {
-            PyObject* row = PyList_GetItem(list_obj, i);
-            for (Py_ssize_t j = 0; j < size1; j++) {
-                t->data[i * size1 + j] = PyFloat_AsDouble(PyList_GetItem(row, j));
-            }
-        }
-    } else {
-        t->shape = {(size_t)size0};
-        t->data.resize(size0);
-        for (Py_ssize_t i = 0; i < size0; i++) {
-            t->data[i] = PyFloat_AsDouble(PyList_GetItem(list_obj, i));
-        }
-    }
+    ProfileScope scope({"attach", {}});
+    std::unique_ptr<Tensor> t(new Tensor());
+    if (!attach_shared(shm_path(name), strcmp(mode, "r+") == 0, t.get())) return NULL;
+    scope.output(t.get());
+    return make_pytensor(t.release());
+}
+
+// ------------------------------------------------------------
+// Pickling
+// ------------------------------------------------------------
+// Shared-memory tensors pickle as their name and view, and unpickle by
+// attaching, so multiprocessing hands them to workers without copying.
+// Others pickle as dtype, shape and payload; with protocol 5 the payload
+// is a PickleBuffer over the tensor, which pickle.dumps(...,
+// buffer_callback=...) passes out of band instead of copying it into
+// the stream. Unpickling copies the payload into new storage once.
+
+// _rebuild(data, dtype, shape): tensor from a pickled payload
+static PyObject* tensor_rebuild(PyObject* self, PyObject* args) {
+    PyObject* data_obj;
+    const char* dtype_str;
+    PyObject* shape_obj;
+    if (!PyArg_ParseTuple(args, "OsO", &data_obj, &dtype_str, &shape_obj)) return NULL;
+
+    std::vector<size_t> shape;
+    DType dtype;
+    if (!parse_shape(shape_obj, shape) || !parse_dtype(dtype_str, &dtype)) return NULL;
 
-    if (PyErr_Occurred()) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(data_obj, &view, PyBUF_SIMPLE) < 0) return NULL;
+    ProfileScope scope({"unpickle", {}});
+    Tensor* t = new_tensor(shape, dtype);
+    if (t && (size_t)view.len != t->nbytes()) {
         delete t;
-        return NULL;
+        t = nullptr;
+        PyErr_SetString(PyExc_ValueError, "pickled tensor data has the wrong size");
     }
-
+    if (t && view.len > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        std::memcpy(t->raw(), view.buf, view.len);
+        Py_END_ALLOW_THREADS
+    }
+    PyBuffer_Release(&view);
+    if (!t) return NULL;
+    scope.output(t);
     return make_pytensor(t);
 }
 
-static PyObject* tensor_add(PyObject* self, PyObject* args) {
-    PyObject *a_obj, *b_obj;
-    if (!PyArg_ParseTuple(args, "OO", &a_obj, &b_obj)) {
+// _attach_view(name, writable, dtype, shape, strides, offset): a pickled
+// view of a shared-memory tensor
+static PyObject* tensor_attach_view(PyObject* self, PyObject* args) {
+    const char* name;
+    int writable;
+    const char* dtype_str;
+    PyObject *shape_obj, *strides_obj;
+    Py_ssize_t offset;
+    if (!PyArg_ParseTuple(args, "spsOOn", &name, &writable, &dtype_str, &shape_obj, &strides_obj,
+                          &offset)) {
         return NULL;
     }
-
-    Tensor* a = get_tensor(a_obj);
-    Tensor* b = get_tensor(b_obj);
-    if (!a || !b) return NULL;
-
-    if (!a->same_shape(*b)) {
-        PyErr_SetString(PyExc_ValueError, "Shape mismatch");
+    std::vector<size_t> shape;
+    DType dtype;
+    if (!parse_shape(shape_obj, shape) || !parse_dtype(dtype_str, &dtype)) return NULL;
+    if (!PyTuple_Check(strides_obj) || PyTuple_Size(strides_obj) != (Py_ssize_t)shape.size() ||
+        offset < 0) {
+        PyErr_SetString(PyExc_ValueError, "bad shared tensor view");
         return NULL;
     }
 
-    Tensor* result = new Tensor();
-    result->shape = a->shape;
-    result->data.resize(a->size());
-
-    for (size_t i = 0; i < a->size(); i++) {
-        result->data[i] = a->data[i] + b->data[i];
+    std::unique_ptr<Tensor> t(new Tensor());
+    if (!attach_shared(name, writable, t.get())) return NULL;
+    if (t->dtype != dtype) {
+        PyErr_SetString(PyExc_ValueError, "shared memory holds a different dtype");
+        return NULL;
     }
+    t->shape = shape;
+    t->offset = (size_t)offset;
+    t->strides.clear();
+    for (size_t d = 0; d < shape.size(); d++) {
+        long long stride = PyLong_AsLongLong(PyTuple_GET_ITEM(strides_obj, d));
+        if (stride < 0) {
+            if (!PyErr_Occurred()) PyErr_SetString(PyExc_ValueError, "bad shared tensor view");
+            return NULL;
+        }
+        t->strides.push_back(stride);
+    }
+    if (storage_extent(*t) > t->storage->bytes) {
+        PyErr_SetString(PyExc_ValueError, "shared tensor view is out of bounds");
+        return NULL;
+    }
+    return make_pytensor(t.release());
+}
 
-    return make_pytensor(result);
+static PyObject* shape_tuple(const std::vector<size_t>& shape) {
+    PyObject* tuple = PyTuple_New(shape.size());
+    if (!tuple) return NULL;
+    for (size_t i = 0; i < shape.size(); i++) {
+        PyTuple_SET_ITEM(tuple, i, PyLong_FromSize_t(shape[i]));
+    }
+    return tuple;
 }
 
-static PyObject* tensor_mul(PyObject* self, PyObject* args) {
-    PyObject *a_obj, *b_obj;
-    if (!PyArg_ParseTuple(args, "OO", &a_obj, &b_obj)) {
+static PyObject* Tensor_reduce_ex(PyTensor* self, PyObject* args) {
+    int protocol;
+    if (!PyArg_ParseTuple(args, "i", &protocol)) return NULL;
+    Tensor* t = self->tensor;
+    PyObject* module = PyImport_ImportModule("tensor");
+    if (!module) return NULL;
+
+    if (t->storage && !t->storage->shm_name.empty()) {
+        PyObject* strides = PyTuple_New(t->strides.size());
+        if (!strides) {
+            Py_DECREF(module);
+            return NULL;
+        }
+        for (size_t i = 0; i < t->strides.size(); i++) {
+            PyTuple_SET_ITEM(strides, i, PyLong_FromLongLong(t->strides[i]));
+        }
+        PyObject* result = Py_BuildValue("(N(sNsNNn))", PyObject_GetAttrString(module, "_attach_view"),
+                                         t->storage->shm_name.c_str(),
+                                         PyBool_FromLong(t->storage->writable),
+                                         dtype_name(t->dtype), shape_tuple(t->shape), strides,
+                                         (Py_ssize_t)t->offset);
+        Py_DECREF(module);
+        return result;
+    }
+
+    // The payload, row-major
+    std::unique_ptr<Tensor> gathered;
+    Tensor* c = operand(t, t->dtype, gathered);
+    if (!c) {
+        Py_DECREF(module);
         return NULL;
     }
+    PyObject* data;
+    if (protocol >= 5) {
+        PyObject* owner = c == t ? (Py_INCREF(self), (PyObject*)self)
+                                 : make_pytensor(gathered.release());
+        data = owner ? PyPickleBuffer_FromObject(owner) : NULL;
+        Py_XDECREF(owner);
+    } else {
+        data = NULL;
+        if (wait_ready(c)) {
+            data = PyBytes_FromStringAndSize(c->raw() ? (const char*)c->raw() : "",
+                                             (Py_ssize_t)c->nbytes());
+        }
+    }
+    PyObject* result = Py_BuildValue("(N(NsN))", PyObject_GetAttrString(module, "_rebuild"), data,
+                                     dtype_name(t->dtype), shape_tuple(t->shape));
+    Py_DECREF(module);
+    return result;
+}
 
-    Tensor* a = get_tensor(a_obj);
-    Tensor* b = get_tensor(b_obj);
-    if (!a || !b) return NULL;
+static PyObject* Tensor_shm_name(PyTensor* self, void* closure) {
+    const Storage* s = self->tensor->storage.get();
+    if (!s || s->shm_name.empty()) Py_RETURN_NONE;
+    return PyUnicode_FromString(s->shm_name.c_str());
+}
 
-    if (!a->same_shape(*b)) {
-        PyErr_SetString(PyExc_ValueError, "Shape mismatch");
-        return NULL;
+// Read-only buffer over a contiguous tensor (memoryview, PickleBuffer,
+// numpy.asarray). It exports a copy-on-write copy where it can, so the
+// bytes stay valid and unchanged while the buffer lives even if the
+// tensor is written in place; shared memory and mappings are exported
+// as they are.
+static int Tensor_getbuffer(PyTensor* self, Py_buffer* view, int flags) {
+    view->obj = NULL;
+    Tensor* t = self->tensor;
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "tensor buffers are read-only");
+        return -1;
+    }
+    if (!t->is_contiguous()) {
+        PyErr_SetString(PyExc_BufferError, "tensor is not contiguous (use .contiguous())");
+        return -1;
     }
+    if (!wait_ready(t)) return -1;
 
-    Tensor* result = new Tensor();
-    result->shape = a->shape;
-    result->data.resize(a->size());
+    PyObject* owner = (PyObject*)self;
+    if (!g_capture && can_share(t->storage.get())) {
+        owner = make_pytensor(share_tensor(t));
+        if (!owner) return -1;
+    } else {
+        Py_INCREF(owner);
+    }
+    const Tensor* src = ((PyTensor*)owner)->tensor;
 
-    for (size_t i = 0; i < a->size(); i++) {
-        result->data[i] = a->data[i] * b->data[i];
+    size_t ndim = src->shape.size();
+    Py_ssize_t* dims = new (std::nothrow) Py_ssize_t[2 * ndim + 1];  // shape, then strides
+    if (!dims) {
+        Py_DECREF(owner);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (size_t d = 0; d < ndim; d++) {
+        dims[d] = (Py_ssize_t)src->shape[d];
+        dims[ndim + d] = (Py_ssize_t)(src->strides[d] * src->itemsize());
     }
 
-    return make_pytensor(result);
+    static char empty;
+    static const char* formats[] = {"?", "i", "q", "f", "d", "b"};  // by DType value
+    view->obj = owner;
+    view->buf = src->raw() ? src->raw() : &empty;
+    view->len = (Py_ssize_t)src->nbytes();
+    view->readonly = 1;
+    view->itemsize = (Py_ssize_t)src->itemsize();
+    view->format = (flags & PyBUF_FORMAT) ? (char*)formats[(int)src->dtype] : NULL;
+    view->ndim = (int)ndim;
+    view->shape = (flags & PyBUF_ND) ? dims : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? dims + ndim : NULL;
+    view->suboffsets = NULL;
+    view->internal = dims;
+    return 0;
 }
 
-static PyObject* tensor_matmul(PyObject* self, PyObject* args) {
-    PyObject *a_obj, *b_obj;
-    if (!PyArg_ParseTuple(args, "OO", &a_obj, &b_obj)) {
+static void Tensor_releasebuffer(PyTensor* self, Py_buffer* view) {
+    delete[] (Py_ssize_t*)view->internal;
+}
+
+static PyObject* tensor_memory_stats(PyObject* self, PyObject* args) {
+    size_t requests = g_stats.requests.load();
+    size_t hits = g_stats.cache_hits.load();
+    double hit_rate = requests ? (double)hits / requests : 0.0;
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:d,s:n,s:n}",
+        "allocated_bytes", (Py_ssize_t)g_stats.allocated_bytes.load(),
+        "cached_bytes", (Py_ssize_t)g_stats.cached_bytes.load(),
+        "peak_bytes", (Py_ssize_t)g_stats.peak_bytes.load(),
+        "requests", (Py_ssize_t)requests,
+        "cache_hits", (Py_ssize_t)hits,
+        "hit_rate", hit_rate,
+        "system_allocs", (Py_ssize_t)g_stats.system_allocs.load(),
+        "system_frees", (Py_ssize_t)g_stats.system_frees.load());
+}
+
+static PyObject* tensor_empty_cache(PyObject* self, PyObject* args) {
+    storage_empty_cache();
+    Py_RETURN_NONE;
+}
+
+static PyObject* tensor_set_huge_pages(PyObject* self, PyObject* args) {
+    const char* mode_str;
+    Py_ssize_t threshold = -1;
+    if (!PyArg_ParseTuple(args, "s|n", &mode_str, &threshold)) {
         return NULL;
     }
 
-    Tensor* a = get_tensor(a_obj);
-    Tensor* b = get_tensor(b_obj);
-    if (!a || !b) return NULL;
-
-    if (a->shape.size() != 2 || b->shape.size() != 2) {
-        PyErr_SetString(PyExc_ValueError, "matmul requires 2D tensors");
+    HugePages mode;
+    if (strcmp(mode_str, "off") == 0) {
+        mode = HugePages::Off;
+    } else if (strcmp(mode_str, "thp") == 0) {
+        mode = HugePages::Transparent;
+    } else if (strcmp(mode_str, "hugetlb") == 0) {
+        mode = HugePages::Explicit;
+    } else {
+        PyErr_SetString(PyExc_ValueError, "mode must be 'off', 'thp' or 'hugetlb'");
         return NULL;
     }
 
-    size_t m = a->shape[0];
-    size_t k = a->shape[1];
-    size_t n = b->shape[1];
+    g_huge_pages = mode;
+    if (threshold >= 0) g_huge_threshold = (size_t)threshold;
 
-    if (k != b->shape[0]) {
-        PyErr_SetString(PyExc_ValueError, "Inner dimensions must match");
+    // Cached blocks were mapped under the old policy
+    storage_empty_cache();
+    Py_RETURN_NONE;
+}
+
+// ------------------------------------------------------------
+// Profiler (tensor.profiler)
+// ------------------------------------------------------------
+static const size_t kProfileDefaultEvents = 1 << 16;
+
+static uint64_t g_profile_origin = 0;  // profiler.start() time; trace timestamps count from here
+
+// start(capacity=65536): clears earlier events
+static PyObject* profiler_start(PyObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* kwlist[] = {"capacity", NULL};
+    Py_ssize_t capacity = kProfileDefaultEvents;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n", (char**)kwlist, &capacity)) {
+        return NULL;
+    }
+    if (capacity < 1) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be positive");
         return NULL;
     }
+    ProfileSlot* ring = new (std::nothrow) ProfileSlot[capacity];
+    if (!ring) return PyErr_NoMemory();
 
-    Tensor* result = new Tensor();
-    result->shape = {m, n};
-    result->data.resize(m * n, 0.0);
+    // Queued ops may still record into the old ring; the calling thread
+    // holds the GIL, so nothing new is launched meanwhile
+    g_profiling.store(false);
+    Py_BEGIN_ALLOW_THREADS
+    stream_drain();
+    Py_END_ALLOW_THREADS
+    delete[] g_profile_ring;
+    g_profile_ring = ring;
+    g_profile_capacity = (size_t)capacity;
+    g_profile_next.store(0);
+    g_profile_origin = profile_clock();
+    g_profiling.store(true);
+    Py_RETURN_NONE;
+}
 
-    for (size_t i = 0; i < m; i++) {
-        for (size_t j = 0; j < n; j++) {
-            double sum = 0.0;
-            for (size_t kk = 0; kk < k; kk++) {
-                sum += a->data[i * k + kk] * b->data[kk * n + j];
-            }
-            result->data[i * n + j] = sum;
+// stop(): waits for queued ops so their events are complete
+static PyObject* profiler_stop(PyObject* self, PyObject* args) {
+    g_profiling.store(false);
+    Py_BEGIN_ALLOW_THREADS
+    stream_drain();
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject* profiler_is_enabled(PyObject* self, PyObject* args) {
+    return PyBool_FromLong(g_profiling.load());
+}
+
+static std::vector<ProfileEvent> profile_events(uint64_t* dropped) {
+    *dropped = 0;
+    if (!g_profile_ring) return {};
+    return profile_snapshot(dropped);
+}
+
+static double profile_us(uint64_t ns) {
+    return ns >= g_profile_origin ? (ns - g_profile_origin) / 1e3 : 0.0;
+}
+
+// events(): one dict per recorded op, oldest first
+static PyObject* profiler_events(PyObject* self, PyObject* args) {
+    uint64_t dropped;
+    std::vector<ProfileEvent> events = profile_events(&dropped);
+    PyObject* list = PyList_New(events.size());
+    if (!list) return NULL;
+    for (size_t i = 0; i < events.size(); i++) {
+        const ProfileEvent& e = events[i];
+        PyObject* item = Py_BuildValue("{s:s,s:s,s:s,s:s,s:d,s:d,s:d,s:K,s:d}",
+            "name", e.name,
+            "dtype", e.dtype,
+            "shapes", e.shapes,
+            "thread", e.on_stream ? "stream" : "host",
+            "queued_us", profile_us(e.queued_ns),
+            "start_us", profile_us(e.start_ns),
+            "duration_us", (e.end_ns - e.start_ns) / 1e3,
+            "bytes", (unsigned long long)e.bytes,
+            "flops", e.flops);
+        if (!item) {
+            Py_DECREF(list);
+            return NULL;
         }
+        PyList_SET_ITEM(list, i, item);
     }
+    return list;
+}
 
-    return make_pytensor(result);
+// summary(): per-op totals as a table, most expensive first
+static PyObject* profiler_summary(PyObject* self, PyObject* args) {
+    struct Totals {
+        const char* name;
+        size_t calls = 0;
+        uint64_t ns = 0, bytes = 0;
+        double flops = 0;
+    };
+    uint64_t dropped;
+    std::vector<ProfileEvent> events = profile_events(&dropped);
+    std::vector<Totals> ops;
+    uint64_t all_ns = 0;
+    for (const ProfileEvent& e : events) {
+        auto it = std::find_if(ops.begin(), ops.end(), [&](const Totals& t) {
+            return std::strcmp(t.name, e.name) == 0;
+        });
+        if (it == ops.end()) {
+            ops.push_back(Totals{e.name});
+            it = ops.end() - 1;
+        }
+        uint64_t ns = e.end_ns - e.start_ns;
+        it->calls++;
+        it->ns += ns;
+        it->bytes += e.bytes;
+        it->flops += e.flops;
+        all_ns += ns;
+    }
+    std::sort(ops.begin(), ops.end(), [](const Totals& a, const Totals& b) { return a.ns > b.ns; });
+
+    std::string out;
+    char line[160];
+    std::snprintf(line, sizeof(line), "%-12s %8s %12s %12s %7s %10s %10s\n",
+                  "op", "calls", "total ms", "mean us", "%", "GB/s", "GFLOP/s");
+    out += line;
+    out += std::string(76, '-') + "\n";
+    for (const Totals& t : ops) {
+        double seconds = t.ns / 1e9;
+        std::snprintf(line, sizeof(line), "%-12s %8zu %12.3f %12.2f %7.1f %10.2f %10.2f\n",
+                      t.name, t.calls, t.ns / 1e6, t.ns / 1e3 / t.calls,
+                      all_ns ? 100.0 * t.ns / all_ns : 0.0,
+                      seconds > 0 ? t.bytes / seconds / 1e9 : 0.0,
+                      seconds > 0 ? t.flops / seconds / 1e9 : 0.0);
+        out += line;
+    }
+    std::snprintf(line, sizeof(line), "%zu events, %.3f ms total", events.size(), all_ns / 1e6);
+    out += line;
+    if (dropped > 0) {
+        std::snprintf(line, sizeof(line), " (%llu older events overwritten)",
+                      (unsigned long long)dropped);
+        out += line;
+    }
+    out += "\n";
+    return PyUnicode_FromString(out.c_str());
 }
 
-static PyObject* tensor_sum(PyObject* self, PyObject* args) {
-    PyObject* a_obj;
-    if (!PyArg_ParseTuple(args, "O", &a_obj)) {
+// export_chrome_trace(path): JSON for chrome://tracing or Perfetto. Host
+// and stream work appear as two threads.
+static PyObject* profiler_export_chrome_trace(PyObject* self, PyObject* args) {
+    PyObject* path_obj;
+    if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &path_obj)) {
         return NULL;
     }
+    const char* path = PyBytes_AS_STRING(path_obj);
 
-    Tensor* a = get_tensor(a_obj);
-    if (!a) return NULL;
-
-    double sum = 0.0;
-    for (double val : a->data) {
-        sum += val;
+    uint64_t dropped;
+    std::vector<ProfileEvent> events = profile_events(&dropped);
+    long pid = (long)getpid();
+    std::ostringstream json;
+    json << "{\"traceEvents\": [\n";
+    json << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid
+         << ", \"tid\": 1, \"args\": {\"name\": \"tensor\"}},\n";
+    json << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+         << ", \"tid\": 1, \"args\": {\"name\": \"host\"}},\n";
+    json << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+         << ", \"tid\": 2, \"args\": {\"name\": \"stream\"}}";
+    char ts[64];
+    for (const ProfileEvent& e : events) {
+        std::snprintf(ts, sizeof(ts), "\"ts\": %.3f, \"dur\": %.3f",
+                      profile_us(e.start_ns), (e.end_ns - e.start_ns) / 1e3);
+        // Names and shapes are built here and need no escaping
+        json << ",\n{\"name\": \"" << e.name << "\", \"cat\": \"tensor\", \"ph\": \"X\", "
+             << ts << ", \"pid\": " << pid << ", \"tid\": " << (e.on_stream ? 2 : 1)
+             << ", \"args\": {\"shapes\": \"" << e.shapes << "\", \"dtype\": \"" << e.dtype
+             << "\", \"bytes\": " << e.bytes << ", \"flops\": " << (uint64_t)e.flops;
+        if (e.on_stream) {
+            std::snprintf(ts, sizeof(ts), "%.3f", (e.start_ns - e.queued_ns) / 1e3);
+            json << ", \"queued_us\": " << ts;
+        }
+        json << "}}";
     }
+    json << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    std::string text = json.str();
 
-    return PyFloat_FromDouble(sum);
+    bool ok = false;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        ok = write_all(fd, text.data(), text.size());
+        ok = close(fd) == 0 && ok;
+    }
+    if (!ok) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        Py_DECREF(path_obj);
+        return NULL;
+    }
+    Py_DECREF(path_obj);
+    Py_RETURN_NONE;
 }
 
 // ============================================================
 // Module definition
 // ============================================================
 static PyMethodDef TensorMethods[] = {
-    {"zeros", tensor_zeros, METH_VARARGS, "Create tensor of zeros"},
-    {"from_list", tensor_from_list, METH_VARARGS, "Create tensor from list"},
+    {"zeros", (PyCFunction)tensor_zeros, METH_VARARGS | METH_KEYWORDS,
+     "Create tensor of zeros: zeros(shape, dtype='float64')"},
+    {"empty", (PyCFunction)tensor_empty, METH_VARARGS | METH_KEYWORDS,
+     "Create uninitialized tensor: empty(shape, dtype='float64')"},
+    {"from_list", (PyCFunction)tensor_from_list, METH_VARARGS | METH_KEYWORDS,
+     "Create tensor from list: from_list(data, dtype='float64')"},
+    {"rand", (PyCFunction)tensor_rand, METH_VARARGS | METH_KEYWORDS,
+     "Uniform on [0, 1): rand(shape, dtype='float64', seed=None, offset=None)"},
+    {"randn", (PyCFunction)tensor_randn, METH_VARARGS | METH_KEYWORDS,
+     "Standard normal: randn(shape, dtype='float64', seed=None, offset=None)"},
+    {"randint", (PyCFunction)tensor_randint, METH_VARARGS | METH_KEYWORDS,
+     "Integers in [low, high): randint(low, high, shape, dtype='int64', seed=None, offset=None)"},
+    {"manual_seed", tensor_manual_seed, METH_VARARGS,
+     "Reset the default generator: manual_seed(seed)"},
+    {"get_rng_state", tensor_get_rng_state, METH_NOARGS,
+     "Default generator state as (seed, counter)"},
+    {"set_rng_state", tensor_set_rng_state, METH_VARARGS,
+     "Restore a state from get_rng_state()"},
     {"add", tensor_add, METH_VARARGS, "Element-wise addition"},
     {"mul", tensor_mul, METH_VARARGS, "Element-wise multiplication"},
-    {"matmul", tensor_matmul, METH_VARARGS, "Matrix multiplication"},
-    {"sum", tensor_sum, METH_VARARGS, "Sum all elements"},
+    {"matmul", tensor_matmul, METH_VARARGS, "Matrix multiplication, batched over leading dimensions"},
+    {"conv2d", (PyCFunction)tensor_conv2d, METH_VARARGS | METH_KEYWORDS,
+     "conv2d(x, w, bias=None, stride=1, padding=0, dilation=1, method='auto'): 2D convolution"},
+    {"quantize", (PyCFunction)tensor_quantize, METH_VARARGS | METH_KEYWORDS,
+     "int8 quantization: quantize(x, scale, zero_point=0, axis=None)"},
+    {"dequantize", (PyCFunction)tensor_dequantize, METH_VARARGS | METH_KEYWORDS,
+     "dequantize(q, scale, zero_point=0, axis=None, dtype='float32')"},
+    {"qparams", (PyCFunction)tensor_qparams, METH_VARARGS | METH_KEYWORDS,
+     "Scale and zero point covering x: qparams(x, axis=None, symmetric=True)"},
+    {"qmatmul", (PyCFunction)tensor_qmatmul, METH_VARARGS | METH_KEYWORDS,
+     "int8 matmul: qmatmul(a, b, a_scale=None, b_scale=None, a_zero_point=0, b_zero_point=0, "
+     "bias=None, out_scale=None, out_zero_point=0)"},
+    {"transpose", (PyCFunction)tensor_transpose, METH_VARARGS | METH_KEYWORDS,
+     "Transposed view: transpose(t, axes=None)"},
+    {"exp", (PyCFunction)tensor_exp, METH_VARARGS | METH_KEYWORDS, "Elementwise e^x: exp(a, out=None)"},
+    {"log", (PyCFunction)tensor_log, METH_VARARGS | METH_KEYWORDS,
+     "Elementwise natural log: log(a, out=None)"},
+    {"tanh", (PyCFunction)tensor_tanh, METH_VARARGS | METH_KEYWORDS,
+     "Elementwise tanh: tanh(a, out=None)"},
+    {"sigmoid", (PyCFunction)tensor_sigmoid, METH_VARARGS | METH_KEYWORDS,
+     "Elementwise 1 / (1 + e^-x): sigmoid(a, out=None)"},
+    {"relu", (PyCFunction)tensor_relu, METH_VARARGS | METH_KEYWORDS,
+     "Elementwise max(x, 0): relu(a, out=None)"},
+    {"exp_", tensor_exp_, METH_VARARGS, "In-place exp"},
+    {"log_", tensor_log_, METH_VARARGS, "In-place log"},
+    {"tanh_", tensor_tanh_, METH_VARARGS, "In-place tanh"},
+    {"sigmoid_", tensor_sigmoid_, METH_VARARGS, "In-place sigmoid"},
+    {"relu_", tensor_relu_, METH_VARARGS, "In-place relu"},
+    {"gelu", (PyCFunction)tensor_gelu, METH_VARARGS | METH_KEYWORDS,
+     "Elementwise GELU (tanh form): gelu(a, out=None)"},
+    {"gelu_", tensor_gelu_, METH_VARARGS, "In-place gelu"},
+    {"softmax", (PyCFunction)tensor_softmax, METH_VARARGS | METH_KEYWORDS,
+     "Softmax over the last axis: softmax(a, out=None)"},
+    {"log_softmax", (PyCFunction)tensor_log_softmax, METH_VARARGS | METH_KEYWORDS,
+     "Log of softmax over the last axis: log_softmax(a, out=None)"},
+    {"layer_norm", (PyCFunction)tensor_layer_norm, METH_VARARGS | METH_KEYWORDS,
+     "Layer normalization over the last axis: layer_norm(a, weight=None, bias=None, eps=1e-5, out=None)"},
+    {"sparse_coo", (PyCFunction)tensor_sparse_coo, METH_VARARGS | METH_KEYWORDS,
+     "CSR sparse matrix from COO triplets: sparse_coo(row, col, values, shape, dtype='float64')"},
+    {"to_sparse", tensor_to_sparse, METH_VARARGS, "CSR sparse matrix from a dense 2D tensor"},
+    {"spmv", tensor_spmv, METH_VARARGS, "Sparse matrix times dense vector"},
+    {"spmm", tensor_spmm, METH_VARARGS, "Sparse matrix times dense matrix"},
+    {"sum", (PyCFunction)tensor_sum, METH_VARARGS | METH_KEYWORDS,
+     "Sum: sum(a, axis=None, keepdims=False)"},
+    {"mean", (PyCFunction)tensor_mean, METH_VARARGS | METH_KEYWORDS,
+     "Mean: mean(a, axis=None, keepdims=False)"},
+    {"max", (PyCFunction)tensor_max, METH_VARARGS | METH_KEYWORDS,
+     "Maximum: max(a, axis=None, keepdims=False)"},
+    {"min", (PyCFunction)tensor_min, METH_VARARGS | METH_KEYWORDS,
+     "Minimum: min(a, axis=None, keepdims=False)"},
+    {"argmax", (PyCFunction)tensor_argmax, METH_VARARGS | METH_KEYWORDS,
+     "Index of the first maximum: argmax(a, axis=None, keepdims=False)"},
+    {"cumsum", (PyCFunction)tensor_cumsum, METH_VARARGS | METH_KEYWORDS,
+     "Running sum along an axis: cumsum(a, axis=None)"},
+    {"cumprod", (PyCFunction)tensor_cumprod, METH_VARARGS | METH_KEYWORDS,
+     "Running product along an axis: cumprod(a, axis=None)"},
+    {"index_select", (PyCFunction)tensor_index_select, METH_VARARGS | METH_KEYWORDS,
+     "Rows at index along an axis: index_select(a, axis, index)"},
+    {"index_add", (PyCFunction)tensor_index_add, METH_VARARGS | METH_KEYWORDS,
+     "Copy of a with src rows added at index: index_add(a, axis, index, src)"},
+    {"index_add_", (PyCFunction)tensor_index_add_, METH_VARARGS | METH_KEYWORDS,
+     "In-place index_add; returns a"},
+    {"gather", (PyCFunction)tensor_gather, METH_VARARGS | METH_KEYWORDS,
+     "Values at index along an axis, elementwise: gather(a, axis, index)"},
+    {"scatter", (PyCFunction)tensor_scatter, METH_VARARGS | METH_KEYWORDS,
+     "Copy of a with src written at index: scatter(a, axis, index, src)"},
+    {"scatter_", (PyCFunction)tensor_scatter_, METH_VARARGS | METH_KEYWORDS,
+     "In-place scatter; returns a"},
+    {"scatter_add", (PyCFunction)tensor_scatter_add, METH_VARARGS | METH_KEYWORDS,
+     "Copy of a with src added at index: scatter_add(a, axis, index, src)"},
+    {"scatter_add_", (PyCFunction)tensor_scatter_add_, METH_VARARGS | METH_KEYWORDS,
+     "In-place scatter_add; returns a"},
+    {"concat", (PyCFunction)tensor_concat, METH_VARARGS | METH_KEYWORDS,
+     "Join tensors along an existing axis: concat(tensors, axis=0)"},
+    {"stack", (PyCFunction)tensor_stack, METH_VARARGS | METH_KEYWORDS,
+     "Join tensors along a new axis: stack(tensors, axis=0)"},
+    {"builder", (PyCFunction)tensor_builder, METH_VARARGS | METH_KEYWORDS,
+     "Growable row buffer: builder(row_shape=None, dtype=None, capacity=0)"},
+    {"sort", (PyCFunction)tensor_sort, METH_VARARGS | METH_KEYWORDS,
+     "Sorted copy along an axis: sort(a, axis=-1, descending=False)"},
+    {"argsort", (PyCFunction)tensor_argsort, METH_VARARGS | METH_KEYWORDS,
+     "Stable sorting indices as int64: argsort(a, axis=-1, descending=False)"},
+    {"topk", (PyCFunction)tensor_topk, METH_VARARGS | METH_KEYWORDS,
+     "k largest (or smallest) values and their indices: topk(a, k, axis=-1, largest=True)"},
+    {"set_out_of_core_threshold", tensor_set_out_of_core_threshold, METH_VARARGS,
+     "Operand bytes at which matmul over mapped tensors streams tiles from disk"},
+    {"set_num_threads", tensor_set_num_threads, METH_VARARGS, "Worker threads for parallel kernels"},
+    {"get_num_threads", tensor_get_num_threads, METH_NOARGS, "Worker threads for parallel kernels"},
+    {"capture", tensor_capture, METH_VARARGS,
+     "Record the ops fn runs as a replayable Graph: capture(fn, *inputs)"},
+    {"set_async", tensor_set_async, METH_VARARGS,
+     "Queue ops on a background stream instead of running them inline; returns the old setting"},
+    {"synchronize", tensor_synchronize, METH_NOARGS, "Wait for every queued op"},
+    {"save", tensor_save, METH_VARARGS, "Write tensor to a file: save(path, t)"},
+    {"load", (PyCFunction)tensor_load, METH_VARARGS | METH_KEYWORDS,
+     "Read tensor from a file: load(path, mmap=True, mode='r')"},
+    {"shared", (PyCFunction)tensor_shared, METH_VARARGS | METH_KEYWORDS,
+     "Tensor in POSIX shared memory: shared(shape, dtype='float64', name=None) or shared(t)"},
+    {"attach", (PyCFunction)tensor_attach, METH_VARARGS | METH_KEYWORDS,
+     "Map a shared() tensor from another process by name: attach(name, mode='r+')"},
+    {"_rebuild", tensor_rebuild, METH_VARARGS, "Unpickle helper"},
+    {"_attach_view", tensor_attach_view, METH_VARARGS, "Unpickle helper for shared tensors"},
+    {"memory_stats", tensor_memory_stats, METH_NOARGS, "Caching allocator statistics"},
+    {"empty_cache", tensor_empty_cache, METH_NOARGS, "Release cached storage to the system"},
+    {"set_huge_pages", tensor_set_huge_pages, METH_VARARGS,
+     "Huge page policy for large tensors: set_huge_pages('off'|'thp'|'hugetlb', threshold_bytes=None)"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMethodDef ProfilerMethods[] = {
+    {"start", (PyCFunction)profiler_start, METH_VARARGS | METH_KEYWORDS,
+     "Start recording ops, clearing earlier events: start(capacity=65536)"},
+    {"stop", profiler_stop, METH_NOARGS, "Stop recording (waits for queued ops)"},
+    {"is_enabled", profiler_is_enabled, METH_NOARGS, "Whether ops are being recorded"},
+    {"events", profiler_events, METH_NOARGS, "Recorded ops as a list of dicts, oldest first"},
+    {"summary", profiler_summary, METH_NOARGS, "Per-op totals as a table"},
+    {"export_chrome_trace", profiler_export_chrome_trace, METH_VARARGS,
+     "Write events as Chrome trace JSON: export_chrome_trace(path)"},
     {NULL, NULL, 0, NULL}
 };
 
+static struct PyModuleDef profilermodule = {
+    PyModuleDef_HEAD_INIT,
+    "tensor.profiler",
+    "Per-op profiler for the tensor module",
+    -1,
+    ProfilerMethods
+};
+
 static struct PyModuleDef tensormodule = {
     PyModuleDef_HEAD_INIT,
     "tensor",
@@ -384,7 +9116,8 @@ static struct PyModuleDef tensormodule = {
 };
 
 PyMODINIT_FUNC PyInit_tensor(void) {
-    if (PyType_Ready(&PyTensorType) < 0) {
+    if (PyType_Ready(&PyTensorType) < 0 || PyType_Ready(&PySparseTensorType) < 0 ||
+        PyType_Ready(&PyGraphType) < 0 || PyType_Ready(&PyBuilderType) < 0) {
         return NULL;
     }
 
@@ -398,5 +9131,50 @@ PyMODINIT_FUNC PyInit_tensor(void) {
         return NULL;
     }
 
+    Py_INCREF(&PySparseTensorType);
+    if (PyModule_AddObject(m, "SparseTensor", (PyObject*)&PySparseTensorType) < 0) {
+        Py_DECREF(&PySparseTensorType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&PyGraphType);
+    if (PyModule_AddObject(m, "Graph", (PyObject*)&PyGraphType) < 0) {
+        Py_DECREF(&PyGraphType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    Py_INCREF(&PyBuilderType);
+    if (PyModule_AddObject(m, "Builder", (PyObject*)&PyBuilderType) < 0) {
+        Py_DECREF(&PyBuilderType);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    PyObject* profiler = PyModule_Create(&profilermodule);
+    if (!profiler || PyModule_AddObject(m, "profiler", profiler) < 0) {
+        Py_XDECREF(profiler);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+    // tensor.float32 etc., usable wherever a dtype name is expected
+    static const DType dtypes[] = {DType::Bool, DType::Int8, DType::Int32, DType::Int64,
+                                   DType::Float32, DType::Float64};
+    for (DType d : dtypes) {
+        if (PyModule_AddStringConstant(m, dtype_name(d), dtype_name(d)) < 0) {
+            Py_DECREF(m);
+            return NULL;
+        }
+    }
+
+    // The qmatmul inner kernel this CPU gets, e.g. "avx2"
+    qgemm_select();
+    if (PyModule_AddStringConstant(m, "qgemm_kernel", qgemm_kernel_name()) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+
     return m;
 }
\ No newline at end of file
@@ -15,6 +15,20 @@ v2 = tensor.from_list([5.0, 6.0, 7.0, 8.0])
 print(f"v1: {v1}")
 print(f"v2: {v2}")
 
+print("\n=== Random Numbers ===")
+u = tensor.rand(4, seed=0)
+print(f"rand(4, seed=0): {[round(x, 6) for x in u.tolist()]}")     # [0.399046, 0.972241, 0.019449, 0.787368]
+print(f"randint(1, 7, (2, 5)): {tensor.randint(1, 7, (2, 5), seed=0).tolist()}")
+n = tensor.randn(100_000, dtype="float32", seed=1)
+print(f"randn mean/std: {tensor.mean(n):.2f} {tensor.mean(tensor.mul(n, n)) ** 0.5:.2f}")  # 0.00 1.00
+print(f"offset=2 continues the stream: {tensor.rand(2, seed=0, offset=2).tolist() == u.tolist()[2:]}")
+tensor.manual_seed(7)
+state = tensor.get_rng_state()             # (7, 0)
+first = tensor.rand(3).tolist()
+tensor.set_rng_state(state)
+print(f"state {state} replays: {tensor.rand(3).tolist() == first}")
+print(f"next call differs: {tensor.rand(3).tolist() != first}")
+
 print("\n=== Element-wise Operations ===")
 print(f"add(v1, v2): {tensor.add(v1, v2)}")
 print(f"mul(v1, v2): {tensor.mul(v1, v2)}")
@@ -27,4 +41,417 @@ print(f"m1: {m1}")
 print(f"m2: {m2}")
 result = tensor.matmul(m1, m2)
 print(f"matmul(m1, m2): {result}")
-print(f"as list: {result.tolist()}")
\ No newline at end of file
+print(f"as list: {result.tolist()}")
+print("\n=== Caching Allocator ===")
+x = tensor.from_list([[float(i + j) for j in range(64)] for i in range(64)])
+for _ in range(3):
+    y = tensor.add(tensor.matmul(x, x), x)
+before = tensor.memory_stats()
+for _ in range(100):
+    y = tensor.add(tensor.matmul(x, x), x)
+after = tensor.memory_stats()
+print(f"system allocs in steady-state loop: {after['system_allocs'] - before['system_allocs']}")
+print("  (expected: 0)")
+print(f"hit rate: {after['hit_rate']:.2f}, peak bytes: {after['peak_bytes']}")
+del y
+tensor.empty_cache()
+print(f"cached bytes after empty_cache(): {tensor.memory_stats()['cached_bytes']}")
+
+print("\n=== Aligned / Huge-Page Storage ===")
+big = tensor.zeros((1024, 1024))   # 8 MB: mapped, 2 MB aligned, THP-advised
+print(f"sum of 8 MB zeros: {tensor.sum(big)}")
+tensor.set_huge_pages("off")
+big = tensor.zeros((1024, 1024))
+print(f"with huge pages off: {tensor.sum(big)}")
+tensor.set_huge_pages("thp")
+
+print("\n=== Lazy Zeros / empty() ===")
+dirty = tensor.zeros(400_000)        # 3.2 MB blocks
+dirty = tensor.add(tensor.exp(dirty), tensor.exp(dirty))  # all 2.0
+del dirty                            # non-zero blocks go back to the cache...
+z = tensor.zeros(400_000)            # ...and is reused without a memset
+print(f"sum(zeros(400000)) from a recycled block: {tensor.sum(z)}")
+print("  (expected: 0.0)")
+e = tensor.empty((2, 3))
+print(f"empty((2, 3)).shape: {e.shape}")
+
+print("\n=== Data Types ===")
+f32 = tensor.from_list([[1.0, 2.0], [3.0, 4.0]], dtype="float32")
+i32 = tensor.from_list([[1, 0], [0, 1]], dtype=tensor.int32)
+print(f"f32: {f32}")
+print(f"i32: {i32}")
+print(f"matmul(f32, i32): {tensor.matmul(f32, i32)}")
+print("  (int32 @ float32 promotes to float32)")
+flags = tensor.from_list([True, False, True], dtype="bool")
+print(f"sum(bool): {tensor.sum(flags)}")
+print(f"astype: {f32.astype('int64').tolist()}")
+
+print("\n=== Axis Reductions ===")
+r = tensor.from_list([[1.0, 5.0, 3.0], [4.0, 2.0, 6.0]])
+print(f"r: {r.tolist()}")
+print(f"sum(r, axis=0): {tensor.sum(r, axis=0).tolist()}")       # [5, 7, 9]
+print(f"mean(r, axis=1): {tensor.mean(r, axis=1).tolist()}")     # [3, 4]
+print(f"max(r, axis=1, keepdims=True): {tensor.max(r, axis=1, keepdims=True).tolist()}")
+print(f"min(r, axis=-1): {tensor.min(r, axis=-1).tolist()}")     # [1, 2]
+print(f"argmax(r, axis=1): {tensor.argmax(r, axis=1).tolist()}") # [1, 2]
+print(f"argmax(r): {tensor.argmax(r)}")                          # 5 (flat index)
+long_row = tensor.from_list([float(i % 7) for i in range(200_000)])
+totals = set()
+for n in [1, 2, 4]:
+    tensor.set_num_threads(n)
+    totals.add(tensor.sum(long_row))
+print(f"sum with 1/2/4 threads identical: {len(totals) == 1}")
+
+print("\n=== Prefix Scans ===")
+print(f"cumsum(r, axis=1): {tensor.cumsum(r, axis=1).tolist()}")     # [[1, 6, 9], [4, 6, 12]]
+print(f"cumprod(r, axis=0): {tensor.cumprod(r, axis=0).tolist()}")   # [[1, 5, 3], [4, 10, 18]]
+print(f"cumsum of ints: {tensor.cumsum(tensor.from_list([1, 2, 3], dtype='int32')).tolist()}")  # [1, 3, 6] (int64)
+series = tensor.from_list([float(i % 10) for i in range(300_000)])
+lasts = set()
+for n in [1, 4]:
+    tensor.set_num_threads(n)
+    lasts.add(tensor.cumsum(series).tolist()[-1])
+print(f"cumsum with 1/4 threads identical: {len(lasts) == 1}")   # True
+
+print("\n=== Sorting ===")
+s = tensor.from_list([3.0, float("nan"), -1.0, 2.0, -1.0])
+print(f"sort: {tensor.sort(s).tolist()}")                           # [-1, -1, 2, 3, nan]
+print(f"argsort: {tensor.argsort(s).tolist()}")                     # [2, 4, 3, 0, 1] (stable)
+print(f"descending: {tensor.sort(s, descending=True).tolist()}")    # [nan, 3, 2, -1, -1]
+print(f"sort(r, axis=0): {tensor.sort(r, axis=0).tolist()}")        # [[1, 2, 3], [4, 5, 6]]
+values, indices = tensor.topk(r, 2)
+print(f"topk(r, 2): {values.tolist()} at {indices.tolist()}")       # [[5, 3], [6, 4]] at [[1, 2], [2, 0]]
+print(f"2 smallest: {tensor.topk(r, 2, largest=False)[0].tolist()}")  # [[1, 3], [2, 4]]
+long_row = tensor.from_list([float((i * 7919) % 100_003) for i in range(200_000)])
+orders = set()
+for n in [1, 4]:
+    tensor.set_num_threads(n)
+    orders.add(tuple(tensor.argsort(long_row).tolist()))
+print(f"argsort with 1/4 threads identical: {len(orders) == 1}")
+
+print("\n=== Indexing ===")
+t = tensor.from_list([[1.0, 2.0], [3.0, 4.0], [5.0, 6.0]])
+print(f"index_select rows [2, -3]: {tensor.index_select(t, 0, [2, -3]).tolist()}")  # [[5, 6], [1, 2]]
+idx = tensor.from_list([[1, 1], [0, 1], [1, 0]], dtype="int64")
+print(f"gather(t, 1, idx): {tensor.gather(t, 1, idx).tolist()}")   # [[2, 2], [3, 4], [6, 5]]
+z = tensor.zeros(4)
+src = tensor.from_list([1.0, 2.0, 3.0, 4.0])
+print(f"scatter_add: {tensor.scatter_add(z, 0, [0, 2, 0, 3], src).tolist()}")  # [4, 0, 2, 4]
+print(f"scatter (last wins): {tensor.scatter(z, 0, [1, 1], tensor.from_list([5.0, 7.0])).tolist()}")  # [0, 7, 0, 0]
+emb = tensor.zeros((3, 2))
+grads = tensor.from_list([[1.0, 1.0], [2.0, 2.0], [3.0, 3.0]])
+tensor.index_add_(emb, 0, [2, 0, 2], grads)
+print(f"index_add_ into embedding: {emb.tolist()}")                 # [[2, 2], [0, 0], [4, 4]]
+try:
+    tensor.index_select(t, 0, [3])
+except IndexError as e:
+    print(f"IndexError: {e}")
+pick = tensor.capture(lambda i: tensor.index_select(t, 0, i), tensor.from_list([0], dtype="int64"))
+try:
+    pick(tensor.from_list([5], dtype="int64"))   # checked when the replay runs
+except IndexError as e:
+    print(f"IndexError on replay: {e}")
+
+print("\n=== Concat / Stack ===")
+p = tensor.from_list([[1.0, 2.0], [3.0, 4.0]])
+q = tensor.from_list([[5.0, 6.0]])
+print(f"concat axis 0: {tensor.concat([p, q]).tolist()}")           # [[1, 2], [3, 4], [5, 6]]
+print(f"concat axis 1: {tensor.concat([p, p.T], axis=1).tolist()}") # [[1, 2, 1, 3], [3, 4, 2, 4]]
+print(f"stack axis 1: {tensor.stack([p, p], axis=1).shape}")        # (2, 2, 2)
+b = tensor.builder(row_shape=2)
+for i in range(5):
+    b.append(tensor.from_list([float(i), float(i * i)]))           # one row at a time
+b.append(q)                                                         # or several
+print(f"builder: {len(b)} rows, capacity {b.capacity}")             # 6 rows, capacity 8
+print(f"build(): {b.build().tolist()}")   # [[0, 0], [1, 1], [2, 4], [3, 9], [4, 16], [5, 6]]
+
+print("\n=== Save / Load (memory-mapped) ===")
+import os, tempfile
+path = os.path.join(tempfile.mkdtemp(), "weights.tensor")
+w = tensor.from_list([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]], dtype="float32")
+tensor.save(path, w)
+print(f"file size: {os.path.getsize(path)} bytes (64-byte aligned header + 24-byte payload)")
+mapped = tensor.load(path)                 # instant: nothing is read until touched
+print(f"load(mmap=True): {mapped}")
+copied = tensor.load(path, mmap=False)
+print(f"load(mmap=False): {copied.tolist()}")
+print(f"sum(mapped): {tensor.sum(mapped)}")  # 21.0
+import struct
+raw = bytearray(open(path, "rb").read())
+struct.pack_into("<QQ", raw, 32, 2**64 - 56, 10_000_000)   # data_bytes, shape[0]: sums wrap
+open(path, "wb").write(raw)
+try:
+    tensor.load(path)
+except ValueError as e:
+    print(f"crafted header: {e}")          # corrupt tensor header (payload size/offset)
+os.remove(path)
+
+print("\n=== Pickling / Shared Memory ===")
+import pickle
+t = tensor.from_list([[1.0, 2.0], [3.0, 4.0]])
+buffers = []
+data = pickle.dumps(t, protocol=5, buffer_callback=buffers.append)
+print(f"pickle: {len(data)} bytes + {len(buffers)} out-of-band buffer of {buffers[0].raw().nbytes} bytes")
+print(f"loads: {pickle.loads(data, buffers=buffers).tolist()}")  # [[1.0, 2.0], [3.0, 4.0]]
+print(f"memoryview: format={memoryview(t).format}, shape={memoryview(t).shape}")  # d, (2, 2)
+s = tensor.shared(t)                       # copy in POSIX shared memory
+s2 = tensor.attach(s.shm_name)             # as another process would
+tensor.exp_(s2)
+print(f"written through attach: {[round(v, 3) for v in s.tolist()[0]]}")  # [2.718, 7.389]
+print(f"pickled shared tensor: {len(pickle.dumps(s))} bytes, same memory: "
+      f"{pickle.loads(pickle.dumps(s)).shm_name == s.shm_name}")  # True
+pid = os.fork()
+if pid == 0:
+    del s                                  # a forked child's copy doesn't unlink the name
+    os._exit(0)
+os.waitpid(pid, 0)
+print(f"attach after a child freed it: {tensor.attach(s.shm_name).shape}")  # (2, 2)
+del s, s2
+
+print("\n=== Out-of-Core Matmul ===")
+path = os.path.join(tempfile.mkdtemp(), "a.tensor")
+a_mem = tensor.from_list([[float(i + j) for j in range(300)] for i in range(200)])
+b_mem = tensor.from_list([[float(i - j) for j in range(100)] for i in range(300)])
+tensor.save(path, a_mem)
+a_map = tensor.load(path)
+tensor.set_out_of_core_threshold(0)        # force the tiled, streaming path
+streamed = tensor.matmul(a_map, b_mem)
+tensor.set_out_of_core_threshold(1 << 40)
+in_memory = tensor.matmul(a_mem, b_mem)
+print(f"streamed == in-memory: {streamed.tolist() == in_memory.tolist()}")
+del a_map
+os.remove(path)
+
+print("\n=== Transpose / Views ===")
+m = tensor.from_list([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]])
+mt = m.T                                   # view: no data is copied
+print(f"m.strides={m.strides}, m.T.strides={mt.strides}, contiguous={mt.is_contiguous}")
+print(f"m.T: {mt.tolist()}")               # [[1, 4], [2, 5], [3, 6]]
+print(f"matmul(m, m.T): {tensor.matmul(m, mt).tolist()}")  # [[14, 32], [32, 77]]
+print(f"contiguous(): {mt.contiguous().strides}")          # (2, 1)
+
+print("\n=== Copy-on-Write ===")
+w = tensor.from_list([[1.0, 2.0], [3.0, 4.0]])
+before = tensor.memory_stats()['allocated_bytes']
+w2 = w.copy()                              # shares w's memory
+print(f"bytes allocated by copy(): {tensor.memory_stats()['allocated_bytes'] - before}")  # 0
+tensor.relu_(tensor.mul(w2, w2))           # out-of-place ops leave both alone
+tensor.exp_(w2)                            # first in-place write: w2 gets its own memory
+print(f"w after exp_(w2): {w.tolist()}")  # [[1.0, 2.0], [3.0, 4.0]]
+print(f"w2: {[[round(v, 3) for v in row] for row in w2.tolist()]}")
+# [[2.718, 7.389], [20.086, 54.598]]
+wt = w.T
+w3 = w.copy()
+tensor.exp_(w)                             # the view follows w, the copy keeps the old data
+print(f"w.T after exp_(w): {[[round(v, 3) for v in row] for row in wt.tolist()]}")
+# [[2.718, 20.086], [7.389, 54.598]]
+print(f"w3: {w3.tolist()}")                # [[1.0, 2.0], [3.0, 4.0]]
+
+print("\n=== Sparse Tensors ===")
+s = tensor.sparse_coo([0, 2, 2, 0], [1, 0, 2, 1], [1.0, 2.0, 3.0, 4.0], (3, 3))
+print(s)                                   # nnz=3: the two (0, 1) entries are summed
+print(f"indptr={s.indptr.tolist()}, indices={s.indices.tolist()}, values={s.values.tolist()}")
+print(f"spmv: {tensor.spmv(s, tensor.from_list([1.0, 1.0, 1.0])).tolist()}")  # [5, 0, 5]
+print(f"spmm: {tensor.spmm(s, tensor.from_list([[1.0, 0.0], [0.0, 1.0], [1.0, 1.0]])).tolist()}")
+print(f"to_sparse(to_dense()).nnz: {tensor.to_sparse(s.to_dense()).nnz}")  # 3
+
+print("\n=== Batched Matmul ===")
+a3 = tensor.from_list([[[1.0, 2.0], [3.0, 4.0]], [[0.0, 1.0], [1.0, 0.0]]])  # 2 x (2x2)
+eye = tensor.from_list([[1.0, 0.0], [0.0, 1.0]])
+print(f"shape: {tensor.matmul(a3, a3).shape}")             # (2, 2, 2)
+print(f"a3 @ a3: {tensor.matmul(a3, a3).tolist()}")        # [[[7, 10], [15, 22]], [[1, 0], [0, 1]]]
+print(f"broadcast a3 @ eye == a3: {tensor.matmul(a3, eye).tolist() == a3.tolist()}")
+
+print("\n=== Matrix-Vector Shapes ===")
+mv = tensor.from_list([[1.0, 2.0, 3.0], [4.0, 5.0, 6.0]])
+col = tensor.from_list([[1.0], [0.0], [-1.0]])
+row = tensor.from_list([[1.0, 1.0]])
+print(f"gemv mv @ col: {tensor.matmul(mv, col).tolist()}")         # [[-2], [-2]]
+print(f"row @ mv: {tensor.matmul(row, mv).tolist()}")              # [[5, 7, 9]]
+print(f"mv.T @ row.T: {tensor.matmul(mv.T, row.T).tolist()}")      # [[5], [7], [9]] (no gather)
+print(f"dot: {tensor.matmul(tensor.from_list([[1.0, 2.0, 3.0]]), col).tolist()}")  # [[-2]]
+print(f"outer: {tensor.matmul(col, row).tolist()}")                # [[1, 1], [0, 0], [-1, -1]]
+# Past the four-way unrolling and the vector tails: k > 2 x SIMD width,
+# m and n not multiples of 4. Small integers keep every sum exact.
+def small_ints(shape, seed):
+    return tensor.randint(-3, 4, shape, seed=seed).astype("float64")
+
+def ref_matmul(a, b):
+    cols = list(zip(*b.tolist()))
+    return [[sum(x * y for x, y in zip(r, c)) for c in cols] for r in a.tolist()]
+
+A, B = small_ints((9, 41), 3), small_ints((41, 9), 4)
+x, r = small_ints((41, 1), 5), small_ints((1, 41), 6)
+print(f"(9, 41) @ (41, 1): {tensor.matmul(A, x).tolist() == ref_matmul(A, x)}")  # True
+print(f"(1, 41) @ (41, 9): {tensor.matmul(r, B).tolist() == ref_matmul(r, B)}")  # True
+print(f"B.T @ x: {tensor.matmul(B.T, x).tolist() == ref_matmul(B.T, x)}")        # True
+print(f"r @ A.T: {tensor.matmul(r, A.T).tolist() == ref_matmul(r, A.T)}")        # True
+# Sizes that split across threads (by rows, by column chunks, by blocks
+# of k), against the general kernel: the vector is doubled to two
+# columns (or rows) and the first one kept.
+A, x = small_ints((600, 4000), 7), small_ints((4000, 1), 8)
+ref = [[v[0]] for v in tensor.matmul(A, tensor.concat([x, x], axis=1)).tolist()]
+print(f"(600, 4000) @ (4000, 1): {tensor.matmul(A, x).tolist() == ref}")   # True
+r = small_ints((1, 4000), 9)
+ref = tensor.matmul(tensor.concat([r, r]), A.T).tolist()[:1]
+print(f"(1, 4000) @ A.T: {tensor.matmul(r, A.T).tolist() == ref}")         # True
+for k, n in [(300, 8200), (4500, 500)]:
+    B, r = small_ints((k, n), k), small_ints((1, k), n)
+    ref = tensor.matmul(tensor.concat([r, r]), B).tolist()[:1]
+    print(f"(1, {k}) @ ({k}, {n}): {tensor.matmul(r, B).tolist() == ref}")  # True
+
+print("\n=== Elementwise Math ===")
+x = tensor.from_list([-2.0, -0.5, 0.0, 0.5, 2.0])
+print(f"exp:     {[round(v, 6) for v in tensor.exp(x).tolist()]}")
+print(f"tanh:    {[round(v, 6) for v in tensor.tanh(x).tolist()]}")
+print(f"sigmoid: {[round(v, 6) for v in tensor.sigmoid(x).tolist()]}")
+print(f"relu:    {tensor.relu(x).tolist()}")                   # [0, 0, 0, 0.5, 2]
+print(f"gelu:    {[round(v, 6) for v in tensor.gelu(x).tolist()]}")  # [-0.045402, -0.154286, 0, 0.345714, 1.954598]
+print(f"log(exp(x)) == x: {[round(v, 12) for v in tensor.log(tensor.exp(x)).tolist()] == x.tolist()}")
+y = tensor.empty((5,))
+print(f"out= returns out: {tensor.exp(x, out=y) is y}")
+tensor.relu_(x)                            # in place
+print(f"after relu_: {x.tolist()}")
+print(f"exp of int32 -> {tensor.exp(tensor.from_list([0, 1], dtype='int32')).dtype}")  # float64
+
+print("\n=== Softmax and LayerNorm ===")
+logits = tensor.from_list([[1.0, 2.0, 3.0], [1000.0, 1000.0, -1000.0]])
+print(f"softmax: {[[round(v, 6) for v in row] for row in tensor.softmax(logits).tolist()]}")
+# [[0.090031, 0.244728, 0.665241], [0.5, 0.5, 0.0]]: no overflow at 1000
+print(f"log_softmax: {[round(v, 6) for v in tensor.log_softmax(logits).tolist()[0]]}")
+# [-2.407606, -1.407606, -0.407606]
+far = tensor.from_list([[1e4, 1e4 + 0.5]], dtype="float32")
+print(f"log_softmax far from 0: {[round(v, 5) for v in tensor.log_softmax(far).tolist()[0]]}")
+# [-0.97408, -0.47408]: the offset doesn't eat into log(sum)
+h = tensor.from_list([[1.0, 2.0, 3.0, 4.0], [1e8, 1e8 + 1, 1e8 + 2, 1e8 + 3]])
+print(f"layer_norm: {[round(v, 6) for v in tensor.layer_norm(h).tolist()[1]]}")
+# [-1.341635, -0.447212, 0.447212, 1.341635]: same as row 0 despite the offset
+gamma = tensor.from_list([2.0, 2.0, 2.0, 2.0])
+beta = tensor.from_list([1.0, 1.0, 1.0, 1.0])
+print(f"with weight and bias: {[round(v, 4) for v in tensor.layer_norm(h, gamma, beta, eps=0.0).tolist()[0]]}")
+# [-1.6833, 0.1056, 1.8944, 3.6833]
+
+print("\n=== Quantization ===")
+x = tensor.from_list([[-1.0, -0.5, 0.0, 0.5], [1.0, 0.25, -0.25, 0.75]])
+s, z = tensor.qparams(x)
+print(f"qparams: scale={s:.6f}, zero_point={z}")  # scale=0.007874 (1/127), zero_point=0
+qx = tensor.quantize(x, s, z)
+print(f"quantize: {qx.tolist()[0]}, dtype={qx.dtype}")  # [-127, -64, 0, 64], dtype=int8
+print(f"dequantize: {[round(v, 4) for v in tensor.dequantize(qx, s, z).tolist()[0]]}")
+# [-1.0, -0.5039, 0.0, 0.5039]: rounding error up to scale/2
+w = tensor.from_list([[1.0, -2.0], [0.5, 1.0], [0.0, 3.0], [-1.0, 0.5]])
+ws, _ = tensor.qparams(w, axis=1)
+qw = tensor.quantize(w, ws, axis=1)
+print(f"per-column scales: {[round(v, 6) for v in ws]}")  # [0.007874, 0.023622]
+print(f"qmatmul int32: {tensor.qmatmul(qx, qw).tolist()[0]}")  # [-28353, 9451]
+y = tensor.qmatmul(qx, qw, a_scale=s, b_scale=ws, bias=[0.5, -0.5])
+print(f"qmatmul float32: {[round(v, 3) for v in y.tolist()[0]]}")  # [-1.258, 1.258]
+print(f"float64 matmul:  {[round(v + b, 3) for v, b in zip(tensor.matmul(x, w).tolist()[0], [0.5, -0.5])]}")
+# [-1.25, 1.25]
+qy = tensor.qmatmul(qx, qw, a_scale=s, b_scale=ws, bias=[0.5, -0.5], out_scale=0.05)
+print(f"requantized: {qy.tolist()[0]}, dtype={qy.dtype}")  # [-25, 25], dtype=int8
+print(f"qgemm kernel: {tensor.qgemm_kernel}")  # picked at import: avx512vnni, avx2, sse2, ...
+# Shapes off every kernel's k group and column tile, with zero points
+qa = tensor.randint(-128, 128, (7, 37), dtype="int8", seed=1)
+qb = tensor.randint(-128, 128, (37, 45), dtype="int8", seed=2)
+la, lb = qa.tolist(), qb.tolist()
+ref = [[sum((la[i][p] - 3) * (lb[p][j] + 5) for p in range(37)) for j in range(45)] for i in range(7)]
+got = tensor.qmatmul(qa, qb, a_zero_point=3, b_zero_point=-5).tolist()
+print(f"qmatmul (7, 37) @ (37, 45) exact: {got == ref}")  # True
+
+print("\n=== Async Stream ===")
+print(f"set_async(True) was: {tensor.set_async(True)}")    # False
+a = tensor.from_list([[1.0, 2.0], [3.0, 4.0]])
+c = tensor.matmul(a, a)                    # queued; returns at once
+tensor.relu_(c)                            # queued behind the matmul
+d = tensor.add(c, a)                       # reads c after both ops
+print(f"d: {d.wait().tolist()}, ready: {d.ready}")        # [[8, 12], [18, 26]], True
+print(f"sum(c) blocks: {tensor.sum(c)}")   # 54.0: a Python scalar is a sync point
+tensor.synchronize()
+rows = tensor.from_list([[1.0, 2.0], [3.0, 4.0], [5.0, 6.0]])
+big = tensor.rand((400, 400), seed=0)
+slow = tensor.matmul(big, big)             # keeps the stream busy, so the index
+i = tensor.add(tensor.from_list([5], dtype="int64"), tensor.from_list([0], dtype="int64"))
+bad = tensor.index_select(rows, 0, i)      # is still pending: checked when it runs
+print(f"other tensors still read: {tensor.add(a, a).tolist()}")  # [[2, 4], [6, 8]]
+try:
+    bad.tolist()
+except IndexError as e:
+    print(f"IndexError from bad.tolist(): {e}")  # index 5 is out of bounds ...
+tensor.synchronize()                       # raised once already: returns normally
+tensor.set_async(False)
+
+print("\n=== Profiler ===")
+a = tensor.from_list([[1.0, 2.0], [3.0, 4.0]])
+tensor.profiler.start()
+for _ in range(3):
+    tensor.exp(tensor.matmul(a, a))
+tensor.profiler.stop()
+events = tensor.profiler.events()
+print(f"events: {[e['name'] for e in events]}")   # matmul, exp, matmul, exp, ...
+print(f"first: {events[0]['shapes']}, flops={events[0]['flops']}")  # (2, 2), (2, 2) -> (2, 2), 16.0
+print(tensor.profiler.summary().splitlines()[0])   # column headings
+
+print("\n=== Graph Capture ===")
+w = tensor.from_list([[1.0, -1.0], [0.5, 2.0]])
+
+def layer(x):
+    return tensor.add(tensor.relu(tensor.matmul(x, w)), x)
+
+g = tensor.capture(layer, tensor.zeros((2, 2)))
+print(g)                                   # Graph(ops=3, inputs=1, arena_bytes=...)
+x = tensor.from_list([[1.0, 2.0], [3.0, 4.0]])
+y = g(x)                                   # replay on new data
+print(f"replay == eager: {y.tolist() == layer(x).tolist()}")   # True
+print(f"same output tensor each call: {g(x) is y}")             # True
+
+def grow(x):
+    return tensor.add(tensor.mul(tensor.exp(x), tensor.exp(x)), x)
+
+g = tensor.capture(grow, tensor.zeros((2,)))
+x = e = tensor.from_list([0.5, 0.25])
+for _ in range(2):
+    x, e = g(x), grow(e)                   # the result fed back in is copied first
+print(f"x = g(x) == eager: {x.tolist() == e.tolist()}")         # True
+
+import threading, time
+other_ops = 0
+stop = threading.Event()
+def other_thread():                        # ops from another thread aren't captured
+    global other_ops
+    noise = tensor.rand(64)
+    while not stop.is_set():
+        tensor.exp(noise).tolist()
+        other_ops += 1
+worker = threading.Thread(target=other_thread)
+worker.start()
+def layer_while_busy(x):
+    y = layer(x)
+    while other_ops < 3:                   # let the other thread run meanwhile
+        time.sleep(0.001)
+    return y
+try:
+    g = tensor.capture(layer_while_busy, tensor.zeros((2, 2)))
+finally:
+    stop.set()
+    worker.join()
+print(f"captured ops with another thread busy: {g.num_ops}")    # 3
+
+print("\n=== Conv2d ===")
+x = tensor.from_list([[[[float(i * 4 + j) for j in range(4)] for i in range(4)]]])  # [1, 1, 4, 4]
+box = tensor.from_list([[[[1.0, 1.0, 1.0]] * 3]])                                 # [1, 1, 3, 3]
+y = tensor.conv2d(x, box)
+print(f"3x3 box sums: {y.shape} {y.tolist()}")      # (1, 1, 2, 2) [[[[45, 54], [81, 90]]]]
+y = tensor.conv2d(x, box, padding=1, stride=2)
+print(f"padded, stride 2: {y.tolist()}")            # [[[[10, 24], [51, 90]]]]
+same = [tensor.conv2d(x, box, padding=1, method=m).tolist() for m in ("direct", "im2col")]
+print(f"direct == im2col: {same[0] == same[1]}")    # True
+w = tensor.from_list([[[[1.0]]], [[[-1.0]]]])       # two 1x1 filters
+b = tensor.from_list([0.5, 0.0])
+print(f"1x1 with bias: {tensor.conv2d(x, w, b, dilation=2).shape}")  # (1, 2, 4, 4)
+tensor.set_num_threads(1)
+xs = tensor.rand((8, 1, 4, 4))
+conv = lambda t: tensor.conv2d(t, box, padding=1, method="im2col")
+g = tensor.capture(conv, xs)
+tensor.set_num_threads(8)                           # replay keeps the captured task count
+print(f"replay after set_num_threads: {g(xs).tolist() == conv(xs).tolist()}")  # True